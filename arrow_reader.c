@@ -0,0 +1,520 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "arrow_reader.h"
+
+/* Arrow's flatbuffer schema (Message.fbs, Schema.fbs, File.fbs): the enum
+ * values and the numbers of the table fields used here */
+#define HEADER_SCHEMA 1
+#define HEADER_RECORD_BATCH 3
+#define TYPE_NULL 1
+#define TYPE_INT 2
+#define TYPE_FLOATING_POINT 3
+#define TYPE_BINARY 4
+#define TYPE_UTF8 5
+#define TYPE_BOOL 6
+#define TYPE_LARGE_BINARY 19
+#define TYPE_LARGE_UTF8 20
+
+#define MESSAGE_HEADER_TYPE 1
+#define MESSAGE_HEADER 2
+#define MESSAGE_BODY_LENGTH 3
+#define SCHEMA_ENDIANNESS 0
+#define SCHEMA_FIELDS 1
+#define FIELD_NAME 0
+#define FIELD_TYPE_TYPE 2
+#define FIELD_TYPE 3
+#define FIELD_DICTIONARY 4
+#define BATCH_LENGTH 0
+#define BATCH_NODES 1
+#define BATCH_BUFFERS 2
+#define BATCH_COMPRESSION 3
+
+#define CONTINUATION 0xFFFFFFFF
+#define FILE_MAGIC "ARROW1"
+#define FILE_MAGIC_LEN 6
+/* the file format's header: the magic, padded to 8 bytes */
+#define FILE_HEADER_LEN 8
+
+enum column_kind { KIND_NULL, KIND_BOOL, KIND_INT, KIND_FLOAT, KIND_UTF8,
+	KIND_BINARY };
+
+struct arrow_column {
+	char *name;
+	enum column_kind kind;
+	int width;	/* of Ints, FloatingPoints and offsets, in bytes */
+	bool is_signed;
+	/* in the current batch */
+	const unsigned char *validity;	/* NULL if there are no NULLs */
+	const unsigned char *offsets;
+	const unsigned char *data;
+};
+
+struct arrow_reader {
+	const unsigned char *map;
+	size_t size;
+	size_t pos;	/* of the next message */
+	size_t end;	/* of the messages, where a file's footer starts */
+	int num_cols;
+	struct arrow_column *cols;
+};
+
+/* Reads an unsigned little-endian number of 'size' bytes. */
+
+static uint64_t load_le(const unsigned char *p, int size)
+{
+	uint64_t value = 0;
+	for (int i = size - 1; i >= 0; i--)
+		value = value << 8 | p[i];
+	return value;
+}
+
+/* A flatbuffer being read: reads out of its bounds return 0, and make
+ * 'bad' true. */
+
+struct fb {
+	const unsigned char *buf;
+	size_t len;
+	bool bad;
+};
+
+static uint64_t fb_get(struct fb *fb, size_t pos, int size)
+{
+	if (pos > fb->len || (size_t) size > fb->len - pos) {
+		fb->bad = true;
+		return 0;
+	}
+	return load_le(fb->buf + pos, size);
+}
+
+/* Returns the position of field 'field' of the table at 'table', or 0 if it
+ * is absent. */
+
+static size_t fb_field(struct fb *fb, size_t table, int field)
+{
+	size_t vtable = table - (int32_t) fb_get(fb, table, 4);
+	size_t vtable_size = fb_get(fb, vtable, 2);
+	if (4 + 2 * (size_t) field + 2 > vtable_size) return 0;
+	size_t offset = fb_get(fb, vtable + 4 + 2 * field, 2);
+	return 0 == offset ? 0 : table + offset;
+}
+
+static uint64_t fb_scalar(struct fb *fb, size_t table, int field, int size)
+{
+	size_t pos = fb_field(fb, table, field);
+	return 0 == pos ? 0 : fb_get(fb, pos, size);
+}
+
+/* Returns the position of the table, vector or string that field 'field'
+ * refers to, or 0 if it is absent. A vector's elements start 4 bytes after
+ * it. */
+
+static size_t fb_ref(struct fb *fb, size_t table, int field)
+{
+	size_t pos = fb_field(fb, table, field);
+	return 0 == pos ? 0 : pos + fb_get(fb, pos, 4);
+}
+
+/* Element 'i' of a vector of tables. */
+
+static size_t fb_element(struct fb *fb, size_t vector, size_t i)
+{
+	size_t pos = vector + 4 + 4 * i;
+	return pos + fb_get(fb, pos, 4);
+}
+
+bool is_arrow_file(const char *filename)
+{
+	struct stat st;
+	if (-1 == stat(filename, &st) || ! S_ISREG(st.st_mode)) return false;
+	int fd = open(filename, O_RDONLY);
+	if (-1 == fd) return false;
+	unsigned char start[FILE_MAGIC_LEN];
+	bool arrow = sizeof(start) == read(fd, start, sizeof(start)) &&
+		(0 == memcmp(start, FILE_MAGIC, FILE_MAGIC_LEN) ||
+		 CONTINUATION == load_le(start, 4));
+	close(fd);
+	return arrow;
+}
+
+/* Reads the message at r->pos, and moves past it. Sets *fb to its
+ * flatbuffer, *header to the position of its header, and *body to where its
+ * body starts. Returns its header type, or 0 at the end of the data, or -1 if
+ * it is broken. */
+
+static int read_message(arrow_reader_t *r, struct fb *fb, size_t *header,
+		size_t *body, size_t *body_len)
+{
+	if (r->end - r->pos < 4) return 0;
+	size_t meta = r->pos + 4;
+	uint64_t meta_len = load_le(r->map + r->pos, 4);
+	if (CONTINUATION == meta_len) {
+		/* else a message of before Arrow 0.15 */
+		if (r->end - r->pos < 8) return -1;
+		meta_len = load_le(r->map + r->pos + 4, 4);
+		meta += 4;
+	}
+	if (0 == meta_len) return 0;	/* end of stream */
+	if (meta_len > r->end - meta) return -1;
+
+	fb->buf = r->map + meta;
+	fb->len = meta_len;
+	fb->bad = false;
+	size_t message = fb_get(fb, 0, 4);
+	int header_type = fb_scalar(fb, message, MESSAGE_HEADER_TYPE, 1);
+	*header = fb_ref(fb, message, MESSAGE_HEADER);
+	*body = meta + meta_len;
+	*body_len = fb_scalar(fb, message, MESSAGE_BODY_LENGTH, 8);
+	if (fb->bad || 0 == *header || *body_len > r->end - *body) return -1;
+	r->pos = *body + *body_len;
+	return header_type;
+}
+
+static const char *read_type(struct fb *fb, size_t field,
+		struct arrow_column *col)
+{
+	int type_type = fb_scalar(fb, field, FIELD_TYPE_TYPE, 1);
+	size_t type = fb_ref(fb, field, FIELD_TYPE);
+	uint64_t precision;
+	if (0 != fb_field(fb, field, FIELD_DICTIONARY))
+		return "dictionary-encoded Arrow columns are not supported";
+
+	switch (type_type) {
+	case TYPE_NULL:
+		col->kind = KIND_NULL;
+		break;
+	case TYPE_BOOL:
+		col->kind = KIND_BOOL;
+		break;
+	case TYPE_INT:
+		col->kind = KIND_INT;
+		/* bitWidth, is_signed */
+		col->width = fb_scalar(fb, type, 0, 4) / 8;
+		col->is_signed = fb_scalar(fb, type, 1, 1);
+		if (1 != col->width && 2 != col->width && 4 != col->width &&
+				8 != col->width)
+			return "bad Arrow Int width";
+		break;
+	case TYPE_FLOATING_POINT:
+		col->kind = KIND_FLOAT;
+		/* precision: HALF, SINGLE, DOUBLE */
+		precision = fb_scalar(fb, type, 0, 2);
+		if (precision > 2) return "bad Arrow FloatingPoint precision";
+		col->width = 2 << precision;
+		break;
+	case TYPE_UTF8:
+	case TYPE_LARGE_UTF8:
+		col->kind = KIND_UTF8;
+		col->width = TYPE_UTF8 == type_type ? 4 : 8;
+		break;
+	case TYPE_BINARY:
+	case TYPE_LARGE_BINARY:
+		col->kind = KIND_BINARY;
+		col->width = TYPE_BINARY == type_type ? 4 : 8;
+		break;
+	default:
+		return "unsupported Arrow column type";
+	}
+	return NULL;
+}
+
+static const char *read_schema(arrow_reader_t *r)
+{
+	struct fb fb;
+	size_t schema, body, body_len;
+	if (HEADER_SCHEMA != read_message(r, &fb, &schema, &body, &body_len))
+		return "no Arrow schema";
+	if (0 != fb_scalar(&fb, schema, SCHEMA_ENDIANNESS, 2))
+		return "big-endian Arrow data are not supported";
+	size_t fields = fb_ref(&fb, schema, SCHEMA_FIELDS);
+	int num_cols = 0 == fields ? 0 : fb_get(&fb, fields, 4);
+	if (fb.bad || num_cols <= 0) return "no columns in Arrow schema";
+	if ((size_t) num_cols > (fb.len - fields) / 4)
+		return "bad Arrow schema";
+	r->cols = calloc(num_cols, sizeof(struct arrow_column));
+	if (NULL == r->cols) return strerror(ENOMEM);
+	r->num_cols = num_cols;
+
+	for (int i = 0; i < num_cols; i++) {
+		struct arrow_column *col = &r->cols[i];
+		size_t field = fb_element(&fb, fields, i);
+		size_t name = fb_ref(&fb, field, FIELD_NAME);
+		size_t name_len = 0 == name ? 0 : fb_get(&fb, name, 4);
+		if (fb.bad || name_len > fb.len - name - 4)
+			return "bad Arrow schema";
+		col->name = strndup((const char *) fb.buf + name + 4,
+				name_len);
+		if (NULL == col->name) return strerror(ENOMEM);
+		const char *error = read_type(&fb, field, col);
+		if (NULL != error) return error;
+		if (fb.bad) return "bad Arrow schema";
+	}
+	return NULL;
+}
+
+arrow_reader_t *open_arrow_reader(const char *filename, const char **error)
+{
+	arrow_reader_t *r = calloc(1, sizeof(arrow_reader_t));
+	if (NULL == r) {
+		*error = strerror(errno);
+		return NULL;
+	}
+	int fd = open(filename, O_RDONLY);
+	struct stat st;
+	if (-1 == fd || -1 == fstat(fd, &st)) {
+		*error = strerror(errno);
+		if (-1 != fd) close(fd);
+		free(r);
+		return NULL;
+	}
+	r->size = st.st_size;
+	void *map = 0 == r->size ? MAP_FAILED :
+		mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (MAP_FAILED == map) {
+		*error = 0 == r->size ? "empty Arrow file" : strerror(errno);
+		free(r);
+		return NULL;
+	}
+	r->map = map;
+	r->end = r->size;
+
+	*error = NULL;
+	if (r->size >= FILE_HEADER_LEN &&
+			0 == memcmp(r->map, FILE_MAGIC, FILE_MAGIC_LEN)) {
+		/* the file format: the magic, the stream, the footer, its
+		 * length, and the magic again */
+		size_t tail = sizeof(int32_t) + FILE_MAGIC_LEN;
+		size_t footer_len = r->size < FILE_HEADER_LEN + tail ? 0 :
+			load_le(r->map + r->size - tail, 4);
+		if (r->size < FILE_HEADER_LEN + tail + footer_len ||
+				0 != memcmp(r->map + r->size - FILE_MAGIC_LEN,
+					FILE_MAGIC, FILE_MAGIC_LEN))
+			*error = "truncated Arrow file";
+		r->pos = FILE_HEADER_LEN;
+		r->end = r->size - tail - footer_len;
+	}
+	if (NULL == *error) *error = read_schema(r);
+	if (NULL != *error) {
+		close_arrow_reader(r);
+		return NULL;
+	}
+	return r;
+}
+
+int arrow_reader_num_columns(const arrow_reader_t *r)
+{
+	return r->num_cols;
+}
+
+const char *arrow_reader_column_name(const arrow_reader_t *r, int col)
+{
+	return r->cols[col].name;
+}
+
+int arrow_reader_column_type(const arrow_reader_t *r, int col)
+{
+	switch (r->cols[col].kind) {
+	case KIND_NULL: return SQLITE_NULL;
+	case KIND_BOOL:
+	case KIND_INT: return SQLITE_INTEGER;
+	case KIND_FLOAT: return SQLITE_FLOAT;
+	case KIND_UTF8: return SQLITE_TEXT;
+	default: return SQLITE_BLOB;
+	}
+}
+
+bool arrow_reader_column_has_reals(const arrow_reader_t *r, int col)
+{
+	const struct arrow_column *c = &r->cols[col];
+	return KIND_INT == c->kind && ! c->is_signed && 8 == c->width;
+}
+
+/* Checks that the offsets of a Utf8 or Binary column's 'num_rows' values
+ * stay within its data, of 'data_len' bytes. */
+
+static bool offsets_are_valid(const struct arrow_column *col,
+		int64_t num_rows, uint64_t data_len)
+{
+	uint64_t prev = load_le(col->offsets, col->width);
+	for (int64_t row = 1; row <= num_rows; row++) {
+		uint64_t offset = load_le(col->offsets + row * col->width,
+				col->width);
+		if (offset < prev) return false;
+		prev = offset;
+	}
+	return prev <= data_len;
+}
+
+/* Sets the column's buffers up, from the batch's 'buffers' (its next
+ * ones are at *buffer). */
+
+static const char *read_column(struct fb *fb, struct arrow_column *col,
+		const unsigned char *body, size_t body_len, size_t buffers,
+		size_t *buffer, int64_t num_rows, int64_t null_count)
+{
+	int num_buffers = KIND_NULL == col->kind ? 0 :
+		KIND_UTF8 == col->kind || KIND_BINARY == col->kind ? 3 : 2;
+	const unsigned char *start[3];
+	uint64_t len[3];
+	for (int b = 0; b < num_buffers; b++, (*buffer)++) {
+		/* Buffer { offset, length } */
+		size_t pos = buffers + 4 + 16 * *buffer;
+		uint64_t offset = fb_get(fb, pos, 8);
+		len[b] = fb_get(fb, pos + 8, 8);
+		if (offset > body_len || len[b] > body_len - offset)
+			return "bad Arrow record batch";
+		start[b] = body + offset;
+	}
+	if (fb->bad) return "bad Arrow record batch";
+	/* the buffers of an empty column may be left out */
+	if (0 == num_buffers || 0 == num_rows) return NULL;
+
+	uint64_t n = num_rows;
+	col->validity = NULL;
+	if (null_count > 0) {
+		if (len[0] < (n + 7) / 8) return "bad Arrow validity bitmap";
+		col->validity = start[0];
+	}
+	switch (col->kind) {
+	case KIND_BOOL:
+		if (len[1] < (n + 7) / 8) return "bad Arrow Bool values";
+		break;
+	case KIND_INT:
+	case KIND_FLOAT:
+		if (len[1] / col->width < n) return "bad Arrow values";
+		break;
+	default:
+		if (len[1] / col->width < n + 1) return "bad Arrow offsets";
+		col->offsets = start[1];
+		col->data = start[2];
+		if (! offsets_are_valid(col, num_rows, len[2]))
+			return "bad Arrow offsets";
+		return NULL;
+	}
+	col->data = start[1];
+	return NULL;
+}
+
+int arrow_reader_next_batch(arrow_reader_t *r, int64_t *num_rows,
+		const char **error)
+{
+	struct fb fb;
+	size_t batch, body, body_len;
+	int header_type;
+	*error = "bad Arrow message";
+	/* anything else, e.g. a Tensor, is skipped */
+	while (HEADER_RECORD_BATCH != (header_type = read_message(r, &fb,
+				&batch, &body, &body_len)))
+		if (header_type <= 0) return header_type;
+
+	if (0 != fb_field(&fb, batch, BATCH_COMPRESSION)) {
+		*error = "compressed Arrow record batches are not supported";
+		return -1;
+	}
+	int64_t length = fb_scalar(&fb, batch, BATCH_LENGTH, 8);
+	size_t nodes = fb_ref(&fb, batch, BATCH_NODES);
+	size_t buffers = fb_ref(&fb, batch, BATCH_BUFFERS);
+	*error = "bad Arrow record batch";
+	if (fb.bad || 0 == nodes || 0 == buffers || length < 0 ||
+			fb_get(&fb, nodes, 4) != (uint64_t) r->num_cols)
+		return -1;
+
+	size_t buffer = 0;
+	for (int i = 0; i < r->num_cols; i++) {
+		/* FieldNode { length, null_count } */
+		size_t node = nodes + 4 + 16 * i;
+		int64_t node_length = fb_get(&fb, node, 8);
+		int64_t null_count = fb_get(&fb, node + 8, 8);
+		if (node_length != length) return -1;
+		*error = read_column(&fb, &r->cols[i], r->map + body,
+				body_len, buffers, &buffer, length, null_count);
+		if (NULL != *error) return -1;
+	}
+	*num_rows = length;
+	return 1;
+}
+
+static double half_to_double(unsigned half)
+{
+	int exponent = (half >> 10) & 0x1f;
+	int mantissa = half & 0x3ff;
+	double value;
+	if (0 == exponent)
+		value = ldexp(mantissa, -24);
+	else if (0x1f == exponent)
+		value = 0 == mantissa ? INFINITY : NAN;
+	else
+		value = ldexp(mantissa + 0x400, exponent - 25);
+	return half & 0x8000 ? -value : value;
+}
+
+void arrow_reader_value(const arrow_reader_t *r, int col, int64_t row,
+		struct arrow_value *value)
+{
+	const struct arrow_column *c = &r->cols[col];
+	if (KIND_NULL == c->kind || (NULL != c->validity &&
+				! (c->validity[row / 8] >> (row % 8) & 1))) {
+		value->type = SQLITE_NULL;
+		return;
+	}
+
+	uint64_t bits;
+	switch (c->kind) {
+	case KIND_BOOL:
+		value->type = SQLITE_INTEGER;
+		value->u.integer = c->data[row / 8] >> (row % 8) & 1;
+		break;
+	case KIND_INT:
+		bits = load_le(c->data + row * c->width, c->width);
+		value->type = SQLITE_INTEGER;
+		if (c->is_signed && c->width < 8 &&
+				bits >> (8 * c->width - 1))
+			bits |= ~(uint64_t) 0 << (8 * c->width);
+		if (! c->is_signed && bits > INT64_MAX) {
+			value->type = SQLITE_FLOAT;
+			value->u.real = bits;
+		} else {
+			value->u.integer = (int64_t) bits;
+		}
+		break;
+	case KIND_FLOAT:
+		bits = load_le(c->data + row * c->width, c->width);
+		value->type = SQLITE_FLOAT;
+		if (2 == c->width) {
+			value->u.real = half_to_double(bits);
+		} else if (4 == c->width) {
+			uint32_t bits32 = bits;
+			float real;
+			memcpy(&real, &bits32, sizeof(real));
+			value->u.real = real;
+		} else {
+			memcpy(&value->u.real, &bits, sizeof(bits));
+		}
+		break;
+	default: {
+		uint64_t start = load_le(c->offsets + row * c->width, c->width);
+		uint64_t end = load_le(c->offsets + (row + 1) * c->width,
+				c->width);
+		value->type = KIND_UTF8 == c->kind ? SQLITE_TEXT : SQLITE_BLOB;
+		value->u.bytes.start = (const char *) c->data + start;
+		value->u.bytes.len = end - start;
+	}
+	}
+}
+
+void close_arrow_reader(arrow_reader_t *r)
+{
+	for (int i = 0; i < r->num_cols; i++)
+		free(r->cols[i].name);
+	free(r->cols);
+	munmap((void *) r->map, r->size);
+	free(r);
+}
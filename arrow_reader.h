@@ -0,0 +1,80 @@
+#ifndef ARROW_READER_H
+#define ARROW_READER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sqlite3.h"
+
+/* Input of Apache Arrow IPC data, in either the stream format (as written by
+ * sqawk -o arrow, see arrow_writer.h) or the file format ("Feather v2"),
+ * so that typed columnar data can be loaded without going through text. The
+ * file is mmap()ed, and values are read straight from the mapping: text and
+ * blobs stay valid until the reader is closed.
+ *
+ * Columns may be of type Null, Bool, Int (any width, signed or not),
+ * FloatingPoint (any precision), Utf8, LargeUtf8, Binary or LargeBinary.
+ * Their values come out as SQLite values: Bools and Ints as integers (but
+ * unsigned 64-bit ones too large for an integer as reals), FloatingPoints as
+ * reals, Utf8s as text, Binaries as blobs. Other types (dates, nested types,
+ * dictionary-encoded columns, etc.), and compressed record batches, are not
+ * supported. */
+
+struct arrow_reader;
+typedef struct arrow_reader arrow_reader_t;
+
+struct arrow_value {
+	int type;	/* SQLITE_INTEGER, etc. */
+	union {
+		sqlite3_int64 integer;
+		double real;
+		struct {
+			const char *start;
+			size_t len;
+		} bytes;	/* text or blob */
+	} u;
+};
+
+/* Returns true iff 'filename' is a regular file that starts like Arrow IPC
+ * data (of either format). */
+
+bool is_arrow_file(const char *filename);
+
+/* Opens 'filename' and reads its schema. Returns NULL on failure, and sets
+ * *error to a message telling why. */
+
+arrow_reader_t *open_arrow_reader(const char *filename, const char **error);
+
+int arrow_reader_num_columns(const arrow_reader_t *);
+
+const char *arrow_reader_column_name(const arrow_reader_t *, int col);
+
+/* The type of the column's values: SQLITE_INTEGER, SQLITE_FLOAT,
+ * SQLITE_TEXT, SQLITE_BLOB, or SQLITE_NULL (Null columns). */
+
+int arrow_reader_column_type(const arrow_reader_t *, int col);
+
+/* Returns true if an SQLITE_INTEGER column may also have reals, i.e. if it is
+ * an unsigned 64-bit Int column, whose values beyond INT64_MAX come out as
+ * reals. Its table column should then be NUMERIC rather than INTEGER (which
+ * can't hold them if it is the rowid). */
+
+bool arrow_reader_column_has_reals(const arrow_reader_t *, int col);
+
+/* Moves on to the next record batch, and sets *num_rows to its number of
+ * rows. Returns 1, or 0 at the end of the data, or -1 on failure, and then
+ * sets *error. */
+
+int arrow_reader_next_batch(arrow_reader_t *, int64_t *num_rows,
+		const char **error);
+
+/* Sets *value to the value of column 'col' in row 'row' of the current
+ * batch. */
+
+void arrow_reader_value(const arrow_reader_t *, int col, int64_t row,
+		struct arrow_value *value);
+
+void close_arrow_reader(arrow_reader_t *);
+
+#endif
@@ -0,0 +1,698 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arrow_writer.h"
+
+/* Arrow's flatbuffer schema (Message.fbs, Schema.fbs): the enum values and
+ * the numbers of the table fields used here */
+#define METADATA_V5 4
+#define HEADER_SCHEMA 1
+#define HEADER_RECORD_BATCH 3
+#define TYPE_INT 2
+#define TYPE_FLOATING_POINT 3
+#define TYPE_BINARY 4
+#define TYPE_UTF8 5
+#define PRECISION_DOUBLE 2
+
+#define MESSAGE_VERSION 0
+#define MESSAGE_HEADER_TYPE 1
+#define MESSAGE_HEADER 2
+#define MESSAGE_BODY_LENGTH 3
+#define MESSAGE_FIELDS 4
+#define SCHEMA_FIELDS 1
+#define SCHEMA_NUM_FIELDS 4
+#define FIELD_NAME 0
+#define FIELD_NULLABLE 1
+#define FIELD_TYPE_TYPE 2
+#define FIELD_TYPE 3
+#define FIELD_CHILDREN 5
+#define FIELD_NUM_FIELDS 7
+#define BATCH_LENGTH 0
+#define BATCH_NODES 1
+#define BATCH_BUFFERS 2
+#define BATCH_NUM_FIELDS 4
+
+#define CONTINUATION 0xFFFFFFFF
+
+/* A batch is also ended when a column has this much text, as the offsets of
+ * Utf8 and Binary values are 32-bit (and SQLite's values are at most about
+ * 1 GB). */
+#define MAX_BATCH_BYTES (1 << 30)
+
+struct growbuf {
+	unsigned char *data;
+	size_t len;
+	size_t cap;
+};
+
+/* Makes room for 'n' more bytes, which are zeroed. Returns the position of
+ * the first, or (size_t) -1 if out of memory. */
+
+static size_t grow(struct growbuf *b, size_t n)
+{
+	if (0 == n) return b->len;
+	if (b->len + n > b->cap) {
+		size_t cap = 0 == b->cap ? 4096 : b->cap;
+		while (cap < b->len + n) cap *= 2;
+		unsigned char *data = realloc(b->data, cap);
+		if (NULL == data) return (size_t) -1;
+		b->data = data;
+		b->cap = cap;
+	}
+	memset(b->data + b->len, 0, n);
+	size_t pos = b->len;
+	b->len += n;
+	return pos;
+}
+
+static size_t pad(struct growbuf *b, size_t align)
+{
+	size_t padding = (align - b->len % align) % align;
+	if ((size_t) -1 == grow(b, padding)) return (size_t) -1;
+	return b->len;
+}
+
+/* Stores 'value' in 'size' bytes at 'pos', little-endian. */
+
+static void set_le(struct growbuf *b, size_t pos, uint64_t value, int size)
+{
+	for (int i = 0; i < size; i++)
+		b->data[pos + i] = value >> (8 * i);
+}
+
+/* A flatbuffer, written front to back: a table is laid out before the
+ * objects it refers to, as the offsets to these must be positive. Its vtable
+ * is just before it. Offset fields are written as 0, then linked to their
+ * object once it is laid out. Errors (out of memory) make 'failed' true. */
+
+struct fb {
+	struct growbuf buf;
+	bool failed;
+};
+
+struct fb_table {
+	size_t vtable;
+	size_t pos;
+};
+
+static size_t fb_zeros(struct fb *fb, size_t n, size_t align)
+{
+	if ((size_t) -1 == pad(&fb->buf, align)) fb->failed = true;
+	size_t pos = grow(&fb->buf, n);
+	if ((size_t) -1 == pos) fb->failed = true;
+	return pos;
+}
+
+static struct fb_table fb_start_table(struct fb *fb, int num_fields)
+{
+	size_t vtable_size = 4 + 2 * num_fields;
+	struct fb_table t = { 0, 0 };
+	/* the table is 8-aligned, which suits any of its fields */
+	size_t start = fb->buf.len + vtable_size;
+	size_t padding = (8 - start % 8) % 8;
+	if ((size_t) -1 == grow(&fb->buf, padding)) fb->failed = true;
+	t.vtable = fb_zeros(fb, vtable_size + 4, 1);
+	if (fb->failed) return t;
+	t.pos = t.vtable + vtable_size;
+	set_le(&fb->buf, t.vtable, vtable_size, 2);
+	set_le(&fb->buf, t.pos, t.pos - t.vtable, 4);
+	return t;
+}
+
+/* Returns the field's position. */
+
+static size_t fb_field(struct fb *fb, struct fb_table t, int field,
+		uint64_t value, int size)
+{
+	size_t pos = fb_zeros(fb, size, size);
+	if (fb->failed) return 0;
+	set_le(&fb->buf, pos, value, size);
+	set_le(&fb->buf, t.vtable + 4 + 2 * field, pos - t.pos, 2);
+	return pos;
+}
+
+static void fb_end_table(struct fb *fb, struct fb_table t)
+{
+	if (fb->failed) return;
+	set_le(&fb->buf, t.vtable + 2, fb->buf.len - t.pos, 2);
+}
+
+static void fb_link(struct fb *fb, size_t offset_pos, size_t target)
+{
+	if (fb->failed) return;
+	set_le(&fb->buf, offset_pos, target - offset_pos, 4);
+}
+
+/* Lays out a vector of 'n' elements of 'size' bytes, which are zeroed.
+ * Returns its position; the elements start 4 bytes after it. */
+
+static size_t fb_vector(struct fb *fb, size_t n, size_t size, size_t align)
+{
+	if (align < 4) align = 4;
+	size_t start = fb->buf.len + 4;
+	size_t padding = (align - start % align) % align;
+	if ((size_t) -1 == grow(&fb->buf, padding)) fb->failed = true;
+	size_t pos = fb_zeros(fb, 4 + n * size, 1);
+	if (fb->failed) return 0;
+	set_le(&fb->buf, pos, n, 4);
+	return pos;
+}
+
+static size_t fb_string(struct fb *fb, const char *s)
+{
+	size_t len = strlen(s);
+	size_t pos = fb_vector(fb, len + 1, 1, 4);
+	if (fb->failed) return 0;
+	set_le(&fb->buf, pos, len, 4);
+	memcpy(fb->buf.data + pos + 4, s, len);
+	return pos;
+}
+
+/* Starts a Message; returns the position of its header offset. */
+
+static size_t fb_message(struct fb *fb, int header_type, int64_t body_length)
+{
+	fb->buf.len = 0;
+	fb->failed = false;
+	size_t root = fb_zeros(fb, 4, 4);
+	struct fb_table t = fb_start_table(fb, MESSAGE_FIELDS);
+	fb_link(fb, root, t.pos);
+	fb_field(fb, t, MESSAGE_VERSION, METADATA_V5, 2);
+	fb_field(fb, t, MESSAGE_HEADER_TYPE, header_type, 1);
+	size_t header = fb_field(fb, t, MESSAGE_HEADER, 0, 4);
+	fb_field(fb, t, MESSAGE_BODY_LENGTH, body_length, 8);
+	fb_end_table(fb, t);
+	return header;
+}
+
+enum arrow_type { ARROW_INT64, ARROW_FLOAT64, ARROW_UTF8, ARROW_BINARY };
+
+/* A value as SQLite gave it. Text and blobs are in the column's 'bytes'. */
+
+struct cell {
+	int type;	/* SQLITE_INTEGER, etc. */
+	union {
+		sqlite3_int64 integer;
+		double real;
+		size_t offset;
+	} u;
+	size_t len;
+};
+
+struct arrow_column {
+	char *name;
+	char *decl_type;	/* NULL if none */
+	enum arrow_type type;	/* once the schema is written */
+	struct cell *cells;	/* one per row of the batch */
+	struct growbuf bytes;
+};
+
+struct arrow_writer {
+	FILE *out;
+	int error;	/* errno of the first failure, or 0 */
+	int num_cols;	/* -1 until known */
+	struct arrow_column *cols;
+	size_t num_rows;
+	size_t max_rows;
+	bool batch_full;
+	bool schema_written;
+	struct fb meta;
+	struct growbuf body;
+};
+
+arrow_writer_t *create_arrow_writer(FILE *out)
+{
+	arrow_writer_t *w = calloc(1, sizeof(arrow_writer_t));
+	if (NULL == w) return NULL;
+	w->out = out;
+	w->num_cols = -1;
+	return w;
+}
+
+static void fail(arrow_writer_t *w, int error)
+{
+	if (0 == w->error) w->error = error;
+}
+
+static void write_out(arrow_writer_t *w, const void *data, size_t len)
+{
+	if (0 == len || 0 != w->error) return;
+	if (len != fwrite(data, 1, len, w->out))
+		fail(w, 0 == errno ? EIO : errno);
+}
+
+static void free_columns(arrow_writer_t *w)
+{
+	for (int i = 0; i < w->num_cols; i++) {
+		free(w->cols[i].name);
+		free(w->cols[i].decl_type);
+		free(w->cols[i].cells);
+		free(w->cols[i].bytes.data);
+	}
+	free(w->cols);
+	w->cols = NULL;
+}
+
+void arrow_writer_columns(arrow_writer_t *w, sqlite3_stmt *stmt)
+{
+	int num_cols = sqlite3_column_count(stmt);
+	if (-1 != w->num_cols) {
+		/* the schema can't change within a stream */
+		if (num_cols != w->num_cols) fail(w, EINVAL);
+		return;
+	}
+	w->cols = calloc(num_cols, sizeof(struct arrow_column));
+	if (NULL == w->cols) {
+		fail(w, ENOMEM);
+		return;
+	}
+	w->num_cols = num_cols;
+	for (int i = 0; i < num_cols; i++) {
+		const char *name = sqlite3_column_name(stmt, i);
+		const char *decl_type = sqlite3_column_decltype(stmt, i);
+		w->cols[i].name = strdup(NULL == name ? "" : name);
+		if (NULL != decl_type)
+			w->cols[i].decl_type = strdup(decl_type);
+		if (NULL == w->cols[i].name || (NULL != decl_type &&
+					NULL == w->cols[i].decl_type))
+			fail(w, ENOMEM);
+	}
+}
+
+void arrow_writer_row(arrow_writer_t *w, sqlite3_stmt *stmt)
+{
+	if (-1 == w->num_cols) arrow_writer_columns(w, stmt);
+	if (0 != w->error) return;
+	if (w->num_rows == w->max_rows) {
+		size_t max_rows = 0 == w->max_rows ? 1024 : 2 * w->max_rows;
+		for (int i = 0; i < w->num_cols; i++) {
+			struct cell *cells = realloc(w->cols[i].cells,
+					max_rows * sizeof(struct cell));
+			if (NULL == cells) {
+				fail(w, ENOMEM);
+				return;
+			}
+			w->cols[i].cells = cells;
+		}
+		w->max_rows = max_rows;
+	}
+
+	for (int i = 0; i < w->num_cols; i++) {
+		struct arrow_column *col = &w->cols[i];
+		struct cell *cell = &col->cells[w->num_rows];
+		const void *data;
+		cell->type = sqlite3_column_type(stmt, i);
+		switch (cell->type) {
+		case SQLITE_INTEGER:
+			cell->u.integer = sqlite3_column_int64(stmt, i);
+			break;
+		case SQLITE_FLOAT:
+			cell->u.real = sqlite3_column_double(stmt, i);
+			break;
+		case SQLITE_NULL:
+			break;
+		default:
+			data = SQLITE_BLOB == cell->type ?
+				sqlite3_column_blob(stmt, i) :
+				sqlite3_column_text(stmt, i);
+			cell->len = sqlite3_column_bytes(stmt, i);
+			cell->u.offset = grow(&col->bytes, cell->len);
+			if ((size_t) -1 == cell->u.offset) {
+				fail(w, ENOMEM);
+				return;
+			}
+			if (cell->len > 0)
+				memcpy(col->bytes.data + cell->u.offset, data,
+						cell->len);
+			if (col->bytes.len > MAX_BATCH_BYTES)
+				w->batch_full = true;
+		}
+	}
+	if (++w->num_rows == ARROW_BATCH_ROWS) w->batch_full = true;
+	if (w->batch_full) arrow_writer_flush(w);
+}
+
+/* As SQLite's rules for column affinity. */
+
+static enum arrow_type declared_type(const char *decl_type)
+{
+	if (NULL == decl_type) return ARROW_UTF8;
+	if (0 == sqlite3_strlike("%INT%", decl_type, 0)) return ARROW_INT64;
+	if (0 == sqlite3_strlike("%CHAR%", decl_type, 0) ||
+			0 == sqlite3_strlike("%CLOB%", decl_type, 0) ||
+			0 == sqlite3_strlike("%TEXT%", decl_type, 0))
+		return ARROW_UTF8;
+	if (0 == sqlite3_strlike("%BLOB%", decl_type, 0) ||
+			'\0' == decl_type[0])
+		return ARROW_BINARY;
+	return ARROW_FLOAT64;	/* REAL, NUMERIC, etc. */
+}
+
+/* The type of the column: that of its declared type, if any, unless the
+ * values in the batch need a wider one (e.g. Float64 for a real in an INTEGER
+ * column); else that of these values. The types are in order of width: each
+ * can hold the values of those before it. */
+
+static enum arrow_type column_type(const struct arrow_column *col,
+		size_t num_rows)
+{
+	enum arrow_type type = ARROW_INT64;
+	bool any = false;
+	for (size_t row = 0; row < num_rows; row++) {
+		enum arrow_type value_type;
+		switch (col->cells[row].type) {
+		case SQLITE_BLOB: value_type = ARROW_BINARY; break;
+		case SQLITE_TEXT: value_type = ARROW_UTF8; break;
+		case SQLITE_FLOAT: value_type = ARROW_FLOAT64; break;
+		case SQLITE_INTEGER: value_type = ARROW_INT64; break;
+		default: continue;
+		}
+		if (value_type > type) type = value_type;
+		any = true;
+	}
+	if (NULL == col->decl_type)
+		return any ? type : ARROW_UTF8;
+	enum arrow_type declared = declared_type(col->decl_type);
+	return declared > type ? declared : type;
+}
+
+/* Frames and writes a message: the flatbuffer is padded so that the body
+ * starts 8-aligned. */
+
+static void write_message(arrow_writer_t *w)
+{
+	if (w->meta.failed) {
+		fail(w, ENOMEM);
+		return;
+	}
+	if ((size_t) -1 == pad(&w->meta.buf, 8)) {
+		fail(w, ENOMEM);
+		return;
+	}
+	unsigned char prefix[8];
+	struct growbuf p = { prefix, 0, sizeof(prefix) };
+	set_le(&p, 0, CONTINUATION, 4);
+	set_le(&p, 4, w->meta.buf.len, 4);
+	write_out(w, prefix, sizeof(prefix));
+	write_out(w, w->meta.buf.data, w->meta.buf.len);
+}
+
+static void write_schema(arrow_writer_t *w)
+{
+	static const int type_ids[] = { TYPE_INT, TYPE_FLOATING_POINT,
+		TYPE_UTF8, TYPE_BINARY };
+	struct fb *fb = &w->meta;
+	size_t header = fb_message(fb, HEADER_SCHEMA, 0);
+
+	struct fb_table schema = fb_start_table(fb, SCHEMA_NUM_FIELDS);
+	fb_link(fb, header, schema.pos);
+	size_t fields = fb_field(fb, schema, SCHEMA_FIELDS, 0, 4);
+	fb_end_table(fb, schema);
+	size_t vector = fb_vector(fb, w->num_cols, 4, 4);
+	fb_link(fb, fields, vector);
+
+	for (int i = 0; i < w->num_cols; i++) {
+		struct arrow_column *col = &w->cols[i];
+		struct fb_table field = fb_start_table(fb, FIELD_NUM_FIELDS);
+		fb_link(fb, vector + 4 + 4 * i, field.pos);
+		size_t name = fb_field(fb, field, FIELD_NAME, 0, 4);
+		fb_field(fb, field, FIELD_NULLABLE, 1, 1);
+		fb_field(fb, field, FIELD_TYPE_TYPE, type_ids[col->type], 1);
+		size_t type = fb_field(fb, field, FIELD_TYPE, 0, 4);
+		size_t children = fb_field(fb, field, FIELD_CHILDREN, 0, 4);
+		fb_end_table(fb, field);
+
+		fb_link(fb, name, fb_string(fb, col->name));
+		struct fb_table type_table;
+		switch (col->type) {
+		case ARROW_INT64:
+			type_table = fb_start_table(fb, 2);
+			/* bitWidth, is_signed */
+			fb_field(fb, type_table, 0, 64, 4);
+			fb_field(fb, type_table, 1, 1, 1);
+			break;
+		case ARROW_FLOAT64:
+			type_table = fb_start_table(fb, 1);
+			fb_field(fb, type_table, 0, PRECISION_DOUBLE, 2);
+			break;
+		default:
+			type_table = fb_start_table(fb, 0);
+		}
+		fb_end_table(fb, type_table);
+		fb_link(fb, type, type_table.pos);
+		fb_link(fb, children, fb_vector(fb, 0, 4, 4));
+	}
+	write_message(w);
+	w->schema_written = true;
+}
+
+/* Appends a buffer of 'len' zeroed bytes to the body. Its offset and length
+ * go in 'ref'. */
+
+static size_t body_buffer(arrow_writer_t *w, size_t len, int64_t *ref)
+{
+	size_t pos = grow(&w->body, len);
+	if ((size_t) -1 == pos || (size_t) -1 == pad(&w->body, 8)) {
+		fail(w, ENOMEM);
+		return 0;
+	}
+	ref[0] = pos;
+	ref[1] = len;
+	return pos;
+}
+
+/* Whether the integer is a double without rounding. */
+
+static bool is_exact_real(sqlite3_int64 integer)
+{
+	double real = integer;
+	return fabs(real) < 9e18 && (sqlite3_int64) real == integer;
+}
+
+static void set_valid(arrow_writer_t *w, size_t validity, size_t row)
+{
+	w->body.data[validity + row / 8] |= 1 << (row % 8);
+}
+
+/* Lays out the column's buffers in the body: the validity bitmap, then the
+ * values, or the offsets and the bytes of the values. Returns the number of
+ * nulls. A value that doesn't fit the column's type fails the writer with
+ * EDOM, rather than being written as a null. */
+
+static int64_t column_buffers(arrow_writer_t *w, struct arrow_column *col,
+		int64_t refs[3][2])
+{
+	size_t num_rows = w->num_rows;
+	int64_t num_nulls = 0;
+	size_t validity = body_buffer(w, (num_rows + 7) / 8, refs[0]);
+	if (0 != w->error) return 0;
+
+	if (ARROW_INT64 == col->type || ARROW_FLOAT64 == col->type) {
+		size_t values = body_buffer(w, 8 * num_rows, refs[1]);
+		if (0 != w->error) return 0;
+		for (size_t row = 0; row < num_rows; row++) {
+			const struct cell *cell = &col->cells[row];
+			union { int64_t integer; double real; } v;
+			bool valid = true;
+			if (ARROW_INT64 == col->type) {
+				if (SQLITE_INTEGER == cell->type)
+					v.integer = cell->u.integer;
+				else if (SQLITE_FLOAT == cell->type &&
+						fabs(cell->u.real) < 9e18 &&
+						cell->u.real ==
+						(int64_t) cell->u.real)
+					v.integer = cell->u.real;
+				else if (SQLITE_NULL == cell->type)
+					valid = false;
+				else
+					goto misfit;
+				if (valid)
+					set_le(&w->body, values + 8 * row,
+						v.integer, 8);
+			} else {
+				if (SQLITE_FLOAT == cell->type)
+					v.real = cell->u.real;
+				else if (SQLITE_INTEGER == cell->type &&
+						is_exact_real(cell->u.integer))
+					v.real = cell->u.integer;
+				else if (SQLITE_NULL == cell->type)
+					valid = false;
+				else
+					goto misfit;
+				if (valid) {
+					uint64_t bits;
+					memcpy(&bits, &v.real, 8);
+					set_le(&w->body, values + 8 * row,
+						bits, 8);
+				}
+			}
+			if (valid)
+				set_valid(w, validity, row);
+			else
+				num_nulls++;
+		}
+	} else {
+		size_t offsets = body_buffer(w, 4 * (num_rows + 1), refs[1]);
+		if (0 != w->error) return 0;
+		size_t start = w->body.len;
+		for (size_t row = 0; row < num_rows; row++) {
+			const struct cell *cell = &col->cells[row];
+			char number[32];
+			const void *data = NULL;
+			size_t len = 0;
+			switch (cell->type) {
+			case SQLITE_INTEGER:
+				sqlite3_snprintf(sizeof(number), number,
+						"%lld", cell->u.integer);
+				data = number;
+				len = strlen(number);
+				break;
+			case SQLITE_FLOAT:
+				/* as SQLite converts reals to text */
+				sqlite3_snprintf(sizeof(number), number,
+						"%!.15g", cell->u.real);
+				data = number;
+				len = strlen(number);
+				break;
+			case SQLITE_TEXT:
+			case SQLITE_BLOB:
+				if (SQLITE_BLOB == cell->type &&
+						ARROW_UTF8 == col->type)
+					goto misfit;
+				data = col->bytes.data + cell->u.offset;
+				len = cell->len;
+				break;
+			}
+			if (NULL != data) {
+				size_t pos = grow(&w->body, len);
+				if ((size_t) -1 == pos) {
+					fail(w, ENOMEM);
+					return 0;
+				}
+				if (len > 0)
+					memcpy(w->body.data + pos, data, len);
+				set_valid(w, validity, row);
+			} else {
+				num_nulls++;
+			}
+			set_le(&w->body, offsets + 4 * (row + 1),
+					w->body.len - start, 4);
+		}
+		refs[2][0] = start;
+		refs[2][1] = w->body.len - start;
+		if ((size_t) -1 == pad(&w->body, 8)) fail(w, ENOMEM);
+	}
+	if (0 == num_nulls) {
+		/* no bitmap needed: all are valid */
+		refs[0][1] = 0;
+	}
+	return num_nulls;
+
+misfit:
+	fail(w, EDOM);
+	return 0;
+}
+
+static void write_batch(arrow_writer_t *w)
+{
+	int num_cols = w->num_cols;
+	int64_t (*refs)[3][2] = calloc(num_cols, sizeof(*refs));
+	int64_t *num_nulls = calloc(num_cols, sizeof(int64_t));
+	if (NULL == refs || NULL == num_nulls) {
+		free(refs);
+		free(num_nulls);
+		fail(w, ENOMEM);
+		return;
+	}
+	w->body.len = 0;
+	int num_buffers = 0;
+	for (int i = 0; i < num_cols && 0 == w->error; i++) {
+		num_nulls[i] = column_buffers(w, &w->cols[i], refs[i]);
+		num_buffers += ARROW_UTF8 == w->cols[i].type ||
+			ARROW_BINARY == w->cols[i].type ? 3 : 2;
+	}
+
+	struct fb *fb = &w->meta;
+	size_t header = fb_message(fb, HEADER_RECORD_BATCH, w->body.len);
+	struct fb_table batch = fb_start_table(fb, BATCH_NUM_FIELDS);
+	fb_link(fb, header, batch.pos);
+	fb_field(fb, batch, BATCH_LENGTH, w->num_rows, 8);
+	size_t nodes = fb_field(fb, batch, BATCH_NODES, 0, 4);
+	size_t buffers = fb_field(fb, batch, BATCH_BUFFERS, 0, 4);
+	fb_end_table(fb, batch);
+
+	/* FieldNode { length, null_count } */
+	size_t vector = fb_vector(fb, num_cols, 16, 8);
+	fb_link(fb, nodes, vector);
+	for (int i = 0; i < num_cols && ! fb->failed; i++) {
+		set_le(&fb->buf, vector + 4 + 16 * i, w->num_rows, 8);
+		set_le(&fb->buf, vector + 12 + 16 * i, num_nulls[i], 8);
+	}
+	/* Buffer { offset, length } */
+	vector = fb_vector(fb, num_buffers, 16, 8);
+	fb_link(fb, buffers, vector);
+	size_t pos = vector + 4;
+	for (int i = 0; i < num_cols && ! fb->failed; i++) {
+		int n = ARROW_UTF8 == w->cols[i].type ||
+			ARROW_BINARY == w->cols[i].type ? 3 : 2;
+		for (int b = 0; b < n; b++, pos += 16) {
+			set_le(&fb->buf, pos, refs[i][b][0], 8);
+			set_le(&fb->buf, pos + 8, refs[i][b][1], 8);
+		}
+	}
+	free(refs);
+	free(num_nulls);
+
+	if (0 != w->error) return;
+	write_message(w);
+	write_out(w, w->body.data, w->body.len);
+}
+
+int arrow_writer_flush(arrow_writer_t *w)
+{
+	if (-1 != w->num_cols && 0 == w->error) {
+		if (! w->schema_written) {
+			for (int i = 0; i < w->num_cols; i++)
+				w->cols[i].type = column_type(&w->cols[i],
+						w->num_rows);
+			write_schema(w);
+		}
+		if (w->num_rows > 0) write_batch(w);
+	}
+	w->num_rows = 0;
+	w->batch_full = false;
+	for (int i = 0; i < w->num_cols; i++)
+		w->cols[i].bytes.len = 0;
+
+	if (0 == w->error && 0 != fflush(w->out)) fail(w, errno);
+	if (0 == w->error) return 0;
+	errno = w->error;
+	return -1;
+}
+
+int destroy_arrow_writer(arrow_writer_t *w)
+{
+	int result = arrow_writer_flush(w);
+	if (0 == result && w->schema_written) {
+		/* end of stream */
+		unsigned char eos[8];
+		struct growbuf p = { eos, 0, sizeof(eos) };
+		set_le(&p, 0, CONTINUATION, 4);
+		set_le(&p, 4, 0, 4);
+		write_out(w, eos, sizeof(eos));
+		if (0 == w->error && 0 != fflush(w->out)) fail(w, errno);
+		result = 0 == w->error ? 0 : -1;
+	}
+	int error = w->error;
+	free_columns(w);
+	free(w->meta.buf.data);
+	free(w->body.data);
+	free(w);
+	errno = error;
+	return result;
+}
@@ -0,0 +1,56 @@
+#ifndef ARROW_WRITER_H
+#define ARROW_WRITER_H
+
+#include <stdio.h>
+
+#include "sqlite3.h"
+
+/* Output of query results as an Apache Arrow IPC stream: a schema message,
+ * record batches of (at most ARROW_BATCH_ROWS) rows, and an end-of-stream
+ * marker, so that the results can be loaded by Arrow-based tools without
+ * parsing text. The flatbuffers of the messages are written by hand, so no
+ * Arrow library is needed.
+ *
+ * A column is Int64, Float64, Utf8 or Binary, and nullable. Its type is
+ * chosen by its declared type's affinity (INTEGER: Int64, REAL and NUMERIC:
+ * Float64, TEXT: Utf8, BLOB or none: Binary), or for an expression by the
+ * values in the first batch (Binary if there is any blob, else Utf8 if there
+ * is any text, else Float64 if there is any real, else Int64; Utf8 if they are
+ * all NULL); the values in the first batch may also widen a declared type
+ * (e.g. a real makes an INTEGER column Float64). Numbers in Utf8 and Binary
+ * columns are converted to text (as SQLite would), integers in Float64
+ * columns to reals, and integral reals in Int64 columns to integers. A value
+ * that can't be converted without loss (e.g. text in a Float64 column, or an
+ * integer that a double can't hold exactly) fails the writer with EDOM. The results of
+ * several queries (e.g. with -P) make up a single stream, and must all have
+ * the same columns. */
+
+#define ARROW_BATCH_ROWS 65536
+
+typedef struct arrow_writer arrow_writer_t;
+
+/* Returns a writer to 'out', or NULL if out of memory. */
+
+arrow_writer_t *create_arrow_writer(FILE *out);
+
+/* Notes the columns of 'stmt', before its rows are added, or if it has none
+ * (the schema is written even if there are no rows). */
+
+void arrow_writer_columns(arrow_writer_t *, sqlite3_stmt *stmt);
+
+/* Adds the current row of 'stmt'. */
+
+void arrow_writer_row(arrow_writer_t *, sqlite3_stmt *stmt);
+
+/* Writes the rows added so far as a record batch (after the schema, if this
+ * was not written yet). Returns 0, or -1 if this or an earlier write failed
+ * (errno tells why). */
+
+int arrow_writer_flush(arrow_writer_t *);
+
+/* Flushes the writer, ends the stream, and destroys the writer. Returns as
+ * arrow_writer_flush(). */
+
+int destroy_arrow_writer(arrow_writer_t *);
+
+#endif
@@ -0,0 +1,604 @@
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "sqlite3.h"
+
+#include "buffered_CSV.h"
+#include "csv_number.h"
+#include "result_writer.h"
+
+/* Microbenchmarks of the load path (make bench). Synthetic files of several
+ * shapes are generated, then each stage of loading them is timed on its own:
+ *
+ * - read: splitting the data into lines (buf_csv_next_data_line_view());
+ * - tokenize: splitting the lines into fields;
+ * - infer: classifying the values, as type inference does;
+ * - bind: converting the values, binding them to a multi-row INSERT, and
+ *   stepping it, into an in-memory table; this is a copy of sqawk's
+ *   batching and binding (insert_rows() and run_bind_pass() below), not
+ *   sqawk.c's own code, so it must be kept in step with it, and it leaves
+ *   out what sqawk adds to it (-N NULL tokens, pushed-down WHERE terms);
+ * - index: indexing the table on its first column;
+ * - output: writing out the whole table as TSV (see result_writer.h);
+ * - sqawk: the whole program, loading the file for a query that reads all
+ *   its columns, if there is a ./sqawk to run.
+ *
+ * The first stages can't be run without the ones before them, so a pass is
+ * timed that stops after each of these, and the time of a stage is the
+ * difference between its pass and the one before, i.e. what it adds to them
+ * (e.g. tokenizing adds little to reading, as both scan the line). Each pass
+ * is repeated, and the fastest run is kept.
+ *
+ * The results go to stdout as TSV, one line per file and stage, after a
+ * header: file, stage, rows, bytes (of input, but of output for 'output'),
+ * seconds, MB/s (10^6 bytes) and rows/s. */
+
+#define DEFAULT_ROWS 100000
+#define DEFAULT_REPEATS 3
+#define BATCH_ROWS 128	/* a copy of sqawk's INSERT_BATCH_ROWS */
+#define SQAWK "./sqawk"
+
+struct dataset {
+	const char *name;
+	const char *filename;
+	char separator;
+	char *first_line_re;
+	bool quoted;	/* RFC 4180 (-Q) */
+	void (*generate)(FILE *out, int num_rows);
+};
+
+enum pass { PASS_READ, PASS_TOKENIZE, PASS_INFER, NUM_PASSES };
+
+static const char *pass_names[NUM_PASSES] = { "read", "tokenize", "infer" };
+
+static void die(const char *msg)
+{
+	if (NULL == msg)
+		perror(NULL);
+	else
+		fprintf(stderr, "FATAL: %s\n", msg);
+
+	exit(EXIT_FAILURE);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Data generation. The data are pseudo-random, but the same on every run, so
+ * that runs on different commits can be compared. */
+
+static uint64_t rng_state;
+
+static uint64_t rng(void)
+{
+	/* xorshift64* */
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static void put_word(FILE *out, int len)
+{
+	for (int i = 0; i < len; i++)
+		fputc('a' + rng() % 26, out);
+}
+
+/* A few short columns of each type. */
+
+static void generate_narrow(FILE *out, int num_rows)
+{
+	fputs("id\tcount\tscore\tcode\n", out);
+	for (int i = 0; i < num_rows; i++) {
+		fprintf(out, "%d\t%d\t%.3f\t", i, (int) (rng() % 1000),
+				(rng() % 1000000) / 1000.0);
+		put_word(out, 8);
+		fputc('\n', out);
+	}
+}
+
+/* Many short columns, half of them integers. */
+
+static void generate_wide(FILE *out, int num_rows)
+{
+	for (int c = 0; c < 64; c++)
+		fprintf(out, "%sc%d", 0 == c ? "" : "\t", c);
+	fputc('\n', out);
+	for (int i = 0; i < num_rows; i++) {
+		for (int c = 0; c < 64; c++) {
+			if (c > 0) fputc('\t', out);
+			if (0 == c % 2)
+				fprintf(out, "%d", (int) (rng() % 100000));
+			else
+				put_word(out, 6);
+		}
+		fputc('\n', out);
+	}
+}
+
+/* Few columns, one of them a long text. */
+
+static void generate_long(FILE *out, int num_rows)
+{
+	fputs("id\tkey\ttext\n", out);
+	for (int i = 0; i < num_rows; i++) {
+		fprintf(out, "%d\t", i);
+		put_word(out, 12);
+		fputc('\t', out);
+		for (int w = 0; w < 50; w++) {
+			if (w > 0) fputc(' ', out);
+			put_word(out, 2 + rng() % 12);
+		}
+		fputc('\n', out);
+	}
+}
+
+/* RFC 4180 CSV, with separators and doubled quotes within quoted fields. */
+
+static void generate_quoted(FILE *out, int num_rows)
+{
+	fputs("id,name,comment,amount\n", out);
+	for (int i = 0; i < num_rows; i++) {
+		fprintf(out, "%d,\"", i);
+		put_word(out, 7);
+		fputs(", ", out);
+		put_word(out, 5);
+		fputs("\",\"", out);
+		put_word(out, 10);
+		fputs(" \"\"", out);
+		put_word(out, 6);
+		fputs("\"\", ", out);
+		put_word(out, 12);
+		fprintf(out, "\",%d.%02d\n", (int) (rng() % 10000),
+				(int) (rng() % 100));
+	}
+}
+
+/* VCF-like: meta-information lines to skip, then variants with an INFO
+ * column and per-sample genotypes. */
+
+static void generate_vcf(FILE *out, int num_rows)
+{
+	fputs("##fileformat=VCFv4.2\n", out);
+	for (int i = 0; i < 20; i++)
+		fprintf(out, "##INFO=<ID=X%d,Number=1,Type=Integer,"
+			"Description=\"Field %d\">\n", i, i);
+	fputs("#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT", out);
+	for (int s = 1; s <= 8; s++)
+		fprintf(out, "\tS%d", s);
+	fputc('\n', out);
+	static const char bases[] = "ACGT";
+	long pos = 10000;
+	for (int i = 0; i < num_rows; i++) {
+		pos += 1 + rng() % 500;
+		fprintf(out, "chr%d\t%ld\trs%d\t%c\t%c\t%d\tPASS\t"
+			"DP=%d;AF=0.%03d;MQ=60\tGT:DP:GQ",
+			1 + i * 22 / num_rows, pos, 1000000 + i,
+			bases[rng() % 4], bases[rng() % 4],
+			(int) (rng() % 100), (int) (rng() % 500),
+			(int) (rng() % 1000));
+		for (int s = 0; s < 8; s++)
+			fprintf(out, "\t%d|%d:%d:%d", (int) (rng() % 2),
+				(int) (rng() % 2), (int) (rng() % 60),
+				(int) (rng() % 100));
+		fputc('\n', out);
+	}
+}
+
+static struct dataset datasets[] = {
+	{ "narrow", "narrow.tsv", '\t', NULL, false, generate_narrow },
+	{ "wide", "wide.tsv", '\t', NULL, false, generate_wide },
+	{ "long", "long.tsv", '\t', NULL, false, generate_long },
+	{ "quoted", "quoted.csv", ',', NULL, true, generate_quoted },
+	{ "vcf", "vcf.vcf", '\t', "^#CHROM", false, generate_vcf },
+};
+
+#define NUM_DATASETS (int) (sizeof(datasets) / sizeof(datasets[0]))
+
+static void report(const char *file, const char *stage, long rows,
+		long long bytes, double seconds)
+{
+	if (seconds < 1e-9) seconds = 1e-9;
+	printf("%s\t%s\t%ld\t%lld\t%.6f\t%.2f\t%.0f\n", file, stage, rows,
+			bytes, seconds, bytes / seconds / 1e6, rows / seconds);
+}
+
+static buffered_CSV_t *open_dataset(const struct dataset *ds)
+{
+	FILE *csv = fopen(ds->filename, "r");
+	if (NULL == csv) die(NULL);
+	buffered_CSV_t *buf_csv = create_buffered_CSV(csv, ds->separator,
+			ds->first_line_re, ds->quoted ? BUF_CSV_QUOTED : 0);
+	if (NULL == buf_csv) die(NULL);
+	return buf_csv;
+}
+
+/* Runs the read pass, or the tokenize or infer one, and returns its time.
+ * Sets *num_rows to the number of data lines. */
+
+static double run_pass(const struct dataset *ds, enum pass pass,
+		long *num_rows)
+{
+	buffered_CSV_t *buf_csv = open_dataset(ds);
+	int num_fields = buf_csv_field_count(buf_csv);
+	buf_csv_field_t fields[num_fields];
+	long rows = 0;
+	long classes = 0;	/* so that the classification isn't elided */
+
+	double start = now();
+	if (PASS_READ == pass) {
+		const char *line;
+		while (-1 != buf_csv_next_data_line_view(buf_csv, &line))
+			rows++;
+	} else {
+		while (-1 != buf_csv_next_data_line_slices(buf_csv, fields)) {
+			rows++;
+			if (PASS_INFER != pass) continue;
+			for (int i = 0; i < num_fields; i++)
+				classes += csv_number_class(&fields[i]);
+		}
+	}
+	double seconds = now() - start;
+
+	destroy_buffered_CSV(buf_csv);
+	if (classes < 0) die("impossible");
+	*num_rows = rows;
+	return seconds;
+}
+
+static void exec_sql(sqlite3 *db, const char *sql)
+{
+	char *error_msg;
+	if (SQLITE_OK != sqlite3_exec(db, sql, NULL, NULL, &error_msg))
+		die(error_msg);
+}
+
+static sqlite3_stmt *prepare_insert(sqlite3 *db, int num_fields,
+		int num_rows)
+{
+	sqlite3_str *sql = sqlite3_str_new(db);
+	sqlite3_str_appendall(sql, "INSERT INTO t VALUES ");
+	for (int r = 0; r < num_rows; r++) {
+		sqlite3_str_appendall(sql, 0 == r ? "(?" : ", (?");
+		for (int i = 1; i < num_fields; i++)
+			sqlite3_str_appendall(sql, ", ?");
+		sqlite3_str_appendchar(sql, 1, ')');
+	}
+	char *insert_SQL = sqlite3_str_finish(sql);
+	if (NULL == insert_SQL) die(NULL);
+	sqlite3_stmt *stmt;
+	if (SQLITE_OK != sqlite3_prepare_v2(db, insert_SQL, -1, &stmt, NULL))
+		die(sqlite3_errmsg(db));
+	sqlite3_free(insert_SQL);
+	return stmt;
+}
+
+/* Binds the values of 'fields' (of 'num_rows' rows) as sqawk does, i.e.
+ * numbers as such, and steps 'stmt'. This copies sqawk.c's binding: change
+ * both together. */
+
+static void insert_rows(sqlite3 *db, sqlite3_stmt *stmt,
+		const buf_csv_field_t *fields, int num_fields, int num_rows)
+{
+	for (int i = 0; i < num_rows * num_fields; i++) {
+		int64_t integer;
+		double real;
+		int result;
+		switch (csv_number(&fields[i], &integer, &real)) {
+		case CSV_INTEGER:
+			result = sqlite3_bind_int64(stmt, i + 1, integer);
+			break;
+		case CSV_REAL:
+			result = sqlite3_bind_double(stmt, i + 1, real);
+			break;
+		default:
+			result = sqlite3_bind_text(stmt, i + 1,
+				fields[i].start, fields[i].len, SQLITE_STATIC);
+		}
+		if (SQLITE_OK != result) die(sqlite3_errmsg(db));
+	}
+	if (SQLITE_DONE != sqlite3_step(stmt)) die(sqlite3_errmsg(db));
+	sqlite3_reset(stmt);
+}
+
+/* Runs the bind pass (which also reads and tokenizes) into table t of 'db',
+ * and returns its time. Unless the fields are views into the mapping, they
+ * are copied into a buffer as a batch is filled, as sqawk does, since they
+ * don't stay valid. */
+
+static double run_bind_pass(const struct dataset *ds, sqlite3 *db)
+{
+	buffered_CSV_t *buf_csv = open_dataset(ds);
+	int num_fields = buf_csv_field_count(buf_csv);
+	bool copy_text = ! buf_csv_splittable(buf_csv);
+
+	exec_sql(db, "DROP TABLE IF EXISTS t");
+	sqlite3_str *create = sqlite3_str_new(db);
+	sqlite3_str_appendall(create, "CREATE TABLE t (c0");
+	for (int i = 1; i < num_fields; i++)
+		sqlite3_str_appendf(create, ", c%d", i);
+	sqlite3_str_appendchar(create, 1, ')');
+	char *create_SQL = sqlite3_str_finish(create);
+	if (NULL == create_SQL) die(NULL);
+	exec_sql(db, create_SQL);
+	sqlite3_free(create_SQL);
+
+	int max_params = sqlite3_limit(db, SQLITE_LIMIT_VARIABLE_NUMBER, -1);
+	int batch_rows = max_params / num_fields;
+	if (batch_rows > BATCH_ROWS) batch_rows = BATCH_ROWS;
+	if (batch_rows < 1) batch_rows = 1;
+	sqlite3_stmt *batch_stmt = prepare_insert(db, num_fields, batch_rows);
+	sqlite3_stmt *row_stmt = prepare_insert(db, num_fields, 1);
+	buf_csv_field_t *fields = malloc(batch_rows * num_fields *
+			sizeof(buf_csv_field_t));
+	size_t *offsets = malloc(batch_rows * num_fields * sizeof(size_t));
+	if (NULL == fields || NULL == offsets) die(NULL);
+	char *text = NULL;	/* the copies of the batch's fields */
+	size_t text_len = 0, text_size = 0;
+
+	double start = now();
+	exec_sql(db, "BEGIN");
+	int row = 0;
+	while (-1 != buf_csv_next_data_line_slices(buf_csv,
+				&fields[row * num_fields])) {
+		for (int i = row * num_fields; copy_text &&
+				i < (row + 1) * num_fields; i++) {
+			if (text_len + fields[i].len > text_size) {
+				text_size = 2 * (text_len + fields[i].len);
+				text = realloc(text, text_size);
+				if (NULL == text) die(NULL);
+			}
+			memcpy(text + text_len, fields[i].start,
+					fields[i].len);
+			offsets[i] = text_len;
+			text_len += fields[i].len;
+		}
+		if (++row < batch_rows) continue;
+		for (int i = 0; copy_text && i < row * num_fields; i++)
+			fields[i].start = text + offsets[i];
+		insert_rows(db, batch_stmt, fields, num_fields, batch_rows);
+		row = 0;
+		text_len = 0;
+	}
+	for (int i = 0; copy_text && i < row * num_fields; i++)
+		fields[i].start = text + offsets[i];
+	for (int r = 0; r < row; r++)
+		insert_rows(db, row_stmt, &fields[r * num_fields], num_fields,
+				1);
+	exec_sql(db, "COMMIT");
+	double seconds = now() - start;
+
+	free(text);
+	free(offsets);
+	free(fields);
+	sqlite3_finalize(batch_stmt);
+	sqlite3_finalize(row_stmt);
+	destroy_buffered_CSV(buf_csv);
+	return seconds;
+}
+
+static double run_index(sqlite3 *db)
+{
+	exec_sql(db, "DROP INDEX IF EXISTS t_c0");
+	double start = now();
+	exec_sql(db, "CREATE INDEX t_c0 ON t (c0)");
+	return now() - start;
+}
+
+static ssize_t count_bytes(void *cookie, const char *buf, size_t size)
+{
+	(void) buf;
+	*(long long *) cookie += size;
+	return size;
+}
+
+/* Writes out table t of 'db', and returns the time it took. Sets *bytes to
+ * the size of the output, which is counted rather than written anywhere. */
+
+static double run_output(sqlite3 *db, long long *bytes)
+{
+	*bytes = 0;
+	cookie_io_functions_t counter = { NULL, count_bytes, NULL, NULL };
+	FILE *out = fopencookie(bytes, "w", counter);
+	if (NULL == out) die(NULL);
+	result_writer_t *writer = create_result_writer(out, RESULT_TSV);
+	if (NULL == writer) die(NULL);
+	sqlite3_stmt *stmt;
+	if (SQLITE_OK != sqlite3_prepare_v2(db, "SELECT * FROM t", -1, &stmt,
+				NULL))
+		die(sqlite3_errmsg(db));
+
+	double start = now();
+	result_writer_headers(writer, stmt);
+	while (SQLITE_ROW == sqlite3_step(stmt))
+		result_writer_row(writer, stmt);
+	if (0 != result_writer_flush(writer)) die(NULL);
+	double seconds = now() - start;
+
+	sqlite3_finalize(stmt);
+	destroy_result_writer(writer);
+	fclose(out);
+	return seconds;
+}
+
+/* Runs sqawk on the dataset (with 'sqawk' a path relative to the directory
+ * the benchmark was started from), and returns the time it took, or -1 if it
+ * failed. */
+
+static double run_sqawk(const struct dataset *ds, const char *sqawk)
+{
+	char table[64];
+	snprintf(table, sizeof(table), "%.*s", (int) strcspn(ds->filename,
+				"."), ds->filename);
+	char sep[2] = { ds->separator, '\0' };
+	char query[128];
+	snprintf(query, sizeof(query), "SELECT * FROM %s LIMIT 0", table);
+	char *argv[9];
+	int argc = 0;
+	argv[argc++] = (char *) sqawk;
+	argv[argc++] = "-s";
+	argv[argc++] = sep;
+	if (ds->quoted)
+		argv[argc++] = "-Q";
+	if (NULL != ds->first_line_re) {
+		argv[argc++] = "-f";
+		argv[argc++] = ds->first_line_re;
+	}
+	argv[argc++] = (char *) ds->filename;
+	argv[argc++] = query;
+	argv[argc] = NULL;
+
+	fflush(stdout);	/* or the child would write it out again */
+	double start = now();
+	pid_t pid = fork();
+	if (-1 == pid) die(NULL);
+	if (0 == pid) {
+		if (NULL == freopen("/dev/null", "w", stdout)) _exit(127);
+		execv(sqawk, argv);
+		_exit(127);
+	}
+	int status;
+	if (-1 == waitpid(pid, &status, 0)) die(NULL);
+	double seconds = now() - start;
+	return WIFEXITED(status) && 0 == WEXITSTATUS(status) ? seconds : -1;
+}
+
+static void bench_dataset(const struct dataset *ds, int repeats,
+		const char *sqawk)
+{
+	struct stat st;
+	if (-1 == stat(ds->filename, &st)) die(NULL);
+	long long bytes = st.st_size;
+
+	long rows = 0;
+	double pass_times[NUM_PASSES];
+	for (int p = 0; p < NUM_PASSES; p++) {
+		pass_times[p] = -1;
+		for (int r = 0; r < repeats; r++) {
+			double t = run_pass(ds, p, &rows);
+			if (pass_times[p] < 0 || t < pass_times[p])
+				pass_times[p] = t;
+		}
+		report(ds->name, pass_names[p], rows, bytes, pass_times[p] -
+			(0 == p ? 0 : pass_times[p - 1]));
+	}
+
+	sqlite3 *db;
+	if (SQLITE_OK != sqlite3_open(":memory:", &db))
+		die(sqlite3_errmsg(db));
+	double bind_time = -1, index_time = -1, output_time = -1;
+	long long output_bytes = 0;
+	for (int r = 0; r < repeats; r++) {
+		double t = run_bind_pass(ds, db);
+		if (bind_time < 0 || t < bind_time) bind_time = t;
+		t = run_index(db);
+		if (index_time < 0 || t < index_time) index_time = t;
+		t = run_output(db, &output_bytes);
+		if (output_time < 0 || t < output_time) output_time = t;
+	}
+	sqlite3_close(db);
+	/* bind includes reading and tokenizing, but not inferring */
+	report(ds->name, "bind", rows, bytes,
+			bind_time - pass_times[PASS_TOKENIZE]);
+	report(ds->name, "index", rows, bytes, index_time);
+	report(ds->name, "output", rows, output_bytes, output_time);
+
+	if (NULL == sqawk) return;
+	double sqawk_time = -1;
+	for (int r = 0; r < repeats; r++) {
+		double t = run_sqawk(ds, sqawk);
+		if (t < 0) die("sqawk failed");
+		if (sqawk_time < 0 || t < sqawk_time) sqawk_time = t;
+	}
+	report(ds->name, "sqawk", rows, bytes, sqawk_time);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: bench_sqawk [-n rows] [-r repeats] "
+		"[-s sqawk|-S] [dataset...]\n"
+		"datasets:");
+	for (int d = 0; d < NUM_DATASETS; d++)
+		fprintf(stderr, " %s", datasets[d].name);
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	int num_rows = DEFAULT_ROWS;
+	int repeats = DEFAULT_REPEATS;
+	const char *sqawk = SQAWK;
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "n:r:s:S"))) {
+		switch (opt) {
+		case 'n': num_rows = atoi(optarg); break;
+		case 'r': repeats = atoi(optarg); break;
+		case 's': sqawk = optarg; break;
+		case 'S': sqawk = NULL; break;
+		default: usage();
+		}
+	}
+	if (num_rows < 1 || repeats < 1) usage();
+
+	bool selected[NUM_DATASETS];
+	for (int d = 0; d < NUM_DATASETS; d++)
+		selected[d] = optind == argc;
+	for (int a = optind; a < argc; a++) {
+		int d = 0;
+		while (d < NUM_DATASETS &&
+				0 != strcmp(argv[a], datasets[d].name))
+			d++;
+		if (NUM_DATASETS == d) usage();
+		selected[d] = true;
+	}
+
+	/* sqawk is run from the data's directory */
+	char *sqawk_path = NULL;
+	if (NULL != sqawk && -1 == access(sqawk, X_OK))
+		sqawk = NULL;
+	if (NULL != sqawk) {
+		sqawk_path = realpath(sqawk, NULL);
+		if (NULL == sqawk_path) die(NULL);
+	}
+
+	const char *tmp = getenv("TMPDIR");
+	char *dir;
+	if (-1 == asprintf(&dir, "%s/sqawk_bench_XXXXXX",
+				NULL == tmp ? "/tmp" : tmp))
+		die(NULL);
+	if (NULL == mkdtemp(dir) || -1 == chdir(dir)) die(NULL);
+
+	printf("file\tstage\trows\tbytes\tseconds\tMB_per_s\trows_per_s\n");
+	for (int d = 0; d < NUM_DATASETS; d++) {
+		if (! selected[d]) continue;
+		const struct dataset *ds = &datasets[d];
+		FILE *out = fopen(ds->filename, "w");
+		if (NULL == out) die(NULL);
+		rng_state = 0x9E3779B97F4A7C15ULL + d;
+		ds->generate(out, num_rows);
+		if (0 != fclose(out)) die(NULL);
+		bench_dataset(ds, repeats, sqawk_path);
+		fflush(stdout);
+		unlink(ds->filename);
+	}
+
+	if (-1 == chdir("/") || -1 == rmdir(dir)) die(NULL);
+	free(dir);
+	free(sqawk_path);
+	return 0;
+}
@@ -7,13 +7,18 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <math.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "buffered_CSV.h"
+#include "csv_scan.h"
 
 #define SKIP_SUCCESS 0
 
 const int BUF_CSV_DUMP_SKIPPED = 1;
 const int BUF_CSV_NO_HEADER = 2;
+const int BUF_CSV_QUOTED = 4;
 
 /* This structure adds buffering of the first two lines of a FILE* structure,
  * corresponding to the CSV header and first line.  This allows the file's data
@@ -22,6 +27,12 @@ const int BUF_CSV_NO_HEADER = 2;
  * means that unseekable streams, such as pipes, also work. I keep the
  * structure in this file so users need not (and cannot) know the details. */
 
+/* If the stream turns out to be a regular file, it is mmap()ed instead, and
+ * lines are handed out as views into the mapping: no getline(), no copy. The
+ * first data line is then not buffered at all - we just remember where it
+ * starts. Pipes and the like still go through stdio, but with a single line
+ * buffer that is reused for every line. */
+
 struct buffered_CSV {
 	FILE *csv;
 	char separator;
@@ -30,10 +41,185 @@ struct buffered_CSV {
 	char *first_data_line;
 	int lines_read;
 	int field_count;
+	/* mmap backend (map is NULL if reading through stdio) */
+	char *map;
+	size_t map_len;
+	const char *cursor;	/* start of next unread line */
+	const char *line_start;	/* start of last line read */
+	const char *map_end;
+	/* stdio backend */
+	char *line_buf;
+	size_t line_buf_len;
+	/* finds field and line boundaries (see csv_scan.h), with the
+	 * classifier chosen for the separator and CPU */
+	csv_scan_fn scan;
+	struct csv_scanner scanner;
+	/* RFC 4180 mode: a "line" is then a record, which may span several
+	 * lines of the file. */
+	bool quoted;
+	char *unquote_buf;	/* holds fields that had doubled quotes */
+	size_t unquote_buf_len;
+	buf_csv_field_t *scratch_fields;
+};
+
+/* A range of whole data lines of a mmap()ed file, with its own scanner, so
+ * that ranges can be scanned independently of each other and of the
+ * buffered_CSV they come from. */
+
+struct buf_csv_range {
+	const char *cursor;
+	const char *end;
+	const char *readable_end;	/* the end of the mapping */
+	int field_count;
+	struct csv_scanner scanner;
 };
 
-static int skip_ignored_leading_lines(FILE *csv, char *first_line_re,
-		bool print_skipped, char **header_line)
+/* Maps the rest of 'csv' into memory if it is a non-empty regular file. Leaves
+ * buf_csv->map NULL otherwise, in which case we just use stdio. */
+
+static void try_map_file(buffered_CSV_t *buf_csv)
+{
+	struct stat st;
+	int fd = fileno(buf_csv->csv);
+
+	buf_csv->map = NULL;
+	if (-1 == fd || -1 == fstat(fd, &st)) return;
+	if (! S_ISREG(st.st_mode) || 0 == st.st_size) return;
+
+	/* Nothing has been read from 'csv' yet, so its position is also the
+	 * fd's. It may be nonzero, e.g. for stdin redirected from a file. */
+	off_t start = ftello(buf_csv->csv);
+	if (-1 == start || start >= st.st_size) return;
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (MAP_FAILED == map) return;
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	buf_csv->map = map;
+	buf_csv->map_len = st.st_size;
+	buf_csv->cursor = buf_csv->map + start;
+	buf_csv->map_end = buf_csv->map + st.st_size;
+}
+
+/* Reads the next raw line, whatever the backend. The line includes the
+ * trailing '\n', if any, and is NOT '\0'-terminated in the mmap case. Returns
+ * its length, or -1 at EOF. */
+
+static ssize_t next_raw_line(buffered_CSV_t *buf_csv, const char **line)
+{
+	if (NULL == buf_csv->map) {
+		ssize_t len = getline(&buf_csv->line_buf,
+				&buf_csv->line_buf_len, buf_csv->csv);
+		*line = buf_csv->line_buf;
+		return len;
+	}
+
+	if (buf_csv->cursor >= buf_csv->map_end) return -1;
+
+	const char *start = buf_csv->line_start = buf_csv->cursor;
+	const char *nl = memchr(start, '\n', buf_csv->map_end - start);
+	buf_csv->cursor = (NULL == nl) ? buf_csv->map_end : nl + 1;
+	*line = start;
+
+	return buf_csv->cursor - start;
+}
+
+/* Like next_raw_line(), but returns a '\0'-terminated copy (or NULL at EOF).
+ * Only used for the few lines before the data. */
+
+static char *next_raw_line_dup(buffered_CSV_t *buf_csv)
+{
+	const char *line;
+	ssize_t len = next_raw_line(buf_csv, &line);
+	if (-1 == len) return NULL;
+	return strndup(line, len);
+}
+
+/* Returns the quote parity of a record after 's' is appended to it: 'odd' is
+ * that of the record so far, so that only the new part is scanned. */
+
+static bool odd_quotes(bool odd, const char *s, size_t len)
+{
+	const char *end = s + len;
+	while (NULL != (s = memchr(s, '"', end - s))) {
+		odd = !odd;
+		s++;
+	}
+	return odd;
+}
+
+/* In quoted mode, appends lines to the '\0'-terminated 'line' (which is
+ * realloc()ed) as long as it ends within quotes. Returns NULL on failure. */
+
+static char *complete_record_dup(buffered_CSV_t *buf_csv, char *line)
+{
+	if (! buf_csv->quoted) return line;
+
+	size_t len = strlen(line);
+	bool odd = odd_quotes(false, line, len);
+	while (odd) {
+		const char *more;
+		ssize_t more_len = next_raw_line(buf_csv, &more);
+		if (-1 == more_len) break;	/* unbalanced - leave it */
+		odd = odd_quotes(odd, more, more_len);
+		char *longer = realloc(line, len + more_len + 1);
+		if (NULL == longer) { free(line); return NULL; }
+		line = longer;
+		memcpy(line + len, more, more_len);
+		len += more_len;
+		line[len] = '\0';
+	}
+
+	return line;
+}
+
+/* Reads the next data record: a line, unless in quoted mode. Like
+ * next_raw_line(), the result is not '\0'-terminated. */
+
+static ssize_t next_record(buffered_CSV_t *buf_csv, const char **record)
+{
+	if (! buf_csv->quoted) return next_raw_line(buf_csv, record);
+
+	if (NULL != buf_csv->map) {
+		/* let the scanner find where the record ends */
+		if (buf_csv->cursor >= buf_csv->map_end) return -1;
+		bool ok;
+		*record = buf_csv->line_start = buf_csv->cursor;
+		buf_csv->cursor = csv_scan_line(&buf_csv->scanner,
+				buf_csv->cursor, buf_csv->map_end,
+				buf_csv->map_end, buf_csv->field_count,
+				buf_csv->scratch_fields, &ok);
+		return buf_csv->cursor - *record;
+	}
+
+	/* stdio: append lines to line_buf until the quotes balance */
+	ssize_t len = next_raw_line(buf_csv, record);
+	if (-1 == len) return -1;
+	bool odd = odd_quotes(false, buf_csv->line_buf, len);
+	char *more = NULL;
+	size_t more_buf_len = 0;
+	while (odd) {
+		ssize_t more_len = getline(&more, &more_buf_len, buf_csv->csv);
+		if (-1 == more_len) break;
+		odd = odd_quotes(odd, more, more_len);
+		if ((size_t) (len + more_len) >= buf_csv->line_buf_len) {
+			size_t new_len = 2 * (len + more_len);
+			char *longer = realloc(buf_csv->line_buf, new_len);
+			if (NULL == longer) { free(more); return -1; }
+			buf_csv->line_buf = longer;
+			buf_csv->line_buf_len = new_len;
+		}
+		memcpy(buf_csv->line_buf + len, more, more_len + 1);
+		len += more_len;
+	}
+	free(more);
+	*record = buf_csv->line_buf;
+
+	return len;
+}
+
+static int skip_ignored_leading_lines(buffered_CSV_t *buf_csv,
+		char *first_line_re, bool print_skipped, char **header_line)
 {
 	regex_t preg;
 	int result;
@@ -41,9 +227,8 @@ static int skip_ignored_leading_lines(FILE *csv, char *first_line_re,
 	result = regcomp(&preg, first_line_re, REG_EXTENDED | REG_NOSUB);
 	if (0 != result) return result;
 
-	char *csv_line = NULL;
-	size_t len = 0;
-	while (-1 != getline(&csv_line, &len, csv)) {
+	char *csv_line;
+	while (NULL != (csv_line = next_raw_line_dup(buf_csv))) {
 		result = regexec(&preg, csv_line, 0, NULL, 0);
 		switch(result) {
 		case 0: /* match */
@@ -60,10 +245,7 @@ static int skip_ignored_leading_lines(FILE *csv, char *first_line_re,
 			return result;
 		}
 		free(csv_line);
-		csv_line = NULL;
-		len = 0;
 	}
-	free(csv_line);
 	regfree(&preg);
 
 	/* if we get here without a match, one could argue that there is
@@ -102,51 +284,88 @@ buffered_CSV_t *create_buffered_CSV(FILE * csv, char separator,
 
 	buf_csv->csv = csv;
 	buf_csv->separator = separator;
+	buf_csv->scan = csv_scan_select(separator);
 	buf_csv->field_count = 0;
+	buf_csv->header_line = NULL;
+	buf_csv->first_data_line = NULL;
+	buf_csv->line_buf = NULL;
+	buf_csv->line_buf_len = 0;
+	buf_csv->line_start = NULL;
+	buf_csv->quoted = flags & BUF_CSV_QUOTED;
+	buf_csv->unquote_buf = NULL;
+	buf_csv->unquote_buf_len = 0;
+	buf_csv->scratch_fields = NULL;
+
+	try_map_file(buf_csv);
 
 	char *csv_line = NULL;
-	size_t len = 0;
 
 	if (NULL == first_line_re) {
-		if (-1 == getline(&csv_line, &len, csv)) return NULL; 
+		csv_line = next_raw_line_dup(buf_csv);
+		if (NULL == csv_line) goto fail;
 	} else {
-		if (SKIP_SUCCESS != skip_ignored_leading_lines(csv,
+		if (SKIP_SUCCESS != skip_ignored_leading_lines(buf_csv,
 				first_line_re, flags & BUF_CSV_DUMP_SKIPPED,
 				&csv_line))
-			return NULL;
+			goto fail;
 	}
+	const char *first_line_start = buf_csv->line_start;
+	csv_line = complete_record_dup(buf_csv, csv_line);
+	if (NULL == csv_line) goto fail;
 
 	/* csv_line now points to the first CSV line, which is usually a
 	 * header, but may already be data. At least we can count the fields: */
 
-	for (char *p = csv_line; p; p = index(p + 1, buf_csv->separator))
-		buf_csv->field_count++;
+	buf_csv->field_count = csv_count_fields(csv_line, strlen(csv_line),
+			separator, buf_csv->quoted);
+	buf_csv->scratch_fields = malloc(buf_csv->field_count *
+			sizeof(buf_csv_field_t));
+	if (NULL == buf_csv->scratch_fields) goto fail;
 
 	if (flags & BUF_CSV_NO_HEADER) {
 		/* csv_line is data */
-		buf_csv->header_line = NULL;
-		buf_csv->first_data_line = strdup(csv_line);
-		free(csv_line);
+		buf_csv->first_data_line = csv_line;
+		/* With mmap, just step back so that it is read again */
+		if (NULL != buf_csv->map)
+			buf_csv->cursor = first_line_start;
 	} else {
 		/* csv_line is header */
-		buf_csv->header_line = strdup(csv_line);
-		free(csv_line);
-		csv_line = NULL;
-		if (-1 == getline(&csv_line, &len, csv)) return NULL; 
-		buf_csv->first_data_line = strdup(csv_line);
-		free(csv_line);
+		buf_csv->header_line = csv_line;
+		const char *data_start = buf_csv->cursor;
+		csv_line = next_raw_line_dup(buf_csv);
+		if (NULL == csv_line) goto fail;
+		buf_csv->first_data_line = complete_record_dup(buf_csv, csv_line);
+		if (NULL == buf_csv->first_data_line) goto fail;
+		if (NULL != buf_csv->map)
+			buf_csv->cursor = data_start;
 	}
 
 	buf_csv->lines_read = 0;
+	/* The data start outside of quotes, so this is where the scanner
+	 * starts. */
+	csv_scanner_init(&buf_csv->scanner, buf_csv->scan, separator,
+			buf_csv->quoted, buf_csv->cursor);
 
 	return buf_csv;
+
+fail:
+	if (NULL != buf_csv->map) munmap(buf_csv->map, buf_csv->map_len);
+	free(buf_csv->header_line);
+	free(buf_csv->line_buf);
+	free(buf_csv->scratch_fields);
+	free(buf_csv);
+	return NULL;
 }
 
 void destroy_buffered_CSV(buffered_CSV_t *buf_csv)
 {
+	if (NULL != buf_csv->map) munmap(buf_csv->map, buf_csv->map_len);
 	fclose(buf_csv->csv);
 	free(buf_csv->header_line);
 	free(buf_csv->first_data_line);
+	free(buf_csv->line_buf);
+	free(buf_csv->unquote_buf);
+	free(buf_csv->scratch_fields);
 	free(buf_csv);
 }
 
@@ -165,17 +384,17 @@ char *buf_csv_first_data_line(buffered_CSV_t *buf_csv)
 	return strdup(buf_csv->first_data_line);
 }
 
-ssize_t buf_csv_next_data_line(char **lineptr, buffered_CSV_t *buf_csv)
+ssize_t buf_csv_next_data_line_view(buffered_CSV_t *buf_csv,
+		const char **line)
 {
 	ssize_t read_length;
-	size_t len = 0;
 
-	if (0 == buf_csv->lines_read) {
-		*lineptr = strdup(buf_csv->first_data_line);
-		read_length = strlen(*lineptr);
-		// fprintf(stderr, "read '%s' (length %d)\n", *lineptr, read_length);
+	if (NULL == buf_csv->map && 0 == buf_csv->lines_read) {
+		/* The stream has already moved past it */
+		*line = buf_csv->first_data_line;
+		read_length = strlen(*line);
 	} else {
-		read_length = getline(lineptr, &len, buf_csv->csv);
+		read_length = next_record(buf_csv, line);
 	}
 
 	buf_csv->lines_read++;
@@ -183,59 +402,139 @@ ssize_t buf_csv_next_data_line(char **lineptr, buffered_CSV_t *buf_csv)
 	return read_length;
 }
 
+ssize_t buf_csv_next_data_line(char **lineptr, buffered_CSV_t *buf_csv)
+{
+	const char *line;
+	ssize_t read_length = buf_csv_next_data_line_view(buf_csv, &line);
+
+	if (-1 != read_length) {
+		*lineptr = strndup(line, read_length);
+		if (NULL == *lineptr) return -1;
+	}
+
+	return read_length;
+}
+
 /* An alternative to strtok() (which modifies its input and doesn't handle
  * empty fields). This function does not modify its input, and does handle
  * empty fields (including leading and trailing empty fields). It also takes
  * advantage of the fact that the number of fields in a table is constant, and
- * already known when the function is called. */
+ * already known when the function is called. The line need not be
+ * '\0'-terminated, since its length is passed. Nothing is copied: 'fields'
+ * just points into 'line'. Returns false if there are too few fields. The
+ * actual work is done by csv_scan_line(), which see. Quoted fields keep their
+ * quotes (see unquote_field()). */
 
 // TODO maybe a name that refers to fields would be better, e.g. parse_fields.
-// TODO make this f() quote-aware.
 
 /* Testing:
 
  The following are known to work (notice some empty fields):
 
- tokenize("alpha,beta,gamma,delta,epsilon", ',', 5);
- tokenize("alpha,beta,,delta,epsilon", ',', 5);
- tokenize(",beta,gamma,delta,epsilon", ',', 5);
- tokenize("alpha,beta,gamma,delta,", ',', 5);
- tokenize("alpha,beta,,,epsilon", ',', 5);
+ tokenize(buf_csv, "alpha,beta,gamma,delta,epsilon", 30, flds);
+ tokenize(buf_csv, "alpha,beta,,delta,epsilon", 25, flds);
+ tokenize(buf_csv, ",beta,gamma,delta,epsilon", 25, flds);
+ tokenize(buf_csv, "alpha,beta,gamma,delta,", 23, flds);
+ tokenize(buf_csv, "alpha,beta,,,epsilon", 20, flds);
 
  */
 
-static char ** tokenize(char *line_orig, char sep, int num_fields)
+static bool tokenize(buffered_CSV_t *buf_csv, const char *line, size_t len,
+		buf_csv_field_t *fields)
+{
+	struct csv_scanner scanner;
+	bool ok;
+
+	csv_scanner_init(&scanner, buf_csv->scan, buf_csv->separator,
+			buf_csv->quoted, line);
+	csv_scan_line(&scanner, line, line + len, line + len,
+			buf_csv->field_count, fields, &ok);
+
+	return ok;
+}
+
+/* RFC 4180: if the field is quoted, drops the quotes and turns doubled quotes
+ * into single ones. The field is adjusted to point to the result, which is
+ * just a narrower view unless there were doubled quotes - in which case the
+ * result is written to 'out' (which must have room for field->len chars). A
+ * quote that does not start the field is just data. */
+
+static void unquote_field(buf_csv_field_t *field, char *out)
 {
-	char *line = strdup(line_orig);
-	if (NULL == line) return NULL;
+	const char *start = field->start;
+	size_t len = field->len;
+
+	if (0 == len || '"' != *start) return;
+	start++;
+	len--;
+	if (len > 0 && '"' == start[len-1]) len--;
+
+	if (NULL == memchr(start, '"', len)) {
+		field->start = start;
+		field->len = len;
+		return;
+	}
+
+	char *o = out;
+	for (size_t i = 0; i < len; i++) {
+		*o++ = start[i];
+		if ('"' == start[i] && i + 1 < len && '"' == start[i+1])
+			i++;
+	}
+	field->start = out;
+	field->len = o - out;
+}
+
+/* Applies unquote_field() to all fields of a record of length 'len', using
+ * buf_csv's buffer for the fields that need a copy. Also drops the '\r' of a
+ * CRLF line ending. */
+
+static bool unquote_fields(buffered_CSV_t *buf_csv, buf_csv_field_t *fields,
+		size_t len)
+{
+	if (len > buf_csv->unquote_buf_len) {
+		free(buf_csv->unquote_buf);
+		buf_csv->unquote_buf = malloc(len);
+		if (NULL == buf_csv->unquote_buf) return false;
+		buf_csv->unquote_buf_len = len;
+	}
+
+	buf_csv_field_t *last = fields + buf_csv->field_count - 1;
+	if (last->len > 0 && '\r' == last->start[last->len-1]) last->len--;
+
+	char *out = buf_csv->unquote_buf;
+	for (int i = 0; i < buf_csv->field_count; i++) {
+		unquote_field(fields + i, out);
+		if (fields[i].start == out) out += fields[i].len;
+	}
+
+	return true;
+}
+
+/* Same as tokenize(), but returns a freshly allocated char** of (unquoted)
+ * copies, as used by the field-wise functions. */
+
+static char ** tokenize_dup(buffered_CSV_t *buf_csv, const char *line,
+		size_t len)
+{
+	int num_fields = buf_csv->field_count;
+	buf_csv_field_t slices[num_fields];
+	if (! tokenize(buf_csv, line, len, slices)) return NULL;
+	if (buf_csv->quoted && ! unquote_fields(buf_csv, slices, len))
+		return NULL;
 
-	int i;
-	char *fld_start, *fld_end;
-	fld_start = fld_end = line;
-	//printf("%s", line);
 	char ** fields = malloc(num_fields * sizeof(char*));
 	if (NULL == fields) return NULL;
 
-	for (i = 0; i < num_fields - 1; i++) { /* last field is special */
-		fld_end = index(fld_start, sep);
-		if (NULL == fld_end) return NULL; /* too few fields */
-		size_t flen = fld_end - fld_start;
-		char *f = malloc((flen+1) * sizeof(char));
-		if (NULL == f) return NULL;
-		strncpy(f, fld_start, flen);
-		f[flen] = '\0';
-		fields[i] = f;
-		//printf("fld @ %d-%d (%d): %s\n", fld_start-line, fld_end-line, flen, f);
-		
-		fld_start = fld_end + 1;
-	}
-	/* No more separator - just copy till closing '\0' */
-	fields[i] = strdup(fld_start);
-	/* Remove any trailing '\n' */
-	char *c = rindex(fields[i], '\n');
-	if (NULL != c) *c = '\0';
-
-	free(line);
+	for (int i = 0; i < num_fields; i++) {
+		fields[i] = strndup(slices[i].start, slices[i].len);
+		if (NULL == fields[i]) {
+			while (i-- > 0)
+				free(fields[i]);
+			free(fields);
+			return NULL;
+		}
+	}
 
 	return fields;
 }
@@ -246,39 +545,175 @@ char **buf_csv_header_fields(buffered_CSV_t *buf_csv)
 		/* CSV has no headers */
 		return construct_numeric_field_names(buf_csv->field_count);
 
-	char *hdr = buf_csv_header_line(buf_csv);
-	if (NULL == hdr) return NULL;
-	char **fields = tokenize(hdr, buf_csv->separator,
-			buf_csv_field_count(buf_csv));
-	free(hdr);
-	return fields;
+	return tokenize_dup(buf_csv, buf_csv->header_line,
+			strlen(buf_csv->header_line));
 }
 
 char **buf_csv_first_data_line_fields(buffered_CSV_t *buf_csv)
 {
-	char *fd = buf_csv_first_data_line(buf_csv);
-	if (NULL == fd) return NULL;
-	char ** fields = tokenize(fd, buf_csv->separator,
-			buf_csv_field_count(buf_csv));
-	free(fd);
-	return fields;
+	return tokenize_dup(buf_csv, buf_csv->first_data_line,
+			strlen(buf_csv->first_data_line));
 }
 
 char **buf_csv_next_data_line_fields(buffered_CSV_t *buf_csv)
 {
-	char *csv_line = NULL;
-	ssize_t chars_read = buf_csv_next_data_line(&csv_line, buf_csv);
-	if (-1 == chars_read) { free(csv_line) ; return NULL; }
+	const char *csv_line;
+	ssize_t chars_read = buf_csv_next_data_line_view(buf_csv, &csv_line);
+	if (-1 == chars_read) return NULL;
 
-	char **result = tokenize(csv_line, buf_csv->separator,
-		buf_csv_field_count(buf_csv));
-	free(csv_line);
+	return tokenize_dup(buf_csv, csv_line, chars_read);
+}
+
+/* With mmap, the line and its fields are found in a single pass over the
+ * mapping, and the scanner carries over what it knows of the current block
+ * to the next line. Otherwise, the line is split where it lies. */
+
+int buf_csv_next_data_line_slices(buffered_CSV_t *buf_csv,
+		buf_csv_field_t *fields)
+{
+	bool ok;
+	const char *csv_line;
+	ssize_t chars_read;
 
-	return(result);
+	if (NULL != buf_csv->map) {
+		if (buf_csv->cursor >= buf_csv->map_end) return -1;
+		csv_line = buf_csv->line_start = buf_csv->cursor;
+		buf_csv->cursor = csv_scan_line(&buf_csv->scanner,
+				buf_csv->cursor, buf_csv->map_end,
+				buf_csv->map_end, buf_csv->field_count,
+				fields, &ok);
+		chars_read = buf_csv->cursor - csv_line;
+		buf_csv->lines_read++;
+	} else {
+		chars_read = buf_csv_next_data_line_view(buf_csv, &csv_line);
+		if (-1 == chars_read) return -1;
+
+		/* getline()'s buffer may be read past the line */
+		const char *readable_end = csv_line + chars_read;
+		if (csv_line == buf_csv->line_buf)
+			readable_end = buf_csv->line_buf +
+				buf_csv->line_buf_len;
+
+		csv_scanner_init(&buf_csv->scanner, buf_csv->scan,
+				buf_csv->separator, buf_csv->quoted, csv_line);
+		csv_scan_line(&buf_csv->scanner, csv_line,
+				csv_line + chars_read, readable_end,
+				buf_csv->field_count, fields, &ok);
+	}
+
+	if (! ok) return -1;
+	if (buf_csv->quoted && ! unquote_fields(buf_csv, fields, chars_read))
+		return -1;
+
+	return buf_csv->field_count;
 }
 
 
-int buf_csv_eof(buffered_CSV_t *buf_csv) { return feof(buf_csv->csv); }
+off_t buf_csv_tell(buffered_CSV_t *buf_csv)
+{
+	if (NULL == buf_csv->map) return -1;
+	return buf_csv->cursor - buf_csv->map;
+}
+
+int buf_csv_seek(buffered_CSV_t *buf_csv, off_t offset)
+{
+	if (NULL == buf_csv->map || offset < 0 ||
+			(size_t) offset > buf_csv->map_len)
+		return -1;
+	buf_csv->cursor = buf_csv->map + offset;
+	csv_scanner_init(&buf_csv->scanner, buf_csv->scan,
+			buf_csv->separator, buf_csv->quoted, buf_csv->cursor);
+	return 0;
+}
+
+off_t buf_csv_seek_line(buffered_CSV_t *buf_csv, off_t offset)
+{
+	if (! buf_csv_splittable(buf_csv) || offset < 0)
+		return -1;
+	if ((size_t) offset > buf_csv->map_len)
+		offset = buf_csv->map_len;
+
+	const char *line = buf_csv->map + offset;
+	if (line > buf_csv->map && '\n' != line[-1]) {
+		const char *nl = memchr(line, '\n', buf_csv->map_end - line);
+		line = NULL == nl ? buf_csv->map_end : nl + 1;
+	}
+	offset = line - buf_csv->map;
+	buf_csv_seek(buf_csv, offset);
+	return offset;
+}
+
+off_t buf_csv_size(buffered_CSV_t *buf_csv)
+{
+	if (NULL == buf_csv->map) return -1;
+	return buf_csv->map_len;
+}
+
+/* Ranges can't start just anywhere in quoted mode, as we would not know
+ * whether the start is within quotes. */
+
+int buf_csv_splittable(buffered_CSV_t *buf_csv)
+{
+	return NULL != buf_csv->map && ! buf_csv->quoted;
+}
+
+buf_csv_range_t *buf_csv_next_range(buffered_CSV_t *buf_csv, size_t size)
+{
+	if (! buf_csv_splittable(buf_csv) || buf_csv->cursor >= buf_csv->map_end)
+		return NULL;
+	if (0 == size) size = 1;
+
+	const char *end = buf_csv->map_end;
+	if ((size_t) (end - buf_csv->cursor) > size) {
+		const char *last = buf_csv->cursor + size - 1;
+		const char *nl = memchr(last, '\n', end - last);
+		if (NULL != nl) end = nl + 1;
+	}
+
+	buf_csv_range_t *range = malloc(sizeof(buf_csv_range_t));
+	if (NULL == range) return NULL;
+	range->cursor = buf_csv->cursor;
+	range->end = end;
+	range->readable_end = buf_csv->map_end;
+	range->field_count = buf_csv->field_count;
+	csv_scanner_init(&range->scanner, buf_csv->scan, buf_csv->separator,
+			false, range->cursor);
+
+	buf_csv->cursor = end;
+
+	return range;
+}
+
+int buf_csv_range_next_slices(buf_csv_range_t *range, buf_csv_field_t *fields)
+{
+	bool ok;
+
+	if (range->cursor >= range->end) return -1;
+	const char *next = csv_scan_line(&range->scanner, range->cursor,
+			range->end, range->readable_end, range->field_count,
+			fields, &ok);
+	if (! ok) return -1;	/* and stay on the short line */
+	range->cursor = next;
+
+	return range->field_count;
+}
+
+int buf_csv_range_at_end(buf_csv_range_t *range)
+{
+	return range->cursor >= range->end;
+}
+
+void destroy_buf_csv_range(buf_csv_range_t *range)
+{
+	free(range);
+}
+
+int buf_csv_eof(buffered_CSV_t *buf_csv)
+{
+	if (NULL != buf_csv->map)
+		return buf_csv->cursor >= buf_csv->map_end;
+	return feof(buf_csv->csv);
+}
 
 
 #ifdef TEST_BUFFERED_CSV
@@ -882,6 +1317,421 @@ int test_no_headers_skip_leading()
 	return 0;
 }
 
+/* Returns a FILE* that reads 'path' through a pipe, so that the stdio (i.e.,
+ * non-mmap) code path gets exercised. The file must fit in the pipe buffer. */
+
+static FILE *open_as_pipe(const char *path)
+{
+	int fds[2];
+	char buf[4096];
+	size_t n;
+
+	FILE *in = fopen(path, "r");
+	if (NULL == in || -1 == pipe(fds)) {
+		perror(NULL);
+		exit(EXIT_FAILURE);
+	}
+	while (0 < (n = fread(buf, 1, sizeof(buf), in)))
+		if ((ssize_t) n != write(fds[1], buf, n)) {
+			perror(NULL);
+			exit(EXIT_FAILURE);
+		}
+	fclose(in);
+	close(fds[1]);
+
+	return fdopen(fds[0], "r");
+}
+
+/* Checks that both backends hand out the same lines through the view
+ * interface. */
+
+int test_line_views()
+{
+	const char *test_name = __func__;
+	char *exp_data[] = { exp_1st_data, exp_2nd_data, exp_3rd_data,
+		exp_4th_data, exp_5th_data };
+
+	for (int piped = 0; piped < 2; piped++) {
+		FILE *csv;
+		if (piped)
+			csv = open_as_pipe("data/test_buffered_CSV.csv");
+		else
+			csv = fopen("data/test_buffered_CSV.csv", "r");
+		if (NULL == csv) {
+			perror(NULL);
+			exit(EXIT_FAILURE);
+		}
+
+		buffered_CSV_t *buf_csv = create_buffered_CSV(csv, '\t', NULL, 0);
+		if (NULL == buf_csv) {
+			printf ("%s: buf_csv should not be NULL.\n", test_name);
+			return 1;
+		}
+		if (piped != (NULL == buf_csv->map)) {
+			printf ("%s: (piped: %d) wrong backend.\n", test_name,
+					piped);
+			return 1;
+		}
+
+		for (int i = 0; i < 5; i++) {
+			const char *line;
+			ssize_t len = buf_csv_next_data_line_view(buf_csv, &line);
+			if ((ssize_t) strlen(exp_data[i]) != len ||
+				0 != strncmp(exp_data[i], line, len)) {
+				printf ("%s: (piped: %d, line %d) expected '%s'.\n",
+					test_name, piped, i+1, exp_data[i]);
+				return 1;
+			}
+		}
+		const char *line;
+		if (-1 != buf_csv_next_data_line_view(buf_csv, &line)) {
+			printf ("%s: (piped: %d) expected EOF.\n", test_name,
+					piped);
+			return 1;
+		}
+		if (! buf_csv_eof(buf_csv)) {
+			printf ("%s: (piped: %d) buf_csv_eof() should be true.\n",
+					test_name, piped);
+			return 1;
+		}
+
+		destroy_buffered_CSV(buf_csv);
+	}
+
+	printf ("%s: ok.\n", test_name);
+	return 0;
+}
+
+int test_field_slices()
+{
+	const char *test_name = __func__;
+	char *exp_genus[] = { "Cercopithecus", "Simias", "Pan", "Pongo",
+		"Colobus" };
+	char *exp_nb[] = { "26", "1", "2", "2", "5" };
+
+	FILE * csv = fopen("data/test_buffered_CSV.csv", "r");
+	if (NULL == csv) {
+		perror(NULL);
+		exit(EXIT_FAILURE);
+	}
+
+	buffered_CSV_t *buf_csv = create_buffered_CSV(csv, '\t', NULL, 0);
+	if (NULL == buf_csv) {
+		printf ("%s: buf_csv should not be NULL.\n", test_name);
+		return 1;
+	}
+
+	buf_csv_field_t flds[2];
+	for (int i = 0; i < 5; i++) {
+		if (2 != buf_csv_next_data_line_slices(buf_csv, flds)) {
+			printf ("%s: (line %d) expected 2 fields.\n", test_name,
+					i+1);
+			return 1;
+		}
+		if (strlen(exp_genus[i]) != flds[0].len ||
+			0 != strncmp(exp_genus[i], flds[0].start, flds[0].len)) {
+			printf ("%s: (line %d) expected '%s', got '%.*s'.\n",
+				test_name, i+1, exp_genus[i],
+				(int) flds[0].len, flds[0].start);
+			return 1;
+		}
+		/* the trailing '\n' must not be part of the last field */
+		if (strlen(exp_nb[i]) != flds[1].len ||
+			0 != strncmp(exp_nb[i], flds[1].start, flds[1].len)) {
+			printf ("%s: (line %d) expected '%s', got '%.*s'.\n",
+				test_name, i+1, exp_nb[i],
+				(int) flds[1].len, flds[1].start);
+			return 1;
+		}
+	}
+	if (-1 != buf_csv_next_data_line_slices(buf_csv, flds)) {
+		printf ("%s: expected EOF.\n", test_name);
+		return 1;
+	}
+
+	destroy_buffered_CSV(buf_csv);
+
+	printf ("%s: ok.\n", test_name);
+	return 0;
+}
+
+/* All classifiers the CPU supports must agree with the portable one, and
+ * long lines (spanning several blocks) must be split like short ones. */
+
+int test_scanners()
+{
+	const char *test_name = __func__;
+	const char alphabet[] = "ab\t,;\n";
+	const char seps[] = "\t,;";
+	char data[1024];
+
+	srand(42);
+	for (size_t i = 0; i < sizeof(data); i++)
+		data[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
+
+	for (int s = 0; '\0' != seps[s]; s++) {
+		csv_scan_fn ref = csv_scan_select_isa(seps[s],
+				CSV_SCAN_GENERIC);
+		for (int isa = CSV_SCAN_SSE2; isa <= CSV_SCAN_AVX2; isa++) {
+			csv_scan_fn scan = csv_scan_select_isa(seps[s], isa);
+			if (NULL == scan) continue;	/* CPU lacks it */
+			for (size_t off = 0; off + 64 <= sizeof(data); off++) {
+				uint64_t ref_q, q;
+				if (ref(data + off, seps[s], &ref_q) !=
+					scan(data + off, seps[s], &q) ||
+					ref_q != q) {
+					printf("%s: ISA %d disagrees on '%c' at "
+						"%d.\n", test_name, isa,
+						seps[s], (int) off);
+					return 1;
+				}
+			}
+		}
+	}
+
+	/* 300 fields of 1 to 3 chars, i.e. ~ 10 blocks */
+	char line[2048];
+	int len = 0;
+	for (int i = 0; i < 300; i++)
+		len += sprintf(line + len, "%s%d", i ? "," : "", i);
+	line[len++] = '\n';
+
+	buf_csv_field_t flds[300];
+	struct csv_scanner scanner;
+	bool ok;
+	csv_scanner_init(&scanner, csv_scan_select(','), ',', false, line);
+	csv_scan_line(&scanner, line, line + len, line + len, 300, flds, &ok);
+	if (! ok) {
+		printf("%s: wide line: too few fields.\n", test_name);
+		return 1;
+	}
+	for (int i = 0; i < 300; i++) {
+		char exp[8];
+		sprintf(exp, "%d", i);
+		if (strlen(exp) != flds[i].len ||
+			0 != strncmp(exp, flds[i].start, flds[i].len)) {
+			printf("%s: wide line: expected '%s', got '%.*s'.\n",
+				test_name, exp, (int) flds[i].len,
+				flds[i].start);
+			return 1;
+		}
+	}
+	if (300 != csv_count_fields(line, len, ',', false)) {
+		printf("%s: wide line: expected 300 fields, counted %d.\n",
+			test_name, csv_count_fields(line, len, ',', false));
+		return 1;
+	}
+
+	printf ("%s: ok.\n", test_name);
+	return 0;
+}
+
+/* Quoted fields, some of which span blocks and lines, through both
+ * backends. */
+
+int test_quoted_CSV()
+{
+	const char *test_name = __func__;
+	const char *exp[][3] = {
+		{ "id", "text", "n" },
+		{ "1", "plain", "10" },
+		{ "2", "with, comma", "20" },
+		{ "3", "with \"quotes\"", "30" },
+		{ "4", "a long field, with a comma, and\na newline, that does "
+			"not fit in one block", "40" },
+		{ "5", "", "" },
+	};
+
+	for (int piped = 0; piped < 2; piped++) {
+		FILE *csv;
+		if (piped)
+			csv = open_as_pipe("data/test_buffered_CSV_quoted.csv");
+		else
+			csv = fopen("data/test_buffered_CSV_quoted.csv", "r");
+		if (NULL == csv) {
+			perror(NULL);
+			exit(EXIT_FAILURE);
+		}
+
+		buffered_CSV_t *buf_csv = create_buffered_CSV(csv, ',', NULL,
+				BUF_CSV_QUOTED);
+		if (NULL == buf_csv) {
+			printf ("%s: buf_csv should not be NULL.\n", test_name);
+			return 1;
+		}
+		if (3 != buf_csv_field_count(buf_csv)) {
+			printf ("%s: expected 3 fields, got %d.\n", test_name,
+					buf_csv_field_count(buf_csv));
+			return 1;
+		}
+
+		char **hdr = buf_csv_header_fields(buf_csv);
+		assert (NULL != hdr);	/* might fail silently otherwise */
+		for (int i = 0; i < 3; i++)
+			if (0 != strcmp(exp[0][i], hdr[i])) {
+				printf ("%s: expected '%s', got '%s'.\n",
+					test_name, exp[0][i], hdr[i]);
+				return 1;
+			}
+
+		buf_csv_field_t flds[3];
+		for (int row = 1; row <= 5; row++) {
+			if (3 != buf_csv_next_data_line_slices(buf_csv, flds)) {
+				printf ("%s: (piped: %d, row %d) expected 3 "
+					"fields.\n", test_name, piped, row);
+				return 1;
+			}
+			for (int i = 0; i < 3; i++)
+				if (strlen(exp[row][i]) != flds[i].len ||
+					0 != strncmp(exp[row][i],
+						flds[i].start, flds[i].len)) {
+					printf ("%s: (piped: %d, row %d) expected "
+						"'%s', got '%.*s'.\n", test_name,
+						piped, row, exp[row][i],
+						(int) flds[i].len,
+						flds[i].start);
+					return 1;
+				}
+		}
+		if (-1 != buf_csv_next_data_line_slices(buf_csv, flds)) {
+			printf ("%s: (piped: %d) expected EOF.\n", test_name,
+					piped);
+			return 1;
+		}
+
+		destroy_buffered_CSV(buf_csv);
+	}
+
+	printf ("%s: ok.\n", test_name);
+	return 0;
+}
+
+/* Ranges of every size must together yield the same lines as a serial read.
+ * The ranges are read in reverse order, as if by threads that finished in
+ * any order. */
+
+int test_ranges()
+{
+	const char *test_name = __func__;
+	char *exp_genus[] = { "Cercopithecus", "Simias", "Pan", "Pongo",
+		"Colobus" };
+
+	for (size_t size = 0; size < 80; size++) {
+		FILE * csv = fopen("data/test_buffered_CSV.csv", "r");
+		if (NULL == csv) {
+			perror(NULL);
+			exit(EXIT_FAILURE);
+		}
+		buffered_CSV_t *buf_csv = create_buffered_CSV(csv, '\t', NULL, 0);
+		if (NULL == buf_csv || ! buf_csv_splittable(buf_csv)) {
+			printf ("%s: file should be splittable.\n", test_name);
+			return 1;
+		}
+
+		buf_csv_range_t *ranges[6];	/* one more for the final NULL */
+		int num_ranges = 0;
+		while (NULL != (ranges[num_ranges] =
+				buf_csv_next_range(buf_csv, size)))
+			num_ranges++;
+		if (! buf_csv_eof(buf_csv)) {
+			printf ("%s: (size %zu) expected EOF.\n", test_name,
+					size);
+			return 1;
+		}
+
+		buf_csv_field_t flds[5][5][2];
+		int lines_in[5];
+		for (int r = num_ranges - 1; r >= 0; r--) {
+			lines_in[r] = 0;
+			while (lines_in[r] < 5 && 2 == buf_csv_range_next_slices(
+					ranges[r], flds[r][lines_in[r]]))
+				lines_in[r]++;
+			destroy_buf_csv_range(ranges[r]);
+		}
+
+		int line = 0;
+		for (int r = 0; r < num_ranges; r++)
+			for (int i = 0; i < lines_in[r]; i++, line++) {
+				buf_csv_field_t genus = flds[r][i][0];
+				if (line >= 5 || strlen(exp_genus[line]) !=
+					genus.len || 0 != strncmp(
+					exp_genus[line], genus.start,
+					genus.len)) {
+					printf ("%s: (size %zu, line %d) got "
+						"'%.*s'.\n", test_name, size,
+						line + 1, (int) genus.len,
+						genus.start);
+					return 1;
+				}
+			}
+		if (5 != line) {
+			printf ("%s: (size %zu) expected 5 lines, got %d.\n",
+					test_name, size, line);
+			return 1;
+		}
+
+		destroy_buffered_CSV(buf_csv);
+	}
+
+	printf ("%s: ok.\n", test_name);
+	return 0;
+}
+
+/* Seeking back to a line's offset must yield that line again. */
+
+int test_seek()
+{
+	const char *test_name = __func__;
+
+	FILE * csv = fopen("data/test_buffered_CSV.csv", "r");
+	if (NULL == csv) {
+		perror(NULL);
+		exit(EXIT_FAILURE);
+	}
+	buffered_CSV_t *buf_csv = create_buffered_CSV(csv, '\t', NULL, 0);
+	if (NULL == buf_csv) {
+		printf ("%s: buf_csv should not be NULL.\n", test_name);
+		return 1;
+	}
+
+	buf_csv_field_t flds[2];
+	buf_csv_next_data_line_slices(buf_csv, flds);
+	off_t offset = buf_csv_tell(buf_csv);
+	if (-1 == offset) {
+		printf ("%s: file should be mmap()ed.\n", test_name);
+		return 1;
+	}
+	while (-1 != buf_csv_next_data_line_slices(buf_csv, flds))
+		;
+	if (0 != buf_csv_seek(buf_csv, offset) ||
+		2 != buf_csv_next_data_line_slices(buf_csv, flds) ||
+		0 != strncmp("Simias", flds[0].start, flds[0].len)) {
+		printf ("%s: expected 'Simias' after seek.\n", test_name);
+		return 1;
+	}
+	/* one byte into a line goes to the next one */
+	off_t line_offset = buf_csv_seek_line(buf_csv, offset + 1);
+	if (line_offset <= offset ||
+		2 != buf_csv_next_data_line_slices(buf_csv, flds) ||
+		0 != strncmp("Pan", flds[0].start, flds[0].len)) {
+		printf ("%s: expected 'Pan' after seek_line.\n",
+				test_name);
+		return 1;
+	}
+	if (buf_csv_size(buf_csv) != buf_csv_seek_line(buf_csv,
+				buf_csv_size(buf_csv) - 1) ||
+		-1 != buf_csv_next_data_line_slices(buf_csv, flds)) {
+		printf ("%s: expected no line after seek_line to end.\n",
+				test_name);
+		return 1;
+	}
+
+	destroy_buffered_CSV(buf_csv);
+
+	printf ("%s: ok.\n", test_name);
+	return 0;
+}
+
 int main ()
 {
 	int failures = 0;
@@ -891,6 +1741,12 @@ int main ()
 	failures += test_no_headers_CSV();
 	failures += test_skip_leading();
 	failures += test_no_headers_skip_leading();
+	failures += test_line_views();
+	failures += test_field_slices();
+	failures += test_scanners();
+	failures += test_quoted_CSV();
+	failures += test_ranges();
+	failures += test_seek();
 
 	if (0 == failures)
 		printf("buffered_CSV tests ok.\n");
@@ -1,3 +1,6 @@
+#ifndef BUFFERED_CSV_H
+#define BUFFERED_CSV_H
+
 #include <sys/types.h>
 #include <stdio.h>
 
@@ -10,6 +13,10 @@
  * pipe, then one cannot seek() on it. That means the header line, etc., must
  * be stored not seek()ed. */
 
+/* Conversely, if the FILE is a regular file, it is mmap()ed, and lines are
+ * read straight from the mapping (see buf_csv_next_data_line_view()). This is
+ * transparent to the caller. */
+
 /* Intended use is something like this:
  *
  * Create buffered_CSV_t object:
@@ -31,6 +38,7 @@
 
 extern const int BUF_CSV_DUMP_SKIPPED;
 extern const int BUF_CSV_NO_HEADER;
+extern const int BUF_CSV_QUOTED;
 
 /* I keep details of struct buffered_CSV hidden, so I can change the
  * implementation without breaking anything. Access to members is by the
@@ -39,14 +47,26 @@ extern const int BUF_CSV_NO_HEADER;
 struct buffered_CSV;
 typedef struct buffered_CSV buffered_CSV_t;
 
+/* A view of one field: 'len' chars starting at 'start', NOT '\0'-terminated.
+ * See buf_csv_next_data_line_slices(). */
+
+typedef struct buf_csv_field {
+	const char *start;
+	size_t len;
+} buf_csv_field_t;
+
 /* Creates a buffered_CSV_t structure and returns a pointer to it, or NULL in
  * case of problems. If 'first_line_regexp' is not NULL, leading lines are
  * skipped until a line matches. The program then proceeds as if this line had
  * been the first of a true CSV file. The 'flags' is a bit array in which any
- * of BUF_CSV_DUMP_SKIPPED and BUF_CSV_NO_HEADER can be set. If
+ * of BUF_CSV_DUMP_SKIPPED, BUF_CSV_NO_HEADER and BUF_CSV_QUOTED can be set. If
  * BUF_CSV_DUMP_SKIPPED is set, any skipped lines will be output to stdout. If
  * BUF_CSV_NO_HEADER is set, the first line is considered data, and a header
- * line is generated, with field names of the form "f1", "f2", etc. */
+ * line is generated, with field names of the form "f1", "f2", etc. If
+ * BUF_CSV_QUOTED is set, fields may be quoted as per RFC 4180: the quotes are
+ * removed, doubled quotes within them stand for one quote, and separators and
+ * newlines within them are data. A "line" is then really a record, which may
+ * span several lines. */
 
 buffered_CSV_t *create_buffered_CSV(FILE *, char separator,
 		char *first_line_regexp, int flags);
@@ -73,6 +93,13 @@ char *buf_csv_first_data_line(buffered_CSV_t *);
 
 ssize_t buf_csv_next_data_line(char **lineptr, buffered_CSV_t *);
 
+/* Like buf_csv_next_data_line(), but does not copy the line: *line is set to
+ * point to it, and its length (including any trailing '\n') is returned. The
+ * line is NOT '\0'-terminated. It stays valid until the next call, or (if the
+ * file is mmap()ed) until the buffered_CSV_t is destroyed. Returns -1 at EOF. */
+
+ssize_t buf_csv_next_data_line_view(buffered_CSV_t *, const char **line);
+
 /* Field-wise functions */
 
 int buf_csv_field_count(buffered_CSV_t *);
@@ -97,12 +124,85 @@ char **buf_csv_first_data_line_fields(buffered_CSV_t *);
 
 char **buf_csv_next_data_line_fields(buffered_CSV_t *);
 
+/* Allocation-free version of buf_csv_next_data_line_fields(): fills 'fields',
+ * which is owned by the caller and must have room for buf_csv_field_count()
+ * elements, with views of the next data line's fields. The views are valid
+ * for as long as a line obtained from buf_csv_next_data_line_view() would be
+ * (but only until the next call for quoted fields that contained doubled
+ * quotes, as these had to be copied).
+ * Returns the number of fields, or -1 if no more line was read (or if the line
+ * has too few fields). */
+
+int buf_csv_next_data_line_slices(buffered_CSV_t *, buf_csv_field_t *fields);
+
+/* Random access (mmap()ed files only) */
+
+/* Returns the offset in the file of the next data line, or -1 if the file is
+ * not mmap()ed. */
+
+off_t buf_csv_tell(buffered_CSV_t *);
+
+/* Makes the line at 'offset' (which must have been returned by
+ * buf_csv_tell()) the next data line. Returns 0, or -1 if the file is not
+ * mmap()ed or the offset is out of bounds. */
+
+int buf_csv_seek(buffered_CSV_t *, off_t offset);
+
+/* Like buf_csv_seek(), but 'offset' may be anywhere: the next data line is
+ * the first one that starts at or after it. Not available in quoted mode, as
+ * we can't tell whether 'offset' is within quotes. Returns the offset of that
+ * line (the file's size if there is none), or -1. */
+
+off_t buf_csv_seek_line(buffered_CSV_t *, off_t offset);
+
+/* Returns the size of the mmap()ed file, or -1. */
+
+off_t buf_csv_size(buffered_CSV_t *);
+
+/* Range functions */
+
+/* A mmap()ed file's data lines can be handed out in ranges of consecutive
+ * lines, which can then be split into fields independently of each other,
+ * e.g. by several threads. The fields are views into the mapping, and stay
+ * valid until the buffered_CSV_t is destroyed. */
+
+struct buf_csv_range;
+typedef struct buf_csv_range buf_csv_range_t;
+
+/* Returns nonzero iff the data can be split into ranges, i.e. if the file is
+ * mmap()ed and not in quoted mode. */
+
+int buf_csv_splittable(buffered_CSV_t *);
+
+/* Returns the next range of data lines, which is about 'size' bytes long
+ * (it extends to the end of the line that contains the size-th byte), or
+ * NULL if there is no more data, or if the data can't be split. The lines
+ * are consumed: they will not be returned by any other function. Ranges are
+ * returned in file order. */
+
+buf_csv_range_t *buf_csv_next_range(buffered_CSV_t *, size_t size);
+
+/* Like buf_csv_next_data_line_slices(), for the range's next line. */
+
+int buf_csv_range_next_slices(buf_csv_range_t *, buf_csv_field_t *fields);
+
+/* Returns nonzero iff all the range's lines have been read, i.e. iff the last
+ * -1 from buf_csv_range_next_slices() was not due to a short line. */
+
+int buf_csv_range_at_end(buf_csv_range_t *);
+
+void destroy_buf_csv_range(buf_csv_range_t *);
+
 /* Misc functions */
 
-/* Calls feof() on the associated FILE*, and returns its value */
+/* Returns nonzero iff there is no more data. For streams this is feof() on
+ * the associated FILE*; for mmap()ed files, it is true as soon as the last line
+ * has been read. */
 
 int buf_csv_eof(buffered_CSV_t *);
 
 /* Destroys the buffered_CSV structure */
 
 void destroy_buffered_CSV(buffered_CSV_t *);
+
+#endif
@@ -0,0 +1,833 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdlib.h>
+#include <strings.h>
+
+#include "sqlite3.h"
+#include "chunk_merge.h"
+#include "sql_token.h"
+
+#define NEW_TABLE CHUNK_MERGE_TABLE "_new"
+#define KEY_COL "sqawk_k%d"
+#define PARTIAL_COL "sqawk_m%d"
+
+/* Tokens [start, end); start is -1 if the span is absent. */
+
+struct span {
+	int start, end;
+};
+
+enum agg_kind { AGG_COUNT, AGG_SUM, AGG_TOTAL, AGG_MIN, AGG_MAX, AGG_AVG };
+
+static const char *const agg_names[] = { "count", "sum", "total", "min",
+	"max", "avg", NULL };
+
+/* SQLite's other aggregates, which can't be merged (e.g. group_concat()
+ * depends on the order of its rows), and the errors that name them */
+static const char *const other_agg_names[] = { "group_concat", "string_agg",
+	"json_group_array", "json_group_object", "jsonb_group_array",
+	"jsonb_group_object", NULL };
+static const char *const other_agg_errors[] = {
+	"group_concat() can't be merged", "string_agg() can't be merged",
+	"json_group_array() can't be merged",
+	"json_group_object() can't be merged",
+	"jsonb_group_array() can't be merged",
+	"jsonb_group_object() can't be merged" };
+
+struct aggregate {
+	struct span call;
+	struct span args;
+	enum agg_kind kind;
+	int partial;	/* number of its first partial column */
+};
+
+struct item {
+	struct span expr;
+	int alias;	/* token, or -1 */
+};
+
+struct order_term {
+	struct span expr;
+	struct span suffix;	/* COLLATE, ASC, DESC, NULLS ... */
+};
+
+struct query {
+	const struct sql_token *tok;
+	bool distinct;
+	int num_items;
+	struct item *items;
+	struct span from, where, having, limit;
+	int num_group;
+	struct span *group;
+	int num_order;
+	struct order_term *order;
+	int ref;	/* the chunked table's name or alias in FROM */
+	int num_keys;
+	struct span *keys;
+	int num_aggs;
+	struct aggregate *aggs;
+	int num_partials;
+};
+
+static bool has_span(struct span s)
+{
+	return -1 != s.start;
+}
+
+static void append_span(sqlite3_str *out, const struct sql_token *tok,
+		struct span s)
+{
+	if (s.end <= s.start) return;
+	const char *start = tok[s.start].start;
+	const char *end = tok[s.end-1].start + tok[s.end-1].len;
+	sqlite3_str_append(out, start, end - start);
+}
+
+static bool is_name(const struct sql_token *tok)
+{
+	static const char *const keywords[] = { "AS", "ON", "USING", "JOIN",
+		"NATURAL", "LEFT", "RIGHT", "FULL", "INNER", "CROSS", "OUTER",
+		"INDEXED", "NOT", "WHERE", "GROUP", "HAVING", "ORDER", "LIMIT",
+		"END", "NULL", "ISNULL", "NOTNULL", "COLLATE", "ASC", "DESC",
+		NULL };
+	if (SQL_QUOTED == tok->type) return true;
+	if (SQL_WORD != tok->type) return false;
+	for (int i = 0; NULL != keywords[i]; i++)
+		if (sql_is_keyword(tok, keywords[i])) return false;
+	return true;
+}
+
+static bool tokens_equal(const struct sql_token *a, const struct sql_token *b)
+{
+	if (a->type != b->type || (SQL_QUOTED != a->type && a->len != b->len))
+		return false;
+	switch (a->type) {
+	case SQL_WORD: return 0 == strncasecmp(a->start, b->start, a->len);
+	case SQL_QUOTED: return 0 == strcasecmp(a->text, b->text);
+	default: return 0 == memcmp(a->start, b->start, a->len);
+	}
+}
+
+/* The name of a word or quoted identifier */
+
+static void append_name(sqlite3_str *out, const struct sql_token *tok)
+{
+	if (SQL_QUOTED == tok->type)
+		sqlite3_str_appendall(out, tok->text);
+	else
+		sqlite3_str_append(out, tok->start, tok->len);
+}
+
+static int matching_paren(const struct sql_token *tok, int open, int end)
+{
+	int depth = 0;
+	for (int t = open; t < end; t++) {
+		if (sql_is_op(&tok[t], "(")) depth++;
+		if (sql_is_op(&tok[t], ")") && 0 == --depth) return t;
+	}
+	return -1;
+}
+
+/* Splits 's' at the commas outside parentheses. Returns the number of
+ * parts. */
+
+static int split_list(const struct sql_token *tok, struct span s,
+		struct span **parts)
+{
+	int num = 0, depth = 0, start = s.start;
+	*parts = NULL;
+	for (int t = s.start; t <= s.end; t++) {
+		if (t < s.end && sql_is_op(&tok[t], "(")) depth++;
+		if (t < s.end && sql_is_op(&tok[t], ")")) depth--;
+		if (t == s.end || (0 == depth && sql_is_op(&tok[t], ","))) {
+			struct span *p = realloc(*parts,
+					(num + 1) * sizeof(struct span));
+			if (NULL == p) return -1;
+			*parts = p;
+			p[num++] = (struct span) { start, t };
+			start = t + 1;
+		}
+	}
+	return num;
+}
+
+/* Column reference at 't': 'name' or 'qualifier.name'. Returns the number of
+ * tokens, or 0. */
+
+static int colref_at(const struct sql_token *tok, int t, int end,
+		int *qualifier, int *name)
+{
+	if (t > 0 && sql_is_op(&tok[t-1], ".")) return 0;
+	if (t + 2 < end && is_name(&tok[t]) && sql_is_op(&tok[t+1], ".") &&
+			is_name(&tok[t+2])) {
+		*qualifier = t;
+		*name = t + 2;
+		return 3;
+	}
+	if (t < end && is_name(&tok[t]) && ! (t + 1 < end &&
+			(sql_is_op(&tok[t+1], ".") ||
+			 sql_is_op(&tok[t+1], "(")))) {
+		*qualifier = -1;
+		*name = t;
+		return 1;
+	}
+	return 0;
+}
+
+/* Returns the number of tokens at 't' that are key 'key', or 0. A column
+ * matches with or without its qualifier. */
+
+static int key_at(const struct query *q, int key, int t, int end)
+{
+	const struct sql_token *tok = q->tok;
+	struct span k = q->keys[key];
+	int kq, kn, tq, tn;
+	if (colref_at(tok, k.start, k.end, &kq, &kn) == k.end - k.start) {
+		int len = colref_at(tok, t, end, &tq, &tn);
+		if (0 != len && tokens_equal(&tok[kn], &tok[tn]) &&
+				(-1 == kq || -1 == tq ||
+				 tokens_equal(&tok[kq], &tok[tq])))
+			return len;
+	}
+	int len = k.end - k.start;
+	if (t + len > end) return 0;
+	for (int i = 0; i < len; i++)
+		if (! tokens_equal(&tok[k.start + i], &tok[t + i])) return 0;
+	return len;
+}
+
+/* Notes the aggregate calls in 's'. */
+
+static const char *find_aggregates(struct query *q, struct span s)
+{
+	const struct sql_token *tok = q->tok;
+	for (int t = s.start; t < s.end; t++) {
+		if (t + 1 < s.end && sql_is_op(&tok[t+1], "("))
+			for (int o = 0; NULL != other_agg_names[o]; o++)
+				if (sql_is_keyword(&tok[t], other_agg_names[o]))
+					return other_agg_errors[o];
+		int kind;
+		for (kind = 0; NULL != agg_names[kind]; kind++)
+			if (sql_is_keyword(&tok[t], agg_names[kind])) break;
+		if (NULL == agg_names[kind] || t + 1 >= s.end ||
+				! sql_is_op(&tok[t+1], "("))
+			continue;
+		int close = matching_paren(tok, t + 1, s.end);
+		if (-1 == close) return "unbalanced parentheses";
+		struct span args = { t + 2, close };
+		struct span *parts;
+		int num_args = split_list(tok, args, &parts);
+		free(parts);
+		if ((AGG_MIN == kind || AGG_MAX == kind) && num_args > 1)
+			continue;	/* the scalar function */
+		if (args.start < args.end &&
+				(sql_is_keyword(&tok[args.start], "DISTINCT") ||
+				 sql_is_keyword(&tok[args.start], "ALL")))
+			return "DISTINCT aggregates can't be merged";
+
+		struct aggregate *aggs = realloc(q->aggs,
+				(q->num_aggs + 1) * sizeof(struct aggregate));
+		if (NULL == aggs) return "out of memory";
+		q->aggs = aggs;
+		aggs[q->num_aggs++] = (struct aggregate) {
+			.call = { t, close + 1 }, .args = args, .kind = kind,
+			.partial = q->num_partials };
+		q->num_partials += AGG_AVG == kind ? 2 : 1;
+		t = close;
+	}
+	return NULL;
+}
+
+/* Returns the item that 's' (an ORDER BY or GROUP BY term) refers to by
+ * number or alias, or -1. */
+
+static int item_ref(const struct query *q, struct span s)
+{
+	const struct sql_token *tok = q->tok;
+	if (1 != s.end - s.start) return -1;
+	if (SQL_NUMBER == tok[s.start].type) {
+		int n = atoi(tok[s.start].start);
+		return n >= 1 && n <= q->num_items ? n - 1 : -1;
+	}
+	for (int i = 0; i < q->num_items; i++)
+		if (-1 != q->items[i].alias && tokens_equal(&tok[s.start],
+					&tok[q->items[i].alias]))
+			return i;
+	return -1;
+}
+
+/* Splits the query into its clauses. */
+
+static const char *parse_query(struct query *q, const sql_tokens_t *toks,
+		const char *tbl_name)
+{
+	static const char *const forbidden[] = { "WITH", "UNION", "INTERSECT",
+		"EXCEPT", "VALUES", "OVER", "FILTER", "WINDOW", NULL };
+	const struct sql_token *tok = toks->tok;
+	int num = toks->num, num_selects = 0;
+	while (num > 0 && sql_is_op(&tok[num-1], ";")) num--;
+	for (int t = 0; t < num; t++) {
+		if (sql_is_keyword(&tok[t], "SELECT")) num_selects++;
+		for (int k = 0; NULL != forbidden[k]; k++)
+			if (sql_is_keyword(&tok[t], forbidden[k]))
+				return "the query has a compound, a CTE, or "
+					"a window function";
+		if (sql_is_op(&tok[t], ";"))
+			return "there is more than one statement";
+	}
+	if (0 == num || ! sql_is_keyword(&tok[0], "SELECT"))
+		return "the query is not a SELECT";
+	if (1 != num_selects) return "the query has a subquery";
+
+	/* The clauses, in their order */
+	static const char *const clauses[] = { "FROM", "WHERE", "GROUP",
+		"HAVING", "ORDER", "LIMIT", NULL };
+	struct span select = { 1, num };
+	struct span *spans[] = { &q->from, &q->where, NULL, &q->having, NULL,
+		&q->limit };
+	struct span group = { -1, -1 }, order = { -1, -1 };
+	spans[2] = &group;
+	spans[4] = &order;
+	struct span *current = &select;
+	int next_clause = 0, depth = 0;
+	for (int t = 1; t < num; t++) {
+		if (sql_is_op(&tok[t], "(")) depth++;
+		if (sql_is_op(&tok[t], ")")) depth--;
+		if (0 != depth) continue;
+		for (int c = next_clause; NULL != clauses[c]; c++) {
+			if (! sql_is_keyword(&tok[t], clauses[c])) continue;
+			current->end = t;
+			if (2 == c || 4 == c) {
+				if (t + 1 >= num ||
+					! sql_is_keyword(&tok[t+1], "BY"))
+					return "syntax error";
+				t++;
+			}
+			current = spans[c];
+			*current = (struct span) { t + 1, num };
+			next_clause = c + 1;
+			break;
+		}
+	}
+	if (! has_span(q->from)) return NULL;
+
+	if (select.start < select.end &&
+			sql_is_keyword(&tok[select.start], "DISTINCT")) {
+		q->distinct = true;
+		select.start++;
+	} else if (select.start < select.end &&
+			sql_is_keyword(&tok[select.start], "ALL")) {
+		select.start++;
+	}
+
+	struct span *parts;
+	q->num_items = split_list(tok, select, &parts);
+	if (q->num_items < 0) return "out of memory";
+	q->items = calloc(q->num_items, sizeof(struct item));
+	if (NULL == q->items) {
+		free(parts);
+		return "out of memory";
+	}
+	for (int i = 0; i < q->num_items; i++) {
+		struct span p = parts[i];
+		struct item *item = &q->items[i];
+		item->expr = p;
+		item->alias = -1;
+		int len = p.end - p.start;
+		if (len >= 3 && sql_is_keyword(&tok[p.end-2], "AS")) {
+			item->alias = p.end - 1;
+			item->expr.end = p.end - 2;
+		} else if (len >= 2 && is_name(&tok[p.end-1]) &&
+				! sql_is_op(&tok[p.end-2], ".") &&
+				(sql_is_op(&tok[p.end-2], ")") ||
+				 SQL_OP != tok[p.end-2].type) &&
+				! sql_is_keyword(&tok[p.end-2], "IS") &&
+				! sql_is_keyword(&tok[p.end-2], "NOT") &&
+				! sql_is_keyword(&tok[p.end-2], "COLLATE")) {
+			item->alias = p.end - 1;
+			item->expr.end = p.end - 1;
+		}
+	}
+	free(parts);
+
+	if (has_span(group)) {
+		q->num_group = split_list(tok, group, &q->group);
+		if (q->num_group < 0) return "out of memory";
+	}
+	if (has_span(order)) {
+		q->num_order = split_list(tok, order, &parts);
+		if (q->num_order < 0) return "out of memory";
+		q->order = calloc(q->num_order, sizeof(struct order_term));
+		if (NULL == q->order) {
+			free(parts);
+			return "out of memory";
+		}
+		for (int i = 0; i < q->num_order; i++) {
+			/* expr [COLLATE name] [ASC|DESC] [NULLS FIRST|LAST] */
+			struct span e = parts[i];
+			if (e.end - e.start > 2 &&
+				sql_is_keyword(&tok[e.end-2], "NULLS"))
+				e.end -= 2;
+			if (e.end - e.start > 1 &&
+				(sql_is_keyword(&tok[e.end-1], "ASC") ||
+				 sql_is_keyword(&tok[e.end-1], "DESC")))
+				e.end--;
+			if (e.end - e.start > 2 &&
+				sql_is_keyword(&tok[e.end-2], "COLLATE"))
+				e.end -= 2;
+			q->order[i].expr = e;
+			q->order[i].suffix = (struct span) { e.end,
+				parts[i].end };
+		}
+		free(parts);
+	}
+
+	/* The chunked table in the FROM clause */
+	int uses = 0;
+	for (int t = q->from.start; t < q->from.end; t++) {
+		if (! sql_name_is(&tok[t], tbl_name) || (t + 1 < q->from.end &&
+					sql_is_op(&tok[t+1], ".")))
+			continue;
+		uses++;
+		q->ref = t;
+		if (t + 2 < q->from.end && sql_is_keyword(&tok[t+1], "AS"))
+			q->ref = t + 2;
+		else if (t + 1 < q->from.end && is_name(&tok[t+1]))
+			q->ref = t + 1;
+	}
+	if (uses > 1) return "the chunked table is used more than once";
+	if (0 == uses) q->from.start = -1;
+	return NULL;
+}
+
+static void append_partials(sqlite3_str *out, const struct query *q)
+{
+	for (int k = 0; k < q->num_keys; k++) {
+		sqlite3_str_appendf(out, "%s", 0 == k ? "" : ", ");
+		append_span(out, q->tok, q->keys[k]);
+	}
+	for (int a = 0; a < q->num_aggs; a++) {
+		const struct aggregate *agg = &q->aggs[a];
+		const char *fn = AGG_AVG == agg->kind ? "total" :
+			agg_names[agg->kind];
+		sqlite3_str_appendf(out, "%s%s(", 0 == q->num_keys && 0 == a ?
+				"" : ", ", fn);
+		append_span(out, q->tok, agg->args);
+		sqlite3_str_appendall(out, ")");
+		if (AGG_AVG == agg->kind) {
+			sqlite3_str_appendall(out, ", count(");
+			append_span(out, q->tok, agg->args);
+			sqlite3_str_appendall(out, ")");
+		}
+	}
+}
+
+static void append_key_cols(sqlite3_str *out, const struct query *q)
+{
+	for (int k = 0; k < q->num_keys; k++)
+		sqlite3_str_appendf(out, "%s" KEY_COL, 0 == k ? "" : ", ", k);
+}
+
+/* How the partials of the same group are combined */
+
+static void append_combined(sqlite3_str *out, const struct query *q)
+{
+	append_key_cols(out, q);
+	for (int a = 0; a < q->num_aggs; a++) {
+		const struct aggregate *agg = &q->aggs[a];
+		static const char *const fns[] = { "sum", "sum", "total",
+			"min", "max", "total" };
+		sqlite3_str_appendf(out, "%s%s(" PARTIAL_COL ")",
+			0 == q->num_keys && 0 == a ? "" : ", ",
+			fns[agg->kind], agg->partial);
+		if (AGG_AVG == agg->kind)
+			sqlite3_str_appendf(out, ", sum(" PARTIAL_COL ")",
+					agg->partial + 1);
+	}
+}
+
+static void append_final_aggregate(sqlite3_str *out,
+		const struct aggregate *agg)
+{
+	int m = agg->partial;
+	switch (agg->kind) {
+	case AGG_COUNT:
+		sqlite3_str_appendf(out, "coalesce(sum(" PARTIAL_COL "), 0)",
+				m);
+		break;
+	case AGG_AVG:
+		sqlite3_str_appendf(out, "CASE WHEN sum(" PARTIAL_COL ") > 0 "
+			"THEN total(" PARTIAL_COL ") / sum(" PARTIAL_COL ") "
+			"END", m + 1, m, m + 1);
+		break;
+	default:
+		sqlite3_str_appendf(out, "%s(" PARTIAL_COL ")",
+				agg_names[agg->kind], m);
+	}
+}
+
+/* Appends 's', with the aggregates and keys replaced by what they are in the
+ * state table. */
+
+static void append_rewritten(sqlite3_str *out, const struct query *q,
+		struct span s)
+{
+	const struct sql_token *tok = q->tok;
+	for (int t = s.start; t < s.end; ) {
+		int a;
+		for (a = 0; a < q->num_aggs; a++)
+			if (q->aggs[a].call.start == t) break;
+		if (a < q->num_aggs) {
+			append_final_aggregate(out, &q->aggs[a]);
+			sqlite3_str_appendall(out, " ");
+			t = q->aggs[a].call.end;
+			continue;
+		}
+		int k, len = 0;
+		for (k = 0; k < q->num_keys && 0 == len; k++)
+			len = key_at(q, k, t, s.end);
+		if (0 != len) {
+			sqlite3_str_appendf(out, KEY_COL " ", k - 1);
+			t += len;
+			continue;
+		}
+		append_span(out, tok, (struct span) { t, t + 1 });
+		sqlite3_str_appendall(out, " ");
+		t++;
+	}
+}
+
+/* The name SQLite gives the result column of an item */
+
+static void append_item_name(sqlite3_str *out, const struct query *q,
+		const struct item *item)
+{
+	int qualifier, name;
+	sqlite3_str *s = sqlite3_str_new(NULL);
+	if (-1 != item->alias)
+		append_name(s, &q->tok[item->alias]);
+	else if (colref_at(q->tok, item->expr.start, item->expr.end,
+			&qualifier, &name) == item->expr.end - item->expr.start)
+		append_name(s, &q->tok[name]);
+	else
+		append_span(s, q->tok, item->expr);
+	char *text = sqlite3_str_finish(s);
+	sqlite3_str_appendf(out, "\"%w\"", NULL == text ? "" : text);
+	sqlite3_free(text);
+}
+
+/* Notes the keys: the GROUP BY terms, or the items for a plain DISTINCT. */
+
+static const char *find_keys(struct query *q)
+{
+	if (q->num_group > 0) {
+		q->num_keys = q->num_group;
+		q->keys = malloc(q->num_keys * sizeof(struct span));
+		if (NULL == q->keys) return "out of memory";
+		for (int k = 0; k < q->num_keys; k++) {
+			int i = item_ref(q, q->group[k]);
+			q->keys[k] = -1 == i ? q->group[k] : q->items[i].expr;
+		}
+	} else if (0 == q->num_aggs) {
+		q->num_keys = q->num_items;
+		q->keys = malloc(q->num_keys * sizeof(struct span));
+		if (NULL == q->keys) return "out of memory";
+		for (int k = 0; k < q->num_keys; k++)
+			q->keys[k] = q->items[k].expr;
+	}
+	return NULL;
+}
+
+/* Checks that 's' only reads columns through keys and aggregates, as the
+ * state table has nothing else (e.g. not the bare column 's' of SELECT k, s,
+ * count(*) ... GROUP BY k). In HAVING and ORDER BY ('aliases'), items may
+ * also be named by their aliases. Words that are SQL keywords, and type and
+ * collation names, are not columns. */
+
+static const char *find_bare_columns(const struct query *q, struct span s,
+		bool aliases)
+{
+	const struct sql_token *tok = q->tok;
+	for (int t = s.start; t < s.end; ) {
+		int a;
+		for (a = 0; a < q->num_aggs; a++)
+			if (q->aggs[a].call.start == t) break;
+		if (a < q->num_aggs) {
+			t = q->aggs[a].call.end;
+			continue;
+		}
+		int len = 0;
+		for (int k = 0; k < q->num_keys && 0 == len; k++)
+			len = key_at(q, k, t, s.end);
+		if (0 != len) {
+			t += len;
+			continue;
+		}
+		int qualifier, name;
+		len = colref_at(tok, t, s.end, &qualifier, &name);
+		if (0 == len || (t > s.start &&
+				(sql_is_keyword(&tok[t-1], "AS") ||
+				 sql_is_keyword(&tok[t-1], "COLLATE")))) {
+			t++;
+			continue;
+		}
+		if (-1 == qualifier && SQL_WORD == tok[name].type &&
+				(sqlite3_keyword_check(tok[name].start,
+					tok[name].len) ||
+				 sql_is_keyword(&tok[name], "TRUE") ||
+				 sql_is_keyword(&tok[name], "FALSE"))) {
+			t++;
+			continue;
+		}
+		if (aliases && -1 == qualifier &&
+				-1 != item_ref(q, (struct span) { t, t + 1 })) {
+			t++;
+			continue;
+		}
+		return "columns that are neither grouped by nor aggregated "
+			"can't be merged";
+	}
+	return NULL;
+}
+
+static struct chunk_merge *aggregate_plan(struct query *q)
+{
+	const struct sql_token *tok = q->tok;
+	for (int i = 0; i < q->num_items; i++) {
+		struct span e = q->items[i].expr;
+		if (e.end > e.start && sql_is_op(&tok[e.end-1], "*") &&
+				(e.end - e.start == 1 ||
+				 sql_is_op(&tok[e.end-2], ".")))
+			return NULL;
+	}
+
+	struct chunk_merge *plan = calloc(1, sizeof(struct chunk_merge));
+	if (NULL == plan) return NULL;
+	plan->flush = true;
+
+	sqlite3_str *cols = sqlite3_str_new(NULL);
+	append_key_cols(cols, q);
+	for (int m = 0; m < q->num_partials; m++)
+		sqlite3_str_appendf(cols, "%s" PARTIAL_COL,
+				0 == q->num_keys && 0 == m ? "" : ", ", m);
+	char *col_list = sqlite3_str_finish(cols);
+
+	plan->setup_sql = sqlite3_mprintf("CREATE TABLE %s (%s); "
+			"CREATE TABLE %s (%s);", CHUNK_MERGE_TABLE, col_list,
+			NEW_TABLE, col_list);
+	sqlite3_free(col_list);
+
+	sqlite3_str *chunk = sqlite3_str_new(NULL);
+	sqlite3_str_appendf(chunk, "INSERT INTO %s SELECT ",
+			CHUNK_MERGE_TABLE);
+	append_partials(chunk, q);
+	sqlite3_str_appendall(chunk, " FROM ");
+	append_span(chunk, tok, q->from);
+	if (has_span(q->where)) {
+		sqlite3_str_appendall(chunk, " WHERE ");
+		append_span(chunk, tok, q->where);
+	}
+	if (q->num_keys > 0) {
+		sqlite3_str_appendall(chunk, " GROUP BY ");
+		for (int k = 0; k < q->num_keys; k++) {
+			sqlite3_str_appendf(chunk, "%s", 0 == k ? "" : ", ");
+			append_span(chunk, tok, q->keys[k]);
+		}
+	}
+	sqlite3_str_appendf(chunk, "; INSERT INTO %s SELECT ", NEW_TABLE);
+	append_combined(chunk, q);
+	sqlite3_str_appendf(chunk, " FROM %s", CHUNK_MERGE_TABLE);
+	if (q->num_keys > 0) {
+		sqlite3_str_appendall(chunk, " GROUP BY ");
+		append_key_cols(chunk, q);
+	}
+	sqlite3_str_appendf(chunk, "; DELETE FROM %s; INSERT INTO %s SELECT * "
+			"FROM %s; DELETE FROM %s;", CHUNK_MERGE_TABLE,
+			CHUNK_MERGE_TABLE, NEW_TABLE, NEW_TABLE);
+	plan->chunk_sql = sqlite3_str_finish(chunk);
+
+	sqlite3_str *final = sqlite3_str_new(NULL);
+	sqlite3_str_appendf(final, "SELECT %s", q->distinct ? "DISTINCT " : "");
+	for (int i = 0; i < q->num_items; i++) {
+		sqlite3_str_appendf(final, "%s", 0 == i ? "" : ", ");
+		append_rewritten(final, q, q->items[i].expr);
+		sqlite3_str_appendall(final, "AS ");
+		append_item_name(final, q, &q->items[i]);
+	}
+	sqlite3_str_appendf(final, " FROM %s", CHUNK_MERGE_TABLE);
+	if (q->num_keys > 0) {
+		sqlite3_str_appendall(final, " GROUP BY ");
+		append_key_cols(final, q);
+	}
+	if (has_span(q->having)) {
+		sqlite3_str_appendall(final, " HAVING ");
+		append_rewritten(final, q, q->having);
+	}
+	for (int o = 0; o < q->num_order; o++) {
+		sqlite3_str_appendall(final, 0 == o ? " ORDER BY " : ", ");
+		append_rewritten(final, q, q->order[o].expr);
+		append_span(final, tok, q->order[o].suffix);
+	}
+	if (has_span(q->limit)) {
+		sqlite3_str_appendall(final, " LIMIT ");
+		append_span(final, tok, q->limit);
+	}
+	plan->final_sql = sqlite3_str_finish(final);
+
+	return plan;
+}
+
+/* The LIMIT clause, as the number of rows to keep: the limit plus the
+ * offset. */
+
+static void append_keep_limit(sqlite3_str *out, const struct query *q)
+{
+	const struct sql_token *tok = q->tok;
+	struct span limit = q->limit, offset = { -1, -1 };
+	int depth = 0;
+	for (int t = limit.start; t < limit.end; t++) {
+		if (sql_is_op(&tok[t], "(")) depth++;
+		if (sql_is_op(&tok[t], ")")) depth--;
+		if (0 != depth) continue;
+		if (sql_is_keyword(&tok[t], "OFFSET")) {
+			offset = (struct span) { t + 1, limit.end };
+			limit.end = t;
+			break;
+		}
+		if (sql_is_op(&tok[t], ",")) {
+			/* LIMIT offset, limit */
+			offset = (struct span) { limit.start, t };
+			limit.start = t + 1;
+			break;
+		}
+	}
+	sqlite3_str_appendall(out, " LIMIT ");
+	if (! has_span(offset)) {
+		append_span(out, tok, limit);
+		return;
+	}
+	sqlite3_str_appendall(out, "CASE WHEN (");
+	append_span(out, tok, limit);
+	sqlite3_str_appendall(out, ") < 0 THEN -1 ELSE (");
+	append_span(out, tok, limit);
+	sqlite3_str_appendall(out, ") + (");
+	append_span(out, tok, offset);
+	sqlite3_str_appendall(out, ") END");
+}
+
+static struct chunk_merge *carry_plan(struct query *q, const char *sql,
+		const char *tbl_name, const char **error)
+{
+	const struct sql_token *tok = q->tok;
+	bool star = false;
+	for (int i = 0; i < q->num_items; i++) {
+		struct span e = q->items[i].expr;
+		if (e.end > e.start && sql_is_op(&tok[e.end-1], "*"))
+			star = true;
+	}
+
+	struct chunk_merge *plan = calloc(1, sizeof(struct chunk_merge));
+	if (NULL == plan) return NULL;
+
+	sqlite3_str *chunk = sqlite3_str_new(NULL);
+	sqlite3_str_appendf(chunk, "DELETE FROM \"%w\" WHERE rowid NOT IN "
+			"(SELECT ", tbl_name);
+	append_span(chunk, tok, (struct span) { q->ref, q->ref + 1 });
+	sqlite3_str_appendall(chunk, ".rowid FROM ");
+	append_span(chunk, tok, q->from);
+	if (has_span(q->where)) {
+		sqlite3_str_appendall(chunk, " WHERE ");
+		append_span(chunk, tok, q->where);
+	}
+	for (int o = 0; o < q->num_order; o++) {
+		struct span e = q->order[o].expr;
+		sqlite3_str_appendall(chunk, 0 == o ? " ORDER BY " : ", ");
+		int i = item_ref(q, e);
+		if (star && 1 == e.end - e.start &&
+				SQL_NUMBER == tok[e.start].type) {
+			*error = "ORDER BY refers to a column by number, "
+				"and there is a '*'";
+			sqlite3_free(sqlite3_str_finish(chunk));
+			free(plan);
+			return NULL;
+		}
+		append_span(chunk, tok, -1 == i ? e : q->items[i].expr);
+		sqlite3_str_appendall(chunk, " ");
+		append_span(chunk, tok, q->order[o].suffix);
+	}
+	if (has_span(q->limit))
+		append_keep_limit(chunk, q);
+	sqlite3_str_appendall(chunk, ")");
+	plan->chunk_sql = sqlite3_str_finish(chunk);
+	plan->final_sql = sqlite3_mprintf("%s", sql);
+
+	return plan;
+}
+
+static void free_query(struct query *q)
+{
+	free(q->items);
+	free(q->group);
+	free(q->order);
+	free(q->keys);
+	free(q->aggs);
+}
+
+struct chunk_merge *chunk_merge_plan(const char *sql, const char *tbl_name,
+		const char **error)
+{
+	*error = NULL;
+	sql_tokens_t toks;
+	if (! sql_tokenize(sql, &toks)) {
+		sql_free_tokens(&toks);
+		*error = "can't parse the query";
+		return NULL;
+	}
+
+	struct query q = { .tok = toks.tok,
+		.from = { -1, -1 }, .where = { -1, -1 },
+		.having = { -1, -1 }, .limit = { -1, -1 } };
+	struct chunk_merge *plan = NULL;
+	*error = parse_query(&q, &toks, tbl_name);
+	if (NULL == *error && has_span(q.from)) {
+		for (int i = 0; i < q.num_items && NULL == *error; i++)
+			*error = find_aggregates(&q, q.items[i].expr);
+		if (NULL == *error && has_span(q.having))
+			*error = find_aggregates(&q, q.having);
+		for (int o = 0; o < q.num_order && NULL == *error; o++)
+			*error = find_aggregates(&q, q.order[o].expr);
+	}
+
+	if (NULL != *error || ! has_span(q.from)) {
+		/* nothing to merge */
+	} else if (q.num_aggs > 0 || q.num_group > 0 || q.distinct) {
+		*error = find_keys(&q);
+		for (int i = 0; i < q.num_items && NULL == *error; i++)
+			*error = find_bare_columns(&q, q.items[i].expr, false);
+		if (NULL == *error && has_span(q.having))
+			*error = find_bare_columns(&q, q.having, true);
+		for (int o = 0; o < q.num_order && NULL == *error; o++)
+			*error = find_bare_columns(&q, q.order[o].expr, true);
+		if (NULL == *error) {
+			plan = aggregate_plan(&q);
+			if (NULL == plan)
+				*error = "'*' can't be merged";
+		}
+	} else if (q.num_order > 0 || has_span(q.limit)) {
+		plan = carry_plan(&q, sql, tbl_name, error);
+	}
+
+	free_query(&q);
+	sql_free_tokens(&toks);
+	return plan;
+}
+
+void chunk_merge_free(struct chunk_merge *plan)
+{
+	if (NULL == plan) return;
+	sqlite3_free(plan->setup_sql);
+	sqlite3_free(plan->chunk_sql);
+	sqlite3_free(plan->final_sql);
+	free(plan);
+}
@@ -0,0 +1,45 @@
+#ifndef CHUNK_MERGE_H
+#define CHUNK_MERGE_H
+
+#include <stdbool.h>
+
+/* Merging query results across the chunks of -P. Normally the user's query is
+ * run on each chunk, so aggregates (and ORDER BY ... LIMIT) only see one
+ * chunk at a time. With -M the query is rewritten so that each chunk only
+ * updates some state, from which a single result is computed at the end:
+ *
+ * - An aggregate query (count, sum, total, min, max, avg, GROUP BY on these,
+ *   DISTINCT) keeps, in table CHUNK_MERGE_TABLE, one row of partial
+ *   aggregates per group; after each chunk the chunk's partials are added,
+ *   and the rows of the same group combined. The final query aggregates the
+ *   partials, with the user's HAVING, ORDER BY and LIMIT.
+ *
+ * - Any other query that has an ORDER BY or a LIMIT keeps, after each chunk,
+ *   just the rows of the chunked table that may still be part of the result
+ *   (e.g. the best k for ORDER BY ... LIMIT k, or those that meet the WHERE
+ *   clause), and the query is run on these at the end.
+ *
+ * Other queries need no merging. The query must be a single SELECT, without
+ * subqueries, compounds, CTEs, window functions, DISTINCT aggregates, or
+ * other aggregates (e.g. group_concat), and may only use the chunked table
+ * once (it may be joined to other tables). */
+
+#define CHUNK_MERGE_TABLE "sqawk_merge"
+
+struct chunk_merge {
+	char *setup_sql;	/* run before the first chunk, or NULL */
+	char *chunk_sql;	/* run after each chunk is loaded, or NULL */
+	bool flush;	/* empty the chunked table after chunk_sql */
+	char *final_sql;	/* run at the end, for the result */
+};
+
+/* Returns how to merge 'sql' across the chunks of table 'tbl_name'. Returns
+ * NULL if this is not needed, and sets *error to NULL; or returns NULL and
+ * sets *error to a message telling why it can't be done. */
+
+struct chunk_merge *chunk_merge_plan(const char *sql, const char *tbl_name,
+		const char **error);
+
+void chunk_merge_free(struct chunk_merge *);
+
+#endif
@@ -0,0 +1,570 @@
+#define _GNU_SOURCE
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "column_stats.h"
+
+/* a sketch has 2^SKETCH_BITS registers, for an error of 1.04 / 2^(BITS/2) */
+#define SKETCH_BITS 12
+#define NUM_REGISTERS (1 << SKETCH_BITS)
+
+struct value {
+	int type;	/* SQLITE_INTEGER, _FLOAT, _TEXT or _BLOB */
+	sqlite3_int64 integer;
+	double real;
+	const void *bytes;	/* of text and blobs */
+	size_t len;
+};
+
+/* One end of a column's range of values. */
+
+struct bound {
+	int type;	/* SQLITE_NULL if there is no value yet */
+	sqlite3_int64 integer;
+	double real;
+	char *bytes;	/* of text and blobs, 'size' allocated */
+	size_t len;
+	size_t size;
+};
+
+struct column {
+	sqlite3_int64 nulls;
+	bool numbers;	/* if some values were numbers */
+	struct bound min;
+	struct bound max;
+	unsigned char registers[NUM_REGISTERS];
+};
+
+struct column_stats {
+	int num_columns;
+	sqlite3_int64 rows;
+	struct column *columns;
+};
+
+column_stats_t *create_column_stats(int num_columns)
+{
+	column_stats_t *stats = malloc(sizeof(column_stats_t));
+	if (NULL == stats) return NULL;
+	stats->num_columns = num_columns;
+	stats->rows = 0;
+	stats->columns = calloc(num_columns, sizeof(struct column));
+	if (NULL == stats->columns) {
+		free(stats);
+		return NULL;
+	}
+	clear_column_stats(stats);
+	return stats;
+}
+
+void destroy_column_stats(column_stats_t *stats)
+{
+	if (NULL == stats) return;
+	for (int i = 0; i < stats->num_columns; i++) {
+		free(stats->columns[i].min.bytes);
+		free(stats->columns[i].max.bytes);
+	}
+	free(stats->columns);
+	free(stats);
+}
+
+void clear_column_stats(column_stats_t *stats)
+{
+	stats->rows = 0;
+	for (int i = 0; i < stats->num_columns; i++) {
+		struct column *c = &stats->columns[i];
+		c->nulls = 0;
+		c->numbers = false;
+		c->min.type = c->max.type = SQLITE_NULL;
+		memset(c->registers, 0, NUM_REGISTERS);
+	}
+}
+
+void column_stats_add_row(column_stats_t *stats)
+{
+	stats->rows++;
+}
+
+void column_stats_add_null(column_stats_t *stats, int column)
+{
+	stats->columns[column].nulls++;
+}
+
+/* Compares an integer to a real the way SQLite does, without losing
+ * precision on large integers. */
+
+static int compare_int_real(sqlite3_int64 i, double r)
+{
+	if (r < -9223372036854775808.0) return 1;
+	if (r >= 9223372036854775808.0) return -1;
+	sqlite3_int64 y = (sqlite3_int64) r;
+	if (i != y) return i < y ? -1 : 1;
+	double d = (double) i;
+	return d < r ? -1 : d > r;
+}
+
+/* numbers sort before text, which sorts before blobs */
+
+static int type_rank(int type)
+{
+	switch (type) {
+	case SQLITE_TEXT: return 1;
+	case SQLITE_BLOB: return 2;
+	default: return 0;
+	}
+}
+
+/* Compares bound 'b', which has a value, to 'v', as SQLite does with the
+ * BINARY collation. */
+
+static int compare_bound(const struct bound *b, const struct value *v)
+{
+	if (SQLITE_INTEGER == b->type && SQLITE_INTEGER == v->type)
+		return b->integer < v->integer ? -1 : b->integer > v->integer;
+	int rank = type_rank(b->type), v_rank = type_rank(v->type);
+	if (rank != v_rank) return rank < v_rank ? -1 : 1;
+	if (rank > 0) {
+		size_t len = b->len < v->len ? b->len : v->len;
+		int cmp = 0 == len ? 0 : memcmp(b->bytes, v->bytes, len);
+		if (0 != cmp) return cmp;
+		return b->len < v->len ? -1 : b->len > v->len;
+	}
+	if (SQLITE_INTEGER == b->type)
+		return compare_int_real(b->integer, v->real);
+	if (SQLITE_INTEGER == v->type)
+		return -compare_int_real(v->integer, b->real);
+	return b->real < v->real ? -1 : b->real > v->real;
+}
+
+static void set_bound(struct bound *b, const struct value *v)
+{
+	b->type = v->type;
+	b->integer = v->integer;
+	b->real = v->real;
+	if (type_rank(v->type) > 0) {
+		if (v->len > b->size) {
+			/* on failure, the bound is just not updated */
+			char *bytes = realloc(b->bytes, v->len);
+			if (NULL == bytes) {
+				b->type = SQLITE_NULL;
+				return;
+			}
+			b->bytes = bytes;
+			b->size = v->len;
+		}
+		if (v->len > 0) memcpy(b->bytes, v->bytes, v->len);
+		b->len = v->len;
+	}
+}
+
+static void widen_bounds(struct column *c, const struct value *v)
+{
+	if (SQLITE_NULL == c->min.type) {
+		set_bound(&c->min, v);
+		set_bound(&c->max, v);
+	} else if (compare_bound(&c->min, v) > 0) {
+		set_bound(&c->min, v);
+	} else if (compare_bound(&c->max, v) < 0) {
+		set_bound(&c->max, v);
+	}
+	if (SQLITE_INTEGER == v->type || SQLITE_FLOAT == v->type)
+		c->numbers = true;
+}
+
+/* HyperLogLog: a value's hash picks a register, which keeps the largest
+ * number of leading zeros (plus one) of the rest of the hashes it got. */
+
+static uint64_t mix(uint64_t h)
+{
+	/* the finalizer of SplitMix64 */
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+	return h ^ (h >> 31);
+}
+
+static uint64_t hash_integer(sqlite3_int64 i)
+{
+	/* SplitMix64's increment keeps 0 from hashing to 0 */
+	return mix((uint64_t) i + 0x9e3779b97f4a7c15ULL);
+}
+
+/* Hashes 8 bytes at a time. */
+
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	h ^= len;
+	for (; len >= 8; p += 8, len -= 8) {
+		uint64_t word;
+		memcpy(&word, p, 8);
+		h = mix(h ^ word);
+	}
+	uint64_t tail = 0;
+	if (len > 0) memcpy(&tail, p, len);
+	return mix(h ^ tail);
+}
+
+static void add_hash(struct column *c, uint64_t h)
+{
+	uint64_t rest = h << SKETCH_BITS;
+	unsigned char rank = 0 == rest ? 64 - SKETCH_BITS + 1 :
+		__builtin_clzll(rest) + 1;
+	unsigned char *reg = &c->registers[h >> (64 - SKETCH_BITS)];
+	if (rank > *reg) *reg = rank;
+}
+
+/* Distinct values the sketch has seen: the harmonic mean of 2^register
+ * (scaled), or, while many registers are still 0, linear counting. */
+
+static sqlite3_int64 estimate_distinct(const unsigned char *registers)
+{
+	double sum = 0;
+	int zeros = 0;
+	for (int i = 0; i < NUM_REGISTERS; i++) {
+		sum += ldexp(1.0, -registers[i]);
+		if (0 == registers[i]) zeros++;
+	}
+	double m = NUM_REGISTERS;
+	double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+	if (estimate <= 2.5 * m && zeros > 0)
+		estimate = m * log(m / zeros);
+	return llround(estimate);
+}
+
+void column_stats_add_integer(column_stats_t *stats, int column,
+		sqlite3_int64 value)
+{
+	struct column *c = &stats->columns[column];
+	struct value v = { .type = SQLITE_INTEGER, .integer = value };
+	widen_bounds(c, &v);
+	add_hash(c, hash_integer(value));
+}
+
+void column_stats_add_real(column_stats_t *stats, int column, double value)
+{
+	/* SQLite stores NaN as NULL */
+	if (isnan(value)) {
+		column_stats_add_null(stats, column);
+		return;
+	}
+	struct column *c = &stats->columns[column];
+	struct value v = { .type = SQLITE_FLOAT, .real = value };
+	widen_bounds(c, &v);
+	/* a real equal to an integer is the same value */
+	if (value >= -9223372036854775808.0 && value < 9223372036854775808.0 &&
+			value == (double) (sqlite3_int64) value)
+		add_hash(c, hash_integer((sqlite3_int64) value));
+	else
+		add_hash(c, hash_bytes(0, &value, sizeof(double)));
+}
+
+void column_stats_add_text(column_stats_t *stats, int column,
+		const char *text, size_t len)
+{
+	struct column *c = &stats->columns[column];
+	struct value v = { .type = SQLITE_TEXT, .bytes = text, .len = len };
+	widen_bounds(c, &v);
+	add_hash(c, hash_bytes(14695981039346656037ULL, text, len));
+}
+
+void column_stats_add_blob(column_stats_t *stats, int column,
+		const void *blob, size_t len)
+{
+	struct column *c = &stats->columns[column];
+	struct value v = { .type = SQLITE_BLOB, .bytes = blob, .len = len };
+	widen_bounds(c, &v);
+	add_hash(c, hash_bytes(~14695981039346656037ULL, blob, len));
+}
+
+/* Sets 'v' to column 'col' of the current row of 'stmt'. Returns false if it
+ * is NULL. */
+
+static bool column_value(sqlite3_stmt *stmt, int col, struct value *v)
+{
+	v->type = sqlite3_column_type(stmt, col);
+	switch (v->type) {
+	case SQLITE_INTEGER:
+		v->integer = sqlite3_column_int64(stmt, col);
+		return true;
+	case SQLITE_FLOAT:
+		v->real = sqlite3_column_double(stmt, col);
+		return true;
+	case SQLITE_TEXT:
+	case SQLITE_BLOB:
+		v->bytes = SQLITE_TEXT == v->type ?
+			(const void *) sqlite3_column_text(stmt, col) :
+			sqlite3_column_blob(stmt, col);
+		v->len = sqlite3_column_bytes(stmt, col);
+		return true;
+	default:
+		return false;
+	}
+}
+
+static sqlite3_stmt *prepare(sqlite3 *db, char *sql)
+{
+	if (NULL == sql) return NULL;
+	sqlite3_stmt *stmt;
+	int ret = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	sqlite3_free(sql);
+	return SQLITE_OK == ret ? stmt : NULL;
+}
+
+static bool exec_free(sqlite3 *db, char *sql)
+{
+	if (NULL == sql) return false;
+	int ret = sqlite3_exec(db, sql, NULL, NULL, NULL);
+	sqlite3_free(sql);
+	return SQLITE_OK == ret;
+}
+
+bool read_column_stats(sqlite3 *db, const char *tbl_name,
+		column_stats_t *stats)
+{
+	sqlite3_stmt *stmt = prepare(db, sqlite3_mprintf(
+		"SELECT ti.cid, s.row_count, s.null_count, s.min_value, "
+		"s.max_value, k.registers "
+		"FROM pragma_table_info(%Q, 'main') AS ti "
+		"JOIN main." STATS_TABLE " AS s ON s.table_name = %Q "
+		"AND s.column_name = ti.name "
+		"JOIN main." STATS_SKETCH_TABLE " AS k ON k.table_name = %Q "
+		"AND k.column_name = ti.name", tbl_name, tbl_name, tbl_name));
+	if (NULL == stmt) return false;
+
+	int num_read = 0;
+	sqlite3_int64 rows = 0;
+	while (SQLITE_ROW == sqlite3_step(stmt)) {
+		int col = sqlite3_column_int(stmt, 0);
+		if (col >= stats->num_columns || NUM_REGISTERS !=
+				sqlite3_column_bytes(stmt, 5))
+			break;
+		struct column *c = &stats->columns[col];
+		rows = sqlite3_column_int64(stmt, 1);
+		c->nulls += sqlite3_column_int64(stmt, 2);
+		struct value v;
+		if (column_value(stmt, 3, &v)) widen_bounds(c, &v);
+		if (column_value(stmt, 4, &v)) widen_bounds(c, &v);
+		const unsigned char *registers = sqlite3_column_blob(stmt, 5);
+		for (int i = 0; i < NUM_REGISTERS; i++)
+			if (registers[i] > c->registers[i])
+				c->registers[i] = registers[i];
+		num_read++;
+	}
+	sqlite3_finalize(stmt);
+	stats->rows += rows;
+	return num_read == stats->num_columns;
+}
+
+/* SQLite's rule for TEXT affinity. */
+
+static bool is_text_type(const char *decl_type)
+{
+	return NULL != decl_type && NULL == strcasestr(decl_type, "INT") &&
+		(NULL != strcasestr(decl_type, "CHAR") ||
+		 NULL != strcasestr(decl_type, "CLOB") ||
+		 NULL != strcasestr(decl_type, "TEXT"));
+}
+
+static void bind_bound(sqlite3_stmt *stmt, int param, const struct bound *b)
+{
+	switch (b->type) {
+	case SQLITE_INTEGER:
+		sqlite3_bind_int64(stmt, param, b->integer);
+		break;
+	case SQLITE_FLOAT:
+		sqlite3_bind_double(stmt, param, b->real);
+		break;
+	case SQLITE_TEXT:
+		sqlite3_bind_text(stmt, param, b->bytes, b->len,
+				SQLITE_STATIC);
+		break;
+	case SQLITE_BLOB:
+		sqlite3_bind_blob(stmt, param, b->bytes, b->len,
+				SQLITE_STATIC);
+		break;
+	default:
+		sqlite3_bind_null(stmt, param);
+	}
+}
+
+static sqlite3_int64 distinct_values(const column_stats_t *stats, int col)
+{
+	const struct column *c = &stats->columns[col];
+	sqlite3_int64 values = stats->rows - c->nulls;
+	sqlite3_int64 distinct = estimate_distinct(c->registers);
+	if (distinct > values) distinct = values;
+	if (0 == distinct && values > 0) distinct = 1;
+	return distinct;
+}
+
+/* Stores the statistics of each column. Numbers in a column that has since
+ * become TEXT (see retype_table() in sqawk.c) have been converted, so the
+ * bounds of such a column are looked up. */
+
+static bool write_columns(sqlite3 *db, const char *tbl_name,
+		const column_stats_t *stats)
+{
+	sqlite3_stmt *columns = prepare(db, sqlite3_mprintf(
+		"SELECT cid, name, type FROM pragma_table_info(%Q, 'main')",
+		tbl_name));
+	sqlite3_stmt *insert = prepare(db, sqlite3_mprintf(
+		"INSERT INTO main." STATS_TABLE " VALUES "
+		"(%Q, ?1, %lld, ?2, ?3, ?4, ?5)", tbl_name,
+		(long long) stats->rows));
+	sqlite3_stmt *sketch = prepare(db, sqlite3_mprintf(
+		"INSERT INTO main." STATS_SKETCH_TABLE " VALUES (%Q, ?1, ?2)",
+		tbl_name));
+	bool ok = NULL != columns && NULL != insert && NULL != sketch;
+
+	while (ok && SQLITE_ROW == sqlite3_step(columns)) {
+		int col = sqlite3_column_int(columns, 0);
+		if (col >= stats->num_columns) continue;
+		const struct column *c = &stats->columns[col];
+		const char *name = (const char *)
+			sqlite3_column_text(columns, 1);
+		sqlite3_stmt *bounds = NULL;
+		if (c->numbers && is_text_type((const char *)
+					sqlite3_column_text(columns, 2))) {
+			bounds = prepare(db, sqlite3_mprintf(
+				"SELECT min(\"%w\"), max(\"%w\") FROM "
+				"main.\"%w\"", name, name, tbl_name));
+			ok = NULL != bounds &&
+				SQLITE_ROW == sqlite3_step(bounds);
+		}
+		if (! ok) break;
+
+		sqlite3_bind_text(insert, 1, name, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(insert, 2, c->nulls);
+		sqlite3_bind_int64(insert, 3, distinct_values(stats, col));
+		if (NULL != bounds) {
+			sqlite3_bind_value(insert, 4,
+					sqlite3_column_value(bounds, 0));
+			sqlite3_bind_value(insert, 5,
+					sqlite3_column_value(bounds, 1));
+		} else {
+			bind_bound(insert, 4, &c->min);
+			bind_bound(insert, 5, &c->max);
+		}
+		ok = SQLITE_DONE == sqlite3_step(insert);
+		sqlite3_reset(insert);
+		sqlite3_finalize(bounds);
+
+		sqlite3_bind_text(sketch, 1, name, -1, SQLITE_STATIC);
+		sqlite3_bind_blob(sketch, 2, c->registers, NUM_REGISTERS,
+				SQLITE_STATIC);
+		ok = ok && SQLITE_DONE == sqlite3_step(sketch);
+		sqlite3_reset(sketch);
+	}
+
+	sqlite3_finalize(columns);
+	sqlite3_finalize(insert);
+	sqlite3_finalize(sketch);
+	return ok;
+}
+
+/* Stores the sqlite_stat1 row of index 'idx': the table's rows, then the
+ * average rows per key of each prefix of the index's columns, as if the
+ * columns were independent, i.e. the distinct keys of a prefix were the
+ * product of the distinct values of its columns (NULL counting as one). An
+ * index on expressions is left out. */
+
+static bool write_index_stat(sqlite3 *db, const char *tbl_name,
+		const column_stats_t *stats, const char *idx, bool unique)
+{
+	sqlite3_stmt *stmt = prepare(db, sqlite3_mprintf(
+		"SELECT cid FROM pragma_index_info(%Q, 'main') ORDER BY seqno",
+		idx));
+	if (NULL == stmt) return false;
+
+	sqlite3_int64 rows = stats->rows > 0 ? stats->rows : 1;
+	sqlite3_str *stat = sqlite3_str_new(db);
+	sqlite3_str_appendf(stat, "%lld", (long long) rows);
+	double keys = 1;
+	bool ok = true;
+	while (ok && SQLITE_ROW == sqlite3_step(stmt)) {
+		int col = sqlite3_column_int(stmt, 0);
+		if (-1 == col) {
+			keys = rows;	/* the rowid */
+		} else if (col >= 0 && col < stats->num_columns) {
+			keys *= distinct_values(stats, col) +
+				(stats->columns[col].nulls > 0);
+		} else {
+			ok = false;
+			break;
+		}
+		if (keys > rows) keys = rows;
+		sqlite3_int64 per_key = keys < 1 ? rows : ceil(rows / keys);
+		sqlite3_str_appendf(stat, " %lld", (long long) per_key);
+	}
+	sqlite3_finalize(stmt);
+
+	char *stat_text = sqlite3_str_finish(stat);
+	if (ok && NULL != stat_text && unique) {
+		/* a unique index has one row per key of all its columns */
+		char *last = strrchr(stat_text, ' ');
+		if (NULL != last) strcpy(last, " 1");
+	}
+	bool written = ! ok || exec_free(db, sqlite3_mprintf(
+		"INSERT INTO main.sqlite_stat1 VALUES (%Q, %Q, %Q)", tbl_name,
+		idx, stat_text));
+	sqlite3_free(stat_text);
+	return written;
+}
+
+static bool write_stat1(sqlite3 *db, const char *tbl_name,
+		const column_stats_t *stats)
+{
+	sqlite3_int64 rows = stats->rows > 0 ? stats->rows : 1;
+	if (! exec_free(db, sqlite3_mprintf(
+			/* which creates sqlite_stat1 if need be */
+			"ANALYZE main.sqlite_schema; "
+			"DELETE FROM main.sqlite_stat1 WHERE tbl = %Q; "
+			"INSERT INTO main.sqlite_stat1 VALUES (%Q, NULL, "
+			"'%lld')", tbl_name, tbl_name, (long long) rows)))
+		return false;
+
+	sqlite3_stmt *stmt = prepare(db, sqlite3_mprintf(
+		"SELECT name, \"unique\" FROM pragma_index_list(%Q, 'main')",
+		tbl_name));
+	if (NULL == stmt) return false;
+	bool ok = true;
+	while (ok && SQLITE_ROW == sqlite3_step(stmt))
+		ok = write_index_stat(db, tbl_name, stats, (const char *)
+				sqlite3_column_text(stmt, 0),
+				sqlite3_column_int(stmt, 1));
+	sqlite3_finalize(stmt);
+	return ok;
+}
+
+bool write_column_stats(sqlite3 *db, const char *tbl_name,
+		const column_stats_t *stats, char **error)
+{
+	if (SQLITE_OK != sqlite3_exec(db, "SAVEPOINT column_stats", NULL,
+				NULL, error))
+		return false;
+	bool ok = exec_free(db, sqlite3_mprintf(
+			"CREATE TABLE IF NOT EXISTS main." STATS_TABLE
+			" (table_name TEXT, column_name TEXT, "
+			"row_count INTEGER, null_count INTEGER, "
+			"distinct_count INTEGER, min_value, max_value); "
+			"CREATE TABLE IF NOT EXISTS main." STATS_SKETCH_TABLE
+			" (table_name TEXT, column_name TEXT, registers BLOB); "
+			"DELETE FROM main." STATS_TABLE
+			" WHERE table_name = %Q; "
+			"DELETE FROM main." STATS_SKETCH_TABLE
+			" WHERE table_name = %Q", tbl_name, tbl_name)) &&
+		write_columns(db, tbl_name, stats) &&
+		write_stat1(db, tbl_name, stats) &&
+		/* which loads the statistics again */
+		SQLITE_OK == sqlite3_exec(db, "ANALYZE main.sqlite_schema",
+				NULL, NULL, NULL);
+	if (! ok) {
+		*error = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+		sqlite3_exec(db, "ROLLBACK TO column_stats; "
+				"RELEASE column_stats", NULL, NULL, NULL);
+		return false;
+	}
+	return SQLITE_OK == sqlite3_exec(db, "RELEASE column_stats", NULL,
+			NULL, error);
+}
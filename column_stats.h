@@ -0,0 +1,71 @@
+#ifndef COLUMN_STATS_H
+#define COLUMN_STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "sqlite3.h"
+
+/* Column statistics, gathered as a table is loaded, i.e. without another pass
+ * over its data as ANALYZE would take: the number of rows, and for each
+ * column its number of NULLs, an estimate of its number of distinct values,
+ * and its smallest and largest values, in SQLite's order (numbers, then text,
+ * then blobs).
+ * Distinct values are counted with a HyperLogLog sketch: a few KiB per column,
+ * whatever the number of rows, for an error of about 2%; small counts are
+ * about exact. The sketches are stored along with the statistics, so that
+ * those of rows added later (e.g. to a cached table) can be merged in.
+ *
+ * The statistics of a table are stored in its database:
+ * - in table STATS_TABLE, one row per column, for users to query;
+ * - in sqlite_stat1, as ANALYZE would store them, for SQLite's planner: the
+ *   rows per key of an index are estimated from the distinct values of its
+ *   columns. */
+
+#define STATS_TABLE "sqawk_stats"
+#define STATS_SKETCH_TABLE "sqawk_stats_sketch"
+
+typedef struct column_stats column_stats_t;
+
+column_stats_t *create_column_stats(int num_columns);
+
+void destroy_column_stats(column_stats_t *stats);
+
+/* Forgets all values, e.g. if the table is loaded again. */
+
+void clear_column_stats(column_stats_t *stats);
+
+/* A row is added by adding it, then each of its values. */
+
+void column_stats_add_row(column_stats_t *stats);
+
+void column_stats_add_null(column_stats_t *stats, int column);
+
+void column_stats_add_integer(column_stats_t *stats, int column,
+		sqlite3_int64 value);
+
+void column_stats_add_real(column_stats_t *stats, int column, double value);
+
+void column_stats_add_text(column_stats_t *stats, int column,
+		const char *text, size_t len);
+
+void column_stats_add_blob(column_stats_t *stats, int column,
+		const void *blob, size_t len);
+
+/* Adds the stored statistics of table 'tbl_name' of 'db' (in its main
+ * database) to 'stats'. Returns false if there are none (or not for all
+ * columns). */
+
+bool read_column_stats(sqlite3 *db, const char *tbl_name,
+		column_stats_t *stats);
+
+/* Stores 'stats' as the statistics of table 'tbl_name' of 'db' (in its main
+ * database), whose columns they are, in order, and tells SQLite's planner
+ * about them. Should be called once the table's indexes have been created.
+ * Returns false on failure, and sets *error to a message, to be freed with
+ * sqlite3_free(). */
+
+bool write_column_stats(sqlite3 *db, const char *tbl_name,
+		const column_stats_t *stats, char **error);
+
+#endif
@@ -0,0 +1,398 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include "csv_filter.h"
+#include "sql_token.h"
+
+/* The SQL is first split into tokens, then the tokens are matched against the
+ * shapes we know (see csv_filter.h). Anything unexpected means nothing (or,
+ * within a term, just that term) is pushed down. */
+
+/* Returns true iff the token is a name, i.e. a quoted identifier or a word
+ * that is not one of the keywords that may follow a table name. */
+
+static bool is_name(const struct sql_token *tok)
+{
+	static const char *const keywords[] = { "WHERE", "GROUP", "ORDER",
+		"LIMIT", "WINDOW", "JOIN", "NATURAL", "LEFT", "RIGHT", "FULL",
+		"INNER", "CROSS", "OUTER", "INDEXED", "NOT", "ON", "USING",
+		"AS", "HAVING", NULL };
+	if (SQL_QUOTED == tok->type) return true;
+	if (SQL_WORD != tok->type) return false;
+	for (int i = 0; NULL != keywords[i]; i++)
+		if (sql_is_keyword(tok, keywords[i])) return false;
+	return true;
+}
+
+/* Returns the column that tokens [*t, end) start with, and moves *t past it;
+ * or returns -1. The column may be qualified by the table's name or alias. */
+
+static int column_at(const struct sql_token *tok, int *t, int end,
+		const char *tbl_name, const char *alias, char **col_names,
+		int num_cols)
+{
+	int i = *t;
+	if (i + 2 < end && sql_is_op(&tok[i+1], ".")) {
+		if (! sql_name_is(&tok[i], tbl_name) &&
+				! (NULL != alias &&
+					sql_name_is(&tok[i], alias)))
+			return -1;
+		i += 2;
+	}
+	if (i >= end) return -1;
+	for (int c = 0; c < num_cols; c++)
+		if (NULL != col_names[c] &&
+				sql_name_is(&tok[i], col_names[c])) {
+			*t = i + 1;
+			return c;
+		}
+	return -1;
+}
+
+/* Reads the literal that tokens [*t, end) start with into *lit, and moves *t
+ * past it. Returns false if there is none. */
+
+static bool literal_at(const struct sql_token *tok, int *t, int end,
+		struct csv_filter_literal *lit)
+{
+	int i = *t;
+	lit->text = NULL;
+	if (i < end && SQL_STRING == tok[i].type) {
+		lit->type = CSV_FILTER_TEXT;
+		lit->len = strlen(tok[i].text);
+		lit->text = strdup(tok[i].text);
+		*t = i + 1;
+		return NULL != lit->text;
+	}
+
+	bool negative = false;
+	if (i < end && (sql_is_op(&tok[i], "-") || sql_is_op(&tok[i], "+"))) {
+		negative = sql_is_op(&tok[i], "-");
+		i++;
+	}
+	if (i >= end || SQL_NUMBER != tok[i].type) return false;
+	char buf[64];
+	if (tok[i].len >= sizeof(buf)) return false;
+	memcpy(buf, tok[i].start, tok[i].len);
+	buf[tok[i].len] = '\0';
+	if (NULL != strpbrk(buf, "xX")) return false;	/* hex */
+
+	char *rest;
+	errno = 0;
+	if (NULL == strpbrk(buf, ".eE")) {
+		long long ll = strtoll(buf, &rest, 10);
+		if ('\0' == *rest && 0 == errno) {
+			lit->type = CSV_FILTER_INTEGER;
+			lit->integer = negative ? -ll : ll;
+			*t = i + 1;
+			return true;
+		}
+	}
+	/* a real, or an integer too big to be one */
+	errno = 0;
+	double d = strtod(buf, &rest);
+	if ('\0' != *rest || 0 != errno) return false;
+	lit->type = CSV_FILTER_REAL;
+	lit->real = negative ? -d : d;
+	*t = i + 1;
+	return true;
+}
+
+/* Sets *op to the comparison 'tok' stands for (seen from the other side if
+ * 'swapped'), and returns true; or returns false. */
+
+static bool comparison_op(const struct sql_token *tok, bool swapped,
+		enum csv_filter_op *op)
+{
+	static const struct { const char *op; enum csv_filter_op fop, swapped; }
+	ops[] = {
+		{ "=", CSV_FILTER_EQ, CSV_FILTER_EQ },
+		{ "==", CSV_FILTER_EQ, CSV_FILTER_EQ },
+		{ "!=", CSV_FILTER_NE, CSV_FILTER_NE },
+		{ "<>", CSV_FILTER_NE, CSV_FILTER_NE },
+		{ "<", CSV_FILTER_LT, CSV_FILTER_GT },
+		{ "<=", CSV_FILTER_LE, CSV_FILTER_GE },
+		{ ">", CSV_FILTER_GT, CSV_FILTER_LT },
+		{ ">=", CSV_FILTER_GE, CSV_FILTER_LE },
+		{ NULL, 0, 0 }
+	};
+	for (int i = 0; NULL != ops[i].op; i++)
+		if (sql_is_op(tok, ops[i].op)) {
+			*op = swapped ? ops[i].swapped : ops[i].fop;
+			return true;
+		}
+	return false;
+}
+
+static void free_term(struct csv_filter_term *term)
+{
+	for (int i = 0; i < term->num_values; i++)
+		free(term->values[i].text);
+	free(term->values);
+	free(term->sql);
+}
+
+static bool add_value(struct csv_filter_term *term,
+		const struct csv_filter_literal *lit)
+{
+	struct csv_filter_literal *values = realloc(term->values,
+			(term->num_values + 1) * sizeof(*values));
+	if (NULL == values) return false;
+	term->values = values;
+	values[term->num_values++] = *lit;
+	return true;
+}
+
+/* Parses tokens [start, end) as one of the terms we know, and appends the
+ * term(s) to 'filter'. BETWEEN makes two terms. */
+
+static void parse_term(const struct sql_token *tok, int start, int end,
+		const char *tbl_name, const char *alias, char **col_names,
+		int num_cols, csv_filter_t *filter)
+{
+	struct csv_filter_term term[2];
+	memset(term, 0, sizeof(term));
+	int num_terms = 1;
+	struct csv_filter_literal lit = { 0 };
+	int t = start;
+
+	int col = column_at(tok, &t, end, tbl_name, alias, col_names,
+			num_cols);
+	if (-1 == col) {
+		/* lit op col */
+		if (! literal_at(tok, &t, end, &lit)) return;
+		if (t + 1 >= end || ! comparison_op(&tok[t++], true,
+					&term[0].op)) {
+			free(lit.text);
+			return;
+		}
+		col = column_at(tok, &t, end, tbl_name, alias, col_names,
+				num_cols);
+		if (-1 == col || ! add_value(&term[0], &lit)) {
+			free(lit.text);
+			return;
+		}
+	} else if (t + 1 == end && (sql_is_keyword(&tok[t], "ISNULL") ||
+				sql_is_keyword(&tok[t], "NOTNULL"))) {
+		term[0].op = sql_is_keyword(&tok[t++], "ISNULL") ?
+			CSV_FILTER_IS_NULL : CSV_FILTER_NOT_NULL;
+	} else if (t < end && sql_is_keyword(&tok[t], "IS")) {
+		t++;
+		term[0].op = CSV_FILTER_IS_NULL;
+		if (t < end && sql_is_keyword(&tok[t], "NOT")) {
+			term[0].op = CSV_FILTER_NOT_NULL;
+			t++;
+		}
+		if (t >= end || ! sql_is_keyword(&tok[t++], "NULL")) return;
+	} else if (t < end && sql_is_keyword(&tok[t], "BETWEEN")) {
+		t++;
+		num_terms = 2;
+		term[0].op = CSV_FILTER_GE;
+		term[1].op = CSV_FILTER_LE;
+		if (! literal_at(tok, &t, end, &lit)) return;
+		if (! add_value(&term[0], &lit)) {
+			free(lit.text);
+			return;
+		}
+		if (t >= end || ! sql_is_keyword(&tok[t++], "AND") ||
+				! literal_at(tok, &t, end, &lit)) {
+			free_term(&term[0]);
+			return;
+		}
+		if (! add_value(&term[1], &lit)) {
+			free(lit.text);
+			free_term(&term[0]);
+			return;
+		}
+	} else if (t < end && sql_is_keyword(&tok[t], "IN")) {
+		t++;
+		term[0].op = CSV_FILTER_IN;
+		if (t >= end || ! sql_is_op(&tok[t++], "(")) return;
+		while (true) {
+			if (! literal_at(tok, &t, end, &lit) ||
+					! add_value(&term[0], &lit)) {
+				free(lit.text);
+				free_term(&term[0]);
+				return;
+			}
+			if (t < end && sql_is_op(&tok[t], ",")) {
+				t++;
+				continue;
+			}
+			if (t < end && sql_is_op(&tok[t], ")")) {
+				t++;
+				break;
+			}
+			free_term(&term[0]);
+			return;
+		}
+	} else {
+		/* col op lit */
+		if (t >= end || ! comparison_op(&tok[t++], false,
+					&term[0].op))
+			return;
+		if (! literal_at(tok, &t, end, &lit)) return;
+		if (! add_value(&term[0], &lit)) {
+			free(lit.text);
+			return;
+		}
+	}
+	if (t != end) {
+		free_term(&term[0]);
+		free_term(&term[1]);
+		return;
+	}
+
+	const char *sql = tok[start].start;
+	size_t sql_len = tok[end-1].start + tok[end-1].len - sql;
+	struct csv_filter_term *terms = realloc(filter->terms,
+			(filter->num_terms + num_terms) * sizeof(*terms));
+	if (NULL == terms) {
+		free_term(&term[0]);
+		free_term(&term[1]);
+		return;
+	}
+	filter->terms = terms;
+	for (int i = 0; i < num_terms; i++) {
+		term[i].col = col;
+		term[i].sql = strndup(sql, sql_len);
+		filter->terms[filter->num_terms++] = term[i];
+	}
+}
+
+/* Checks that the query has the shape we can handle, and returns the index of
+ * its first WHERE token (or -1), setting *alias to the table's alias, if
+ * any. */
+
+static int find_where(const sql_tokens_t *toks, const char *tbl_name,
+		const char **alias_start, size_t *alias_len)
+{
+	static const char *const forbidden[] = { "WITH", "UNION", "INTERSECT",
+		"EXCEPT", "JOIN", "VALUES", "ROWID", "OID", "_ROWID_", NULL };
+	const struct sql_token *tok = toks->tok;
+	int num_selects = 0, from = -1, depth = 0;
+
+	for (int i = 0; i < toks->num; i++) {
+		if (sql_is_keyword(&tok[i], "SELECT")) num_selects++;
+		for (int k = 0; NULL != forbidden[k]; k++)
+			if (sql_name_is(&tok[i], forbidden[k])) return -1;
+		if (sql_is_op(&tok[i], "(")) depth++;
+		if (sql_is_op(&tok[i], ")")) depth--;
+		if (-1 == from && 0 == depth && sql_is_keyword(&tok[i], "FROM"))
+			from = i;
+	}
+	if (1 != num_selects || ! sql_is_keyword(&tok[0], "SELECT") ||
+			-1 == from)
+		return -1;
+
+	int t = from + 1;
+	if (t >= toks->num || ! sql_name_is(&tok[t], tbl_name)) return -1;
+	t++;
+	*alias_start = NULL;
+	if (t < toks->num && sql_is_keyword(&tok[t], "AS")) t++;
+	if (t < toks->num && is_name(&tok[t])) {
+		*alias_start = SQL_QUOTED == tok[t].type ? tok[t].text :
+			tok[t].start;
+		*alias_len = SQL_QUOTED == tok[t].type ? strlen(tok[t].text) :
+			tok[t].len;
+		t++;
+	}
+	if (t >= toks->num || ! sql_is_keyword(&tok[t], "WHERE")) return -1;
+	return t;
+}
+
+csv_filter_t *csv_filter_find(const char *sql, const char *tbl_name,
+		char **col_names, int num_cols)
+{
+	sql_tokens_t toks;
+	if (! sql_tokenize(sql, &toks)) {
+		sql_free_tokens(&toks);
+		return NULL;
+	}
+
+	const char *alias_start;
+	size_t alias_len;
+	int where = find_where(&toks, tbl_name, &alias_start, &alias_len);
+	if (-1 == where) {
+		sql_free_tokens(&toks);
+		return NULL;
+	}
+	char *alias = NULL == alias_start ? NULL :
+		strndup(alias_start, alias_len);
+
+	/* The clause ends at the end of the statement, or at the first
+	 * clause that may follow WHERE; it must have no OR outside
+	 * parentheses (CASE ... END counts as parentheses). */
+	const struct sql_token *tok = toks.tok;
+	int end, depth = 0;
+	for (end = where + 1; end < toks.num; end++) {
+		if (sql_is_op(&tok[end], "(") ||
+				sql_is_keyword(&tok[end], "CASE"))
+			depth++;
+		else if (sql_is_op(&tok[end], ")") ||
+				sql_is_keyword(&tok[end], "END"))
+			depth--;
+		else if (0 == depth && (sql_is_op(&tok[end], ";") ||
+				sql_is_keyword(&tok[end], "GROUP") ||
+				sql_is_keyword(&tok[end], "ORDER") ||
+				sql_is_keyword(&tok[end], "LIMIT") ||
+				sql_is_keyword(&tok[end], "WINDOW")))
+			break;
+		else if (0 == depth && sql_is_keyword(&tok[end], "OR"))
+			depth = -1;
+		if (depth < 0) break;
+	}
+
+	csv_filter_t *filter = calloc(1, sizeof(csv_filter_t));
+	if (depth >= 0 && NULL != filter) {
+		/* Splits the clause at the ANDs outside parentheses, except
+		 * those of BETWEEN */
+		int start = where + 1;
+		bool between = false;
+		depth = 0;
+		for (int t = start; t <= end; t++) {
+			if (t == end || (0 == depth &&
+					sql_is_keyword(&tok[t], "AND") &&
+					! between)) {
+				if (t > start)
+					parse_term(tok, start, t, tbl_name,
+						alias, col_names, num_cols,
+						filter);
+				start = t + 1;
+				continue;
+			}
+			if (sql_is_op(&tok[t], "(") ||
+					sql_is_keyword(&tok[t], "CASE"))
+				depth++;
+			else if (sql_is_op(&tok[t], ")") ||
+					sql_is_keyword(&tok[t], "END"))
+				depth--;
+			else if (0 == depth &&
+					sql_is_keyword(&tok[t], "BETWEEN"))
+				between = true;
+			else if (0 == depth && sql_is_keyword(&tok[t], "AND"))
+				between = false;
+		}
+	}
+
+	free(alias);
+	sql_free_tokens(&toks);
+	if (NULL != filter && 0 == filter->num_terms) {
+		csv_filter_free(filter);
+		return NULL;
+	}
+	return filter;
+}
+
+void csv_filter_free(csv_filter_t *filter)
+{
+	if (NULL == filter) return;
+	for (int i = 0; i < filter->num_terms; i++)
+		free_term(&filter->terms[i]);
+	free(filter->terms);
+	free(filter);
+}
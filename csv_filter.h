@@ -0,0 +1,63 @@
+#ifndef CSV_FILTER_H
+#define CSV_FILTER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Predicate pushdown: finding, in the user's SQL, simple conditions that all
+ * the rows of a table must meet, so that rows that don't can be dropped while
+ * the file is read, rather than stored and then filtered out by the query.
+ *
+ * This is done by looking at the SQL's tokens, and only for a query of the
+ * simplest shape: a single SELECT (no subquery, compound, CTE nor join) from
+ * just the table, that doesn't use rowids (which dropping rows changes). Its
+ * WHERE clause must be a conjunction (there must be no OR outside
+ * parentheses); of its terms, those of the following forms are taken, where
+ * 'col' is a column of the table and 'lit' a number or string literal:
+ *
+ *	col = lit, col == lit, col != lit, col <> lit, col < lit, col <= lit,
+ *	col > lit, col >= lit (or the other way round),
+ *	col BETWEEN lit AND lit, col IN (lit, ...),
+ *	col IS NULL, col ISNULL, col IS NOT NULL, col NOTNULL.
+ *
+ * Other terms are just ignored: as the query keeps its WHERE clause, the
+ * filter only needs to let through every row the query may want. */
+
+enum csv_filter_op { CSV_FILTER_EQ, CSV_FILTER_NE, CSV_FILTER_LT,
+	CSV_FILTER_LE, CSV_FILTER_GT, CSV_FILTER_GE, CSV_FILTER_IN,
+	CSV_FILTER_IS_NULL, CSV_FILTER_NOT_NULL };
+
+enum csv_filter_literal_type { CSV_FILTER_INTEGER, CSV_FILTER_REAL,
+	CSV_FILTER_TEXT };
+
+struct csv_filter_literal {
+	enum csv_filter_literal_type type;
+	int64_t integer;
+	double real;
+	char *text;
+	size_t len;
+};
+
+struct csv_filter_term {
+	int col;	/* numbered from 0 */
+	enum csv_filter_op op;
+	int num_values;	/* 1, or more for IN, 0 for IS [NOT] NULL */
+	struct csv_filter_literal *values;
+	char *sql;	/* the term, for messages */
+};
+
+typedef struct csv_filter {
+	int num_terms;
+	struct csv_filter_term *terms;
+} csv_filter_t;
+
+/* Returns the terms of 'sql''s WHERE clause that apply to table 'tbl_name',
+ * whose columns are 'col_names' (as SQLite has them, i.e. unquoted), or NULL
+ * if there are none. Names are compared without regard to (ASCII) case. */
+
+csv_filter_t *csv_filter_find(const char *sql, const char *tbl_name,
+		char **col_names, int num_cols);
+
+void csv_filter_free(csv_filter_t *);
+
+#endif
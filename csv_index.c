@@ -0,0 +1,337 @@
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "csv_index.h"
+#include "buffered_CSV.h"
+#include "csv_number.h"
+
+/* The sidecar holds a header, then the indexed columns (int32_t), then the
+ * block offsets (uint64_t), then the min and max of each indexed column in
+ * each block (double, block-major). Everything is in native byte order; the
+ * magic also tells whether that is ours. */
+
+#define INDEX_MAGIC 0x58444957415153ULL	/* "SQAWIDX" */
+#define INDEX_VERSION 1
+
+struct index_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t rows_per_block;
+	uint64_t file_size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int32_t separator;
+	int32_t flags;
+	uint32_t re_hash;
+	uint32_t num_cols;
+	uint64_t num_blocks;
+};
+
+struct csv_index {
+	char *filename;
+	struct index_header hdr;
+	int32_t *cols;
+	uint64_t *offsets;
+	double *bounds;	/* [block][col][min, max] */
+};
+
+static uint32_t hash_string(const char *s)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261u;
+	for (; NULL != s && '\0' != *s; s++)
+		h = (h ^ (unsigned char) *s) * 16777619u;
+	return h;
+}
+
+static bool parse_number(const buf_csv_field_t *fld, double *value)
+{
+	int64_t integer;
+	switch (csv_number(fld, &integer, value)) {
+	case CSV_INTEGER:
+		*value = integer;
+		return true;
+	case CSV_REAL:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void free_index(csv_index_t *index)
+{
+	free(index->filename);
+	free(index->cols);
+	free(index->offsets);
+	free(index->bounds);
+	free(index);
+}
+
+static char *sidecar_name(const char *filename)
+{
+	char *name;
+	if (-1 == asprintf(&name, "%s%s", filename, CSV_INDEX_SUFFIX))
+		return NULL;
+	return name;
+}
+
+static bool stat_matches(const struct index_header *hdr, const struct stat *st)
+{
+	return hdr->file_size == (uint64_t) st->st_size &&
+		hdr->mtime_sec == st->st_mtim.tv_sec &&
+		hdr->mtime_nsec == st->st_mtim.tv_nsec;
+}
+
+/* Reads the whole file, noting each block's offset and bounds. Values that
+ * are not numbers compare greater than any number, so they make a block's
+ * max infinite. */
+
+static bool build_index(csv_index_t *index, char separator, int flags,
+		const char *first_line_re)
+{
+	FILE *csv = fopen(index->filename, "r");
+	if (NULL == csv) return false;
+	buffered_CSV_t *buf_csv = create_buffered_CSV(csv, separator,
+			(char *) first_line_re, flags);
+	if (NULL == buf_csv) {
+		fclose(csv);
+		return false;
+	}
+	if (-1 == buf_csv_tell(buf_csv)) {
+		destroy_buffered_CSV(buf_csv);
+		return false;
+	}
+
+	int num_fields = buf_csv_field_count(buf_csv);
+	int num_cols = index->hdr.num_cols;
+	for (int c = 0; c < num_cols; c++)
+		if (index->cols[c] < 0 || index->cols[c] >= num_fields) {
+			destroy_buffered_CSV(buf_csv);
+			return false;
+		}
+
+	buf_csv_field_t *fields = malloc(num_fields * sizeof(buf_csv_field_t));
+	if (NULL == fields) {
+		destroy_buffered_CSV(buf_csv);
+		return false;
+	}
+
+	size_t max_blocks = 0;
+	uint64_t num_blocks = 0;
+	bool ok = true;
+	off_t offset = buf_csv_tell(buf_csv);
+	bool more = -1 != buf_csv_next_data_line_slices(buf_csv, fields);
+	while (ok && more) {
+		if (num_blocks == max_blocks) {
+			max_blocks = 0 == max_blocks ? 64 : 2 * max_blocks;
+			uint64_t *offsets = realloc(index->offsets,
+					max_blocks * sizeof(uint64_t));
+			if (NULL != offsets) index->offsets = offsets;
+			double *bounds = realloc(index->bounds, max_blocks *
+					num_cols * 2 * sizeof(double));
+			if (NULL != bounds) index->bounds = bounds;
+			if (NULL == offsets || NULL == bounds) {
+				ok = false;
+				break;
+			}
+		}
+		index->offsets[num_blocks] = offset;
+		double *bounds = index->bounds + num_blocks * num_cols * 2;
+		for (int c = 0; c < num_cols; c++) {
+			bounds[2*c] = INFINITY;
+			bounds[2*c + 1] = -INFINITY;
+		}
+		num_blocks++;
+
+		/* As when importing, a short line ends the data. */
+		for (uint32_t row = 0; more && row < index->hdr.rows_per_block;
+				row++) {
+			for (int c = 0; c < num_cols; c++) {
+				double value;
+				if (! parse_number(&fields[index->cols[c]],
+							&value))
+					value = INFINITY;
+				if (value < bounds[2*c])
+					bounds[2*c] = value;
+				if (value > bounds[2*c + 1])
+					bounds[2*c + 1] = value;
+			}
+			offset = buf_csv_tell(buf_csv);
+			more = -1 != buf_csv_next_data_line_slices(buf_csv,
+					fields);
+		}
+	}
+	index->hdr.num_blocks = num_blocks;
+
+	/* Doubles can't hold all int64 values, so widen the bounds by one
+	 * unit in the last place. */
+	for (uint64_t i = 0; i < num_blocks * num_cols * 2; i += 2) {
+		index->bounds[i] = nextafter(index->bounds[i], -INFINITY);
+		index->bounds[i+1] = nextafter(index->bounds[i+1], INFINITY);
+	}
+
+	free(fields);
+	destroy_buffered_CSV(buf_csv);
+	return ok;
+}
+
+static bool read_index(csv_index_t *index, const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (NULL == f) return false;
+
+	struct index_header hdr;
+	bool ok = 1 == fread(&hdr, sizeof(hdr), 1, f) &&
+		INDEX_MAGIC == hdr.magic && INDEX_VERSION == hdr.version &&
+		0 == memcmp(&hdr, &index->hdr,
+			offsetof(struct index_header, num_blocks));
+	if (ok) {
+		int32_t cols[hdr.num_cols];
+		ok = hdr.num_cols == fread(cols, sizeof(int32_t), hdr.num_cols,
+				f) && 0 == memcmp(cols, index->cols,
+				sizeof(cols));
+	}
+	if (ok) {
+		uint64_t n = hdr.num_blocks;
+		index->offsets = malloc(n * sizeof(uint64_t));
+		index->bounds = malloc(n * hdr.num_cols * 2 * sizeof(double));
+		ok = NULL != index->offsets && NULL != index->bounds &&
+			n == fread(index->offsets, sizeof(uint64_t), n, f) &&
+			n * hdr.num_cols * 2 == fread(index->bounds,
+				sizeof(double), n * hdr.num_cols * 2, f);
+		index->hdr.num_blocks = n;
+	}
+
+	fclose(f);
+	return ok;
+}
+
+/* Writes to a temporary file, then renames it, so that a reader never sees a
+ * partial index. */
+
+static void write_index(csv_index_t *index, const char *path)
+{
+	char *tmp_path;
+	if (-1 == asprintf(&tmp_path, "%s.%d", path, (int) getpid())) return;
+
+	FILE *f = fopen(tmp_path, "w");
+	if (NULL == f) {
+		free(tmp_path);
+		return;
+	}
+	uint64_t n = index->hdr.num_blocks;
+	uint32_t num_cols = index->hdr.num_cols;
+	bool ok = 1 == fwrite(&index->hdr, sizeof(index->hdr), 1, f) &&
+		num_cols == fwrite(index->cols, sizeof(int32_t), num_cols, f) &&
+		n == fwrite(index->offsets, sizeof(uint64_t), n, f) &&
+		n * num_cols * 2 == fwrite(index->bounds, sizeof(double),
+				n * num_cols * 2, f);
+	ok = (0 == fclose(f)) && ok;
+
+	if (! ok || 0 != rename(tmp_path, path))
+		unlink(tmp_path);
+	free(tmp_path);
+}
+
+csv_index_t *csv_index_open(const char *filename, char separator, int flags,
+		const char *first_line_re, int num_cols, const int *cols)
+{
+	struct stat st;
+	if (-1 == stat(filename, &st) || ! S_ISREG(st.st_mode)) return NULL;
+
+	csv_index_t *index = calloc(1, sizeof(csv_index_t));
+	if (NULL == index) return NULL;
+	index->filename = strdup(filename);
+	index->cols = malloc(num_cols * sizeof(int32_t));
+	if (NULL == index->filename || NULL == index->cols) {
+		free_index(index);
+		return NULL;
+	}
+	for (int c = 0; c < num_cols; c++)
+		index->cols[c] = cols[c];
+
+	/* Everything that must match for the sidecar to be valid */
+	struct index_header *hdr = &index->hdr;
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = INDEX_MAGIC;
+	hdr->version = INDEX_VERSION;
+	hdr->rows_per_block = CSV_INDEX_BLOCK_ROWS;
+	hdr->file_size = st.st_size;
+	hdr->mtime_sec = st.st_mtim.tv_sec;
+	hdr->mtime_nsec = st.st_mtim.tv_nsec;
+	hdr->separator = separator;
+	hdr->flags = flags;
+	hdr->re_hash = hash_string(first_line_re);
+	hdr->num_cols = num_cols;
+
+	char *path = sidecar_name(filename);
+	if (NULL == path) {
+		free_index(index);
+		return NULL;
+	}
+
+	if (! read_index(index, path)) {
+		free(index->offsets);
+		free(index->bounds);
+		index->offsets = NULL;
+		index->bounds = NULL;
+		if (! build_index(index, separator, flags, first_line_re)) {
+			free(path);
+			free_index(index);
+			return NULL;
+		}
+		write_index(index, path);
+	}
+
+	free(path);
+	return index;
+}
+
+bool csv_index_is_current(csv_index_t *index)
+{
+	struct stat st;
+	return 0 == stat(index->filename, &st) && stat_matches(&index->hdr, &st);
+}
+
+long csv_index_num_blocks(csv_index_t *index)
+{
+	return index->hdr.num_blocks;
+}
+
+off_t csv_index_block_offset(csv_index_t *index, long block)
+{
+	return index->offsets[block];
+}
+
+bool csv_index_block_may_match(csv_index_t *index, long block, int col,
+		enum csv_index_op op, double value)
+{
+	uint32_t c;
+	for (c = 0; c < index->hdr.num_cols; c++)
+		if (index->cols[c] == col) break;
+	if (c == index->hdr.num_cols || isnan(value)) return true;
+
+	double *bounds = index->bounds + (block * index->hdr.num_cols + c) * 2;
+	double min = bounds[0], max = bounds[1];
+	switch (op) {
+	case CSV_INDEX_EQ: return min <= value && value <= max;
+	case CSV_INDEX_LT: return min < value;
+	case CSV_INDEX_LE: return min <= value;
+	case CSV_INDEX_GT: return max > value;
+	case CSV_INDEX_GE: return max >= value;
+	}
+	return true;
+}
+
+void csv_index_close(csv_index_t *index)
+{
+	free_index(index);
+}
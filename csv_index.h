@@ -0,0 +1,53 @@
+#ifndef CSV_INDEX_H
+#define CSV_INDEX_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* A sparse index of a CSV file, for reading only the parts of it that may
+ * hold the rows a query wants. The data lines are grouped in blocks of
+ * CSV_INDEX_BLOCK_ROWS, and for each block the index has the offset of its
+ * first line, and the minimum and maximum numeric values of some columns.
+ *
+ * The index is kept in a sidecar file (the CSV file's name plus
+ * CSV_INDEX_SUFFIX), and rebuilt whenever it no longer matches the file (size
+ * or modification time), the way it is read (separator, flags, first-line
+ * regexp), or the columns asked for. If the sidecar can't be written, the
+ * index is just kept in memory. Only mmap()able files can be indexed. */
+
+#define CSV_INDEX_SUFFIX ".sqawkidx"
+#define CSV_INDEX_BLOCK_ROWS 1024
+
+enum csv_index_op { CSV_INDEX_EQ, CSV_INDEX_LT, CSV_INDEX_LE, CSV_INDEX_GT,
+	CSV_INDEX_GE };
+
+struct csv_index;
+typedef struct csv_index csv_index_t;
+
+/* Returns the index of 'filename' on fields 'cols' (numbered from 0), which
+ * is read as per the other parameters (see create_buffered_CSV()). Returns
+ * NULL if the file can't be indexed. */
+
+csv_index_t *csv_index_open(const char *filename, char separator, int flags,
+		const char *first_line_re, int num_cols, const int *cols);
+
+/* Returns true iff the file has not changed since the index was built. */
+
+bool csv_index_is_current(csv_index_t *);
+
+long csv_index_num_blocks(csv_index_t *);
+
+/* The offset of the first line of block 'block' (see buf_csv_seek()). */
+
+off_t csv_index_block_offset(csv_index_t *, long block);
+
+/* Returns false if no row of block 'block' can satisfy "field 'col' 'op'
+ * 'value'" when compared as NUMERIC, true otherwise (including if 'col' is
+ * not indexed). */
+
+bool csv_index_block_may_match(csv_index_t *, long block, int col,
+		enum csv_index_op op, double value);
+
+void csv_index_close(csv_index_t *);
+
+#endif
@@ -0,0 +1,127 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include "csv_number.h"
+
+/* Longest number we bother parsing: anything longer is text. */
+#define MAX_NUMBER_LEN 63
+
+/* Up to this many digits always fit in an int64_t. */
+#define SAFE_DIGITS 18
+
+static bool is_space(char c)
+{
+	return ' ' == c || '\t' == c || '\n' == c || '\r' == c || '\f' == c ||
+		'\v' == c;
+}
+
+/* Skips the digits at 's', counting them in *num_digits. */
+
+static const char *skip_digits(const char *s, const char *end, int *num_digits)
+{
+	for (; s < end && *s >= '0' && *s <= '9'; s++)
+		(*num_digits)++;
+	return s;
+}
+
+/* Checks the syntax of the (trimmed) number in [s, end): CSV_INTEGER for
+ * digits with an optional sign (however many there are, see *int_digits),
+ * CSV_REAL if there is a fractional part or an exponent. */
+
+static enum csv_number_type classify(const char *s, const char *end,
+		int *int_digits)
+{
+	if (s < end && ('-' == *s || '+' == *s)) s++;
+
+	int frac_digits = 0, exp_digits = 0;
+	bool fraction = false;
+	*int_digits = 0;
+	s = skip_digits(s, end, int_digits);
+	if (s < end && '.' == *s) {
+		fraction = true;
+		s = skip_digits(s + 1, end, &frac_digits);
+	}
+	if (0 == *int_digits + frac_digits) return CSV_NOT_A_NUMBER;
+	if (s < end && ('e' == *s || 'E' == *s)) {
+		fraction = true;
+		s++;
+		if (s < end && ('-' == *s || '+' == *s)) s++;
+		s = skip_digits(s, end, &exp_digits);
+		if (0 == exp_digits) return CSV_NOT_A_NUMBER;
+	}
+	if (s != end) return CSV_NOT_A_NUMBER;
+
+	return fraction ? CSV_REAL : CSV_INTEGER;
+}
+
+enum csv_number_type csv_number_class(const buf_csv_field_t *field)
+{
+	const char *s = field->start, *end = field->start + field->len;
+	while (s < end && is_space(*s)) s++;
+	while (end > s && is_space(end[-1])) end--;
+	if (s == end || end - s > MAX_NUMBER_LEN) return CSV_NOT_A_NUMBER;
+
+	int int_digits;
+	enum csv_number_type type = classify(s, end, &int_digits);
+	if (CSV_INTEGER == type && int_digits > SAFE_DIGITS) {
+		/* may not fit */
+		int64_t integer;
+		double real;
+		return csv_number(field, &integer, &real);
+	}
+	return type;
+}
+
+enum csv_number_type csv_number(const buf_csv_field_t *field, int64_t *integer,
+		double *real)
+{
+	const char *s = field->start, *end = field->start + field->len;
+	while (s < end && is_space(*s)) s++;
+	while (end > s && is_space(end[-1])) end--;
+	size_t len = end - s;
+	if (0 == len || len > MAX_NUMBER_LEN) return CSV_NOT_A_NUMBER;
+
+	/* Fast path: the common short integer */
+	const char *p = s;
+	bool negative = '-' == *p;
+	if ('-' == *p || '+' == *p) p++;
+	if (p < end && end - p <= SAFE_DIGITS) {
+		int64_t value = 0;
+		const char *d;
+		for (d = p; d < end && *d >= '0' && *d <= '9'; d++)
+			value = 10 * value + (*d - '0');
+		if (d == end) {
+			*integer = negative ? -value : value;
+			return CSV_INTEGER;
+		}
+	}
+
+	int int_digits;
+	enum csv_number_type type = classify(s, end, &int_digits);
+	if (CSV_NOT_A_NUMBER == type) return CSV_NOT_A_NUMBER;
+
+	char buf[MAX_NUMBER_LEN + 1];
+	memcpy(buf, s, len);
+	buf[len] = '\0';
+	char *rest;
+
+	if (CSV_INTEGER == type) {
+		errno = 0;
+		long long ll = strtoll(buf, &rest, 10);
+		if (0 == errno) {
+			*integer = ll;
+			return CSV_INTEGER;
+		}
+	}
+
+	double d = strtod(buf, &rest);
+	/* e.g. "3.0", which NUMERIC stores as 3 */
+	if (d > -9.2e18 && d < 9.2e18 && d == (double) (int64_t) d) {
+		*integer = (int64_t) d;
+		return CSV_INTEGER;
+	}
+	*real = d;
+	return CSV_REAL;
+}
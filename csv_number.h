@@ -0,0 +1,30 @@
+#ifndef CSV_NUMBER_H
+#define CSV_NUMBER_H
+
+#include <stdint.h>
+
+#include "buffered_CSV.h"
+
+/* Conversion of CSV fields to numbers, following SQLite's NUMERIC affinity:
+ * a field that looks like a number becomes an integer if it can be one
+ * without loss (so "3.0" and "1e3" are integers), a real otherwise. Leading
+ * and trailing spaces are allowed; hex, "inf", "nan" and the like are not
+ * numbers. Doing this in C lets us bind numbers directly instead of having
+ * SQLite parse text. */
+
+enum csv_number_type { CSV_NOT_A_NUMBER, CSV_INTEGER, CSV_REAL };
+
+/* Returns the type of 'field', and stores its value in *integer or *real
+ * accordingly. */
+
+enum csv_number_type csv_number(const buf_csv_field_t *field, int64_t *integer,
+		double *real);
+
+/* Tells what a field looks like, without converting it: CSV_INTEGER if it is
+ * an integer that fits an int64_t, CSV_REAL if it is any other decimal number
+ * (so "3.0" and "1e3" are reals here), CSV_NOT_A_NUMBER otherwise. This is
+ * much faster than strtod(), and is used for inferring column types. */
+
+enum csv_number_type csv_number_class(const buf_csv_field_t *field);
+
+#endif
@@ -0,0 +1,314 @@
+#include <string.h>
+
+#include "csv_scan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#define BLOCK_SIZE 64
+
+/* Portable classifier. The loop has no branches, so the compiler is free to
+ * vectorize it for whatever the baseline ISA is. */
+
+static inline uint64_t generic_mask(const char *p, char sep, uint64_t *quotes)
+{
+	uint64_t mask = 0, quote_mask = 0;
+	for (int i = 0; i < BLOCK_SIZE; i++) {
+		mask |= (uint64_t) ((p[i] == sep) | (p[i] == '\n')) << i;
+		quote_mask |= (uint64_t) (p[i] == '"') << i;
+	}
+	*quotes = quote_mask;
+	return mask;
+}
+
+static uint64_t scan_generic(const char *p, char sep, uint64_t *quotes)
+{
+	return generic_mask(p, sep, quotes);
+}
+
+static uint64_t scan_generic_tab(const char *p, char sep, uint64_t *quotes)
+{
+	(void) sep;
+	return generic_mask(p, '\t', quotes);
+}
+
+static uint64_t scan_generic_comma(const char *p, char sep, uint64_t *quotes)
+{
+	(void) sep;
+	return generic_mask(p, ',', quotes);
+}
+
+#ifdef HAVE_X86_SIMD
+
+/* These are always inlined in their callers, which means that for the
+ * specialized versions the separator is a compile-time constant. */
+
+static inline __attribute__((always_inline, target("sse2")))
+uint64_t sse2_mask(const char *p, char sep, uint64_t *quotes)
+{
+	const __m128i vsep = _mm_set1_epi8(sep);
+	const __m128i vnl = _mm_set1_epi8('\n');
+	const __m128i vquote = _mm_set1_epi8('"');
+	uint64_t mask = 0, quote_mask = 0;
+
+	for (int i = 0; i < BLOCK_SIZE / 16; i++) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (p + 16 * i));
+		__m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, vsep),
+				_mm_cmpeq_epi8(v, vnl));
+		mask |= (uint64_t) (uint16_t) _mm_movemask_epi8(hit) << (16 * i);
+		quote_mask |= (uint64_t) (uint16_t) _mm_movemask_epi8(
+				_mm_cmpeq_epi8(v, vquote)) << (16 * i);
+	}
+
+	*quotes = quote_mask;
+	return mask;
+}
+
+static __attribute__((target("sse2")))
+uint64_t scan_sse2(const char *p, char sep, uint64_t *quotes)
+{
+	return sse2_mask(p, sep, quotes);
+}
+
+static __attribute__((target("sse2")))
+uint64_t scan_sse2_tab(const char *p, char sep, uint64_t *quotes)
+{
+	(void) sep;
+	return sse2_mask(p, '\t', quotes);
+}
+
+static __attribute__((target("sse2")))
+uint64_t scan_sse2_comma(const char *p, char sep, uint64_t *quotes)
+{
+	(void) sep;
+	return sse2_mask(p, ',', quotes);
+}
+
+static inline __attribute__((always_inline, target("avx2")))
+uint64_t avx2_mask(const char *p, char sep, uint64_t *quotes)
+{
+	const __m256i vsep = _mm256_set1_epi8(sep);
+	const __m256i vnl = _mm256_set1_epi8('\n');
+	const __m256i vquote = _mm256_set1_epi8('"');
+
+	__m256i lo = _mm256_loadu_si256((const __m256i *) p);
+	__m256i hi = _mm256_loadu_si256((const __m256i *) (p + 32));
+	__m256i hit_lo = _mm256_or_si256(_mm256_cmpeq_epi8(lo, vsep),
+			_mm256_cmpeq_epi8(lo, vnl));
+	__m256i hit_hi = _mm256_or_si256(_mm256_cmpeq_epi8(hi, vsep),
+			_mm256_cmpeq_epi8(hi, vnl));
+
+	*quotes = (uint64_t) (uint32_t) _mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(lo, vquote)) |
+		(uint64_t) (uint32_t) _mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(hi, vquote)) << 32;
+
+	return (uint64_t) (uint32_t) _mm256_movemask_epi8(hit_lo) |
+		(uint64_t) (uint32_t) _mm256_movemask_epi8(hit_hi) << 32;
+}
+
+static __attribute__((target("avx2")))
+uint64_t scan_avx2(const char *p, char sep, uint64_t *quotes)
+{
+	return avx2_mask(p, sep, quotes);
+}
+
+static __attribute__((target("avx2")))
+uint64_t scan_avx2_tab(const char *p, char sep, uint64_t *quotes)
+{
+	(void) sep;
+	return avx2_mask(p, '\t', quotes);
+}
+
+static __attribute__((target("avx2")))
+uint64_t scan_avx2_comma(const char *p, char sep, uint64_t *quotes)
+{
+	(void) sep;
+	return avx2_mask(p, ',', quotes);
+}
+
+#endif
+
+enum csv_scan_isa csv_scan_best_isa(void)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return CSV_SCAN_AVX2;
+	if (__builtin_cpu_supports("sse2")) return CSV_SCAN_SSE2;
+#endif
+	return CSV_SCAN_GENERIC;
+}
+
+csv_scan_fn csv_scan_select_isa(char sep, enum csv_scan_isa isa)
+{
+	if (isa > csv_scan_best_isa()) return NULL;
+
+	switch (isa) {
+#ifdef HAVE_X86_SIMD
+	case CSV_SCAN_AVX2:
+		if ('\t' == sep) return scan_avx2_tab;
+		if (',' == sep) return scan_avx2_comma;
+		return scan_avx2;
+	case CSV_SCAN_SSE2:
+		if ('\t' == sep) return scan_sse2_tab;
+		if (',' == sep) return scan_sse2_comma;
+		return scan_sse2;
+#endif
+	case CSV_SCAN_GENERIC:
+		if ('\t' == sep) return scan_generic_tab;
+		if (',' == sep) return scan_generic_comma;
+		return scan_generic;
+	default:
+		return NULL;
+	}
+}
+
+csv_scan_fn csv_scan_select(char sep)
+{
+	return csv_scan_select_isa(sep, csv_scan_best_isa());
+}
+
+void csv_scanner_init(struct csv_scanner *scanner, csv_scan_fn scan, char sep,
+		bool quoted, const char *base)
+{
+	scanner->scan = scan;
+	scanner->sep = sep;
+	scanner->quoted = quoted;
+	scanner->base = base;
+	scanner->block = NULL;
+	scanner->mask = 0;
+	scanner->in_quote = 0;
+}
+
+/* Bit i of the result is the XOR of bits 0..i of x. Applied to a quote mask,
+ * this sets the bits from each opening quote up to (but excluding) the
+ * matching closing one. A doubled quote inside a quoted field just closes and
+ * reopens it, which is harmless since the doubled quote is no separator. */
+
+static inline uint64_t prefix_xor(uint64_t x)
+{
+	x ^= x << 1;
+	x ^= x << 2;
+	x ^= x << 4;
+	x ^= x << 8;
+	x ^= x << 16;
+	x ^= x << 32;
+	return x;
+}
+
+/* Classifies the block at 'block', which may extend beyond 'end' (those bits
+ * are cleared) and even beyond 'readable_end' (we then work on a copy). In
+ * quoted mode, separators and newlines between quotes are dropped from the
+ * mask; this needs no branch per byte, and is skipped altogether for blocks
+ * that are neither in quotes nor contain any. Blocks must be loaded in
+ * order, since whether a block starts in quotes depends on the previous one. */
+
+static uint64_t load_mask(struct csv_scanner *scanner,
+		const char *block, const char *end, const char *readable_end)
+{
+	uint64_t mask, quotes;
+
+	if (readable_end - block >= BLOCK_SIZE) {
+		mask = scanner->scan(block, scanner->sep, &quotes);
+	} else {
+		char tmp[BLOCK_SIZE];
+		memset(tmp, 0, BLOCK_SIZE);
+		memcpy(tmp, block, readable_end - block);
+		mask = scanner->scan(tmp, scanner->sep, &quotes);
+	}
+	if (end - block < BLOCK_SIZE) {
+		uint64_t valid = ((uint64_t) 1 << (end - block)) - 1;
+		mask &= valid;
+		quotes &= valid;
+	}
+
+	if (scanner->quoted && 0 != (quotes | scanner->in_quote)) {
+		uint64_t inside = prefix_xor(quotes) ^ scanner->in_quote;
+		mask &= ~inside;
+		/* all ones iff the block ends in quotes */
+		scanner->in_quote = (uint64_t) ((int64_t) inside >> 63);
+	}
+
+	return mask;
+}
+
+const char *csv_scan_line(struct csv_scanner *scanner, const char *line,
+		const char *end, const char *readable_end, int num_fields,
+		buf_csv_field_t *fields, bool *ok)
+{
+	size_t offset = line - scanner->base;
+	const char *block = scanner->base + (offset & ~(size_t) (BLOCK_SIZE-1));
+	uint64_t mask;
+
+	if (block == scanner->block) {
+		mask = scanner->mask;
+	} else {
+		mask = load_mask(scanner, block, end, readable_end);
+		scanner->block = block;
+	}
+	/* forget anything before the line */
+	mask &= ~(uint64_t) 0 << (offset % BLOCK_SIZE);
+
+	int fld = 0;
+	const char *fld_start = line;
+	const char *line_end;
+
+	for (;;) {
+		while (0 == mask) {
+			block += BLOCK_SIZE;
+			if (block >= end) {
+				/* last line, and no trailing '\n' */
+				scanner->block = NULL;
+				line_end = end;
+				goto last_field;
+			}
+			mask = load_mask(scanner, block, end, readable_end);
+			scanner->block = block;
+		}
+
+		const char *p = block + __builtin_ctzll(mask);
+		mask &= mask - 1;	/* clear lowest set bit */
+
+		if ('\n' == *p) {
+			scanner->mask = mask;
+			line_end = p;
+			break;
+		}
+		/* a separator - in the last field, it is just data */
+		if (fld < num_fields - 1) {
+			fields[fld].start = fld_start;
+			fields[fld].len = p - fld_start;
+			fld++;
+			fld_start = p + 1;
+		}
+	}
+
+last_field:
+	*ok = (fld == num_fields - 1);
+	fields[fld].start = fld_start;
+	fields[fld].len = line_end - fld_start;
+
+	return line_end < end ? line_end + 1 : end;
+}
+
+int csv_count_fields(const char *line, size_t len, char sep, bool quoted)
+{
+	struct csv_scanner scanner;
+	csv_scanner_init(&scanner, csv_scan_select(sep), sep, quoted, line);
+
+	const char *end = line + len;
+	int num_fields = 1;
+	for (const char *block = line; block < end; block += BLOCK_SIZE) {
+		uint64_t mask = load_mask(&scanner, block, end, end);
+		while (0 != mask) {
+			if ('\n' == block[__builtin_ctzll(mask)])
+				return num_fields;
+			num_fields++;
+			mask &= mask - 1;
+		}
+	}
+
+	return num_fields;
+}
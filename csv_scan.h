@@ -0,0 +1,83 @@
+#ifndef CSV_SCAN_H
+#define CSV_SCAN_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "buffered_CSV.h"
+
+/* Block-wise scanning of CSV data. Instead of looking for the next separator
+ * with index() once per field, a whole 64-byte block is classified at once,
+ * yielding a bit mask in which bit i is set iff block[i] is a separator or a
+ * '\n'. The field and line boundaries are then read off the mask, and a mask
+ * serves for as many (short) lines as fit in the block.
+ *
+ * In quoted (RFC 4180) mode, a second mask of the '"' chars is used to
+ * remove the separators and newlines that are within quotes.
+ *
+ * There are SSE2 and AVX2 versions of the classifier, as well as a portable
+ * one; the best one the CPU supports is chosen at run time. There are
+ * specialized versions for TAB and comma, the most common separators. */
+
+/* Classifies the 64 bytes starting at 'block'. Returns the mask of
+ * separators and newlines, and stores that of quotes in *quotes. */
+
+typedef uint64_t (*csv_scan_fn)(const char *block, char sep, uint64_t *quotes);
+
+enum csv_scan_isa { CSV_SCAN_GENERIC, CSV_SCAN_SSE2, CSV_SCAN_AVX2 };
+
+/* The best instruction set this CPU supports. */
+
+enum csv_scan_isa csv_scan_best_isa(void);
+
+/* Returns a classifier for 'sep' using instruction set 'isa', or NULL if the
+ * CPU (or compiler) does not support it. */
+
+csv_scan_fn csv_scan_select_isa(char sep, enum csv_scan_isa isa);
+
+/* Returns the best classifier for 'sep' */
+
+csv_scan_fn csv_scan_select(char sep);
+
+/* The scanning state. 'base' defines the block grid: blocks start at base +
+ * 64*k, so that a block that holds several lines is classified only once.
+ * 'mask' holds the not-yet-consumed part of the mask of the block at
+ * 'block'. In quoted mode, 'in_quote' is all ones iff that block ends within
+ * quotes. */
+
+struct csv_scanner {
+	csv_scan_fn scan;
+	char sep;
+	bool quoted;
+	const char *base;
+	const char *block;
+	uint64_t mask;
+	uint64_t in_quote;
+};
+
+/* Initializes 'scanner' for data starting at 'base', which must not be
+ * within quotes, with classifier 'scan' (see csv_scan_select(): choosing it
+ * once per file saves the CPU checks for each line). */
+
+void csv_scanner_init(struct csv_scanner *scanner, csv_scan_fn scan, char sep,
+		bool quoted, const char *base);
+
+/* Splits the line starting at 'line' into 'num_fields' fields (extra
+ * separators end up in the last field). The line ends at the first '\n' (not
+ * in quotes) or at 'end'. Memory up to 'readable_end' (>= end) may be read
+ * (but is otherwise ignored). Returns a pointer just after the line, and sets
+ * *ok to false if the line has fewer than 'num_fields' fields. Quoted fields
+ * are returned as is, i.e. with their quotes. Lines must be scanned in
+ * order. */
+
+const char *csv_scan_line(struct csv_scanner *scanner, const char *line,
+		const char *end, const char *readable_end, int num_fields,
+		buf_csv_field_t *fields, bool *ok);
+
+/* Returns the number of fields in the line (of length 'len'), i.e. one more
+ * than its number of separators before the first '\n'. */
+
+int csv_count_fields(const char *line, size_t len, char sep, bool quoted);
+
+#endif
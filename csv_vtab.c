@@ -0,0 +1,530 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include "csv_vtab.h"
+#include "csv_index.h"
+#include "csv_number.h"
+#include "buffered_CSV.h"
+
+/* Number of module arguments before the column definitions: module name,
+ * database name, table name, file, separator, flags, regexp, NULL token,
+ * indexed columns. */
+#define FIRST_COLDEF_ARG 9
+
+/* Constraints on indexed columns are passed to xFilter() as a string of
+ * (column, operator) pairs, each pair taking this many chars. */
+#define IDX_STR_PAIR "%04d%c"
+#define IDX_STR_PAIR_LEN 5
+
+struct csv_vtab {
+	sqlite3_vtab base;
+	char *filename;
+	char separator;
+	int flags;
+	char *first_line_re;
+	char *null_token;	/* NULL if none */
+	size_t null_token_len;
+	int num_fields;
+	bool *numeric;	/* column i is NUMERIC or INTEGER */
+	int num_index_cols;
+	int *index_cols;
+	csv_index_t *index;	/* NULL if none, or if it can't be built */
+};
+
+/* A scan either reads all the data, or only the blocks of the index that may
+ * match the constraints (see csv_index.h). In the latter case, 'blocks' holds
+ * the numbers of those blocks, and 'rows_left' counts down the rows of the
+ * current one. */
+
+struct csv_cursor {
+	sqlite3_vtab_cursor base;
+	buffered_CSV_t *buf_csv;
+	off_t data_start;	/* for rewinding buf_csv, if mmap()ed */
+	buf_csv_field_t *fields;
+	sqlite3_int64 rowid;
+	bool eof;
+	long *blocks;
+	long num_blocks;
+	long next_block;
+	int rows_left;
+};
+
+/* Removes SQL quotes ('...', "...") from an argument. Returns a malloc()ed
+ * string, or NULL if the argument is the NULL keyword (or on failure). */
+
+static char *dequote(const char *arg)
+{
+	if (0 == strcasecmp("NULL", arg)) return NULL;
+
+	char quote = arg[0];
+	if ('\'' != quote && '"' != quote) return strdup(arg);
+
+	size_t len = strlen(arg);
+	char *s = malloc(len);
+	if (NULL == s) return NULL;
+
+	char *o = s;
+	for (size_t i = 1; i < len - 1; i++) {
+		*o++ = arg[i];
+		if (quote == arg[i] && quote == arg[i+1]) i++;
+	}
+	*o = '\0';
+
+	return s;
+}
+
+/* The column definitions are "name TYPE", with the types sqawk infers; INTEGER
+ * affinity behaves as NUMERIC for the values of a CSV file. */
+
+static bool is_numeric_coldef(const char *coldef)
+{
+	const char *type = strrchr(coldef, ' ');
+	return NULL != type && (0 == strcasecmp(" NUMERIC", type) ||
+			0 == strcasecmp(" INTEGER", type));
+}
+
+/* Parses a comma-separated list of column numbers. Returns their count, or -1
+ * on failure (including a number out of range). */
+
+static int parse_index_cols(const char *list, int num_fields, int **cols)
+{
+	int n = 1;
+	for (const char *c = list; '\0' != *c; c++)
+		if (',' == *c) n++;
+	*cols = malloc(n * sizeof(int));
+	if (NULL == *cols) return -1;
+
+	const char *c = list;
+	for (int i = 0; i < n; i++) {
+		char *end;
+		(*cols)[i] = strtol(c, &end, 10);
+		if (end == c || (*cols)[i] < 0 || (*cols)[i] >= num_fields)
+			return -1;
+		c = end + 1;
+	}
+
+	return n;
+}
+
+static void free_vtab(struct csv_vtab *vtab)
+{
+	if (NULL != vtab->index) csv_index_close(vtab->index);
+	free(vtab->index_cols);
+	free(vtab->filename);
+	free(vtab->first_line_re);
+	free(vtab->null_token);
+	free(vtab->numeric);
+	sqlite3_free(vtab);
+}
+
+/* (Re)builds the index if there should be one and it's missing or stale.
+ * Failure is not an error: the table will just be scanned in full. */
+
+static void refresh_index(struct csv_vtab *vtab)
+{
+	if (0 == vtab->num_index_cols) return;
+	if (NULL != vtab->index) {
+		if (csv_index_is_current(vtab->index)) return;
+		csv_index_close(vtab->index);
+	}
+	vtab->index = csv_index_open(vtab->filename, vtab->separator,
+			vtab->flags, vtab->first_line_re, vtab->num_index_cols,
+			vtab->index_cols);
+}
+
+static int csv_vtab_connect(sqlite3 *db, void *aux, int argc,
+		const char *const *argv, sqlite3_vtab **vtabp, char **errp)
+{
+	(void) aux;
+
+	if (argc <= FIRST_COLDEF_ARG) {
+		*errp = sqlite3_mprintf("%s: expected file, separator, flags, "
+			"regexp, NULL token, indexed columns, and column "
+			"definitions", CSV_VTAB_MODULE);
+		return SQLITE_ERROR;
+	}
+
+	struct csv_vtab *vtab = sqlite3_malloc(sizeof(struct csv_vtab));
+	if (NULL == vtab) return SQLITE_NOMEM;
+	memset(vtab, 0, sizeof(struct csv_vtab));
+
+	vtab->filename = dequote(argv[3]);
+	vtab->separator = atoi(argv[4]);
+	vtab->flags = atoi(argv[5]);
+	vtab->first_line_re = dequote(argv[6]);
+	vtab->null_token = dequote(argv[7]);
+	if (NULL != vtab->null_token)
+		vtab->null_token_len = strlen(vtab->null_token);
+	vtab->num_fields = argc - FIRST_COLDEF_ARG;
+	vtab->numeric = calloc(vtab->num_fields, sizeof(bool));
+	if (NULL == vtab->filename || NULL == vtab->numeric) {
+		free_vtab(vtab);
+		return SQLITE_NOMEM;
+	}
+
+	char *index_cols = dequote(argv[8]);
+	if (NULL != index_cols) {
+		vtab->num_index_cols = parse_index_cols(index_cols,
+				vtab->num_fields, &vtab->index_cols);
+		free(index_cols);
+		if (-1 == vtab->num_index_cols) {
+			*errp = sqlite3_mprintf("%s: bad indexed columns '%s'",
+					CSV_VTAB_MODULE, argv[8]);
+			free_vtab(vtab);
+			return SQLITE_ERROR;
+		}
+	}
+
+	sqlite3_str *schema = sqlite3_str_new(db);
+	sqlite3_str_appendall(schema, "CREATE TABLE x(");
+	for (int i = 0; i < vtab->num_fields; i++) {
+		const char *coldef = argv[FIRST_COLDEF_ARG + i];
+		if (i > 0) sqlite3_str_appendall(schema, ", ");
+		sqlite3_str_appendall(schema, coldef);
+		vtab->numeric[i] = is_numeric_coldef(coldef);
+	}
+	sqlite3_str_appendall(schema, ")");
+	char *create_SQL = sqlite3_str_finish(schema);
+	if (NULL == create_SQL) {
+		free_vtab(vtab);
+		return SQLITE_NOMEM;
+	}
+
+	int result = sqlite3_declare_vtab(db, create_SQL);
+	sqlite3_free(create_SQL);
+	if (SQLITE_OK != result) {
+		*errp = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+		free_vtab(vtab);
+		return result;
+	}
+
+	refresh_index(vtab);
+
+	*vtabp = &vtab->base;
+	return SQLITE_OK;
+}
+
+static int csv_vtab_disconnect(sqlite3_vtab *base)
+{
+	free_vtab((struct csv_vtab *) base);
+	return SQLITE_OK;
+}
+
+static char index_op(unsigned char sqlite_op)
+{
+	switch (sqlite_op) {
+	case SQLITE_INDEX_CONSTRAINT_EQ: return '=';
+	case SQLITE_INDEX_CONSTRAINT_LT: return '<';
+	case SQLITE_INDEX_CONSTRAINT_LE: return 'l';
+	case SQLITE_INDEX_CONSTRAINT_GT: return '>';
+	case SQLITE_INDEX_CONSTRAINT_GE: return 'g';
+	default: return '\0';
+	}
+}
+
+static bool is_index_col(struct csv_vtab *vtab, int col)
+{
+	for (int i = 0; i < vtab->num_index_cols; i++)
+		if (vtab->index_cols[i] == col) return true;
+	return false;
+}
+
+/* Without an index, only full scans are possible, and they cost about the
+ * same whatever the constraints. With one, comparisons of indexed NUMERIC
+ * columns can narrow the scan down to some blocks. SQLite still checks the
+ * constraints on the rows we return, so the blocks need only be a superset
+ * of those that match. */
+
+static int csv_vtab_best_index(sqlite3_vtab *base, sqlite3_index_info *info)
+{
+	struct csv_vtab *vtab = (struct csv_vtab *) base;
+
+	info->estimatedCost = 1000000;
+	info->estimatedRows = 1000000;
+	if (NULL == vtab->index) return SQLITE_OK;
+
+	sqlite3_str *idx_str = sqlite3_str_new(NULL);
+	int num_used = 0;
+	for (int i = 0; i < info->nConstraint; i++) {
+		struct sqlite3_index_constraint *cons = &info->aConstraint[i];
+		char op = index_op(cons->op);
+		if (! cons->usable || '\0' == op || cons->iColumn < 0 ||
+				! vtab->numeric[cons->iColumn] ||
+				! is_index_col(vtab, cons->iColumn))
+			continue;
+		info->aConstraintUsage[i].argvIndex = ++num_used;
+		sqlite3_str_appendf(idx_str, IDX_STR_PAIR, cons->iColumn, op);
+		info->estimatedCost /= ('=' == op) ? 100 : 4;
+		info->estimatedRows /= ('=' == op) ? 100 : 4;
+	}
+
+	info->idxNum = num_used;
+	info->idxStr = sqlite3_str_finish(idx_str);
+	info->needToFreeIdxStr = 1;
+	if (num_used > 0 && NULL == info->idxStr) return SQLITE_NOMEM;
+
+	return SQLITE_OK;
+}
+
+static int csv_vtab_open(sqlite3_vtab *base, sqlite3_vtab_cursor **cursorp)
+{
+	struct csv_vtab *vtab = (struct csv_vtab *) base;
+
+	struct csv_cursor *cursor = sqlite3_malloc(sizeof(struct csv_cursor));
+	if (NULL == cursor) return SQLITE_NOMEM;
+	memset(cursor, 0, sizeof(struct csv_cursor));
+
+	cursor->fields = malloc(vtab->num_fields * sizeof(buf_csv_field_t));
+	if (NULL == cursor->fields) {
+		sqlite3_free(cursor);
+		return SQLITE_NOMEM;
+	}
+	cursor->eof = true;
+
+	*cursorp = &cursor->base;
+	return SQLITE_OK;
+}
+
+static int csv_vtab_close(sqlite3_vtab_cursor *base)
+{
+	struct csv_cursor *cursor = (struct csv_cursor *) base;
+	if (NULL != cursor->buf_csv) destroy_buffered_CSV(cursor->buf_csv);
+	free(cursor->fields);
+	free(cursor->blocks);
+	sqlite3_free(cursor);
+	return SQLITE_OK;
+}
+
+static int csv_vtab_next(sqlite3_vtab_cursor *base)
+{
+	struct csv_cursor *cursor = (struct csv_cursor *) base;
+
+	if (NULL != cursor->blocks) {
+		if (0 == cursor->rows_left) {
+			if (cursor->next_block == cursor->num_blocks) {
+				cursor->eof = true;
+				return SQLITE_OK;
+			}
+			struct csv_vtab *vtab =
+				(struct csv_vtab *) base->pVtab;
+			long block = cursor->blocks[cursor->next_block++];
+			buf_csv_seek(cursor->buf_csv,
+				csv_index_block_offset(vtab->index, block));
+			cursor->rows_left = CSV_INDEX_BLOCK_ROWS;
+			/* rowids are as in a full scan */
+			cursor->rowid = block * CSV_INDEX_BLOCK_ROWS;
+		}
+		cursor->rows_left--;
+	}
+
+	/* As when importing, a line with too few fields ends the data. */
+	if (-1 == buf_csv_next_data_line_slices(cursor->buf_csv,
+				cursor->fields))
+		cursor->eof = true;
+	else
+		cursor->rowid++;
+
+	return SQLITE_OK;
+}
+
+/* Sets the cursor's list of blocks to those that may match all the
+ * constraints in 'idx_str', with values in 'argv'. */
+
+static int select_blocks(struct csv_cursor *cursor, csv_index_t *index,
+		const char *idx_str, int argc, sqlite3_value **argv)
+{
+	long num_blocks = csv_index_num_blocks(index);
+	cursor->blocks = malloc((num_blocks + 1) * sizeof(long));
+	if (NULL == cursor->blocks) return SQLITE_NOMEM;
+
+	cursor->num_blocks = 0;
+	for (long block = 0; block < num_blocks; block++) {
+		bool may_match = true;
+		for (int i = 0; may_match && i < argc; i++) {
+			int col;
+			char op;
+			sscanf(idx_str + i * IDX_STR_PAIR_LEN, "%4d%c", &col,
+					&op);
+			/* Only numbers are compared to numbers */
+			int type = sqlite3_value_numeric_type(argv[i]);
+			if (SQLITE_INTEGER != type && SQLITE_FLOAT != type)
+				continue;
+			double value = sqlite3_value_double(argv[i]);
+			enum csv_index_op index_op =
+				'=' == op ? CSV_INDEX_EQ :
+				'<' == op ? CSV_INDEX_LT :
+				'l' == op ? CSV_INDEX_LE :
+				'>' == op ? CSV_INDEX_GT : CSV_INDEX_GE;
+			may_match = csv_index_block_may_match(index, block,
+					col, index_op, value);
+		}
+		if (may_match)
+			cursor->blocks[cursor->num_blocks++] = block;
+	}
+
+	cursor->next_block = 0;
+	cursor->rows_left = 0;
+	return SQLITE_OK;
+}
+
+/* Opens the file afresh, and checks it still has the expected fields. */
+
+static int open_file(struct csv_cursor *cursor, struct csv_vtab *vtab)
+{
+	if (NULL != cursor->buf_csv) destroy_buffered_CSV(cursor->buf_csv);
+	cursor->buf_csv = NULL;
+
+	FILE *csv = fopen(vtab->filename, "r");
+	if (NULL == csv) {
+		vtab->base.zErrMsg = sqlite3_mprintf("%s: %s", vtab->filename,
+				strerror(errno));
+		return SQLITE_ERROR;
+	}
+	cursor->buf_csv = create_buffered_CSV(csv, vtab->separator,
+			vtab->first_line_re, vtab->flags);
+	if (NULL == cursor->buf_csv) {
+		fclose(csv);
+		vtab->base.zErrMsg = sqlite3_mprintf("%s: can't read",
+				vtab->filename);
+		return SQLITE_ERROR;
+	}
+	if (vtab->num_fields != buf_csv_field_count(cursor->buf_csv)) {
+		vtab->base.zErrMsg = sqlite3_mprintf("%s: expected %d fields, "
+				"found %d", vtab->filename, vtab->num_fields,
+				buf_csv_field_count(cursor->buf_csv));
+		return SQLITE_ERROR;
+	}
+
+	cursor->data_start = buf_csv_tell(cursor->buf_csv);
+	return SQLITE_OK;
+}
+
+/* Each scan reads the file anew: we keep the buffered_CSV_t if it is
+ * mmap()ed and the file has not changed, and reopen it otherwise. */
+
+static int csv_vtab_filter(sqlite3_vtab_cursor *base, int idx_num,
+		const char *idx_str, int argc, sqlite3_value **argv)
+{
+	struct csv_cursor *cursor = (struct csv_cursor *) base;
+	struct csv_vtab *vtab = (struct csv_vtab *) base->pVtab;
+
+	cursor->rowid = 0;
+	cursor->eof = true;
+	free(cursor->blocks);
+	cursor->blocks = NULL;
+
+	if (NULL != vtab->index && ! csv_index_is_current(vtab->index)) {
+		refresh_index(vtab);
+		/* the mapping may be stale, too */
+		if (NULL != cursor->buf_csv)
+			destroy_buffered_CSV(cursor->buf_csv);
+		cursor->buf_csv = NULL;
+	}
+
+	if (NULL != cursor->buf_csv && -1 != cursor->data_start) {
+		buf_csv_seek(cursor->buf_csv, cursor->data_start);
+	} else if (SQLITE_OK != open_file(cursor, vtab)) {
+		return SQLITE_ERROR;
+	}
+
+	/* The index may have vanished (see refresh_index()). */
+	if (idx_num > 0 && NULL != vtab->index && -1 != cursor->data_start) {
+		int result = select_blocks(cursor, vtab->index, idx_str, argc,
+				argv);
+		if (SQLITE_OK != result) return result;
+	}
+
+	cursor->eof = false;
+	return csv_vtab_next(base);
+}
+
+
+static int csv_vtab_eof(sqlite3_vtab_cursor *base)
+{
+	return ((struct csv_cursor *) base)->eof;
+}
+
+static bool is_null_token(const struct csv_vtab *vtab,
+		const buf_csv_field_t *fld)
+{
+	return NULL != vtab->null_token && vtab->null_token_len == fld->len &&
+		0 == memcmp(vtab->null_token, fld->start, fld->len);
+}
+
+/* Returns the value as a number if it looks like one, as NUMERIC affinity
+ * would. Empty values are NULL, as when importing. */
+
+static void result_numeric(sqlite3_context *ctx, const buf_csv_field_t *fld)
+{
+	int64_t integer;
+	double real;
+
+	if (0 == fld->len) {
+		sqlite3_result_null(ctx);
+		return;
+	}
+	switch (csv_number(fld, &integer, &real)) {
+	case CSV_INTEGER:
+		sqlite3_result_int64(ctx, integer);
+		break;
+	case CSV_REAL:
+		sqlite3_result_double(ctx, real);
+		break;
+	default:
+		sqlite3_result_text(ctx, fld->start, fld->len,
+				SQLITE_TRANSIENT);
+	}
+}
+
+static int csv_vtab_column(sqlite3_vtab_cursor *base, sqlite3_context *ctx,
+		int col)
+{
+	struct csv_cursor *cursor = (struct csv_cursor *) base;
+	struct csv_vtab *vtab = (struct csv_vtab *) base->pVtab;
+	const buf_csv_field_t *fld = &cursor->fields[col];
+
+	/* the NULL token is NULL, as when importing */
+	if (is_null_token(vtab, fld))
+		sqlite3_result_null(ctx);
+	else if (vtab->numeric[col])
+		result_numeric(ctx, fld);
+	else
+		sqlite3_result_text(ctx, fld->start, fld->len,
+				SQLITE_TRANSIENT);
+
+	return SQLITE_OK;
+}
+
+static int csv_vtab_rowid(sqlite3_vtab_cursor *base, sqlite3_int64 *rowid)
+{
+	*rowid = ((struct csv_cursor *) base)->rowid;
+	return SQLITE_OK;
+}
+
+static sqlite3_module csv_vtab_module = {
+	.iVersion = 0,
+	.xCreate = csv_vtab_connect,
+	.xConnect = csv_vtab_connect,
+	.xBestIndex = csv_vtab_best_index,
+	.xDisconnect = csv_vtab_disconnect,
+	.xDestroy = csv_vtab_disconnect,
+	.xOpen = csv_vtab_open,
+	.xClose = csv_vtab_close,
+	.xFilter = csv_vtab_filter,
+	.xNext = csv_vtab_next,
+	.xEof = csv_vtab_eof,
+	.xColumn = csv_vtab_column,
+	.xRowid = csv_vtab_rowid,
+};
+
+int csv_vtab_register(sqlite3 *db)
+{
+	return sqlite3_create_module(db, CSV_VTAB_MODULE, &csv_vtab_module,
+			NULL);
+}
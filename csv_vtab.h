@@ -0,0 +1,35 @@
+#ifndef CSV_VTAB_H
+#define CSV_VTAB_H
+
+#include "sqlite3.h"
+
+/* A virtual table module that reads a CSV file through a buffered_CSV_t
+ * every time the table is scanned, instead of storing its data in the
+ * database. This saves the import when the data are only needed once, e.g. in
+ * a single full scan.
+ *
+ * Usage:
+ *
+ * CREATE VIRTUAL TABLE t USING sqawk_csv('file', sep, flags, 're', 'null',
+ * 	'cols', coldefs)
+ *
+ * where 'sep' is the separator's char code, 'flags' are buffered_CSV flags
+ * (see create_buffered_CSV()), 're' is the first-line regexp (or NULL), 'null'
+ * is the value that stands for NULL (or NULL, if none), 'cols' is a
+ * comma-separated list of the numbers (from 0) of the columns to index (or
+ * NULL), and 'coldefs' are the column definitions, as in CREATE TABLE (e.g.
+ * "num NUMERIC, name TEXT"). Values of NUMERIC columns that look like numbers
+ * are returned as numbers, as they would have been stored in a real table.
+ * The file is opened again for each scan, so it can't be stdin.
+ *
+ * If there are indexed columns, the file gets a sidecar index (see
+ * csv_index.h), and comparisons of indexed NUMERIC columns with numbers only
+ * read the blocks of the file that may hold matching rows. */
+
+#define CSV_VTAB_MODULE "sqawk_csv"
+
+/* Registers the module with 'db'. Returns an SQLite result code. */
+
+int csv_vtab_register(sqlite3 *db);
+
+#endif
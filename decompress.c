@@ -0,0 +1,535 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "decompress.h"
+
+/* how much decompressed data a block holds, and how many blocks per
+ * decompressing thread are held (being filled, or waiting to be read) */
+#define BLOCK_SIZE (4 << 20)
+#define BLOCKS_PER_THREAD 2
+/* the buffer of the FILE */
+#define FILE_BUFFER_SIZE (256 << 10)
+/* zlib takes at most 4 GiB of input at a time */
+#define MAX_ZLIB_INPUT (1U << 30)
+
+#define GZIP_HEADER_LEN 10
+#define GZIP_FEXTRA 0x04
+/* the header of a BGZF block: a gzip header with an extra field, with a
+ * "BC" subfield holding the size of the block, less 1 */
+#define BGZF_HEADER_LEN 18
+#define BGZF_TRAILER_LEN 8
+#define BGZF_MAX_BLOCK (64 << 10)
+
+static const unsigned char gzip_magic[] = { 0x1f, 0x8b, 0x08 };
+static const unsigned char zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+/* libzstd's streaming API (zstd.h), loaded at run time */
+struct zstd_in {
+	const void *src;
+	size_t size;
+	size_t pos;
+};
+
+struct zstd_out {
+	void *dst;
+	size_t size;
+	size_t pos;
+};
+
+struct zstd_api {
+	void *(*create)(void);
+	size_t (*free)(void *);
+	size_t (*decompress)(void *, struct zstd_out *, struct zstd_in *);
+	unsigned (*is_error)(size_t);
+	const char *(*error_name)(size_t);
+};
+
+enum block_state { BLOCK_FREE, BLOCK_FILLING, BLOCK_READY };
+
+struct block {
+	unsigned char *data;
+	size_t len;
+	enum block_state state;
+	bool last;	/* the end of the data */
+};
+
+struct decompressor {
+	char *filename;
+	enum compression compression;
+	const unsigned char *map;
+	size_t size;
+
+	/* block 'seq' goes to blocks[seq % num_blocks] */
+	struct block *blocks;
+	int num_blocks;
+	pthread_t *threads;
+	int num_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	/* under the lock */
+	size_t next_in;		/* the input still to be taken */
+	long next_seq;		/* of the next block to be filled */
+	bool input_done;	/* all blocks to be filled are taken */
+	bool stop;
+	const char *error;
+
+	/* the state of the gzip or zstd stream (which has a single thread) */
+	z_stream z;
+	bool z_started;
+	struct zstd_api zstd;
+	void *zstd_stream;
+	size_t zstd_ret;	/* 0 at the end of a frame */
+
+	/* the reader's */
+	long read_seq;
+	struct block *current;
+	size_t current_pos;
+	bool done;
+};
+
+enum compression file_compression(const char *filename)
+{
+	struct stat st;
+	if (-1 == stat(filename, &st) || ! S_ISREG(st.st_mode))
+		return COMPRESSION_NONE;
+	int fd = open(filename, O_RDONLY);
+	if (-1 == fd) return COMPRESSION_NONE;
+	unsigned char start[BGZF_HEADER_LEN];
+	ssize_t len = read(fd, start, sizeof(start));
+	close(fd);
+	if (len >= (ssize_t) sizeof(zstd_magic) &&
+			0 == memcmp(start, zstd_magic, sizeof(zstd_magic)))
+		return COMPRESSION_ZSTD;
+	if (len < GZIP_HEADER_LEN ||
+			0 != memcmp(start, gzip_magic, sizeof(gzip_magic)))
+		return COMPRESSION_NONE;
+	if (BGZF_HEADER_LEN == len && start[3] & GZIP_FEXTRA &&
+			'B' == start[12] && 'C' == start[13] &&
+			2 == start[14] && 0 == start[15])
+		return COMPRESSION_BGZF;
+	return COMPRESSION_GZIP;
+}
+
+const char *compression_name(enum compression compression)
+{
+	switch (compression) {
+	case COMPRESSION_GZIP: return "gzip";
+	case COMPRESSION_BGZF: return "BGZF";
+	case COMPRESSION_ZSTD: return "zstd";
+	default: return "none";
+	}
+}
+
+size_t compression_suffix_len(const char *filename)
+{
+	static const char *suffixes[] = { ".gz", ".bgz", ".zst", ".zstd" };
+	size_t len = strlen(filename);
+	for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+		size_t suffix_len = strlen(suffixes[i]);
+		if (len > suffix_len && 0 == strcasecmp(
+					filename + len - suffix_len,
+					suffixes[i]))
+			return suffix_len;
+	}
+	return 0;
+}
+
+static uint32_t load_le32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static bool load_zstd(struct zstd_api *api)
+{
+	void *lib = dlopen("libzstd.so.1", RTLD_NOW);
+	if (NULL == lib) return false;
+	*(void **) &api->create = dlsym(lib, "ZSTD_createDStream");
+	*(void **) &api->free = dlsym(lib, "ZSTD_freeDStream");
+	*(void **) &api->decompress = dlsym(lib, "ZSTD_decompressStream");
+	*(void **) &api->is_error = dlsym(lib, "ZSTD_isError");
+	*(void **) &api->error_name = dlsym(lib, "ZSTD_getErrorName");
+	return NULL != api->create && NULL != api->free &&
+		NULL != api->decompress && NULL != api->is_error &&
+		NULL != api->error_name;
+}
+
+/* Fills b from the gzip stream. Returns false on error (and sets *error).
+ * Sets b->last at the end of the data: of the last member, or when what
+ * follows is not another member (as gzip, trailing garbage is ignored). */
+
+static bool fill_gzip(struct decompressor *d, struct block *b,
+		const char **error)
+{
+	z_stream *z = &d->z;
+	z->next_out = b->data;
+	z->avail_out = BLOCK_SIZE;
+	while (z->avail_out > 0) {
+		if (0 == z->avail_in) {
+			if (d->next_in == d->size) {
+				*error = "truncated gzip data";
+				return false;
+			}
+			size_t len = d->size - d->next_in;
+			z->next_in = (unsigned char *) d->map + d->next_in;
+			z->avail_in = len < MAX_ZLIB_INPUT ?
+				len : MAX_ZLIB_INPUT;
+			d->next_in += z->avail_in;
+		}
+		int ret = inflate(z, Z_NO_FLUSH);
+		if (Z_STREAM_END == ret) {
+			/* the start of what follows, if it is in the mapping
+			 * (else it is too short to be a member) */
+			const unsigned char *next = z->next_in;
+			size_t left = z->avail_in + d->size - d->next_in;
+			if (left < GZIP_HEADER_LEN || 0 != memcmp(next,
+						gzip_magic,
+						sizeof(gzip_magic))) {
+				b->last = true;
+				break;
+			}
+			inflateReset(z);
+		} else if (Z_OK != ret && Z_BUF_ERROR != ret) {
+			*error = NULL != z->msg ? z->msg : "corrupt gzip data";
+			return false;
+		}
+	}
+	b->len = BLOCK_SIZE - z->avail_out;
+	return true;
+}
+
+/* Fills b from the zstd stream, as fill_gzip(). */
+
+static bool fill_zstd(struct decompressor *d, struct block *b,
+		const char **error)
+{
+	struct zstd_in in = { d->map, d->size, d->next_in };
+	struct zstd_out out = { b->data, BLOCK_SIZE, 0 };
+	while (out.pos < out.size) {
+		size_t in_pos = in.pos, out_pos = out.pos;
+		size_t ret = d->zstd.decompress(d->zstd_stream, &out, &in);
+		if (d->zstd.is_error(ret)) {
+			*error = d->zstd.error_name(ret);
+			return false;
+		}
+		if (in.pos == in.size && in_pos == in.pos &&
+				out_pos == out.pos) {
+			/* the end of the input: it must end a frame */
+			if (0 != d->zstd_ret) {
+				*error = "truncated zstd data";
+				return false;
+			}
+			b->last = true;
+			break;
+		}
+		d->zstd_ret = ret;
+		if (in.pos == in.size && 0 == ret) {
+			b->last = true;
+			break;
+		}
+	}
+	d->next_in = in.pos;
+	b->len = out.pos;
+	return true;
+}
+
+/* Takes the run of BGZF blocks that fits in a block, from d->next_in, and
+ * sets *start and *end to where it starts and ends. Returns false if one is
+ * broken (and sets d->error). */
+
+static bool take_bgzf(struct decompressor *d, size_t *start, size_t *end)
+{
+	size_t len = 0;
+	*start = d->next_in;
+	while (d->next_in < d->size) {
+		const unsigned char *h = d->map + d->next_in;
+		size_t left = d->size - d->next_in;
+		if (left < BGZF_HEADER_LEN + BGZF_TRAILER_LEN ||
+				0 != memcmp(h, gzip_magic,
+					sizeof(gzip_magic)) ||
+				! (h[3] & GZIP_FEXTRA) ||
+				'B' != h[12] || 'C' != h[13]) {
+			d->error = "broken BGZF block";
+			return false;
+		}
+		size_t block_len = (h[16] | h[17] << 8) + 1;
+		size_t header_len = GZIP_HEADER_LEN + 2 + (h[10] | h[11] << 8);
+		if (block_len > left) {
+			d->error = "truncated BGZF data";
+			return false;
+		}
+		if (header_len < BGZF_HEADER_LEN ||
+				header_len + BGZF_TRAILER_LEN > block_len ||
+				load_le32(h + block_len - 4) > BGZF_MAX_BLOCK) {
+			d->error = "broken BGZF block";
+			return false;
+		}
+		size_t out_len = load_le32(h + block_len - 4);
+		if (len + out_len > BLOCK_SIZE) break;
+		len += out_len;
+		d->next_in += block_len;
+	}
+	*end = d->next_in;
+	return true;
+}
+
+/* Decompresses the BGZF blocks from 'start' to 'end' into b, with 'z', a raw
+ * inflate stream. Returns false on error (and sets *error). */
+
+static bool fill_bgzf(struct decompressor *d, size_t start, size_t end,
+		struct block *b, z_stream *z, const char **error)
+{
+	b->len = 0;
+	for (size_t pos = start; pos < end; ) {
+		const unsigned char *h = d->map + pos;
+		size_t block_len = (h[16] | h[17] << 8) + 1;
+		size_t header_len = GZIP_HEADER_LEN + 2 + (h[10] | h[11] << 8);
+		const unsigned char *trailer = h + block_len - BGZF_TRAILER_LEN;
+		uint32_t out_len = load_le32(trailer + 4);
+		inflateReset(z);
+		z->next_in = (unsigned char *) h + header_len;
+		z->avail_in = block_len - BGZF_TRAILER_LEN - header_len;
+		z->next_out = b->data + b->len;
+		z->avail_out = out_len;
+		int ret = inflate(z, Z_FINISH);
+		if (Z_STREAM_END != ret || 0 != z->avail_out ||
+				crc32(0, b->data + b->len, out_len) !=
+				load_le32(trailer)) {
+			*error = "corrupt BGZF block";
+			return false;
+		}
+		b->len += out_len;
+		pos += block_len;
+	}
+	return true;
+}
+
+/* A decompressing thread: takes the blocks to be filled in order, and fills
+ * them when the reader has freed them. */
+
+static void *decompress_blocks(void *arg)
+{
+	struct decompressor *d = arg;
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	bool bgzf = COMPRESSION_BGZF == d->compression;
+	if (bgzf && Z_OK != inflateInit2(&z, -MAX_WBITS)) {
+		pthread_mutex_lock(&d->lock);
+		d->error = "out of memory";
+		d->stop = true;
+		pthread_cond_broadcast(&d->changed);
+		pthread_mutex_unlock(&d->lock);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&d->lock);
+	while (! d->stop && ! d->input_done) {
+		struct block *b = &d->blocks[d->next_seq++ % d->num_blocks];
+		/* the runs of BGZF blocks are taken in order, with their
+		 * blocks */
+		size_t start = 0, end = 0;
+		bool ok = ! bgzf || take_bgzf(d, &start, &end);
+		bool last = bgzf && (! ok || end == d->size);
+		if (bgzf) d->input_done = last;
+		while (! d->stop && BLOCK_FREE != b->state)
+			pthread_cond_wait(&d->changed, &d->lock);
+		if (d->stop) break;
+		b->state = BLOCK_FILLING;
+		b->last = false;
+		pthread_mutex_unlock(&d->lock);
+		const char *error = NULL;
+		if (ok && bgzf)
+			ok = fill_bgzf(d, start, end, b, &z, &error);
+		else if (ok && COMPRESSION_ZSTD == d->compression)
+			ok = fill_zstd(d, b, &error);
+		else if (ok)
+			ok = fill_gzip(d, b, &error);
+		pthread_mutex_lock(&d->lock);
+		if (! ok && NULL == d->error) d->error = error;
+		/* the reader gives up at a block that failed */
+		if (! ok || last) b->last = true;
+		if (b->last) d->input_done = true;
+		b->state = BLOCK_READY;
+		pthread_cond_broadcast(&d->changed);
+	}
+	pthread_mutex_unlock(&d->lock);
+	if (bgzf) inflateEnd(&z);
+	return NULL;
+}
+
+static void destroy_decompressor(struct decompressor *d)
+{
+	if (NULL != d->threads) {
+		pthread_mutex_lock(&d->lock);
+		d->stop = true;
+		pthread_cond_broadcast(&d->changed);
+		pthread_mutex_unlock(&d->lock);
+		for (int i = 0; i < d->num_threads; i++)
+			pthread_join(d->threads[i], NULL);
+		free(d->threads);
+	}
+	if (NULL != d->blocks)
+		for (int i = 0; i < d->num_blocks; i++)
+			free(d->blocks[i].data);
+	free(d->blocks);
+	if (d->z_started) inflateEnd(&d->z);
+	if (NULL != d->zstd_stream) d->zstd.free(d->zstd_stream);
+	if (NULL != d->map) munmap((void *) d->map, d->size);
+	pthread_mutex_destroy(&d->lock);
+	pthread_cond_destroy(&d->changed);
+	free(d->filename);
+	free(d);
+}
+
+static ssize_t read_decompressed(void *cookie, char *buf, size_t size)
+{
+	struct decompressor *d = cookie;
+	if (NULL == d->current) {
+		if (d->done) return 0;
+		struct block *b = &d->blocks[d->read_seq % d->num_blocks];
+		pthread_mutex_lock(&d->lock);
+		while (BLOCK_READY != b->state && NULL == d->error)
+			pthread_cond_wait(&d->changed, &d->lock);
+		const char *error = d->error;
+		pthread_mutex_unlock(&d->lock);
+		if (NULL != error) {
+			fprintf(stderr, "FATAL: %s: %s\n", d->filename, error);
+			exit(EXIT_FAILURE);
+		}
+		d->current = b;
+		d->current_pos = 0;
+	}
+
+	struct block *b = d->current;
+	size_t len = b->len - d->current_pos;
+	if (len > size) len = size;
+	memcpy(buf, b->data + d->current_pos, len);
+	d->current_pos += len;
+	if (d->current_pos == b->len) {
+		d->done = b->last;
+		d->current = NULL;
+		d->read_seq++;
+		pthread_mutex_lock(&d->lock);
+		b->state = BLOCK_FREE;
+		pthread_cond_broadcast(&d->changed);
+		pthread_mutex_unlock(&d->lock);
+		/* an empty block (e.g. BGZF's end-of-file marker) is not the
+		 * end, unless it is the last */
+		if (0 == len) return read_decompressed(cookie, buf, size);
+	}
+	return len;
+}
+
+static int close_decompressed(void *cookie)
+{
+	destroy_decompressor(cookie);
+	return 0;
+}
+
+/* Sets up d to decompress its mapping, and starts its threads. Returns
+ * false on failure, and sets *error (or leaves it NULL if errno tells
+ * why). */
+
+static bool start_decompressor(struct decompressor *d, int num_threads,
+		const char **error)
+{
+	if (COMPRESSION_GZIP == d->compression) {
+		if (Z_OK != inflateInit2(&d->z, MAX_WBITS + 16)) {
+			*error = "out of memory";
+			return false;
+		}
+		d->z_started = true;
+	} else if (COMPRESSION_ZSTD == d->compression) {
+		if (! load_zstd(&d->zstd)) {
+			*error = "zstd data, but libzstd can't be loaded";
+			return false;
+		}
+		d->zstd_stream = d->zstd.create();
+		if (NULL == d->zstd_stream) {
+			*error = "out of memory";
+			return false;
+		}
+	}
+
+	/* gzip and zstd are streams, decompressed in order, by one thread */
+	d->num_threads = COMPRESSION_BGZF == d->compression && num_threads > 1 ?
+		num_threads : 1;
+	d->num_blocks = BLOCKS_PER_THREAD * d->num_threads;
+	d->blocks = calloc(d->num_blocks, sizeof(struct block));
+	if (NULL == d->blocks) return false;
+	for (int i = 0; i < d->num_blocks; i++) {
+		d->blocks[i].data = malloc(BLOCK_SIZE);
+		if (NULL == d->blocks[i].data) return false;
+	}
+	d->threads = calloc(d->num_threads, sizeof(pthread_t));
+	if (NULL == d->threads) return false;
+	for (int i = 0; i < d->num_threads; i++) {
+		int ret = pthread_create(&d->threads[i], NULL,
+				decompress_blocks, d);
+		if (0 != ret) {
+			d->num_threads = i;
+			errno = ret;
+			return false;
+		}
+	}
+	return true;
+}
+
+FILE *open_decompressed(const char *filename, int num_threads,
+		const char **error)
+{
+	*error = NULL;
+	enum compression compression = file_compression(filename);
+	if (COMPRESSION_NONE == compression) return fopen(filename, "r");
+
+	struct decompressor *d = calloc(1, sizeof(struct decompressor));
+	if (NULL == d) return NULL;
+	pthread_mutex_init(&d->lock, NULL);
+	pthread_cond_init(&d->changed, NULL);
+	d->compression = compression;
+	d->zstd_ret = 1;
+	d->filename = strdup(filename);
+	int fd = open(filename, O_RDONLY);
+	struct stat st;
+	if (NULL == d->filename || -1 == fd || -1 == fstat(fd, &st)) {
+		if (-1 != fd) close(fd);
+		destroy_decompressor(d);
+		return NULL;
+	}
+	d->size = st.st_size;
+	void *map = mmap(NULL, d->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (MAP_FAILED == map) {
+		destroy_decompressor(d);
+		return NULL;
+	}
+	d->map = map;
+	madvise(map, d->size, MADV_SEQUENTIAL);
+
+	cookie_io_functions_t io = {
+		.read = read_decompressed,
+		.close = close_decompressed,
+	};
+	FILE *f = NULL;
+	if (start_decompressor(d, num_threads, error))
+		f = fopencookie(d, "r", io);
+	if (NULL == f) {
+		int saved_errno = errno;
+		destroy_decompressor(d);
+		errno = saved_errno;
+		return NULL;
+	}
+	setvbuf(f, NULL, _IOFBF, FILE_BUFFER_SIZE);
+	return f;
+}
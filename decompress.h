@@ -0,0 +1,46 @@
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* Transparent decompression of input files. A compressed file is recognised
+ * by its first bytes, whatever its name, and read through a FILE that hands
+ * out the decompressed data: the file is mmap()ed, and decompressed by a
+ * separate thread, a few large blocks ahead of the reader, so that
+ * decompressing and parsing overlap.
+ *
+ * - gzip (possibly several members, one after the other) is decompressed with
+ *   zlib.
+ * - BGZF (gzip made of independent blocks of at most 64 KiB, as written by
+ *   bgzip, and used for VCF, BAM, etc.) is decompressed by several threads at
+ *   once, each taking a run of blocks; the runs are handed out in order.
+ * - zstd (possibly several frames) is decompressed with libzstd, which is
+ *   loaded at run time, so that sqawk does not depend on it otherwise.
+ *
+ * The reader of the FILE can't tell a read error from the end of the data, so
+ * corrupt or truncated data are fatal: the program exits with a message. */
+
+enum compression { COMPRESSION_NONE, COMPRESSION_GZIP, COMPRESSION_BGZF,
+	COMPRESSION_ZSTD };
+
+/* The compression of 'filename', from its first bytes: COMPRESSION_NONE if
+ * it is not compressed, or not a regular file. */
+
+enum compression file_compression(const char *filename);
+
+const char *compression_name(enum compression);
+
+/* The length of the compression suffix of 'filename' (e.g. ".gz"), or 0. */
+
+size_t compression_suffix_len(const char *filename);
+
+/* Opens 'filename' for reading: if it is compressed, as a FILE of the
+ * decompressed data (BGZF is decompressed by up to 'num_threads' threads);
+ * else as fopen() would. Returns NULL on failure, and sets *error to a
+ * message telling why, or to NULL if errno does. */
+
+FILE *open_decompressed(const char *filename, int num_threads,
+		const char **error);
+
+#endif
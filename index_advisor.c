@@ -0,0 +1,440 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "index_advisor.h"
+#include "column_stats.h"
+
+/* the names of the candidate indexes, in the copy of the schema */
+#define CANDIDATE_PREFIX "sqawk_advice_"
+/* the rows per key of an index's first column are estimated from the number
+ * of distinct values of the column, if the table has statistics, else in its
+ * first rows */
+#define SAMPLE_ROWS 10000
+
+struct table {
+	char *schema;
+	char *name;
+	sqlite3_int64 num_rows;	/* -1 if not counted (virtual tables) */
+	bool copied;		/* into the copy of the schema */
+	int num_cols;
+	char **cols;
+	bool *indexed;		/* leads an index, or is the rowid */
+	bool *read;		/* by the query */
+};
+
+struct candidate {
+	int table;
+	int col;
+	bool used;
+};
+
+struct advisor {
+	sqlite3 *db;	/* the database */
+	sqlite3 *plan;	/* the copy of its schema */
+	struct table *tables;
+	int num_tables;
+	struct candidate *candidates;
+	int num_candidates;
+};
+
+/* Runs 'sql' (freed) on 'db'. Returns false on failure. */
+
+static bool exec_free(sqlite3 *db, char *sql)
+{
+	if (NULL == sql) return false;
+	int ret = sqlite3_exec(db, sql, NULL, NULL, NULL);
+	sqlite3_free(sql);
+	return SQLITE_OK == ret;
+}
+
+static sqlite3_stmt *prepare(sqlite3 *db, char *sql)
+{
+	if (NULL == sql) return NULL;
+	sqlite3_stmt *stmt;
+	int ret = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	sqlite3_free(sql);
+	return SQLITE_OK == ret ? stmt : NULL;
+}
+
+static int find_column(const struct table *t, const char *name)
+{
+	for (int i = 0; i < t->num_cols; i++)
+		if (0 == strcasecmp(t->cols[i], name))
+			return i;
+	return -1;
+}
+
+static int find_table(const struct advisor *a, const char *name)
+{
+	for (int i = 0; i < a->num_tables; i++)
+		if (a->tables[i].copied &&
+				0 == strcasecmp(a->tables[i].name, name))
+			return i;
+	return -1;
+}
+
+/* Reads the columns of table t, and notes those that lead an index. Returns
+ * the CREATE TABLE statement of its copy, or NULL on failure. */
+
+static char *read_columns(struct advisor *a, struct table *t)
+{
+	sqlite3_stmt *stmt = prepare(a->db, sqlite3_mprintf(
+		"SELECT name, type, pk FROM pragma_table_info(%Q, %Q)",
+		t->name, t->schema));
+	if (NULL == stmt) return NULL;
+	sqlite3_str *create = sqlite3_str_new(a->plan);
+	sqlite3_str *key = sqlite3_str_new(a->plan);
+	sqlite3_str_appendf(create, "CREATE TABLE \"%w\" (", t->name);
+	int num_keys = 0;
+	bool integer_key = false;
+	while (SQLITE_ROW == sqlite3_step(stmt)) {
+		const char *name = (const char *) sqlite3_column_text(stmt, 0);
+		const char *type = (const char *) sqlite3_column_text(stmt, 1);
+		char **cols = realloc(t->cols,
+				(t->num_cols + 1) * sizeof(char *));
+		if (NULL == cols) break;
+		t->cols = cols;
+		t->cols[t->num_cols] = strdup(name);
+		if (NULL == t->cols[t->num_cols]) break;
+		sqlite3_str_appendf(create, "%s\"%w\" %s",
+				0 == t->num_cols ? "" : ", ", name, type);
+		if (sqlite3_column_int(stmt, 2) > 0) {
+			sqlite3_str_appendf(key, "%s\"%w\"",
+					0 == num_keys ? "" : ", ", name);
+			num_keys++;
+			integer_key = 0 == strcasecmp("INTEGER", type);
+		}
+		t->num_cols++;
+	}
+	sqlite3_finalize(stmt);
+	if (num_keys > 0)
+		sqlite3_str_appendf(create, ", PRIMARY KEY (%s)",
+				sqlite3_str_value(key));
+	sqlite3_str_appendchar(create, 1, ')');
+	sqlite3_free(sqlite3_str_finish(key));
+
+	t->indexed = calloc(t->num_cols, sizeof(bool));
+	t->read = calloc(t->num_cols, sizeof(bool));
+	if (NULL == t->indexed || NULL == t->read) {
+		sqlite3_free(sqlite3_str_finish(create));
+		return NULL;
+	}
+	/* an INTEGER PRIMARY KEY is the rowid */
+	if (1 == num_keys && integer_key) {
+		stmt = prepare(a->db, sqlite3_mprintf("SELECT name FROM "
+			"pragma_table_info(%Q, %Q) WHERE pk = 1",
+			t->name, t->schema));
+		if (NULL != stmt && SQLITE_ROW == sqlite3_step(stmt)) {
+			int col = find_column(t, (const char *)
+					sqlite3_column_text(stmt, 0));
+			if (-1 != col) t->indexed[col] = true;
+		}
+		sqlite3_finalize(stmt);
+	}
+	stmt = prepare(a->db, sqlite3_mprintf("SELECT ii.name FROM "
+		"pragma_index_list(%Q, %Q) AS il, "
+		"pragma_index_info(il.name, %Q) AS ii WHERE ii.seqno = 0",
+		t->name, t->schema, t->schema));
+	while (NULL != stmt && SQLITE_ROW == sqlite3_step(stmt)) {
+		const char *name = (const char *) sqlite3_column_text(stmt, 0);
+		int col = NULL == name ? -1 : find_column(t, name);
+		if (-1 != col) t->indexed[col] = true;
+	}
+	sqlite3_finalize(stmt);
+
+	return sqlite3_str_finish(create);
+}
+
+/* Copies table t, and its indexes, into the copy of the schema, and counts
+ * its rows. */
+
+static void copy_table(struct advisor *a, struct table *t, bool is_virtual)
+{
+	t->num_rows = -1;
+	char *create = read_columns(a, t);
+	/* e.g. a table of the same name in another schema */
+	if (-1 != find_table(a, t->name)) {
+		sqlite3_free(create);
+		return;
+	}
+	if (! exec_free(a->plan, create)) return;
+	t->copied = true;
+
+	sqlite3_stmt *stmt = prepare(a->db, sqlite3_mprintf("SELECT sql FROM "
+		"\"%w\".sqlite_schema WHERE type = 'index' AND "
+		"tbl_name = %Q AND sql IS NOT NULL", t->schema, t->name));
+	while (NULL != stmt && SQLITE_ROW == sqlite3_step(stmt))
+		sqlite3_exec(a->plan, (const char *)
+				sqlite3_column_text(stmt, 0), NULL, NULL, NULL);
+	sqlite3_finalize(stmt);
+
+	if (is_virtual) return;
+	stmt = prepare(a->db, sqlite3_mprintf("SELECT count(*) FROM "
+				"\"%w\".\"%w\"", t->schema, t->name));
+	if (NULL != stmt && SQLITE_ROW == sqlite3_step(stmt))
+		t->num_rows = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+}
+
+static bool copy_schema(struct advisor *a)
+{
+	sqlite3_stmt *stmt = prepare(a->db, sqlite3_mprintf(
+		"SELECT schema, name, type FROM pragma_table_list WHERE "
+		"type IN ('table', 'virtual') AND "
+		"name NOT LIKE 'sqlite!_%%' ESCAPE '!'"));
+	if (NULL == stmt) return false;
+	bool ok = true;
+	while (ok && SQLITE_ROW == sqlite3_step(stmt)) {
+		struct table *tables = realloc(a->tables,
+			(a->num_tables + 1) * sizeof(struct table));
+		ok = NULL != tables;
+		if (! ok) break;
+		a->tables = tables;
+		struct table *t = &a->tables[a->num_tables++];
+		memset(t, 0, sizeof(struct table));
+		t->schema = strdup((const char *) sqlite3_column_text(stmt, 0));
+		t->name = strdup((const char *) sqlite3_column_text(stmt, 1));
+		ok = NULL != t->schema && NULL != t->name;
+		if (ok)
+			copy_table(a, t, 0 == strcmp("virtual", (const char *)
+					sqlite3_column_text(stmt, 2)));
+	}
+	sqlite3_finalize(stmt);
+	return ok;
+}
+
+static int note_read(void *arg, int action, const char *table,
+		const char *column, const char *db_name, const char *trigger)
+{
+	(void) db_name;
+	(void) trigger;
+	struct advisor *a = arg;
+	if (SQLITE_READ != action || NULL == table || NULL == column)
+		return SQLITE_OK;
+	int t = find_table(a, table);
+	if (-1 == t) return SQLITE_OK;
+	int col = find_column(&a->tables[t], column);
+	if (-1 != col) a->tables[t].read[col] = true;
+	return SQLITE_OK;
+}
+
+/* Calls 'f' on the text of each statement of 'sql', as prepared on the copy
+ * of the schema. Returns false if one can't be prepared. */
+
+static bool for_each_statement(struct advisor *a, const char *sql,
+		bool (*f)(struct advisor *, const char *))
+{
+	while (NULL != sql && '\0' != *sql) {
+		sqlite3_stmt *stmt;
+		const char *tail;
+		if (SQLITE_OK != sqlite3_prepare_v2(a->plan, sql, -1, &stmt,
+					&tail))
+			return false;
+		bool ok = NULL == stmt || f(a, sqlite3_sql(stmt));
+		sqlite3_finalize(stmt);
+		if (! ok) return false;
+		sql = tail;
+	}
+	return true;
+}
+
+static bool nothing(struct advisor *a, const char *sql)
+{
+	(void) a;
+	(void) sql;
+	return true;
+}
+
+/* Notes the candidates that the plan of 'sql' uses. */
+
+static bool note_plan(struct advisor *a, const char *sql)
+{
+	sqlite3_stmt *stmt = prepare(a->plan, sqlite3_mprintf(
+				"EXPLAIN QUERY PLAN %s", sql));
+	if (NULL == stmt) return false;
+	while (SQLITE_ROW == sqlite3_step(stmt)) {
+		const char *detail = (const char *)
+			sqlite3_column_text(stmt, 3);
+		const char *name = NULL == detail ? NULL :
+			strstr(detail, " INDEX " CANDIDATE_PREFIX);
+		if (NULL == name) continue;
+		int i = atoi(name + strlen(" INDEX " CANDIDATE_PREFIX));
+		if (i >= 0 && i < a->num_candidates)
+			a->candidates[i].used = true;
+	}
+	sqlite3_finalize(stmt);
+	return true;
+}
+
+static bool add_candidates(struct advisor *a, sqlite3_int64 min_rows)
+{
+	for (int i = 0; i < a->num_tables; i++) {
+		struct table *t = &a->tables[i];
+		if (! t->copied || t->num_rows < min_rows) continue;
+		for (int col = 0; col < t->num_cols; col++) {
+			if (! t->read[col] || t->indexed[col]) continue;
+			struct candidate *candidates = realloc(a->candidates,
+				(a->num_candidates + 1) *
+				sizeof(struct candidate));
+			if (NULL == candidates) return false;
+			a->candidates = candidates;
+			if (! exec_free(a->plan, sqlite3_mprintf(
+					"CREATE INDEX " CANDIDATE_PREFIX
+					"%d ON \"%w\" (\"%w\")",
+					a->num_candidates, t->name,
+					t->cols[col])))
+				continue;
+			a->candidates[a->num_candidates++] =
+				(struct candidate) { i, col, false };
+		}
+	}
+	return true;
+}
+
+/* The rows per key of column 'col' of table t, from its statistics (see
+ * column_stats.h), or 0 if it has none. */
+
+static sqlite3_int64 stored_rows_per_key(struct advisor *a, struct table *t,
+		const char *col)
+{
+	sqlite3_int64 per_key = 0;
+	sqlite3_stmt *stmt = prepare(a->db, sqlite3_mprintf(
+		"SELECT (row_count + distinct_count + (null_count > 0) - 1) / "
+		"(distinct_count + (null_count > 0)) FROM \"%w\"." STATS_TABLE
+		" WHERE table_name = %Q AND column_name = %Q AND "
+		"row_count > 0", t->schema, t->name, col));
+	if (NULL != stmt && SQLITE_ROW == sqlite3_step(stmt))
+		per_key = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+	return per_key;
+}
+
+/* Estimates the rows per key of column 'col' of table t: if most of the
+ * values in the sample are distinct, those of the whole column are likely
+ * to be as well, in proportion; else the sample likely has most of them. */
+
+static sqlite3_int64 rows_per_key(struct advisor *a, struct table *t,
+		const char *col)
+{
+	sqlite3_int64 stored = stored_rows_per_key(a, t, col);
+	if (stored > 0) return stored;
+
+	sqlite3_int64 rows = t->num_rows > 0 ? t->num_rows : 1;
+	sqlite3_stmt *stmt = prepare(a->db, sqlite3_mprintf(
+		"SELECT count(*), count(DISTINCT \"%w\") FROM (SELECT \"%w\" "
+		"FROM \"%w\".\"%w\" LIMIT %d)", col, col, t->schema,
+		t->name, SAMPLE_ROWS));
+	sqlite3_int64 sample = 0, distinct = 0;
+	if (NULL != stmt && SQLITE_ROW == sqlite3_step(stmt)) {
+		sample = sqlite3_column_int64(stmt, 0);
+		distinct = sqlite3_column_int64(stmt, 1);
+	}
+	sqlite3_finalize(stmt);
+	if (0 == distinct) return rows;
+
+	double keys = 2 * distinct > sample ?
+		(double) distinct * rows / sample : distinct;
+	sqlite3_int64 per_key = rows / keys + 0.5;
+	return per_key > 1 ? per_key : 1;
+}
+
+/* Tells SQLite's planner how many rows each table has, and how many rows
+ * per key its indexes have. */
+
+static bool write_stats(struct advisor *a)
+{
+	if (SQLITE_OK != sqlite3_exec(a->plan, "ANALYZE; "
+				"DELETE FROM sqlite_stat1", NULL, NULL, NULL))
+		return false;
+	for (int i = 0; i < a->num_tables; i++) {
+		struct table *t = &a->tables[i];
+		if (! t->copied || -1 == t->num_rows) continue;
+		sqlite3_int64 rows = t->num_rows > 0 ? t->num_rows : 1;
+		if (! exec_free(a->plan, sqlite3_mprintf(
+				"INSERT INTO sqlite_stat1 VALUES (%Q, NULL, "
+				"'%lld')", t->name, rows)))
+			return false;
+		sqlite3_stmt *stmt = prepare(a->plan, sqlite3_mprintf(
+			"SELECT il.name, ii.name FROM pragma_index_list(%Q) "
+			"AS il, pragma_index_info(il.name) AS ii "
+			"WHERE ii.seqno = 0", t->name));
+		if (NULL == stmt) return false;
+		bool ok = true;
+		while (ok && SQLITE_ROW == sqlite3_step(stmt)) {
+			const char *col = (const char *)
+				sqlite3_column_text(stmt, 1);
+			ok = exec_free(a->plan, sqlite3_mprintf(
+				"INSERT INTO sqlite_stat1 VALUES (%Q, %Q, "
+				"'%lld %lld')", t->name,
+				sqlite3_column_text(stmt, 0), rows,
+				NULL == col ? 1 : rows_per_key(a, t, col)));
+		}
+		sqlite3_finalize(stmt);
+		if (! ok) return false;
+	}
+	/* which loads the statistics again */
+	return SQLITE_OK == sqlite3_exec(a->plan, "ANALYZE sqlite_schema",
+			NULL, NULL, NULL);
+}
+
+static char **advice(struct advisor *a, int *num_indexes)
+{
+	*num_indexes = 0;
+	char **advice = calloc(a->num_candidates + 1, sizeof(char *));
+	if (NULL == advice) return NULL;
+	for (int i = 0; i < a->num_candidates; i++) {
+		struct candidate *c = &a->candidates[i];
+		if (! c->used) continue;
+		struct table *t = &a->tables[c->table];
+		char *sql = sqlite3_mprintf("CREATE INDEX IF NOT EXISTS "
+			"\"%w\".\"%w:%w\" ON \"%w\" (\"%w\")", t->schema,
+			t->name, t->cols[c->col], t->name, t->cols[c->col]);
+		if (NULL == sql) {
+			free_index_advice(advice, *num_indexes);
+			return NULL;
+		}
+		advice[(*num_indexes)++] = sql;
+	}
+	return advice;
+}
+
+char **advise_indexes(sqlite3 *db, const char *sql, sqlite3_int64 min_rows,
+		int *num_indexes)
+{
+	struct advisor a = { .db = db };
+	char **result = NULL;
+	if (SQLITE_OK == sqlite3_open(":memory:", &a.plan) &&
+			copy_schema(&a)) {
+		sqlite3_set_authorizer(a.plan, note_read, &a);
+		bool ok = for_each_statement(&a, sql, nothing);
+		sqlite3_set_authorizer(a.plan, NULL, NULL);
+		if (ok && add_candidates(&a, min_rows) && write_stats(&a) &&
+				for_each_statement(&a, sql, note_plan))
+			result = advice(&a, num_indexes);
+	}
+	sqlite3_close(a.plan);
+
+	for (int i = 0; i < a.num_tables; i++) {
+		struct table *t = &a.tables[i];
+		for (int col = 0; col < t->num_cols; col++)
+			free(t->cols[col]);
+		free(t->cols);
+		free(t->indexed);
+		free(t->read);
+		free(t->schema);
+		free(t->name);
+	}
+	free(a.tables);
+	free(a.candidates);
+	return result;
+}
+
+void free_index_advice(char **advice, int num_indexes)
+{
+	for (int i = 0; i < num_indexes; i++)
+		sqlite3_free(advice[i]);
+	free(advice);
+}
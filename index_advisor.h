@@ -0,0 +1,35 @@
+#ifndef INDEX_ADVISOR_H
+#define INDEX_ADVISOR_H
+
+#include "sqlite3.h"
+
+/* Index advice for a query (-A): finds the indexes that would spare the query
+ * full scans of large tables, e.g. of the inner table of a join, or of the
+ * table of a correlated subquery, so that they can be created before it is
+ * run.
+ *
+ * The query is planned on a copy of the database's schema, without its
+ * data, in which every column of a table of at least 'min_rows' rows that the
+ * query reads has a candidate index (unless it already leads an index, or is
+ * the rowid), and sqlite_stat1 gives SQLite's planner each table's actual
+ * number of rows, and the rows per key of each index, from the table's
+ * statistics (see column_stats.h), or as estimated from the distinct values
+ * in its first rows. The candidates that the plan uses are the advice:
+ * smaller tables are left to full scans, or to the automatic indexes SQLite
+ * makes for a single statement. Virtual tables are planned as they are, but
+ * get no candidates.
+ *
+ * All the statements of the query are planned, but only as long as they can
+ * be prepared on the schema as it was before they are run (e.g. not after a
+ * CREATE TABLE). */
+
+/* Returns the CREATE INDEX statements of the advised indexes, in an array of
+ * *num_indexes strings, to be freed with free_index_advice(); or returns NULL
+ * if the query can't be planned. */
+
+char **advise_indexes(sqlite3 *db, const char *sql, sqlite3_int64 min_rows,
+		int *num_indexes);
+
+void free_index_advice(char **advice, int num_indexes);
+
+#endif
@@ -0,0 +1,403 @@
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arrow_writer.h"
+#include "result_writer.h"
+
+#define RESULT_BUFFER_SIZE (1 << 20)
+
+/* Reals this close to 0 that are integers are formatted as integers, plus
+ * ".0": this is how SQLite's "%!.15g" formats them. */
+#define MAX_INTEGRAL_REAL 1e15
+
+struct result_writer {
+	FILE *out;
+	enum result_format format;
+	char *buf;
+	size_t used;
+	int error;	/* errno of the first failed write, or 0 */
+	/* JSON Lines: the member names of the columns, each with its quotes
+	 * and colon, one after the other */
+	char *keys;
+	size_t *key_ends;
+	int num_keys;
+	arrow_writer_t *arrow;	/* RESULT_ARROW */
+};
+
+result_writer_t *create_result_writer(FILE *out, enum result_format format)
+{
+	result_writer_t *w = calloc(1, sizeof(result_writer_t));
+	if (NULL == w) return NULL;
+	w->buf = malloc(RESULT_BUFFER_SIZE);
+	if (NULL == w->buf) {
+		free(w);
+		return NULL;
+	}
+	w->out = out;
+	w->format = format;
+	if (RESULT_ARROW == format) {
+		w->arrow = create_arrow_writer(out);
+		if (NULL == w->arrow) {
+			free(w->buf);
+			free(w);
+			return NULL;
+		}
+	}
+	return w;
+}
+
+static const char *const format_names[] = { "tsv", "csv", "jsonl", "arrow",
+	NULL };
+
+bool result_format_named(const char *name, enum result_format *format)
+{
+	for (int i = 0; NULL != format_names[i]; i++)
+		if (0 == strcmp(format_names[i], name)) {
+			*format = i;
+			return true;
+		}
+	return false;
+}
+
+const char *result_format_name(enum result_format format)
+{
+	return format_names[format];
+}
+
+static void write_out(result_writer_t *w, const char *data, size_t len)
+{
+	if (0 == len || 0 != w->error) return;
+	if (len != fwrite(data, 1, len, w->out))
+		w->error = 0 == errno ? EIO : errno;
+}
+
+int result_writer_flush(result_writer_t *w)
+{
+	/* Arrow batches are written when full, not after each query */
+	write_out(w, w->buf, w->used);
+	w->used = 0;
+	if (0 == w->error && 0 != fflush(w->out))
+		w->error = errno;
+	if (0 == w->error) return 0;
+	errno = w->error;
+	return -1;
+}
+
+static void put(result_writer_t *w, const char *data, size_t len)
+{
+	if (w->used + len > RESULT_BUFFER_SIZE) {
+		write_out(w, w->buf, w->used);
+		w->used = 0;
+		if (len >= RESULT_BUFFER_SIZE) {
+			write_out(w, data, len);
+			return;
+		}
+	}
+	memcpy(w->buf + w->used, data, len);
+	w->used += len;
+}
+
+static void put_char(result_writer_t *w, char c)
+{
+	if (RESULT_BUFFER_SIZE == w->used) {
+		write_out(w, w->buf, w->used);
+		w->used = 0;
+	}
+	w->buf[w->used++] = c;
+}
+
+static void put_integer(result_writer_t *w, sqlite3_int64 value)
+{
+	char digits[24];
+	char *p = digits + sizeof(digits);
+	/* in unsigned arithmetic, as -INT64_MIN doesn't fit */
+	uint64_t n = value < 0 ? -(uint64_t) value : (uint64_t) value;
+	do {
+		*--p = '0' + n % 10;
+		n /= 10;
+	} while (0 != n);
+	if (value < 0) *--p = '-';
+	put(w, p, digits + sizeof(digits) - p);
+}
+
+static void put_real(result_writer_t *w, sqlite3_stmt *stmt, int col)
+{
+	double value = sqlite3_column_double(stmt, col);
+	if (fabs(value) < MAX_INTEGRAL_REAL && value == (sqlite3_int64) value
+			&& ! (0 == value && signbit(value))) {
+		put_integer(w, (sqlite3_int64) value);
+		put(w, ".0", 2);
+		return;
+	}
+	/* SQLite's own formatting, for the same output */
+	put(w, (const char *) sqlite3_column_text(stmt, col),
+			sqlite3_column_bytes(stmt, col));
+}
+
+/* RFC 4180 */
+
+static void put_csv_text(result_writer_t *w, const char *text, size_t len)
+{
+	size_t i;
+	for (i = 0; i < len; i++)
+		if (',' == text[i] || '"' == text[i] || '\n' == text[i] ||
+				'\r' == text[i])
+			break;
+	if (i == len) {
+		put(w, text, len);
+		return;
+	}
+	put_char(w, '"');
+	size_t start = 0;
+	for (i = 0; i < len; i++)
+		if ('"' == text[i]) {
+			/* the quote goes out twice */
+			put(w, text + start, i + 1 - start);
+			start = i;
+		}
+	put(w, text + start, len - start);
+	put_char(w, '"');
+}
+
+static void put_json_string(result_writer_t *w, const char *text, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	put_char(w, '"');
+	size_t start = 0;
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = text[i];
+		if (c >= 0x20 && '"' != c && '\\' != c) continue;
+		put(w, text + start, i - start);
+		start = i + 1;
+		char escape[6] = { '\\', c, 0, 0, 0, 0 };
+		size_t escape_len = 2;
+		switch (c) {
+		case '"': case '\\': break;
+		case '\n': escape[1] = 'n'; break;
+		case '\t': escape[1] = 't'; break;
+		case '\r': escape[1] = 'r'; break;
+		case '\b': escape[1] = 'b'; break;
+		case '\f': escape[1] = 'f'; break;
+		default:
+			memcpy(escape + 1, "u00", 3);
+			escape[4] = hex[c >> 4];
+			escape[5] = hex[c & 0xf];
+			escape_len = 6;
+		}
+		put(w, escape, escape_len);
+	}
+	put(w, text + start, len - start);
+	put_char(w, '"');
+}
+
+/* Writes bytes that aren't UTF-8 text as a JSON string of their hex digits. */
+
+static void put_json_hex(result_writer_t *w, const unsigned char *data,
+		size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	put_char(w, '"');
+	for (size_t i = 0; i < len; i++) {
+		char digits[2] = { hex[data[i] >> 4], hex[data[i] & 0xf] };
+		put(w, digits, 2);
+	}
+	put_char(w, '"');
+}
+
+/* Tells whether 'text' is valid UTF-8: no stray continuation bytes, overlong
+ * forms, surrogates, or code points beyond U+10FFFF. */
+
+static bool is_utf8(const unsigned char *text, size_t len)
+{
+	size_t i = 0;
+	while (i < len) {
+		unsigned char c = text[i];
+		if (c < 0x80) {
+			i++;
+			continue;
+		}
+		int num_cont;
+		unsigned char min = 0x80, max = 0xbf;	/* of the 2nd byte */
+		if (c >= 0xc2 && c <= 0xdf) {
+			num_cont = 1;
+		} else if (c >= 0xe0 && c <= 0xef) {
+			num_cont = 2;
+			if (0xe0 == c) min = 0xa0;
+			if (0xed == c) max = 0x9f;
+		} else if (c >= 0xf0 && c <= 0xf4) {
+			num_cont = 3;
+			if (0xf0 == c) min = 0x90;
+			if (0xf4 == c) max = 0x8f;
+		} else {
+			return false;
+		}
+		if (len - i <= (size_t) num_cont) return false;
+		if (text[i + 1] < min || text[i + 1] > max) return false;
+		for (int k = 2; k <= num_cont; k++)
+			if ((text[i + k] & 0xc0) != 0x80) return false;
+		i += num_cont + 1;
+	}
+	return true;
+}
+
+static void put_text(result_writer_t *w, sqlite3_stmt *stmt, int col)
+{
+	const char *text = (const char *) sqlite3_column_text(stmt, col);
+	size_t len = sqlite3_column_bytes(stmt, col);
+	switch (w->format) {
+	case RESULT_CSV: put_csv_text(w, text, len); break;
+	case RESULT_JSONL:
+		/* JSON text must be UTF-8 */
+		if (is_utf8((const unsigned char *) text, len))
+			put_json_string(w, text, len);
+		else
+			put_json_hex(w, (const unsigned char *) text, len);
+		break;
+	default: put(w, text, len);
+	}
+}
+
+static void put_value(result_writer_t *w, sqlite3_stmt *stmt, int col)
+{
+	switch (sqlite3_column_type(stmt, col)) {
+	case SQLITE_INTEGER:
+		put_integer(w, sqlite3_column_int64(stmt, col));
+		break;
+	case SQLITE_FLOAT:
+		if (RESULT_JSONL == w->format &&
+				! isfinite(sqlite3_column_double(stmt, col)))
+			put(w, "null", 4);
+		else
+			put_real(w, stmt, col);
+		break;
+	case SQLITE_NULL:
+		if (RESULT_JSONL == w->format)
+			put(w, "null", 4);
+		break;
+	case SQLITE_BLOB:
+		if (RESULT_JSONL == w->format) {
+			put_json_hex(w, sqlite3_column_blob(stmt, col),
+				sqlite3_column_bytes(stmt, col));
+			break;
+		}
+		/* FALLTHROUGH */
+	default:
+		put_text(w, stmt, col);
+	}
+}
+
+/* Makes the JSON member names of the columns of 'stmt'. */
+
+static void make_keys(result_writer_t *w, sqlite3_stmt *stmt)
+{
+	int num_cols = sqlite3_column_count(stmt);
+	free(w->keys);
+	free(w->key_ends);
+	w->keys = NULL;
+	w->key_ends = malloc(num_cols * sizeof(size_t));
+	w->num_keys = 0;
+	if (NULL == w->key_ends) {
+		w->error = ENOMEM;
+		return;
+	}
+
+	/* the names are escaped into the (emptied) buffer, then moved out of
+	 * it */
+	write_out(w, w->buf, w->used);
+	w->used = 0;
+	for (int i = 0; i < num_cols; i++) {
+		const char *name = sqlite3_column_name(stmt, i);
+		if (NULL == name) name = "";
+		size_t len = strlen(name);
+		if (w->used + 6 * len + 3 > RESULT_BUFFER_SIZE) {
+			w->error = EOVERFLOW;
+			return;
+		}
+		put_json_string(w, name, len);
+		put_char(w, ':');
+		w->key_ends[i] = w->used;
+	}
+	w->keys = malloc(w->used + 1);
+	if (NULL == w->keys) {
+		w->error = ENOMEM;
+		return;
+	}
+	memcpy(w->keys, w->buf, w->used);
+	w->used = 0;
+	w->num_keys = num_cols;
+}
+
+void result_writer_headers(result_writer_t *w, sqlite3_stmt *stmt)
+{
+	if (RESULT_ARROW == w->format) {
+		arrow_writer_columns(w->arrow, stmt);
+		return;
+	}
+	if (RESULT_JSONL == w->format) {
+		make_keys(w, stmt);
+		return;
+	}
+	char sep = RESULT_CSV == w->format ? ',' : '\t';
+	int num_cols = sqlite3_column_count(stmt);
+	for (int i = 0; i < num_cols; i++) {
+		const char *name = sqlite3_column_name(stmt, i);
+		if (NULL == name) name = "";
+		if (i > 0) put_char(w, sep);
+		if (RESULT_CSV == w->format)
+			put_csv_text(w, name, strlen(name));
+		else
+			put(w, name, strlen(name));
+	}
+	put_char(w, '\n');
+}
+
+void result_writer_row(result_writer_t *w, sqlite3_stmt *stmt)
+{
+	if (RESULT_ARROW == w->format) {
+		arrow_writer_row(w->arrow, stmt);
+		return;
+	}
+	int num_cols = sqlite3_column_count(stmt);
+	if (RESULT_JSONL == w->format) {
+		put_char(w, '{');
+		for (int i = 0; i < num_cols && i < w->num_keys; i++) {
+			size_t key_start = 0 == i ? 0 : w->key_ends[i-1];
+			if (i > 0) put_char(w, ',');
+			put(w, w->keys + key_start, w->key_ends[i] - key_start);
+			put_value(w, stmt, i);
+		}
+		put(w, "}\n", 2);
+		return;
+	}
+	char sep = RESULT_CSV == w->format ? ',' : '\t';
+	for (int i = 0; i < num_cols; i++) {
+		if (i > 0) put_char(w, sep);
+		put_value(w, stmt, i);
+	}
+	put_char(w, '\n');
+}
+
+void result_writer_empty(result_writer_t *w, sqlite3_stmt *stmt)
+{
+	if (RESULT_ARROW == w->format) arrow_writer_columns(w->arrow, stmt);
+}
+
+int destroy_result_writer(result_writer_t *w)
+{
+	int result = result_writer_flush(w);
+	int error = errno;
+	if (NULL != w->arrow && 0 != destroy_arrow_writer(w->arrow) &&
+			0 == result) {
+		result = -1;
+		error = errno;
+	}
+	free(w->keys);
+	free(w->key_ends);
+	free(w->buf);
+	free(w);
+	errno = error;
+	return result;
+}
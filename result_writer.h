@@ -0,0 +1,69 @@
+#ifndef RESULT_WRITER_H
+#define RESULT_WRITER_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "sqlite3.h"
+
+/* Output of query results. Rows are formatted straight into a large buffer,
+ * which is written out when full (and by result_writer_flush()), rather than
+ * printf()ed cell by cell. Text is copied by length (sqlite3_column_bytes()),
+ * and integers are formatted by hand. NULLs are empty fields (null in JSON).
+ *
+ * The formats are:
+ *
+ * - RESULT_TSV: fields separated by TABs, as they are (no quoting), after a
+ *   header line of the column names.
+ * - RESULT_CSV: RFC 4180: fields separated by commas, and quoted (with
+ *   doubled quotes inside) if they contain a comma, a quote, or a line break;
+ *   after a header line.
+ * - RESULT_JSONL: JSON Lines: one object per row, whose members are the
+ *   columns; numbers are JSON numbers, and blobs (and text that isn't valid
+ *   UTF-8) are strings of their bytes' hex digits.
+ * - RESULT_ARROW: an Apache Arrow IPC stream (see arrow_writer.h), which is
+ *   binary, so nothing else should be written to 'out'. A value that doesn't
+ *   fit its column's Arrow type is a failed write, with errno EDOM. */
+
+enum result_format { RESULT_TSV, RESULT_CSV, RESULT_JSONL, RESULT_ARROW };
+
+struct result_writer;
+typedef struct result_writer result_writer_t;
+
+/* Returns a writer to 'out' (which may also be written to directly, after a
+ * result_writer_flush()), or NULL if out of memory. */
+
+result_writer_t *create_result_writer(FILE *out, enum result_format);
+
+/* Sets *format to the format called 'name' ("tsv", "csv", "jsonl" or
+ * "arrow").
+ * Returns false if there is none. */
+
+bool result_format_named(const char *name, enum result_format *format);
+
+const char *result_format_name(enum result_format);
+
+/* Writes the header line (if the format has one) for the columns of 'stmt'. */
+
+void result_writer_headers(result_writer_t *, sqlite3_stmt *stmt);
+
+/* Writes the current row of 'stmt' (which must have just returned
+ * SQLITE_ROW). */
+
+void result_writer_row(result_writer_t *, sqlite3_stmt *stmt);
+
+/* Notes that 'stmt' returned no rows: there is no header line, but an Arrow
+ * stream still has the schema of its columns. */
+
+void result_writer_empty(result_writer_t *, sqlite3_stmt *stmt);
+
+/* Writes out the buffer. Returns 0, or -1 if this or an earlier write failed
+ * (errno tells why). */
+
+int result_writer_flush(result_writer_t *);
+
+/* Flushes the writer and destroys it. Returns as result_writer_flush(). */
+
+int destroy_result_writer(result_writer_t *);
+
+#endif
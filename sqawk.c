@@ -3,6 +3,7 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,30 +13,100 @@
 #include <sys/types.h>
 #include <regex.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "sqlite3.h"
 #include "buffered_CSV.h"
+#include "csv_vtab.h"
+#include "csv_number.h"
+#include "csv_filter.h"
+#include "chunk_merge.h"
+#include "result_writer.h"
+#include "arrow_reader.h"
+#include "decompress.h"
+#include "index_advisor.h"
+#include "column_stats.h"
 
 #define MEM_DATABASE ":memory:"
 #define DISK_DATABASE "sqawk.db"
+#define TEMP_DATABASE ""	/* on disk, deleted when closed */
 
 #define MAX_FILES 16	/* Should be ok for a while... */
 
+/* Files loaded concurrently go to per-file shared in-memory databases, which
+ * are ATTACHed to the main one under these names. */
+#define FILE_DB_URI "file:/sqawk_%d?vfs=memdb"
+#define FILE_DB_SCHEMA "sqawk_%d"
+
+/* Import cache (-C): each cached file has a database of its own in the cache
+ * directory, which is ATTACHed under this name. */
+#define CACHE_DB_NAME "%s/%016llx.db"
+#define CACHE_DB_SCHEMA "sqawk_cache_%d"
+#define CACHE_META_TABLE "sqawk_cache_meta"
+/* For an appended-to file, the end of the data seen last time must still be
+ * the same: we compare a hash of this many bytes before it. */
+#define CACHE_TAIL_LEN 4096
+
+#define INT_TYPE "INTEGER"
 #define NUM_TYPE "NUMERIC"
 #define TEXT_TYPE "TEXT"
+/* for the columns of Arrow files */
+#define REAL_TYPE "REAL"
+#define BLOB_TYPE "BLOB"
+
+/* Column types are inferred from this many data lines (-S), taken at this
+ * many places in the file when it can be split (see get_column_types()). */
+#define DEFAULT_SAMPLE_SIZE 1000
+#define SAMPLE_STRIDES 16
+
+/* From narrowest to widest: a column's type is the widest of its values'.
+ * Columns of reals are NUMERIC rather than REAL, so that their integral values
+ * stay integers (e.g. "140" is not output as "140.0"). */
+enum column_type { COL_NONE, COL_INTEGER, COL_NUMERIC, COL_TEXT };
+
+/* The temporary name of a table being retyped (see retype_table()) */
+#define RETYPE_TABLE "sqawk_retype"
+/* The temporary name of a table being sorted (see sort_table()) */
+#define SORT_TABLE "sqawk_sort"
 
 #define WHOLE_FILE -1
 
+/* Parallel parsing: a file is split into ranges of about this many bytes, and
+ * there are this many ranges in flight per worker. */
+#define PARSE_RANGE_SIZE (1 << 20)
+#define PARSE_SLOTS_PER_WORKER 2
+
+/* Rows are inserted by statements of up to this many rows (fewer if they
+ * would need more parameters than SQLite allows), and the text of rows whose
+ * fields don't outlive their line is copied into blocks of this size.
+ * bench_sqawk.c's bind stage copies this batching: change both together. */
+#define INSERT_BATCH_ROWS 128
+#define TEXT_BLOCK_SIZE (64 * 1024)
+
+/* The index advisor (-A) leaves tables of fewer rows than this to full scans
+ * (see index_advisor.h). */
+#define ADVISE_MIN_ROWS 1000
+
 /* run switches */
 static const int sw_verbose = 1 << 1;
 static const int sw_dry_run = 1 << 2;
 static const int sw_show_sql = 1 << 3;
 static const int sw_enable_foreign_keys = 1 << 4;
+static const int sw_unordered = 1 << 5;
+static const int sw_merge = 1 << 6;
+static const int sw_advise_indexes = 1 << 7;
 
 /* file switches */
 static const int fsw_no_headers = 1 << 1;
 static const int fsw_literal_col_names = 1 << 2;
 static const int fsw_show_skipped_lines = 1 << 3;
+static const int fsw_quoted = 1 << 4;
+static const int fsw_virtual = 1 << 5;
+static const int fsw_sort = 1 << 6;
+static const int fsw_sorted = 1 << 7;
 
 struct file_params {
 	char *filename;
@@ -48,6 +119,12 @@ struct file_params {
 	char *foreign_key;
 	char *fk_referent;
 	char *alias;
+	char *sidecar_index_fields;
+	char *null_token;	/* fields equal to this are NULL */
+	char *kept_fields;	/* -c: NULL means all */
+	bool *used_fields;	/* by the query; NULL means all */
+	csv_filter_t *filter;	/* rows the query wants, NULL if any */
+	buffered_CSV_t *csv;	/* if opened before loading, else NULL */
 };
 
 
@@ -58,7 +135,14 @@ struct parameters {
 	struct file_params *files;
 	int num_files;
 	int chunk_size;	/* flush last table every n rows */
+	int num_workers;	/* parser threads per file */
+	int sample_size;	/* lines read for inferring column types */
+	char *cache_dir;	/* NULL: no import cache */
+	sqlite3_int64 memory_budget;	/* bytes; 0: no budget */
+	bool column_stats;	/* see wants_column_stats() */
 	char *user_sql;
+	enum result_format output_format;
+	result_writer_t *output;	/* of the query's results */
 };
 
 static void die(const char *msg)
@@ -95,6 +179,26 @@ static char * show_file(FILE* f, int n)
 }
 */
 
+/* Returns the size 's' stands for, in bytes: a number, optionally followed by
+ * K, M, G or T (binary multiples), or -1 if it's not one. */
+
+static sqlite3_int64 parse_size(const char *s)
+{
+	char *end;
+	errno = 0;
+	long long size = strtoll(s, &end, 10);
+	if (errno || end == s || size < 0) return -1;
+	int shift = 0;
+	switch (toupper(*end)) {
+	case 'T': shift += 10; /* FALLTHROUGH */
+	case 'G': shift += 10; /* FALLTHROUGH */
+	case 'M': shift += 10; /* FALLTHROUGH */
+	case 'K': shift += 10; end++; break;
+	}
+	if ('\0' != *end || size > (LLONG_MAX >> shift)) return -1;
+	return size << shift;
+}
+
 static struct parameters *parse_arguments(int argc, char **argv)
 {
 	struct parameters *params = malloc(sizeof(struct parameters));
@@ -105,6 +209,11 @@ static struct parameters *parse_arguments(int argc, char **argv)
 	params->files = calloc(MAX_FILES, sizeof(struct file_params));
 	if (NULL == params->files) die (NULL);
 	params->chunk_size = WHOLE_FILE;
+	params->num_workers = 1;
+	params->sample_size = DEFAULT_SAMPLE_SIZE;
+	params->cache_dir = NULL;
+	params->memory_budget = 0;
+	params->output_format = RESULT_TSV;
 
 	int file_num = 0;
 	// TODO: refactor this (done also at end of loop). In fact, is this
@@ -121,6 +230,12 @@ static struct parameters *parse_arguments(int argc, char **argv)
 	params->files[file_num].foreign_key = NULL;
 	params->files[file_num].fk_referent = NULL;
 	params->files[file_num].alias = NULL;
+	params->files[file_num].sidecar_index_fields = NULL;
+	params->files[file_num].null_token = NULL;
+	params->files[file_num].kept_fields = NULL;
+	params->files[file_num].used_fields = NULL;
+	params->files[file_num].filter = NULL;
+	params->files[file_num].csv = NULL;
 
 	int argn;
 	/* 1: skips prog name; -1: last arg is SQL */
@@ -140,6 +255,40 @@ static struct parameters *parse_arguments(int argc, char **argv)
 				argn++;
 				params->chunk_size = atoi(argv[argn]);
 			}
+			else if (0 == strcmp("-o", argv[argn])) {
+				argn++;
+				if (! result_format_named(argv[argn],
+						&params->output_format))
+					die("unknown output format (-o)");
+			}
+			else if (0 == strcmp("-M", argv[argn]))
+				params->switches |= sw_merge;
+			else if (0 == strcmp("-A", argv[argn]))
+				params->switches |= sw_advise_indexes;
+			else if (0 == strcmp("-j", argv[argn])) {
+				argn++;
+				params->num_workers = atoi(argv[argn]);
+				if (params->num_workers < 1)
+					params->num_workers = 1;
+			}
+			else if (0 == strcmp("-S", argv[argn])) {
+				argn++;
+				params->sample_size = atoi(argv[argn]);
+				if (params->sample_size < 1)
+					params->sample_size = 1;
+			}
+			else if (0 == strcmp("-m", argv[argn])) {
+				argn++;
+				params->memory_budget = parse_size(argv[argn]);
+				if (params->memory_budget < 1)
+					die("invalid memory budget (-m)");
+			}
+			else if (0 == strcmp("-C", argv[argn])) {
+				argn++;
+				params->cache_dir = strdup(argv[argn]);
+			}
+			else if (0 == strcmp("-u", argv[argn]))
+				params->switches |= sw_unordered;
 			else if (0 == strcmp("-a", argv[argn])) {
 				argn++;
 				params->files[file_num].alias = strdup(argv[argn]);
@@ -166,6 +315,39 @@ static struct parameters *parse_arguments(int argc, char **argv)
 				params->files[file_num].file_switches 
 					|= fsw_no_headers;
 			}
+			else if (0 == strcmp("-Q", argv[argn])) {
+				params->files[file_num].file_switches
+					|= fsw_quoted;
+			}
+			else if (0 == strcmp("-V", argv[argn])) {
+				params->files[file_num].file_switches
+					|= fsw_virtual;
+			}
+			else if (0 == strcmp("-O", argv[argn])) {
+				params->files[file_num].file_switches
+					|= fsw_sort;
+			}
+			else if (0 == strcmp("-R", argv[argn])) {
+				params->files[file_num].file_switches
+					|= fsw_sorted;
+			}
+			else if (0 == strcmp("-X", argv[argn])) {
+				argn++;
+				params->files[file_num].sidecar_index_fields =
+					strdup(argv[argn]);
+				params->files[file_num].file_switches
+					|= fsw_virtual;
+			}
+			else if (0 == strcmp("-c", argv[argn])) {
+				argn++;
+				params->files[file_num].kept_fields =
+					strdup(argv[argn]);
+			}
+			else if (0 == strcmp("-N", argv[argn])) {
+				argn++;
+				params->files[file_num].null_token =
+					strdup(argv[argn]);
+			}
 			else if (0 == strcmp("-s", argv[argn])) {
 				argn++;
 				params->files[file_num].separator =
@@ -205,6 +387,12 @@ static struct parameters *parse_arguments(int argc, char **argv)
 			params->files[file_num].text_fields = NULL;
 			params->files[file_num].primary_key_fields = NULL;
 			params->files[file_num].foreign_key = NULL;
+			params->files[file_num].sidecar_index_fields = NULL;
+			params->files[file_num].null_token = NULL;
+			params->files[file_num].kept_fields = NULL;
+			params->files[file_num].used_fields = NULL;
+			params->files[file_num].filter = NULL;
+			params->files[file_num].csv = NULL;
 		}
 	}
 	params->num_files = file_num;
@@ -220,8 +408,27 @@ static void show_params(struct parameters *params)
 	printf("verbose:\t%c\n", params->switches & sw_verbose ? 'T' : 'F');
 	printf("show generated SQL:\t%c\n", params->switches & sw_show_sql ? 'T' : 'F');
 	printf("database:\t%s\n", params->database);
+	if (params->switches & sw_advise_indexes)
+		printf("index advisor:\tT\n");
+	if (NULL != params->cache_dir)
+		printf("import cache:\t%s\n", params->cache_dir);
+	if (0 != params->memory_budget)
+		printf("memory budget:\t%lld bytes\n",
+			(long long) params->memory_budget);
+	if (RESULT_TSV != params->output_format)
+		printf("output format:\t%s\n",
+			result_format_name(params->output_format));
 	if (WHOLE_FILE != params->chunk_size) 
-		printf("last table flushed every %d rows.\n", params->chunk_size);
+		printf("last table flushed every %d rows%s.\n",
+			params->chunk_size, params->switches & sw_merge ?
+			", results merged" : "");
+	if (DEFAULT_SAMPLE_SIZE != params->sample_size)
+		printf("column types inferred from %d line(s).\n",
+			params->sample_size);
+	if (params->num_workers > 1)
+		printf("%d parser threads per file, %s.\n", params->num_workers,
+			params->switches & sw_unordered ?
+			"rows in any order" : "rows in file order");
 	printf("\n");
 	printf("%d file(s):\n", params->num_files);
 	for (int i = 0; i < params->num_files; i++) {
@@ -234,25 +441,51 @@ static void show_params(struct parameters *params)
 			printf (", not indexed");
 		else
 			printf (", indexed on %s", fp.index_fields);
-		printf(", separated by ");
-		if ('\t' == fp.separator)
-			printf("TAB");
-		else 
-			printf("'%c'", fp.separator);
-		if (NULL == fp.first_line_re)
-			printf(", no lines skipped");
-		else {
-			printf(", skip to %s", fp.first_line_re);
-			if (fp.file_switches & fsw_show_skipped_lines) 
-				printf ("(skipped lines shown)");
+		enum compression compression = COMPRESSION_NONE;
+		if (0 != strcmp("-", fp.filename))
+			compression = file_compression(fp.filename);
+		if (COMPRESSION_NONE != compression)
+			printf(", %s-compressed",
+					compression_name(compression));
+		if (0 != strcmp("-", fp.filename) &&
+				is_arrow_file(fp.filename)) {
+			printf(", Arrow IPC data");
+		} else {
+			printf(", separated by ");
+			if ('\t' == fp.separator)
+				printf("TAB");
+			else 
+				printf("'%c'", fp.separator);
+			if (NULL == fp.first_line_re)
+				printf(", no lines skipped");
+			else {
+				printf(", skip to %s", fp.first_line_re);
+				if (fp.file_switches & fsw_show_skipped_lines) 
+					printf ("(skipped lines shown)");
+			}
 		}
 		if (NULL != fp.text_fields)
 			printf(", field(s) '%s' forced to TEXT",
 				fp.text_fields);
+		if (NULL != fp.kept_fields)
+			printf(", only field(s) '%s' kept", fp.kept_fields);
+		if (NULL != fp.null_token)
+			printf(", '%s' is NULL", fp.null_token);
 		if (fp.file_switches & fsw_literal_col_names)
 			printf (", literal column names");
+		if (fp.file_switches & fsw_quoted)
+			printf (", RFC 4180 quoting");
+		if (fp.file_switches & fsw_virtual)
+			printf (", read in place (virtual table)");
+		if (NULL != fp.sidecar_index_fields)
+			printf (", sidecar index on %s",
+				fp.sidecar_index_fields);
 		if (NULL != fp.primary_key_fields)
 			printf (", PRIMARY KEY %s", fp.primary_key_fields);
+		if (fp.file_switches & fsw_sorted)
+			printf (", already sorted by key");
+		else if (fp.file_switches & fsw_sort)
+			printf (", sorted by key");
 		if (NULL != fp.foreign_key) 
 			printf (", foreign key '%s' on '%s'",
 				fp.foreign_key, fp.fk_referent);
@@ -339,21 +572,112 @@ static bool is_string_numeric(const char *s)
     return '\0' == *p;
 }
 
-static char ** get_column_types(char **field_values, int num_fields)
+static bool is_null_token(const buf_csv_field_t *fld, const char *null_token,
+		size_t null_token_len)
+{
+	return NULL != null_token && null_token_len == fld->len &&
+		0 == memcmp(null_token, fld->start, fld->len);
+}
+
+/* Widens 'types' to those of a line's values. Missing values (empty, or the
+ * NULL token) have no type. */
+
+static void sample_line(const buf_csv_field_t *fields, int num_fields,
+		const char *null_token, enum column_type *types)
+{
+	size_t null_token_len = NULL == null_token ? 0 : strlen(null_token);
+	for (int i = 0; i < num_fields; i++) {
+		const buf_csv_field_t *fld = &fields[i];
+		if (COL_TEXT == types[i] || 0 == fld->len ||
+				is_null_token(fld, null_token, null_token_len))
+			continue;
+		enum column_type type;
+		switch (csv_number_class(fld)) {
+		case CSV_INTEGER: type = COL_INTEGER; break;
+		case CSV_REAL: type = COL_NUMERIC; break;
+		default: type = COL_TEXT;
+		}
+		if (type > types[i]) types[i] = type;
+	}
+}
+
+/* Reads the sample lines of a mmap()ed file: up to 'sample_size' lines, from
+ * SAMPLE_STRIDES evenly spaced places if the file can be split, else from the
+ * start. Leaves the buffered_CSV where it was. */
+
+static void sample_file(buffered_CSV_t *buf_csv, int num_fields,
+		int sample_size, const char *null_token, enum column_type *types)
+{
+	off_t data_start = buf_csv_tell(buf_csv);
+	off_t data_len = buf_csv_size(buf_csv) - data_start;
+	int num_strides = buf_csv_splittable(buf_csv) &&
+		sample_size >= SAMPLE_STRIDES ? SAMPLE_STRIDES : 1;
+	int stride_lines = (sample_size + num_strides - 1) / num_strides;
+
+	buf_csv_field_t *fields = malloc(num_fields * sizeof(buf_csv_field_t));
+	if (NULL == fields) die(NULL);
+
+	for (int stride = 0; stride < num_strides; stride++) {
+		if (stride > 0 && -1 == buf_csv_seek_line(buf_csv, data_start +
+					data_len / num_strides * stride))
+			break;
+		/* as when importing, a short line ends the data */
+		for (int line = 0; line < stride_lines; line++) {
+			if (-1 == buf_csv_next_data_line_slices(buf_csv,
+						fields))
+				break;
+			sample_line(fields, num_fields, null_token, types);
+		}
+	}
+
+	free(fields);
+	buf_csv_seek(buf_csv, data_start);
+}
+
+/* Returns the column types inferred from a sample of the data lines (see
+ * sample_file()): INTEGER if all the sampled values of a column are integers,
+ * NUMERIC if they are all numbers, TEXT otherwise, or if they are all missing.
+ * Streams can't be sampled beyond their first line, but the import retypes
+ * columns that get values of a wider type later on (see retype_table()). */
+
+static char ** get_column_types(buffered_CSV_t *buf_csv, int num_fields,
+		int sample_size, const char *null_token)
 {
+	enum column_type types[num_fields];
+	for (int i = 0; i < num_fields; i++)
+		types[i] = COL_NONE;
+
+	if (-1 == buf_csv_tell(buf_csv)) {
+		char **field_values = buf_csv_first_data_line_fields(buf_csv);
+		if (NULL == field_values) return NULL;
+		buf_csv_field_t fields[num_fields];
+		for (int i = 0; i < num_fields; i++) {
+			fields[i].start = field_values[i];
+			fields[i].len = strlen(field_values[i]);
+		}
+		sample_line(fields, num_fields, null_token, types);
+		free_string_array(field_values, num_fields);
+	} else {
+		sample_file(buf_csv, num_fields, sample_size, null_token,
+				types);
+	}
+
 	char ** field_types = malloc(num_fields * sizeof(char *));
 	if (NULL == field_types)
 		return NULL;
 	for (int i = 0; i < num_fields; i++) {
-		if (is_string_numeric(field_values[i]))
+		switch (types[i]) {
+		case COL_INTEGER:
+			field_types[i] = strdup(INT_TYPE);
+			break;
+		case COL_NUMERIC:
 			field_types[i] = strdup(NUM_TYPE);
-		else
+			break;
+		default:
 			field_types[i] = strdup(TEXT_TYPE);
+		}
 	}
 
-
-	free_string_array(field_values, num_fields);
-
 	return field_types;
 }
 
@@ -376,7 +700,9 @@ static char *filename2tablename(const char *filename)
 	else
 		start = last_slash + 1;	/* start just after the last '/' */
 
-	/* get rid of extension, if any (anything after last '.') */ 
+	/* get rid of compression suffix, then of extension, if any
+	 * (anything after last '.'): calls.vcf.gz -> calls */
+	start[strlen(start) - compression_suffix_len(start)] = '\0';
 	char * rd = rindex (start, '.');
 	if (NULL != rd) *rd = '\0';
 
@@ -499,7 +825,8 @@ static char *mk_constraints_part(char *primary_key_fields, char *foreign_key,
 
 static char *construct_create_tbl_SQL(const char *tbl_name, int num_fields,
 		char ** field_names, char ** field_types,
-		char *primary_key_fields, char *foreign_key, char *fk_referent)
+		char *primary_key_fields, char *foreign_key, char *fk_referent,
+		bool without_rowid)
 {
 	char *table_name = strdup(tbl_name);
 	if (NULL == table_name) { perror(NULL); exit(EXIT_FAILURE); }
@@ -519,7 +846,7 @@ static char *construct_create_tbl_SQL(const char *tbl_name, int num_fields,
 			fk_referent);
 	if (NULL == part) { perror(NULL); exit(EXIT_FAILURE); }
 	sql_parts[2] = part;
-	part = strdup(");");
+	part = strdup(without_rowid ? ") WITHOUT ROWID;" : ");");
 	if (NULL == part) { perror(NULL); exit(EXIT_FAILURE); }
 	sql_parts[3] = part;
 	
@@ -594,7 +921,8 @@ static void skip_line (FILE *csv)
 
 static void create_file_table(sqlite3 *db, const char *tbl_name, int num_fields,
 	char ** col_names, char ** col_types, char *primary_key_fields,
-	char *foreign_key, char *fk_referent, int run_switches)
+	char *foreign_key, char *fk_referent, bool without_rowid,
+	int run_switches)
 {
 	char *error_msg = NULL;
 
@@ -604,7 +932,7 @@ static void create_file_table(sqlite3 *db, const char *tbl_name, int num_fields,
 
 	char * create_tbl_SQL = construct_create_tbl_SQL(tbl_name,
 			num_fields, col_names, col_types, primary_key_fields,
-			foreign_key, fk_referent);
+			foreign_key, fk_referent, without_rowid);
 	if (NULL == create_tbl_SQL) { perror(NULL); exit (EXIT_FAILURE); }
 
 	if (run_switches & sw_show_sql)
@@ -640,210 +968,1396 @@ static sqlite3_stmt* prepare_insert_statement(sqlite3 *db, const char *tbl_name,
 	return stmt;
 }
 
-// TODO: could dispense with *db by returning the error msg or code
-static void insert_chunk(sqlite3 *db, buffered_CSV_t *buf_csv, int num_fields,
-		int chunk_size, sqlite3_stmt *stmt)
-{
-	if (WHOLE_FILE == chunk_size) chunk_size = INT_MAX;
-
-	for (int nrow = 0; nrow < chunk_size ; nrow++) {
-		char ** fld_vals = buf_csv_next_data_line_fields(buf_csv);
-		if (NULL == fld_vals) break;
-
-		/* Bind all fields in turn */
-		int sql_result;
-		for (int i = 0; i < num_fields; i++) {
-			sql_result = sqlite3_bind_text(stmt, i+1, fld_vals[i],
-					-1, SQLITE_TRANSIENT);
-			if (SQLITE_OK != sql_result)
-				die (sqlite3_errmsg(db));
-		}
+/* Values are converted in C and bound with their type, rather than bound as
+ * text for SQLite to parse: numbers for fields of numeric columns that look
+ * like numbers, NULL for empty fields of numeric columns and for fields equal
+ * to the file's NULL token (-N), text otherwise. */
+
+struct field_value {
+	int type;	/* SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_TEXT or SQLITE_NULL
+			 * (or SQLITE_BLOB, from Arrow files) */
+	union {
+		sqlite3_int64 integer;
+		double real;
+		buf_csv_field_t text;	/* also of blobs */
+	} u;
+};
 
-		sqlite3_step(stmt);
-		sqlite3_clear_bindings(stmt);
-		sqlite3_reset(stmt);
+struct column_conversion {
+	int num_fields;	/* of the table */
+	int num_file_fields;
+	int *file_field;	/* of each column, NULL if the same */
+	enum column_type *types;	/* as declared */
+	enum column_type *widest;	/* of the values converted so far */
+	const char *null_token;	/* NULL if none */
+	size_t null_token_len;
+	struct row_filter *filter;	/* rows that fail it are dropped */
+};
 
-		free_string_array(fld_vals, num_fields);
+/* SQLite's rules for a column's affinity, from its declared type. REAL counts
+ * as NUMERIC, since it takes any number, and BLOB as TEXT. */
 
-	}
+static enum column_type affinity_type(const char *decl_type)
+{
+	if (NULL == decl_type || '\0' == *decl_type) return COL_TEXT; /* BLOB */
+	if (NULL != strcasestr(decl_type, "INT")) return COL_INTEGER;
+	if (NULL != strcasestr(decl_type, "CHAR") ||
+		NULL != strcasestr(decl_type, "CLOB") ||
+		NULL != strcasestr(decl_type, "TEXT") ||
+		NULL != strcasestr(decl_type, "BLOB"))
+		return COL_TEXT;
+	return COL_NUMERIC;	/* NUMERIC or REAL */
 }
 
-// static void insert_csv_into_table(sqlite3 *db, FILE* csv, const char *tbl_name,
-// 	int num_fields, char separator, int run_switches)
-// {
-// 
-// 	sqlite3_stmt *stmt = prepare_insert_statement(db, tbl_name,
-// 			num_fields, run_switches);	
-// 	//if (NULL == stmt) die (sqlite3_errmsg(db));
-// 	if (run_switches & sw_dry_run) return;
-// 
-// 	int sql_result;
-// 	char *csv_line = NULL;
-// 	size_t len = 0;
-// 	while (-1 != getline(&csv_line, &len, csv)) {
-// 		
-// 		char ** fld_vals = tokenize(csv_line, separator, num_fields);
-// 		free(csv_line);
-// 		/* loop ends at eof or of no more values can be read */
-// 		if (NULL == fld_vals) break;
-// 
-// 		/* Bind all fields in turn */
-// 		for (int i = 0; i < num_fields; i++) {
-// 			sql_result = sqlite3_bind_text(stmt, i+1, fld_vals[i],
-// 					-1, SQLITE_TRANSIENT);
-// 			if (SQLITE_OK != sql_result)
-// 				die (sqlite3_errmsg(db));
-// 		}
-// 
-// 		sqlite3_step(stmt);
-// 		sqlite3_clear_bindings(stmt);
-// 		sqlite3_reset(stmt);
-// 
-// 		free_string_array(fld_vals, num_fields);
-// 
-// 		/* Reset these for next iteration (or SIGSEGV!) */
-// 		csv_line = NULL;
-// 		len = 0;
-// 	}
-// 	free(csv_line);
-// 
-// 	sqlite3_finalize(stmt);
-// }
+/* Reads the column types off table 'tbl_name', which must exist (so this
+ * also works for a table created on an earlier run, or retyped). The table's
+ * columns are fields 'field_map' (see kept_field_map()) of the file's
+ * 'num_file_fields'; the conversion takes over 'field_map'. */
 
-static void print_headers(sqlite3_stmt *stmt)
+static struct column_conversion *get_column_conversion(sqlite3 *db,
+		const char *tbl_name, int num_fields, int num_file_fields,
+		int *field_map, struct file_params fp)
 {
-	int num_col = sqlite3_column_count(stmt);
-	printf("%s", sqlite3_column_name(stmt, 0));
-	for (int i = 1; i < num_col; i++) {
-		printf("\t%s", sqlite3_column_name(stmt, i));	
+	struct column_conversion *conv = malloc(
+			sizeof(struct column_conversion));
+	if (NULL == conv) die(NULL);
+	conv->num_fields = num_fields;
+	conv->num_file_fields = num_file_fields;
+	conv->file_field = field_map;
+	conv->types = calloc(num_fields, sizeof(enum column_type));
+	conv->widest = calloc(num_fields, sizeof(enum column_type));
+	if (NULL == conv->types || NULL == conv->widest) die(NULL);
+	conv->null_token = fp.null_token;
+	conv->null_token_len = NULL == fp.null_token ? 0 : strlen(fp.null_token);
+	conv->filter = NULL;
+
+	char *sql = sqlite3_mprintf("PRAGMA table_info(%Q)", tbl_name);
+	if (NULL == sql) die(NULL);
+	sqlite3_stmt *stmt;
+	if (SQLITE_OK != sqlite3_prepare_v2(db, sql, -1, &stmt, NULL))
+		die(sqlite3_errmsg(db));
+	sqlite3_free(sql);
+	while (SQLITE_ROW == sqlite3_step(stmt)) {
+		int col = sqlite3_column_int(stmt, 0);
+		if (col < num_fields)
+			conv->types[col] = affinity_type(
+				(const char *) sqlite3_column_text(stmt, 2));
 	}
-	printf("\n");
+	sqlite3_finalize(stmt);
+	memcpy(conv->widest, conv->types, num_fields *
+			sizeof(enum column_type));
+
+	return conv;
 }
 
-static void print_values(sqlite3_stmt *stmt)
+static void free_column_conversion(struct column_conversion *conv)
 {
-	int num_col = sqlite3_column_count(stmt);
-	printf("%s", sqlite3_column_text(stmt, 0));
-	for (int i = 1; i < num_col; i++) {
-		printf("\t%s", sqlite3_column_text(stmt, i));	
-	}
-	printf("\n");
+	free(conv->types);
+	free(conv->widest);
+	free(conv->file_field);
+	free(conv);
 }
 
-void execute_user_query(sqlite3 *db, char *user_sql)
-{
-	sqlite3_stmt *stmt = NULL;
-	const char *tail;
+/* Also widens 'widest' to the types of the values of numeric columns. */
 
-	sqlite3_prepare_v2(db, user_sql, -1, &stmt, &tail);
-	int result;
-	bool first = true;
-	while ((result = sqlite3_step(stmt)) != SQLITE_DONE) {
-		switch (result) {
-			case SQLITE_ROW:
-				if (first) { /* headers */
-					print_headers(stmt);
-					first = false;
-				}
-				print_values(stmt);
+static void convert_fields(const struct column_conversion *conv,
+		const buf_csv_field_t *fields, struct field_value *values,
+		enum column_type *widest)
+{
+	for (int i = 0; i < conv->num_fields; i++) {
+		const buf_csv_field_t *fld = &fields[NULL == conv->file_field ?
+			i : conv->file_field[i]];
+		struct field_value *val = &values[i];
+		double real;
+		int64_t integer;
+
+		if (is_null_token(fld, conv->null_token,
+					conv->null_token_len)) {
+			val->type = SQLITE_NULL;
+		} else if (COL_TEXT == conv->types[i]) {
+			val->type = SQLITE_TEXT;
+			val->u.text = *fld;
+		} else if (0 == fld->len) {
+			val->type = SQLITE_NULL;
+		} else {
+			switch (csv_number(fld, &integer, &real)) {
+			case CSV_INTEGER:
+				val->type = SQLITE_INTEGER;
+				val->u.integer = integer;
+				break;
+			case CSV_REAL:
+				val->type = SQLITE_FLOAT;
+				val->u.real = real;
+				if (COL_INTEGER == widest[i])
+					widest[i] = COL_NUMERIC;
 				break;
 			default:
-				die(sqlite3_errmsg(db));
+				val->type = SQLITE_TEXT;
+				val->u.text = *fld;
+				widest[i] = COL_TEXT;
+			}
 		}
 	}
-
-	sqlite3_finalize(stmt);
 }
 
-static void start_transaction(sqlite3 *db)
+/* A pushed-down filter (see csv_filter.h), ready to be checked on a row's
+ * values: each literal is converted as SQLite would for comparing it to the
+ * column, i.e. to a number if the column is numeric and it looks like one, to
+ * text if the column is TEXT. A test on a numeric column only holds as long
+ * as the column is not retyped to TEXT, as numbers then compare as text: such
+ * tests are 'unstable'. */
+
+struct value_test {
+	int col;	/* of the table */
+	enum csv_filter_op op;
+	int num_values;
+	struct field_value *values;
+	char **texts;	/* owned by the test, or NULL */
+	bool stable;
+	const char *sql;
+};
+
+struct row_filter {
+	int num_tests;
+	struct value_test *tests;
+};
+
+/* Compiles the terms of 'filter' that apply to the columns of 'conv' (only
+ * the stable ones if 'stable_only'), except those that have gone stale.
+ * Returns NULL if there are none. Real
+ * literals are not compared to TEXT columns, as they would have to be
+ * rendered exactly as SQLite does. */
+
+static struct row_filter *create_row_filter(const csv_filter_t *filter,
+		const struct column_conversion *conv, bool stable_only)
 {
-	char *error_msg = NULL;
-	int sql_result = sqlite3_exec(
-		db, "BEGIN TRANSACTION", NULL, NULL, &error_msg);
-	if (SQLITE_OK != sql_result) die (error_msg);
+	struct row_filter *rf = calloc(1, sizeof(struct row_filter));
+	if (NULL == rf) die(NULL);
+	rf->tests = calloc(filter->num_terms, sizeof(struct value_test));
+	if (NULL == rf->tests) die(NULL);
+
+	for (int t = 0; t < filter->num_terms; t++) {
+		const struct csv_filter_term *term = &filter->terms[t];
+		int col;
+		for (col = 0; col < conv->num_fields; col++)
+			if (term->col == (NULL == conv->file_field ? col :
+						conv->file_field[col]))
+				break;
+		if (col == conv->num_fields) continue;
+		bool text_col = COL_TEXT == conv->types[col];
+		bool stable = text_col || 0 == term->num_values;
+		if (! stable && (stable_only ||
+					COL_TEXT == conv->widest[col]))
+			continue;
+		bool real_vs_text = false;
+		for (int v = 0; v < term->num_values; v++)
+			if (text_col && CSV_FILTER_REAL ==
+					term->values[v].type)
+				real_vs_text = true;
+		if (real_vs_text) continue;
+
+		struct value_test *test = &rf->tests[rf->num_tests++];
+		test->col = col;
+		test->op = term->op;
+		test->num_values = term->num_values;
+		test->stable = stable;
+		test->sql = term->sql;
+		test->values = calloc(term->num_values,
+				sizeof(struct field_value));
+		test->texts = calloc(term->num_values, sizeof(char *));
+		if (NULL == test->values || NULL == test->texts) die(NULL);
+		for (int v = 0; v < term->num_values; v++) {
+			const struct csv_filter_literal *lit = &term->values[v];
+			struct field_value *val = &test->values[v];
+			buf_csv_field_t text = { lit->text, lit->len };
+			if (CSV_FILTER_INTEGER == lit->type && text_col) {
+				if (-1 == asprintf(&test->texts[v], "%lld",
+						(long long) lit->integer))
+					die(NULL);
+				text.start = test->texts[v];
+				text.len = strlen(test->texts[v]);
+			}
+			if (CSV_FILTER_INTEGER == lit->type && ! text_col) {
+				val->type = SQLITE_INTEGER;
+				val->u.integer = lit->integer;
+			} else if (CSV_FILTER_REAL == lit->type) {
+				val->type = SQLITE_FLOAT;
+				val->u.real = lit->real;
+			} else if (text_col) {
+				val->type = SQLITE_TEXT;
+				val->u.text = text;
+			} else {
+				int64_t integer;
+				double real;
+				switch (csv_number(&text, &integer, &real)) {
+				case CSV_INTEGER:
+					val->type = SQLITE_INTEGER;
+					val->u.integer = integer;
+					break;
+				case CSV_REAL:
+					val->type = SQLITE_FLOAT;
+					val->u.real = real;
+					break;
+				default:
+					val->type = SQLITE_TEXT;
+					val->u.text = text;
+				}
+			}
+		}
+	}
+
+	if (0 == rf->num_tests) {
+		free(rf->tests);
+		free(rf);
+		return NULL;
+	}
+	return rf;
 }
 
-static void stop_transaction(sqlite3 *db)
+static void free_row_filter(struct row_filter *rf)
 {
-	char *error_msg = NULL;
-	int sql_result = sqlite3_exec(
-		db, "END TRANSACTION", NULL, NULL, &error_msg);
-	if (SQLITE_OK != sql_result) die (error_msg);
+	if (NULL == rf) return;
+	for (int t = 0; t < rf->num_tests; t++) {
+		for (int v = 0; v < rf->tests[t].num_values; v++)
+			free(rf->tests[t].texts[v]);
+		free(rf->tests[t].texts);
+		free(rf->tests[t].values);
+	}
+	free(rf->tests);
+	free(rf);
 }
 
-static void create_index(sqlite3 *db, char *tbl_name, char *index_fields,
-		int run_switches)
+/* Returns true iff an unstable test's column has been retyped to TEXT. */
+
+static bool row_filter_is_stale(const struct row_filter *rf,
+		const struct column_conversion *conv)
 {
-	char *create_index_SQL = construct_index_SQL(tbl_name, index_fields);
-	if (run_switches & sw_show_sql)
-		printf ("-- Create index:\n%s\n", create_index_SQL);
-	if (run_switches & sw_dry_run) return;
+	if (NULL == rf) return false;
+	for (int t = 0; t < rf->num_tests; t++)
+		if (! rf->tests[t].stable &&
+				COL_TEXT == conv->widest[rf->tests[t].col])
+			return true;
+	return false;
+}
 
-	char *error_msg = NULL;
-	int sql_result = sqlite3_exec(db, create_index_SQL,
-			NULL, NULL, &error_msg);
-	if (SQLITE_OK != sql_result) die(error_msg);
+/* Compares an integer to a real the way SQLite does, without losing
+ * precision on large integers. */
 
-	free(create_index_SQL);
+static int compare_int_real(sqlite3_int64 i, double r)
+{
+	if (r < -9223372036854775808.0) return 1;
+	if (r >= 9223372036854775808.0) return -1;
+	sqlite3_int64 y = (sqlite3_int64) r;
+	if (i != y) return i < y ? -1 : 1;
+	double d = (double) i;
+	return d < r ? -1 : d > r;
 }
 
+/* Compares two non-NULL values as SQLite does with the BINARY collation:
+ * numbers sort before text. */
 
-static char **get_column_names(buffered_CSV_t *buf_csv, bool literal)
+static int compare_values(const struct field_value *a,
+		const struct field_value *b)
 {
-	char **col_names = buf_csv_header_fields(buf_csv);
-	int field_count = buf_csv_field_count(buf_csv);
+	bool a_text = SQLITE_TEXT == a->type, b_text = SQLITE_TEXT == b->type;
+	if (a_text != b_text) return a_text ? 1 : -1;
+	if (a_text) {
+		size_t len = a->u.text.len < b->u.text.len ?
+			a->u.text.len : b->u.text.len;
+		int cmp = memcmp(a->u.text.start, b->u.text.start, len);
+		if (0 != cmp) return cmp;
+		return a->u.text.len < b->u.text.len ? -1 :
+			a->u.text.len > b->u.text.len;
+	}
+	if (SQLITE_INTEGER == a->type && SQLITE_INTEGER == b->type)
+		return a->u.integer < b->u.integer ? -1 :
+			a->u.integer > b->u.integer;
+	if (SQLITE_INTEGER == a->type)
+		return compare_int_real(a->u.integer, b->u.real);
+	if (SQLITE_INTEGER == b->type)
+		return -compare_int_real(b->u.integer, a->u.real);
+	return a->u.real < b->u.real ? -1 : a->u.real > b->u.real;
+}
 
-	if (literal) {
-		for (int i = 0; i < field_count; i++) {
-			char *lit_name;
-			if (-1 == asprintf(&lit_name, "'%s'", col_names[i]))
-				return NULL;
-			free(col_names[i]);
-			col_names[i] = lit_name;
+static bool row_passes(const struct row_filter *rf,
+		const struct field_value *values)
+{
+	for (int t = 0; t < rf->num_tests; t++) {
+		const struct value_test *test = &rf->tests[t];
+		const struct field_value *val = &values[test->col];
+		bool is_null = SQLITE_NULL == val->type;
+		if (CSV_FILTER_IS_NULL == test->op) {
+			if (! is_null) return false;
+			continue;
 		}
-	} else {
-		for (int i = 0; i < field_count; i++) {
-			char *sql_name = free2SQL(col_names[i]);
-			free(col_names[i]);
-			col_names[i] = sql_name;
+		if (CSV_FILTER_NOT_NULL == test->op) {
+			if (is_null) return false;
+			continue;
+		}
+		if (is_null) return false;
+
+		bool pass = false;
+		for (int v = 0; v < test->num_values && ! pass; v++) {
+			int cmp = compare_values(val, &test->values[v]);
+			switch (test->op) {
+			case CSV_FILTER_EQ:
+			case CSV_FILTER_IN: pass = 0 == cmp; break;
+			case CSV_FILTER_NE: pass = 0 != cmp; break;
+			case CSV_FILTER_LT: pass = cmp < 0; break;
+			case CSV_FILTER_LE: pass = cmp <= 0; break;
+			case CSV_FILTER_GT: pass = cmp > 0; break;
+			case CSV_FILTER_GE: pass = cmp >= 0; break;
+			default: pass = true;
+			}
 		}
+		if (! pass) return false;
 	}
+	return true;
+}
 
-	return col_names;
+/* Binds a row's values to parameters 'first_param' and following. Text values
+ * are bound as SQLITE_STATIC views: the caller must keep them valid until the
+ * statement has been stepped. */
+
+static void bind_row(sqlite3 *db, sqlite3_stmt *stmt, int first_param,
+		const struct field_value *values, int num_fields)
+{
+	int sql_result = SQLITE_OK;
+	for (int i = 0; i < num_fields; i++) {
+		const struct field_value *val = &values[i];
+		int param = first_param + i;
+		switch (val->type) {
+		case SQLITE_INTEGER:
+			sql_result = sqlite3_bind_int64(stmt, param,
+					val->u.integer);
+			break;
+		case SQLITE_FLOAT:
+			sql_result = sqlite3_bind_double(stmt, param,
+					val->u.real);
+			break;
+		case SQLITE_NULL:
+			sql_result = sqlite3_bind_null(stmt, param);
+			break;
+		case SQLITE_BLOB:
+			sql_result = sqlite3_bind_blob(stmt, param,
+					val->u.text.start, val->u.text.len,
+					SQLITE_STATIC);
+			break;
+		default:
+			sql_result = sqlite3_bind_text(stmt, param,
+					val->u.text.start, val->u.text.len,
+					SQLITE_STATIC);
+		}
+		if (SQLITE_OK != sql_result)
+			die (sqlite3_errmsg(db));
+	}
 }
 
-/* Returns the index of 'query' in 'array' */
+/* Returns false if the row was not inserted (e.g. on a key constraint). */
 
-static int index_of (char *query, char **str_array, int num_fields)
+static bool insert_row(sqlite3 *db, sqlite3_stmt *stmt,
+		const struct field_value *values, int num_fields)
 {
-	int i;
-	for (i = 0; i < num_fields; i++) 
-		if (0 == strcmp(query, str_array[i]))
-			return i;
-	return -1;
+	bind_row(db, stmt, 1, values, num_fields);
+	int result = sqlite3_step(stmt);
+	sqlite3_clear_bindings(stmt);
+	sqlite3_reset(stmt);
+	return SQLITE_DONE == result;
 }
 
-static void coerce_to_text(char* flds, char ** col_types, char **field_names,
-		int num_fields)
+/* Adds a row that was inserted to the table's statistics. */
+
+static void add_row_stats(column_stats_t *stats,
+		const struct field_value *values, int num_fields)
 {
-	regex_t preg;
-	regmatch_t pmatch[1];
+	column_stats_add_row(stats);
+	for (int i = 0; i < num_fields; i++) {
+		const struct field_value *val = &values[i];
+		switch (val->type) {
+		case SQLITE_INTEGER:
+			column_stats_add_integer(stats, i, val->u.integer);
+			break;
+		case SQLITE_FLOAT:
+			column_stats_add_real(stats, i, val->u.real);
+			break;
+		case SQLITE_NULL:
+			column_stats_add_null(stats, i);
+			break;
+		case SQLITE_BLOB:
+			column_stats_add_blob(stats, i, val->u.text.start,
+					val->u.text.len);
+			break;
+		default:
+			column_stats_add_text(stats, i, val->u.text.start,
+					val->u.text.len);
+		}
+	}
+}
 
-	int result;
+/* Copies of text values that would not outlive their line. Blocks are never
+ * moved, so the copies stay valid until the store is cleared. */
 
-	result = regcomp(&preg, "[^,]+", REG_EXTENDED);
-	assert(0 == result);
+struct text_store {
+	char **blocks;
+	int num_blocks;
+	size_t used;	/* in the last block */
+	size_t block_len;	/* of the last block */
+};
 
-	char *fields = strdup(flds);
-	int len = strlen(fields);
-	char *c;
-	/* iteratively try to match the regexp on the string */
-	for (c = fields; (c-fields) < len-1; ) {
-		result = regexec(&preg, c, 1, pmatch, 0);
-		switch (result) {
-		case 0: /* match */
-			c[pmatch[0].rm_eo] = '\0';
-			int n = -1;
+static void clear_text_store(struct text_store *store)
+{
+	for (int i = 0; i < store->num_blocks; i++)
+		free(store->blocks[i]);
+	store->num_blocks = 0;
+	store->used = store->block_len = 0;
+}
+
+static const char *copy_text(struct text_store *store, const char *text,
+		size_t len)
+{
+	if (store->used + len > store->block_len) {
+		size_t block_len = len > TEXT_BLOCK_SIZE ? len : TEXT_BLOCK_SIZE;
+		char **blocks = realloc(store->blocks,
+			(store->num_blocks + 1) * sizeof(char *));
+		if (NULL == blocks) die(NULL);
+		store->blocks = blocks;
+		blocks[store->num_blocks] = malloc(block_len);
+		if (NULL == blocks[store->num_blocks]) die(NULL);
+		store->num_blocks++;
+		store->used = 0;
+		store->block_len = block_len;
+	}
+	char *copy = store->blocks[store->num_blocks - 1] + store->used;
+	memcpy(copy, text, len);
+	store->used += len;
+	return copy;
+}
+
+/* Makes the text values of 'row' point to copies in 'store'. */
+
+static void copy_row_text(struct text_store *store, struct field_value *row,
+		int num_fields)
+{
+	for (int i = 0; i < num_fields; i++)
+		if (SQLITE_TEXT == row[i].type)
+			row[i].u.text.start = copy_text(store,
+				row[i].u.text.start, row[i].u.text.len);
+}
+
+/* Batched inserts: rows are kept until there are enough of them for a
+ * multi-row INSERT, which saves a statement step per row. The remaining rows
+ * are inserted by a statement sized for them when the batch is flushed. If a
+ * multi-row INSERT fails (e.g. on a key constraint), its rows are inserted
+ * one by one, so that only the offending rows are lost, as before. */
+
+struct row_batch {
+	sqlite3 *db;
+	char *tbl_name;
+	int num_fields;
+	sqlite3_stmt *row_stmt;	/* one row (the caller's) */
+	sqlite3_stmt *batch_stmt;	/* max_rows rows */
+	sqlite3_stmt *tail_stmt;	/* tail_rows rows, or NULL */
+	int max_rows;
+	int tail_rows;
+	struct field_value *rows;	/* num_rows rows of num_fields */
+	int num_rows;
+	bool copy_text;	/* if text values would not outlive their line */
+	struct text_store text;
+	column_stats_t *stats;	/* of the rows inserted, or NULL */
+	long num_added;	/* rows added so far, the current ones included */
+	const char *sorted_file;	/* if its key can't be NULL (-R), or NULL */
+};
+
+static sqlite3_stmt *prepare_batch_statement(sqlite3 *db,
+		const char *tbl_name, int num_fields, int num_rows)
+{
+	sqlite3_str *sql = sqlite3_str_new(db);
+	sqlite3_str_appendf(sql, "INSERT INTO %s VALUES ", tbl_name);
+	for (int row = 0; row < num_rows; row++) {
+		sqlite3_str_appendall(sql, row > 0 ? ", (?" : "(?");
+		for (int i = 1; i < num_fields; i++)
+			sqlite3_str_appendall(sql, ", ?");
+		sqlite3_str_appendchar(sql, 1, ')');
+	}
+	char *insert_SQL = sqlite3_str_finish(sql);
+	if (NULL == insert_SQL) die(NULL);
+
+	sqlite3_stmt *stmt;
+	if (SQLITE_OK != sqlite3_prepare_v2(db, insert_SQL, -1, &stmt, NULL))
+		die(sqlite3_errmsg(db));
+	sqlite3_free(insert_SQL);
+	return stmt;
+}
+
+/* 'copy_text' must be true unless text values stay valid until the batch has
+ * been flushed or destroyed. */
+
+static struct row_batch *create_row_batch(sqlite3 *db, const char *tbl_name,
+		int num_fields, sqlite3_stmt *row_stmt, bool copy_text)
+{
+	struct row_batch *batch = calloc(1, sizeof(struct row_batch));
+	if (NULL == batch) die(NULL);
+	batch->db = db;
+	batch->tbl_name = strdup(tbl_name);
+	if (NULL == batch->tbl_name) die(NULL);
+	batch->num_fields = num_fields;
+	batch->row_stmt = row_stmt;
+
+	int max_params = sqlite3_limit(db, SQLITE_LIMIT_VARIABLE_NUMBER, -1);
+	batch->max_rows = max_params / num_fields;
+	if (batch->max_rows > INSERT_BATCH_ROWS)
+		batch->max_rows = INSERT_BATCH_ROWS;
+	if (batch->max_rows < 1)
+		batch->max_rows = 1;
+	if (batch->max_rows > 1)
+		batch->batch_stmt = prepare_batch_statement(db, tbl_name,
+				num_fields, batch->max_rows);
+
+	batch->rows = malloc(batch->max_rows * num_fields *
+			sizeof(struct field_value));
+	if (NULL == batch->rows) die(NULL);
+	batch->copy_text = copy_text;
+
+	return batch;
+}
+
+/* A table loaded WITHOUT ROWID (-R) rejects NULL keys: this is an error,
+ * rather than a row silently lost. 'row' is the row's number in the batch;
+ * the message gives its number among the rows loaded, i.e. its data line if
+ * no WHERE term was pushed down (see csv_filter.h). */
+
+static void insert_batch_row(struct row_batch *batch, int row)
+{
+	const struct field_value *values = batch->rows +
+		row * batch->num_fields;
+	if (insert_row(batch->db, batch->row_stmt, values, batch->num_fields)) {
+		if (NULL != batch->stats)
+			add_row_stats(batch->stats, values, batch->num_fields);
+	} else if (NULL != batch->sorted_file && SQLITE_CONSTRAINT_NOTNULL ==
+			sqlite3_extended_errcode(batch->db)) {
+		char *msg;
+		if (-1 == asprintf(&msg, "%s: row %ld has a NULL key, which a "
+				"sorted table (-R) can't hold (use -O)",
+				batch->sorted_file, batch->num_added -
+				batch->num_rows + row + 1))
+			die(NULL);
+		die(msg);
+	}
+}
+
+static void step_batch(struct row_batch *batch, sqlite3_stmt *stmt,
+		int num_rows)
+{
+	int num_fields = batch->num_fields;
+	for (int row = 0; row < num_rows; row++)
+		bind_row(batch->db, stmt, row * num_fields + 1,
+				batch->rows + row * num_fields, num_fields);
+	int result = sqlite3_step(stmt);
+	sqlite3_reset(stmt);
+	if (SQLITE_DONE != result)
+		for (int row = 0; row < num_rows; row++)
+			insert_batch_row(batch, row);
+	else if (NULL != batch->stats)
+		for (int row = 0; row < num_rows; row++)
+			add_row_stats(batch->stats,
+				batch->rows + row * num_fields, num_fields);
+}
+
+static void flush_row_batch(struct row_batch *batch)
+{
+	int num_rows = batch->num_rows;
+	if (1 == num_rows) {
+		insert_batch_row(batch, 0);
+	} else if (num_rows == batch->max_rows) {
+		step_batch(batch, batch->batch_stmt, num_rows);
+	} else if (num_rows > 1) {
+		if (batch->tail_rows != num_rows) {
+			sqlite3_finalize(batch->tail_stmt);
+			batch->tail_stmt = prepare_batch_statement(batch->db,
+				batch->tbl_name, batch->num_fields, num_rows);
+			batch->tail_rows = num_rows;
+		}
+		step_batch(batch, batch->tail_stmt, num_rows);
+	}
+	batch->num_rows = 0;
+	if (batch->copy_text)
+		clear_text_store(&batch->text);
+}
+
+static void add_row(struct row_batch *batch, const struct field_value *values)
+{
+	int num_fields = batch->num_fields;
+	struct field_value *row = batch->rows + batch->num_rows * num_fields;
+	memcpy(row, values, num_fields * sizeof(struct field_value));
+	if (batch->copy_text)
+		copy_row_text(&batch->text, row, num_fields);
+	batch->num_added++;
+	if (++batch->num_rows == batch->max_rows)
+		flush_row_batch(batch);
+}
+
+/* Flushes the batch, but doesn't finalize the caller's statement. */
+
+static void destroy_row_batch(struct row_batch *batch)
+{
+	flush_row_batch(batch);
+	sqlite3_finalize(batch->batch_stmt);
+	sqlite3_finalize(batch->tail_stmt);
+	free(batch->text.blocks);
+	free(batch->rows);
+	free(batch->tbl_name);
+	free(batch);
+}
+
+// TODO: could dispense with *db by returning the error msg or code
+static void insert_chunk(struct row_batch *batch, buffered_CSV_t *buf_csv,
+		struct column_conversion *conv, int chunk_size)
+{
+	if (WHOLE_FILE == chunk_size) chunk_size = INT_MAX;
+	int num_fields = conv->num_fields;
+
+	buf_csv_field_t *fld_vals = malloc(conv->num_file_fields *
+			sizeof(buf_csv_field_t));
+	if (NULL == fld_vals) die(NULL);
+	struct field_value *values = malloc(num_fields *
+			sizeof(struct field_value));
+	if (NULL == values) die(NULL);
+
+	for (int nrow = 0; nrow < chunk_size ; nrow++) {
+		if (-1 == buf_csv_next_data_line_slices(buf_csv, fld_vals))
+			break;
+		convert_fields(conv, fld_vals, values, conv->widest);
+		if (NULL == conv->filter || row_passes(conv->filter, values))
+			add_row(batch, values);
+	}
+	flush_row_batch(batch);
+
+	free(values);
+	free(fld_vals);
+}
+
+/* Parallel parsing of a (mmap()ed) file: worker threads take ranges of lines
+ * off the buffered_CSV, split them into fields, convert these to values, and
+ * put the result in a slot.
+ * The calling thread, which owns the connection, is the only writer: it takes
+ * filled slots and just binds and steps their rows. There is a fixed number of
+ * slots, so parsing can't run arbitrarily far ahead of writing. To keep rows
+ * in file order, range number n must go to slot n % num_slots, and the writer
+ * takes the slots in range order; otherwise (-u) any free slot will do. */
+
+enum slot_state { SLOT_FREE, SLOT_PARSING, SLOT_READY };
+
+struct parse_slot {
+	enum slot_state state;
+	long range_num;
+	struct field_value *values;	/* num_rows rows of num_fields */
+	size_t num_rows;
+	size_t max_rows;
+	bool short_line;	/* the range ended on a line with too few fields */
+};
+
+struct parse_pool {
+	buffered_CSV_t *buf_csv;
+	struct column_conversion *conv;	/* 'widest' is under 'lock' */
+	bool ordered;
+	pthread_mutex_t lock;
+	pthread_cond_t slot_ready;
+	pthread_cond_t slot_free;
+	struct parse_slot *slots;
+	int num_slots;
+	long ranges_taken;
+	long ranges_written;
+	bool no_more_ranges;
+	bool stop;
+};
+
+/* Returns a slot that can receive the next range, or NULL. Call with the lock
+ * held. */
+
+static struct parse_slot *free_slot(struct parse_pool *pool)
+{
+	if (pool->ordered) {
+		struct parse_slot *slot =
+			&pool->slots[pool->ranges_taken % pool->num_slots];
+		return SLOT_FREE == slot->state ? slot : NULL;
+	}
+	for (int i = 0; i < pool->num_slots; i++)
+		if (SLOT_FREE == pool->slots[i].state)
+			return &pool->slots[i];
+	return NULL;
+}
+
+/* Returns the slot the writer should write next, or NULL. Call with the lock
+ * held. */
+
+static struct parse_slot *ready_slot(struct parse_pool *pool)
+{
+	if (pool->ordered) {
+		struct parse_slot *slot =
+			&pool->slots[pool->ranges_written % pool->num_slots];
+		if (SLOT_READY == slot->state &&
+				pool->ranges_written == slot->range_num)
+			return slot;
+		return NULL;
+	}
+	for (int i = 0; i < pool->num_slots; i++)
+		if (SLOT_READY == pool->slots[i].state)
+			return &pool->slots[i];
+	return NULL;
+}
+
+static void parse_range(struct parse_pool *pool, buf_csv_range_t *range,
+		struct parse_slot *slot, buf_csv_field_t *fields,
+		enum column_type *widest)
+{
+	int num_fields = pool->conv->num_fields;
+
+	slot->num_rows = 0;
+	slot->short_line = false;
+	while (true) {
+		if (slot->num_rows == slot->max_rows) {
+			slot->max_rows = 0 == slot->max_rows ?
+				1024 : 2 * slot->max_rows;
+			slot->values = realloc(slot->values, slot->max_rows *
+					num_fields * sizeof(struct field_value));
+			if (NULL == slot->values) die(NULL);
+		}
+		if (-1 == buf_csv_range_next_slices(range, fields)) {
+			/* a range ends on a newline, so a line with too few
+			 * fields is the only way to stop early */
+			slot->short_line = ! buf_csv_range_at_end(range);
+			break;
+		}
+		struct field_value *values = slot->values +
+			slot->num_rows * num_fields;
+		convert_fields(pool->conv, fields, values, widest);
+		if (NULL == pool->conv->filter ||
+				row_passes(pool->conv->filter, values))
+			slot->num_rows++;
+	}
+}
+
+static void *parse_worker(void *arg)
+{
+	struct parse_pool *pool = arg;
+
+	int num_fields = pool->conv->num_fields;
+	buf_csv_field_t *fields = malloc(pool->conv->num_file_fields *
+			sizeof(buf_csv_field_t));
+	enum column_type *widest = malloc(num_fields *
+			sizeof(enum column_type));
+	if (NULL == fields || NULL == widest) die(NULL);
+	memcpy(widest, pool->conv->types, num_fields *
+			sizeof(enum column_type));
+
+	pthread_mutex_lock(&pool->lock);
+	while (! pool->stop && ! pool->no_more_ranges) {
+		struct parse_slot *slot = free_slot(pool);
+		if (NULL == slot) {
+			pthread_cond_wait(&pool->slot_free, &pool->lock);
+			continue;
+		}
+		buf_csv_range_t *range = buf_csv_next_range(pool->buf_csv,
+				PARSE_RANGE_SIZE);
+		if (NULL == range) {
+			pool->no_more_ranges = true;
+			break;
+		}
+		slot->state = SLOT_PARSING;
+		slot->range_num = pool->ranges_taken++;
+		pthread_mutex_unlock(&pool->lock);
+
+		parse_range(pool, range, slot, fields, widest);
+		destroy_buf_csv_range(range);
+
+		pthread_mutex_lock(&pool->lock);
+		slot->state = SLOT_READY;
+		pthread_cond_broadcast(&pool->slot_ready);
+	}
+	pthread_cond_broadcast(&pool->slot_ready);
+	for (int i = 0; i < num_fields; i++)
+		if (widest[i] > pool->conv->widest[i])
+			pool->conv->widest[i] = widest[i];
+	pthread_cond_broadcast(&pool->slot_free);
+	pthread_mutex_unlock(&pool->lock);
+
+	free(widest);
+	free(fields);
+	return NULL;
+}
+
+/* Like insert_chunk() for a whole file, but with the parsing done by
+ * 'num_workers' threads. As in insert_chunk(), a line with too few fields ends
+ * the data (with -u, rows from later in the file may have been inserted by
+ * then). */
+
+static void insert_parallel(struct row_batch *batch, buffered_CSV_t *buf_csv,
+		struct column_conversion *conv, int num_workers,
+		bool ordered)
+{
+	int num_fields = conv->num_fields;
+	struct parse_pool pool = {
+		.buf_csv = buf_csv,
+		.conv = conv,
+		.ordered = ordered,
+		.num_slots = PARSE_SLOTS_PER_WORKER * num_workers,
+	};
+	pool.slots = calloc(pool.num_slots, sizeof(struct parse_slot));
+	if (NULL == pool.slots) die(NULL);
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.slot_ready, NULL);
+	pthread_cond_init(&pool.slot_free, NULL);
+
+	pthread_t *workers = malloc(num_workers * sizeof(pthread_t));
+	if (NULL == workers) die(NULL);
+	for (int i = 0; i < num_workers; i++)
+		if (0 != pthread_create(&workers[i], NULL, parse_worker, &pool))
+			die("can't create parser thread");
+
+	pthread_mutex_lock(&pool.lock);
+	while (true) {
+		struct parse_slot *slot = ready_slot(&pool);
+		if (NULL == slot) {
+			if (pool.no_more_ranges &&
+				pool.ranges_written == pool.ranges_taken)
+				break;
+			pthread_cond_wait(&pool.slot_ready, &pool.lock);
+			continue;
+		}
+		pthread_mutex_unlock(&pool.lock);
+
+		for (size_t row = 0; row < slot->num_rows; row++)
+			add_row(batch, slot->values + row * num_fields);
+
+		pthread_mutex_lock(&pool.lock);
+		slot->state = SLOT_FREE;
+		pool.ranges_written++;
+		if (slot->short_line) pool.stop = true;
+		pthread_cond_broadcast(&pool.slot_free);
+		if (pool.stop) break;
+	}
+	pthread_mutex_unlock(&pool.lock);
+	flush_row_batch(batch);
+
+	for (int i = 0; i < num_workers; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+
+	for (int i = 0; i < pool.num_slots; i++)
+		free(pool.slots[i].values);
+	free(pool.slots);
+	pthread_mutex_destroy(&pool.lock);
+	pthread_cond_destroy(&pool.slot_ready);
+	pthread_cond_destroy(&pool.slot_free);
+}
+
+/* Pipelined flushing (-P): a reader thread parses and converts the next chunk
+ * while the calling thread inserts and queries the current one, so that a
+ * chunk takes as long as the slower of the two rather than their sum. There
+ * are two buffers, so the reader is at most one chunk ahead.
+ * The values of a chunk must be converted with the column types that the
+ * table will have by then, i.e. after any retyping due to the chunks before
+ * (see retype_table()). These only depend on the data, so the reader keeps
+ * its own copy of the types and widens them as the caller will; the caller
+ * takes the widest types of each chunk from its buffer. */
+
+struct chunk_buffer {
+	struct field_value *values;	/* num_rows rows of num_fields */
+	size_t num_rows;
+	size_t max_rows;
+	struct text_store text;	/* if copy_text */
+	enum column_type *widest;	/* as of the end of the chunk */
+	bool last;
+	bool ready;	/* for the caller, else for the reader */
+};
+
+struct chunk_reader {
+	buffered_CSV_t *buf_csv;
+	struct column_conversion conv;	/* with the reader's own types */
+	int chunk_size;
+	bool copy_text;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	struct chunk_buffer buffers[2];
+	long chunks_taken;
+	pthread_t thread;
+};
+
+/* Reads a chunk, as insert_chunk() would. */
+
+static void read_chunk(struct chunk_reader *reader, struct chunk_buffer *buf,
+		buf_csv_field_t *fields)
+{
+	struct column_conversion *conv = &reader->conv;
+	int num_fields = conv->num_fields;
+
+	buf->num_rows = 0;
+	clear_text_store(&buf->text);
+	for (int nrow = 0; nrow < reader->chunk_size; nrow++) {
+		if (buf->num_rows == buf->max_rows) {
+			buf->max_rows = 0 == buf->max_rows ?
+				1024 : 2 * buf->max_rows;
+			buf->values = realloc(buf->values, buf->max_rows *
+					num_fields * sizeof(struct field_value));
+			if (NULL == buf->values) die(NULL);
+		}
+		if (-1 == buf_csv_next_data_line_slices(reader->buf_csv,
+					fields))
+			break;
+		struct field_value *values = buf->values +
+			buf->num_rows * num_fields;
+		convert_fields(conv, fields, values, conv->widest);
+		if (NULL != conv->filter && ! row_passes(conv->filter, values))
+			continue;
+		if (reader->copy_text)
+			copy_row_text(&buf->text, values, num_fields);
+		buf->num_rows++;
+	}
+	memcpy(buf->widest, conv->widest, num_fields *
+			sizeof(enum column_type));
+	/* as retype_table() will do */
+	memcpy(conv->types, conv->widest, num_fields *
+			sizeof(enum column_type));
+	buf->last = buf_csv_eof(reader->buf_csv);
+}
+
+static void *chunk_reader_thread(void *arg)
+{
+	struct chunk_reader *reader = arg;
+	buf_csv_field_t *fields = malloc(reader->conv.num_file_fields *
+			sizeof(buf_csv_field_t));
+	if (NULL == fields) die(NULL);
+
+	for (long n = 0; ; n++) {
+		struct chunk_buffer *buf = &reader->buffers[n % 2];
+		pthread_mutex_lock(&reader->lock);
+		while (buf->ready)
+			pthread_cond_wait(&reader->changed, &reader->lock);
+		pthread_mutex_unlock(&reader->lock);
+
+		read_chunk(reader, buf, fields);
+
+		pthread_mutex_lock(&reader->lock);
+		buf->ready = true;
+		pthread_cond_broadcast(&reader->changed);
+		pthread_mutex_unlock(&reader->lock);
+		if (buf->last) break;
+	}
+
+	free(fields);
+	return NULL;
+}
+
+/* Starts reading 'buf_csv' by chunks of 'chunk_size' lines, converted as per
+ * 'conv' (whose filter must not go stale). */
+
+static struct chunk_reader *start_chunk_reader(buffered_CSV_t *buf_csv,
+		const struct column_conversion *conv, int chunk_size)
+{
+	struct chunk_reader *reader = calloc(1, sizeof(struct chunk_reader));
+	if (NULL == reader) die(NULL);
+	int num_fields = conv->num_fields;
+	reader->buf_csv = buf_csv;
+	reader->conv = *conv;
+	reader->conv.types = malloc(num_fields * sizeof(enum column_type));
+	reader->conv.widest = malloc(num_fields * sizeof(enum column_type));
+	if (NULL == reader->conv.types || NULL == reader->conv.widest)
+		die(NULL);
+	memcpy(reader->conv.types, conv->types, num_fields *
+			sizeof(enum column_type));
+	memcpy(reader->conv.widest, conv->widest, num_fields *
+			sizeof(enum column_type));
+	reader->chunk_size = chunk_size;
+	/* the fields of a splittable file are views into its mapping */
+	reader->copy_text = ! buf_csv_splittable(buf_csv);
+	for (int i = 0; i < 2; i++) {
+		reader->buffers[i].widest = malloc(num_fields *
+				sizeof(enum column_type));
+		if (NULL == reader->buffers[i].widest) die(NULL);
+	}
+	pthread_mutex_init(&reader->lock, NULL);
+	pthread_cond_init(&reader->changed, NULL);
+	if (0 != pthread_create(&reader->thread, NULL, chunk_reader_thread,
+				reader))
+		die("can't create reader thread");
+	return reader;
+}
+
+/* Returns the next chunk, which stays valid until release_chunk(). */
+
+static struct chunk_buffer *next_chunk(struct chunk_reader *reader)
+{
+	struct chunk_buffer *buf = &reader->buffers[reader->chunks_taken % 2];
+	pthread_mutex_lock(&reader->lock);
+	while (! buf->ready)
+		pthread_cond_wait(&reader->changed, &reader->lock);
+	pthread_mutex_unlock(&reader->lock);
+	return buf;
+}
+
+static void release_chunk(struct chunk_reader *reader,
+		struct chunk_buffer *buf)
+{
+	pthread_mutex_lock(&reader->lock);
+	buf->ready = false;
+	reader->chunks_taken++;
+	pthread_cond_broadcast(&reader->changed);
+	pthread_mutex_unlock(&reader->lock);
+}
+
+/* Call after the last chunk has been taken. */
+
+static void stop_chunk_reader(struct chunk_reader *reader)
+{
+	pthread_join(reader->thread, NULL);
+	for (int i = 0; i < 2; i++) {
+		struct chunk_buffer *buf = &reader->buffers[i];
+		clear_text_store(&buf->text);
+		free(buf->text.blocks);
+		free(buf->values);
+		free(buf->widest);
+	}
+	free(reader->conv.types);
+	free(reader->conv.widest);
+	pthread_mutex_destroy(&reader->lock);
+	pthread_cond_destroy(&reader->changed);
+	free(reader);
+}
+
+// static void insert_csv_into_table(sqlite3 *db, FILE* csv, const char *tbl_name,
+// 	int num_fields, char separator, int run_switches)
+// {
+// 
+// 	sqlite3_stmt *stmt = prepare_insert_statement(db, tbl_name,
+// 			num_fields, run_switches);	
+// 	//if (NULL == stmt) die (sqlite3_errmsg(db));
+// 	if (run_switches & sw_dry_run) return;
+// 
+// 	int sql_result;
+// 	char *csv_line = NULL;
+// 	size_t len = 0;
+// 	while (-1 != getline(&csv_line, &len, csv)) {
+// 		
+// 		char ** fld_vals = tokenize(csv_line, separator, num_fields);
+// 		free(csv_line);
+// 		/* loop ends at eof or of no more values can be read */
+// 		if (NULL == fld_vals) break;
+// 
+// 		/* Bind all fields in turn */
+// 		for (int i = 0; i < num_fields; i++) {
+// 			sql_result = sqlite3_bind_text(stmt, i+1, fld_vals[i],
+// 					-1, SQLITE_TRANSIENT);
+// 			if (SQLITE_OK != sql_result)
+// 				die (sqlite3_errmsg(db));
+// 		}
+// 
+// 		sqlite3_step(stmt);
+// 		sqlite3_clear_bindings(stmt);
+// 		sqlite3_reset(stmt);
+// 
+// 		free_string_array(fld_vals, num_fields);
+// 
+// 		/* Reset these for next iteration (or SIGSEGV!) */
+// 		csv_line = NULL;
+// 		len = 0;
+// 	}
+// 	free(csv_line);
+// 
+// 	sqlite3_finalize(stmt);
+// }
+
+/* Dies of a failed write of the results (see result_writer.h). */
+
+static void output_failure(void)
+{
+	die(EDOM == errno ? "-o arrow: a value doesn't fit its column's "
+			"Arrow type" : NULL);
+}
+
+/* Prints the rows of 'stmt', after a header line, if there are any. The
+ * statement is reset, so it can be run again. */
+
+static void print_query_result(sqlite3 *db, sqlite3_stmt *stmt,
+		result_writer_t *output)
+{
+	int result;
+	bool first = true;
+	while ((result = sqlite3_step(stmt)) != SQLITE_DONE) {
+		switch (result) {
+			case SQLITE_ROW:
+				if (first) { /* headers */
+					result_writer_headers(output, stmt);
+					first = false;
+				}
+				result_writer_row(output, stmt);
+				break;
+			default:
+				die(sqlite3_errmsg(db));
+		}
+	}
+	if (first) result_writer_empty(output, stmt);
+	sqlite3_reset(stmt);
+	/* before anything else is printed */
+	if (-1 == result_writer_flush(output)) output_failure();
+}
+
+void execute_user_query(sqlite3 *db, char *user_sql, result_writer_t *output)
+{
+	sqlite3_stmt *stmt = NULL;
+	const char *tail;
+
+	sqlite3_prepare_v2(db, user_sql, -1, &stmt, &tail);
+	print_query_result(db, stmt, output);
+	sqlite3_finalize(stmt);
+}
+
+static void start_transaction(sqlite3 *db)
+{
+	char *error_msg = NULL;
+	int sql_result = sqlite3_exec(
+		db, "BEGIN TRANSACTION", NULL, NULL, &error_msg);
+	if (SQLITE_OK != sql_result) die (error_msg);
+}
+
+static void stop_transaction(sqlite3 *db)
+{
+	char *error_msg = NULL;
+	int sql_result = sqlite3_exec(
+		db, "END TRANSACTION", NULL, NULL, &error_msg);
+	if (SQLITE_OK != sql_result) die (error_msg);
+}
+
+static void create_index(sqlite3 *db, char *tbl_name, char *index_fields,
+		int run_switches)
+{
+	char *create_index_SQL = construct_index_SQL(tbl_name, index_fields);
+	if (run_switches & sw_show_sql)
+		printf ("-- Create index:\n%s\n", create_index_SQL);
+	if (run_switches & sw_dry_run) return;
+
+	char *error_msg = NULL;
+	int sql_result = sqlite3_exec(db, create_index_SQL,
+			NULL, NULL, &error_msg);
+	if (SQLITE_OK != sql_result) die(error_msg);
+
+	free(create_index_SQL);
+}
+
+/* Sorted load (-O, -R): the rows of a table with a key (its primary key, else
+ * the fields of its index) are stored in key order, so that its B-tree is
+ * filled by appending, and rows with close keys share pages. A table with a
+ * primary key is then WITHOUT ROWID, i.e. its rows make up the B-tree of the
+ * key (but see sort_table() about NULL keys). With -O, the rows are loaded
+ * in file order, into a table without the primary key, which sort_table()
+ * then copies in key order; with -R, the file is taken to be in key order
+ * already, and the rows go straight into their final table. */
+
+static char *sort_key(struct file_params fp)
+{
+	if (! (fp.file_switches & (fsw_sort | fsw_sorted))) return NULL;
+	return NULL != fp.primary_key_fields ?
+		fp.primary_key_fields : fp.index_fields;
+}
+
+static bool sorts_after_load(struct file_params fp)
+{
+	return NULL != sort_key(fp) && ! (fp.file_switches & fsw_sorted);
+}
+
+/* The primary key of the table as it is loaded, and whether it is WITHOUT
+ * ROWID. */
+
+static char *loaded_primary_key(struct file_params fp)
+{
+	return sorts_after_load(fp) ? NULL : fp.primary_key_fields;
+}
+
+static bool loaded_without_rowid(struct file_params fp)
+{
+	return NULL != sort_key(fp) && NULL != loaded_primary_key(fp);
+}
+
+/* Stores the statistics gathered while loading table 'tbl_name' (see
+ * column_stats.h), and frees them. */
+
+static void store_column_stats(sqlite3 *db, const char *tbl_name,
+		column_stats_t *stats)
+{
+	char *error_msg;
+	if (! write_column_stats(db, tbl_name, stats, &error_msg))
+		die(error_msg);
+	destroy_column_stats(stats);
+}
+
+/* Returns an SQL expression that is true if a field of 'key' (a
+ * comma-separated list of columns) is NULL. Free it with sqlite3_free(). */
+
+static char *null_key_test(sqlite3 *db, const char *key)
+{
+	sqlite3_str *test = sqlite3_str_new(db);
+	for (const char *fld = key; ; fld++) {
+		size_t len = strcspn(fld, ",");
+		sqlite3_str_appendf(test, "%.*s IS NULL", (int) len, fld);
+		fld += len;
+		if ('\0' == *fld) break;
+		sqlite3_str_appendall(test, " OR ");
+	}
+	char *test_SQL = sqlite3_str_finish(test);
+	if (NULL == test_SQL) die(NULL);
+	return test_SQL;
+}
+
+static bool key_has_nulls(sqlite3 *db, const char *tbl_name, const char *key)
+{
+	char *test_SQL = null_key_test(db, key);
+	char *select_SQL = sqlite3_mprintf("SELECT 1 FROM %s WHERE %s LIMIT 1",
+			tbl_name, test_SQL);
+	sqlite3_free(test_SQL);
+	if (NULL == select_SQL) die(NULL);
+
+	sqlite3_stmt *stmt;
+	if (SQLITE_OK != sqlite3_prepare_v2(db, select_SQL, -1, &stmt, NULL))
+		die(sqlite3_errmsg(db));
+	sqlite3_free(select_SQL);
+	bool nulls = SQLITE_ROW == sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+	return nulls;
+}
+
+/* Copies table 'tbl_name', loaded in file order, to a table with its final
+ * key, in key order, and puts the copy in its place. SQLite sorts the rows
+ * in memory, or with an external merge sort on temporary files if they don't
+ * fit (see PRAGMA cache_size and temp_store). A WITHOUT ROWID table can't
+ * hold NULL keys, so if the primary key has any (e.g. empty numeric fields),
+ * the copy keeps a rowid, as without -O; the rows with NULL keys come last,
+ * so that an INTEGER PRIMARY KEY gives them new values after the others, as
+ * it does without -O to those that come after the largest key. */
+
+static void sort_table(sqlite3 *db, const char *tbl_name, int num_fields,
+		struct file_params fp, int run_switches)
+{
+	if (! sorts_after_load(fp) || (run_switches & sw_dry_run)) return;
+	if (run_switches & sw_verbose)
+		printf("Sorting %s by %s.\n", tbl_name, sort_key(fp));
+	bool without_rowid = NULL != fp.primary_key_fields &&
+		! key_has_nulls(db, tbl_name, fp.primary_key_fields);
+	if (NULL != fp.primary_key_fields && ! without_rowid &&
+			(run_switches & sw_verbose))
+		printf("%s has NULL keys: it keeps its rowid.\n", tbl_name);
+
+	/* the columns, with the types they have now */
+	char **col_names = calloc(num_fields, sizeof(char *));
+	char **col_types = calloc(num_fields, sizeof(char *));
+	if (NULL == col_names || NULL == col_types) die(NULL);
+	sqlite3_stmt *stmt;
+	char *sql = sqlite3_mprintf("PRAGMA table_info(%Q)", tbl_name);
+	if (NULL == sql) die(NULL);
+	if (SQLITE_OK != sqlite3_prepare_v2(db, sql, -1, &stmt, NULL))
+		die(sqlite3_errmsg(db));
+	sqlite3_free(sql);
+	for (int i = 0; i < num_fields && SQLITE_ROW == sqlite3_step(stmt);
+			i++) {
+		char *name = sqlite3_mprintf("\"%w\"",
+				sqlite3_column_text(stmt, 1));
+		if (NULL == name) die(NULL);
+		col_names[i] = strdup(name);
+		sqlite3_free(name);
+		col_types[i] = strdup((const char *)
+				sqlite3_column_text(stmt, 2));
+		if (NULL == col_names[i] || NULL == col_types[i]) die(NULL);
+	}
+	sqlite3_finalize(stmt);
+
+	create_file_table(db, SORT_TABLE, num_fields, col_names, col_types,
+		fp.primary_key_fields, fp.foreign_key, fp.fk_referent,
+		without_rowid, run_switches & ~sw_verbose);
+	free_string_array(col_names, num_fields);
+	free_string_array(col_types, num_fields);
+
+	/* as when loading into a keyed table, the first row of a key wins */
+	char *null_keys_last = without_rowid || NULL == fp.primary_key_fields ?
+		sqlite3_mprintf("") : sqlite3_mprintf("%z, ",
+			null_key_test(db, fp.primary_key_fields));
+	if (NULL == null_keys_last) die(NULL);
+	char *sort_SQL = sqlite3_mprintf("INSERT OR IGNORE INTO %s "
+		"SELECT * FROM %s ORDER BY %s%s, rowid; DROP TABLE %s; "
+		"ALTER TABLE %s RENAME TO %s;", SORT_TABLE, tbl_name,
+		null_keys_last, sort_key(fp), tbl_name, SORT_TABLE, tbl_name);
+	sqlite3_free(null_keys_last);
+	if (NULL == sort_SQL) die(NULL);
+	if (run_switches & sw_show_sql)
+		printf("-- Sort table:\n%s\n", sort_SQL);
+	char *error_msg = NULL;
+	if (SQLITE_OK != sqlite3_exec(db, sort_SQL, NULL, NULL, &error_msg))
+		die(error_msg);
+	sqlite3_free(sort_SQL);
+}
+
+
+/* Turns the names of a file's fields into column names, in place: quoted as
+ * they are if 'literal', else made into SQL names (see free2SQL()). */
+
+static char **sql_column_names(char **col_names, int field_count,
+		bool literal)
+{
+	if (NULL == col_names) return NULL;
+	if (literal) {
+		for (int i = 0; i < field_count; i++) {
+			char *lit_name;
+			if (-1 == asprintf(&lit_name, "'%s'", col_names[i]))
+				return NULL;
+			free(col_names[i]);
+			col_names[i] = lit_name;
+		}
+	} else {
+		for (int i = 0; i < field_count; i++) {
+			char *sql_name = free2SQL(col_names[i]);
+			free(col_names[i]);
+			col_names[i] = sql_name;
+		}
+	}
+
+	return col_names;
+}
+
+static char **get_column_names(buffered_CSV_t *buf_csv, bool literal)
+{
+	return sql_column_names(buf_csv_header_fields(buf_csv),
+			buf_csv_field_count(buf_csv), literal);
+}
+
+/* Returns the index of 'query' in 'array' */
+
+static int index_of (char *query, char **str_array, int num_fields)
+{
+	int i;
+	for (i = 0; i < num_fields; i++) 
+		if (0 == strcmp(query, str_array[i]))
+			return i;
+	return -1;
+}
+
+static void coerce_to_text(char* flds, char ** col_types, char **field_names,
+		int num_fields)
+{
+	regex_t preg;
+	regmatch_t pmatch[1];
+
+	int result;
+
+	result = regcomp(&preg, "[^,]+", REG_EXTENDED);
+	assert(0 == result);
+
+	char *fields = strdup(flds);
+	int len = strlen(fields);
+	char *c;
+	/* iteratively try to match the regexp on the string */
+	for (c = fields; (c-fields) < len-1; ) {
+		result = regexec(&preg, c, 1, pmatch, 0);
+		switch (result) {
+		case 0: /* match */
+			c[pmatch[0].rm_eo] = '\0';
+			int n = -1;
 			if (is_string_numeric(c))
 				n = atoi(c);
 			else
@@ -852,208 +2366,1962 @@ static void coerce_to_text(char* flds, char ** col_types, char **field_names,
 				fprintf(stderr, "impossibe index %d\n", n);
 				exit(EXIT_FAILURE);
 			}
-			free(col_types[n]);
-			col_types[n] = strdup(TEXT_TYPE);
-			c += pmatch[0].rm_eo+1;
-		case REG_NOMATCH:
-		default:
-			break;
+			free(col_types[n]);
+			col_types[n] = strdup(TEXT_TYPE);
+			c += pmatch[0].rm_eo+1;
+		case REG_NOMATCH:
+		default:
+			break;
+		}
+	}
+
+	free(fields);
+	regfree(&preg);
+}
+
+static int buf_csv_flags(struct file_params fp)
+{
+	int flags = 0;
+	if (fp.file_switches & fsw_show_skipped_lines)
+		flags |= BUF_CSV_DUMP_SKIPPED;
+	if (fp.file_switches & fsw_no_headers)
+		flags |= BUF_CSV_NO_HEADER;
+	if (fp.file_switches & fsw_quoted)
+		flags |= BUF_CSV_QUOTED;
+	return flags;
+}
+
+/* Turns a comma-separated list of field names or numbers (as for -t) into
+ * one of field numbers. */
+
+static char *field_numbers(char *flds, char **field_names, int num_fields)
+{
+	char *fields = strdup(flds);
+	if (NULL == fields) die(NULL);
+
+	char *numbers = calloc(strlen(flds) * 8 + 1, sizeof(char));
+	if (NULL == numbers) die(NULL);
+
+	char *saveptr;
+	for (char *f = strtok_r(fields, ",", &saveptr); NULL != f;
+			f = strtok_r(NULL, ",", &saveptr)) {
+		int n;
+		if (is_string_numeric(f))
+			n = atoi(f);
+		else
+			n = index_of(f, field_names, num_fields);
+		if (n < 0 || n >= num_fields) {
+			fprintf(stderr, "FATAL: no field '%s'\n", f);
+			exit(EXIT_FAILURE);
+		}
+		sprintf(numbers + strlen(numbers), "%s%d",
+				'\0' == *numbers ? "" : ",", n);
+	}
+
+	free(fields);
+	return numbers;
+}
+
+/* Column pruning: an imported table only gets the fields named with -c (all
+ * if none are), and of these only the ones the query uses, if known (see
+ * analyse_query()). Returns the numbers of the kept fields, in file
+ * order, and sets *num_kept; or returns NULL if all fields are kept. The
+ * fields' column names are only needed for -c. */
+
+static int *kept_columns(char **col_names, int num_fields,
+		struct file_params fp, int *num_kept)
+{
+	*num_kept = num_fields;
+	if (NULL == fp.kept_fields && NULL == fp.used_fields) return NULL;
+
+	bool named[num_fields];
+	for (int i = 0; i < num_fields; i++)
+		named[i] = NULL == fp.kept_fields;
+	if (NULL != fp.kept_fields) {
+		char *numbers = field_numbers(fp.kept_fields, col_names,
+				num_fields);
+		char *saveptr;
+		for (char *n = strtok_r(numbers, ",", &saveptr); NULL != n;
+				n = strtok_r(NULL, ",", &saveptr))
+			named[atoi(n)] = true;
+		free(numbers);
+	}
+
+	int *map = malloc(num_fields * sizeof(int));
+	if (NULL == map) die(NULL);
+	int n = 0;
+	for (int i = 0; i < num_fields; i++)
+		if (named[i] && (NULL == fp.used_fields || fp.used_fields[i]))
+			map[n++] = i;
+	/* a table needs at least one column, e.g. for SELECT count(*) */
+	for (int i = 0; 0 == n && i < num_fields; i++)
+		if (named[i])
+			map[n++] = i;
+
+	*num_kept = n;
+	return map;
+}
+
+static int *kept_field_map(buffered_CSV_t *buf_csv, struct file_params fp,
+		int *num_kept)
+{
+	int num_fields = buf_csv_field_count(buf_csv);
+	char **col_names = NULL;
+	if (NULL != fp.kept_fields) {
+		col_names = get_column_names(buf_csv,
+				fp.file_switches & fsw_literal_col_names);
+		if (NULL == col_names) die(NULL);
+	}
+	int *map = kept_columns(col_names, num_fields, fp, num_kept);
+	if (NULL != col_names)
+		free_string_array(col_names, num_fields);
+	return map;
+}
+
+/* Keeps strings 'map' of 'strings', in that order, and frees the others. */
+
+static void keep_strings(char **strings, int num_strings, const int *map,
+		int num_kept)
+{
+	char *kept[num_kept];
+	for (int i = 0; i < num_kept; i++) {
+		kept[i] = strings[map[i]];
+		strings[map[i]] = NULL;
+	}
+	for (int i = 0; i < num_strings; i++)
+		free(strings[i]);
+	memcpy(strings, kept, num_kept * sizeof(char *));
+}
+
+/* A virtual table reads the file again at each scan, through its own
+ * buffered_CSV_t (see csv_vtab.h). It goes to the temp schema, as it would be
+ * useless in a kept (-k) database. Key constraints can't apply to it. */
+
+static void create_virtual_table(sqlite3 *db, const char *tbl_name,
+	struct file_params fp, int num_fields, char **col_names,
+	char **col_types, int run_switches)
+{
+	char *field_defs = mk_field_def_part(num_fields, col_names, col_types);
+	if (NULL == field_defs) die(NULL);
+
+	char *index_cols = NULL;
+	if (NULL != fp.sidecar_index_fields)
+		index_cols = field_numbers(fp.sidecar_index_fields, col_names,
+				num_fields);
+
+	/* skipped lines were shown on first reading */
+	int flags = buf_csv_flags(fp) & ~BUF_CSV_DUMP_SKIPPED;
+	char *create_vtab_SQL = sqlite3_mprintf(
+		"CREATE VIRTUAL TABLE temp.%s USING %s(%Q, %d, %d, %Q, %Q, %Q, "
+		"%s);", tbl_name, CSV_VTAB_MODULE, fp.filename, fp.separator,
+		flags, fp.first_line_re, fp.null_token, index_cols, field_defs);
+	free(field_defs);
+	free(index_cols);
+	if (NULL == create_vtab_SQL) die(NULL);
+
+	if (run_switches & sw_show_sql)
+		printf("-- Create virtual table:\n%s\n", create_vtab_SQL);
+	if (run_switches & sw_dry_run) {
+		sqlite3_free(create_vtab_SQL);
+		return;
+	}
+
+	char *error_msg = NULL;
+	int sql_result = sqlite3_exec(db, create_vtab_SQL,
+			NULL, NULL, &error_msg);
+	if (SQLITE_OK != sql_result) die(error_msg);
+
+	sqlite3_free(create_vtab_SQL);
+}
+
+static int file2table(sqlite3 *db, buffered_CSV_t *buf_csv, char * tbl_name,
+	struct parameters *params, struct file_params fp)
+
+{
+	int run_switches = params->switches;
+	char *text_fields = fp.text_fields;
+	char *primary_key_fields = loaded_primary_key(fp);
+	char *foreign_key = fp.foreign_key;
+	char *fk_referent = fp.fk_referent;
+
+	// TODO: the first_line_re, etc. should be passed to the ctor of
+	// buffered_CSV, which should take care of the skipping and buffering.
+	/*
+	if (NULL != first_line_re)
+		skip_ignored_leading_lines(csv, first_line_re, file_switches); 
+	*/
+
+	int num_fields = buf_csv_field_count(buf_csv);
+	if (-1 == num_fields) { perror(NULL); exit(EXIT_FAILURE); }
+
+	char **col_names = get_column_names(buf_csv,
+			fp.file_switches & fsw_literal_col_names);
+
+	if (run_switches & sw_verbose)
+		show_char_array(col_names, num_fields, "col_names");
+	if (NULL == col_names) { perror(NULL); exit (EXIT_FAILURE); }
+
+	char **col_types = get_column_types(buf_csv, num_fields,
+			params->sample_size, fp.null_token);
+
+	if (NULL != text_fields)
+		coerce_to_text(text_fields, col_types, col_names, num_fields);
+
+	/* virtual tables store nothing, so there is nothing to prune */
+	if (! (fp.file_switches & fsw_virtual)) {
+		int num_kept;
+		int *field_map = kept_field_map(buf_csv, fp, &num_kept);
+		if (NULL != field_map) {
+			keep_strings(col_names, num_fields, field_map,
+					num_kept);
+			keep_strings(col_types, num_fields, field_map,
+					num_kept);
+			num_fields = num_kept;
+			free(field_map);
+		}
+	}
+
+	if (fp.file_switches & fsw_virtual)
+		create_virtual_table(db, tbl_name, fp, num_fields, col_names,
+			col_types, run_switches);
+	else
+		create_file_table(db, tbl_name, num_fields, col_names,
+			col_types, primary_key_fields, foreign_key,
+			fk_referent, loaded_without_rowid(fp), run_switches);
+
+	free_string_array(col_names, num_fields);
+	free_string_array(col_types, num_fields);
+
+	return num_fields;
+}
+
+static const char *column_type_name(enum column_type type)
+{
+	switch (type) {
+	case COL_INTEGER: return INT_TYPE;
+	case COL_NUMERIC: return NUM_TYPE;
+	default: return TEXT_TYPE;
+	}
+}
+
+static bool needs_retype(const struct column_conversion *conv)
+{
+	for (int i = 0; i < conv->num_fields; i++)
+		if (conv->widest[i] > conv->types[i])
+			return true;
+	return false;
+}
+
+/* The names of the table's columns (which may be only some of the file's). */
+
+static char **table_column_names(buffered_CSV_t *buf_csv,
+		struct file_params fp, const struct column_conversion *conv)
+{
+	char **col_names = get_column_names(buf_csv,
+			fp.file_switches & fsw_literal_col_names);
+	if (NULL == col_names) die(NULL);
+	if (NULL != conv->file_field)
+		keep_strings(col_names, conv->num_file_fields,
+				conv->file_field, conv->num_fields);
+	return col_names;
+}
+
+/* If some columns got values of a wider type than their own (e.g. text in an
+ * INTEGER column, which the sample had no reason to expect), rebuilds the
+ * table with the wider types, so that a column's values all have the same
+ * type: SQLite converts the values already there as it copies them. The
+ * table's columns are 'col_names'. */
+
+static void retype_named_table(sqlite3 *db, const char *tbl_name,
+	char **col_names, struct file_params fp,
+	struct column_conversion *conv, int run_switches)
+{
+	int num_fields = conv->num_fields;
+	if (! needs_retype(conv)) return;
+
+	char **col_types = malloc(num_fields * sizeof(char *));
+	if (NULL == col_types) die(NULL);
+	for (int i = 0; i < num_fields; i++) {
+		col_types[i] = strdup(column_type_name(conv->widest[i]));
+		if (NULL == col_types[i]) die(NULL);
+		if ((run_switches & sw_verbose) &&
+				conv->widest[i] > conv->types[i])
+			printf("Retyping %s.%s to %s.\n", tbl_name,
+				col_names[i], col_types[i]);
+	}
+
+	bool without_rowid = loaded_without_rowid(fp);
+	create_file_table(db, RETYPE_TABLE, num_fields, col_names, col_types,
+		loaded_primary_key(fp), fp.foreign_key, fp.fk_referent,
+		without_rowid, run_switches & ~sw_verbose);
+
+	/* rowids are kept, as they reflect the file's line order */
+	sqlite3_str *copy = sqlite3_str_new(db);
+	sqlite3_str_appendf(copy, "INSERT INTO %s (%s", RETYPE_TABLE,
+			without_rowid ? "" : "rowid, ");
+	for (int i = 0; i < num_fields; i++)
+		sqlite3_str_appendf(copy, "%s%s", 0 == i ? "" : ", ",
+				col_names[i]);
+	sqlite3_str_appendf(copy, ") SELECT %s* FROM %s; DROP TABLE %s; "
+		"ALTER TABLE %s RENAME TO %s;", without_rowid ? "" : "rowid, ",
+		tbl_name, tbl_name, RETYPE_TABLE, tbl_name);
+	char *copy_SQL = sqlite3_str_finish(copy);
+	if (NULL == copy_SQL) die(NULL);
+
+	if (run_switches & sw_show_sql)
+		printf("-- Retype table:\n%s\n", copy_SQL);
+	char *error_msg = NULL;
+	if (SQLITE_OK != sqlite3_exec(db, copy_SQL, NULL, NULL, &error_msg))
+		die(error_msg);
+	sqlite3_free(copy_SQL);
+
+	memcpy(conv->types, conv->widest, num_fields *
+			sizeof(enum column_type));
+	free_string_array(col_types, num_fields);
+}
+
+/* Like retype_named_table(), with the column names from 'buf_csv'. */
+
+static void retype_table(sqlite3 *db, const char *tbl_name,
+	buffered_CSV_t *buf_csv, struct file_params fp,
+	struct column_conversion *conv, int run_switches)
+{
+	if (! needs_retype(conv)) return;
+	char **col_names = table_column_names(buf_csv, fp, conv);
+	retype_named_table(db, tbl_name, col_names, fp, conv, run_switches);
+	free_string_array(col_names, conv->num_fields);
+}
+
+/* Opens data file 'filename', through decompressing threads if it is
+ * compressed (see decompress.h): as many as parser threads, for BGZF. */
+
+static FILE *open_data_file(const char *filename, struct parameters *params)
+{
+	const char *error;
+	FILE *f = open_decompressed(filename, params->num_workers, &error);
+	if (NULL == f) {
+		char *msg;
+		if (NULL == error) die(NULL);
+		if (-1 == asprintf(&msg, "%s: %s", filename, error)) die(NULL);
+		die(msg);
+	}
+	return f;
+}
+
+/* Returns a buffered_CSV for file 'file_index': the one opened by
+ * analyse_query(), if any, else a new one. All I/O should go through the
+ * buffered_CSV_t struct, not the FILE*. */
+
+static buffered_CSV_t *open_input(struct parameters *params, int file_index)
+{
+	struct file_params *fp = &params->files[file_index];
+	if (NULL != fp->csv) {
+		buffered_CSV_t *buf_csv = fp->csv;
+		fp->csv = NULL;
+		return buf_csv;
+	}
+
+	FILE * csv;
+	if (0 == strcmp("-", fp->filename))
+		csv = stdin;
+	else
+		csv = open_data_file(fp->filename, params);
+
+	buffered_CSV_t *buf_csv = create_buffered_CSV(csv, fp->separator,
+			fp->first_line_re, buf_csv_flags(*fp));
+	if (NULL == buf_csv) die(NULL);
+	return buf_csv;
+}
+
+static void flush_table(sqlite3 *db, const char *table_name)
+{
+	char *error_msg = NULL;	
+	char *sql = NULL;
+	asprintf(&sql, "DELETE FROM %s;", table_name);
+	int result = sqlite3_exec(db, sql, NULL, NULL, &error_msg);
+	free(sql);
+	if (SQLITE_OK != result) die(error_msg);
+}
+
+static sqlite3_stmt *flush_statement(sqlite3 *db, const char *table_name)
+{
+	char *sql = sqlite3_mprintf("DELETE FROM %s;", table_name);
+	if (NULL == sql) die(NULL);
+	sqlite3_stmt *stmt;
+	if (SQLITE_OK != sqlite3_prepare_v2(db, sql, -1, &stmt, NULL))
+		die(sqlite3_errmsg(db));
+	sqlite3_free(sql);
+	return stmt;
+}
+
+/* Sets up the pushed-down filter of 'fp', if any, on 'conv'. */
+
+static void set_row_filter(struct column_conversion *conv,
+		struct file_params fp, const char *tbl_name, bool stable_only,
+		int run_switches)
+{
+	free_row_filter(conv->filter);
+	conv->filter = NULL;
+	if (NULL == fp.filter) return;
+	conv->filter = create_row_filter(fp.filter, conv, stable_only);
+	if (NULL == conv->filter || ! (run_switches & sw_verbose)) return;
+	for (int t = 0; t < conv->filter->num_tests; t++)
+		if (0 == t || 0 != strcmp(conv->filter->tests[t].sql,
+				conv->filter->tests[t-1].sql))
+			printf("Keeping rows of %s where %s.\n", tbl_name,
+				conv->filter->tests[t].sql);
+}
+
+/* Inserts the file's data lines, or those from the current position on, and
+ * adds them to 'stats'. */
+
+static void insert_file(sqlite3 *db, const char *tbl_name, sqlite3_stmt *stmt,
+		buffered_CSV_t *buf_csv, struct column_conversion *conv,
+		column_stats_t *stats, struct file_params fp,
+		struct parameters *params)
+{
+	/* the fields of a splittable file are views into its mapping */
+	struct row_batch *batch = create_row_batch(db, tbl_name,
+			conv->num_fields, stmt, ! buf_csv_splittable(buf_csv));
+	batch->stats = stats;
+	if (loaded_without_rowid(fp))
+		batch->sorted_file = fp.filename;
+	if (params->num_workers > 1 && buf_csv_splittable(buf_csv))
+		insert_parallel(batch, buf_csv, conv, params->num_workers,
+			! (params->switches & sw_unordered));
+	else
+		insert_chunk(batch, buf_csv, conv, WHOLE_FILE);
+	destroy_row_batch(batch);
+}
+
+/* Arrow input (see arrow_reader.h). An Arrow file's columns already have a
+ * type, so its values are bound as they are, without parsing or type
+ * inference: Ints and Bools go to INTEGER columns, FloatingPoints to REAL
+ * ones, Utf8s to TEXT ones and Binaries to BLOB ones. Arrow files are
+ * recognised by their contents; the options about CSV syntax don't apply to
+ * them, nor does -V. */
+
+static bool is_arrow_input(struct file_params fp)
+{
+	return 0 != strcmp("-", fp.filename) && is_arrow_file(fp.filename);
+}
+
+static void arrow_failure(struct file_params fp, const char *error)
+{
+	char *msg;
+	if (-1 == asprintf(&msg, "%s: %s", fp.filename, error)) die(NULL);
+	die(msg);
+}
+
+static arrow_reader_t *open_arrow_input(struct file_params fp)
+{
+	const char *error;
+	arrow_reader_t *reader = open_arrow_reader(fp.filename, &error);
+	if (NULL == reader) arrow_failure(fp, error);
+	return reader;
+}
+
+static char **arrow_column_names(arrow_reader_t *reader, bool literal)
+{
+	int num_fields = arrow_reader_num_columns(reader);
+	char **col_names = malloc(num_fields * sizeof(char *));
+	if (NULL == col_names) die(NULL);
+	for (int i = 0; i < num_fields; i++) {
+		col_names[i] = strdup(arrow_reader_column_name(reader, i));
+		if (NULL == col_names[i]) die(NULL);
+	}
+	col_names = sql_column_names(col_names, num_fields, literal);
+	if (NULL == col_names) die(NULL);
+	return col_names;
+}
+
+static const char *arrow_column_type_name(arrow_reader_t *reader, int col)
+{
+	switch (arrow_reader_column_type(reader, col)) {
+	case SQLITE_INTEGER:
+		return arrow_reader_column_has_reals(reader, col) ?
+			NUM_TYPE : INT_TYPE;
+	case SQLITE_FLOAT: return REAL_TYPE;
+	case SQLITE_BLOB: return BLOB_TYPE;
+	default: return TEXT_TYPE;
+	}
+}
+
+/* Like file2table(), for an Arrow file. Sets *field_map to the file's columns
+ * that the table has (see kept_columns()). */
+
+static int arrow2table(sqlite3 *db, arrow_reader_t *reader,
+	const char *tbl_name, struct parameters *params, struct file_params fp,
+	int **field_map)
+{
+	int num_fields = arrow_reader_num_columns(reader);
+	char **col_names = arrow_column_names(reader,
+			fp.file_switches & fsw_literal_col_names);
+	if (params->switches & sw_verbose)
+		show_char_array(col_names, num_fields, "col_names");
+
+	char **col_types = malloc(num_fields * sizeof(char *));
+	if (NULL == col_types) die(NULL);
+	for (int i = 0; i < num_fields; i++) {
+		col_types[i] = strdup(arrow_column_type_name(reader, i));
+		if (NULL == col_types[i]) die(NULL);
+	}
+	if (NULL != fp.text_fields)
+		coerce_to_text(fp.text_fields, col_types, col_names,
+				num_fields);
+
+	int num_kept;
+	*field_map = kept_columns(col_names, num_fields, fp, &num_kept);
+	if (NULL != *field_map) {
+		keep_strings(col_names, num_fields, *field_map, num_kept);
+		keep_strings(col_types, num_fields, *field_map, num_kept);
+		num_fields = num_kept;
+	}
+
+	create_file_table(db, tbl_name, num_fields, col_names, col_types,
+		loaded_primary_key(fp), fp.foreign_key, fp.fk_referent,
+		loaded_without_rowid(fp), params->switches);
+
+	free_string_array(col_names, num_fields);
+	free_string_array(col_types, num_fields);
+	return num_fields;
+}
+
+/* The pushed-down filter compares values as the table holds them, so it is
+ * only used if the values already have their column's type: not if -t made
+ * a numeric column TEXT, nor if there are blobs, which it can't compare. */
+
+static void set_arrow_row_filter(struct column_conversion *conv,
+		arrow_reader_t *reader, struct file_params fp,
+		const char *tbl_name, int run_switches)
+{
+	for (int i = 0; i < conv->num_fields; i++) {
+		int type = arrow_reader_column_type(reader,
+			NULL == conv->file_field ? i : conv->file_field[i]);
+		if (SQLITE_BLOB == type || (SQLITE_NULL != type &&
+				(SQLITE_TEXT == type) !=
+				(COL_TEXT == conv->types[i])))
+			return;
+	}
+	/* the column types never change, so no test goes stale */
+	set_row_filter(conv, fp, tbl_name, false, run_switches);
+}
+
+/* Adds rows 'first_row' to 'end_row' (excluded) of the reader's current
+ * batch. 'values' has room for a row. */
+
+static void add_arrow_rows(struct row_batch *batch, arrow_reader_t *reader,
+		const struct column_conversion *conv, int64_t first_row,
+		int64_t end_row, struct field_value *values)
+{
+	for (int64_t row = first_row; row < end_row; row++) {
+		for (int i = 0; i < conv->num_fields; i++) {
+			struct arrow_value value;
+			struct field_value *val = &values[i];
+			arrow_reader_value(reader, NULL == conv->file_field ?
+					i : conv->file_field[i], row, &value);
+			val->type = value.type;
+			switch (value.type) {
+			case SQLITE_INTEGER:
+				val->u.integer = value.u.integer;
+				break;
+			case SQLITE_FLOAT:
+				val->u.real = value.u.real;
+				break;
+			case SQLITE_TEXT:
+			case SQLITE_BLOB:
+				val->u.text.start = value.u.bytes.start;
+				val->u.text.len = value.u.bytes.len;
+				break;
+			}
+		}
+		if (NULL == conv->filter || row_passes(conv->filter, values))
+			add_row(batch, values);
+	}
+}
+
+/* Like read_file_into_table(), for an Arrow file. */
+
+static off_t read_arrow_into_table(sqlite3 *db, int file_index,
+		struct parameters *params)
+{
+	int run_switches = params->switches;
+	struct file_params fp = params->files[file_index];
+
+	if (fp.file_switches & fsw_virtual)
+		die("Arrow files can't be read in place (-V)");
+
+	arrow_reader_t *reader = open_arrow_input(fp);
+
+	char * tbl_name;
+	if (NULL == fp.alias)
+		tbl_name = filename2tablename(fp.filename);
+	else
+		tbl_name = fp.alias;
+
+	if (NULL == tbl_name) { perror(NULL); exit (EXIT_FAILURE); }
+
+	if (run_switches & sw_verbose)
+		printf("Reading %s into table %s.\n", fp.filename, tbl_name);
+
+	int *field_map;
+	int num_fields = arrow2table(db, reader, tbl_name, params, fp,
+			&field_map);
+
+	start_transaction(db);
+
+	column_stats_t *stats = NULL;
+	sqlite3_stmt *stmt = prepare_insert_statement(db, tbl_name,
+			num_fields, run_switches);
+
+	if (! (run_switches & sw_dry_run)) {
+		if (NULL == stmt) die (sqlite3_errmsg(db));
+		struct column_conversion *conv = get_column_conversion(db,
+				tbl_name, num_fields,
+				arrow_reader_num_columns(reader), field_map,
+				fp);
+		set_arrow_row_filter(conv, reader, fp, tbl_name,
+				run_switches);
+		/* the values stay in the file's mapping */
+		struct row_batch *batch = create_row_batch(db, tbl_name,
+				num_fields, stmt, false);
+		if (params->column_stats) {
+			stats = create_column_stats(num_fields);
+			if (NULL == stats) die(NULL);
+		}
+		batch->stats = stats;
+		if (loaded_without_rowid(fp))
+			batch->sorted_file = fp.filename;
+		struct field_value *values = malloc(num_fields *
+				sizeof(struct field_value));
+		if (NULL == values) die(NULL);
+		int64_t num_rows;
+		const char *error;
+		int more;
+		while (1 == (more = arrow_reader_next_batch(reader, &num_rows,
+						&error)))
+			add_arrow_rows(batch, reader, conv, 0, num_rows,
+					values);
+		if (-1 == more) arrow_failure(fp, error);
+		destroy_row_batch(batch);
+		free(values);
+		free_row_filter(conv->filter);
+		free_column_conversion(conv);
+	} else {
+		free(field_map);
+	}
+
+	sqlite3_finalize(stmt);
+
+	sort_table(db, tbl_name, num_fields, fp, run_switches);
+
+	stop_transaction(db);
+
+	if (NULL != fp.index_fields)
+		create_index(db, tbl_name, fp.index_fields, run_switches);
+
+	if (NULL != stats)
+		store_column_stats(db, tbl_name, stats);
+
+	free(tbl_name);
+	close_arrow_reader(reader);
+
+	/* not appended to in the cache: the file is imported afresh */
+	return -1;
+}
+
+// TODO: for consistency, I should stick to either file_index or file_num, but
+// not both.
+
+/* Returns the offset of the end of the data read, if the file was mmap()ed and
+ * read to its end, or -1. */
+
+static off_t read_file_into_table(sqlite3 *db, int file_index,
+		struct parameters *params)
+{
+	int run_switches = params->switches;
+	struct file_params fp = params->files[file_index];
+
+	char *index_fields = fp.index_fields;
+
+	if (is_arrow_input(fp))
+		return read_arrow_into_table(db, file_index, params);
+
+	if ((fp.file_switches & fsw_virtual) && 0 == strcmp("-", fp.filename))
+		die("stdin can't be read in place (-V)");
+	if ((fp.file_switches & fsw_virtual) &&
+			COMPRESSION_NONE != file_compression(fp.filename))
+		die("compressed files can't be read in place (-V)");
+
+	/* Analyse file and create appropriate table */
+
+	buffered_CSV_t *buf_csv = open_input(params, file_index);
+
+	char * tbl_name;
+	if (NULL == fp.alias)
+		tbl_name = filename2tablename(fp.filename);
+	else
+		tbl_name = fp.alias;
+
+	if (NULL == tbl_name) { perror(NULL); exit (EXIT_FAILURE); }
+
+	if (run_switches & sw_verbose) {
+		char *istream_name;
+		if (0 == strcmp("-", fp.filename))
+			istream_name = "stdin";
+		else
+			istream_name = fp.filename;
+		printf("Reading %s into table %s.\n", istream_name, tbl_name);
+	}
+
+	int num_fields = file2table(db, buf_csv, tbl_name, params, fp);
+
+	if (fp.file_switches & fsw_virtual) {
+		/* The data stay in the file. */
+		free(tbl_name);
+		destroy_buffered_CSV(buf_csv);
+		return -1;
+	}
+
+	/* Populate table in a transaction */
+
+	start_transaction(db);
+
+	column_stats_t *stats = NULL;
+	sqlite3_stmt *stmt = NULL;
+	stmt = prepare_insert_statement(db, tbl_name, num_fields,
+			params->switches);	
+
+	if (! (params->switches & sw_dry_run)) {
+		if (NULL == stmt) die (sqlite3_errmsg(db));
+		int num_kept;
+		int *field_map = kept_field_map(buf_csv, fp, &num_kept);
+		struct column_conversion *conv = get_column_conversion(db,
+				tbl_name, num_fields, buf_csv_field_count(buf_csv),
+				field_map, fp);
+		/* Unstable tests can only be used if the file can be read
+		 * again, in case they go stale: it is then read without them,
+		 * so that the values are converted as they would have been. */
+		off_t data_start = buf_csv_tell(buf_csv);
+		set_row_filter(conv, fp, tbl_name, -1 == data_start,
+				run_switches);
+		if (params->column_stats) {
+			stats = create_column_stats(num_fields);
+			if (NULL == stats) die(NULL);
+		}
+		insert_file(db, tbl_name, stmt, buf_csv, conv, stats, fp,
+				params);
+		if (row_filter_is_stale(conv->filter, conv)) {
+			if (run_switches & sw_verbose)
+				printf("Reading %s again.\n", fp.filename);
+			flush_table(db, tbl_name);
+			if (NULL != stats) clear_column_stats(stats);
+			if (-1 == buf_csv_seek(buf_csv, data_start))
+				die("can't read file again");
+			set_row_filter(conv, fp, tbl_name, false,
+					run_switches);
+			insert_file(db, tbl_name, stmt, buf_csv, conv, stats,
+					fp, params);
+		}
+		retype_table(db, tbl_name, buf_csv, fp, conv, run_switches);
+		free_row_filter(conv->filter);
+		free_column_conversion(conv);
+	}
+
+ 	sqlite3_finalize(stmt);
+
+	sort_table(db, tbl_name, num_fields, fp, run_switches);
+
+	stop_transaction(db);
+
+	/* Create index if requested */
+
+	if (NULL != index_fields) 
+		create_index(db, tbl_name, index_fields, run_switches); 
+
+	if (NULL != stats)
+		store_column_stats(db, tbl_name, stats);
+
+	/* a sorted table is not appended to in the cache, but imported
+	 * afresh */
+	off_t data_end = -1;
+	if (buf_csv_eof(buf_csv) && NULL == sort_key(fp))
+		data_end = buf_csv_tell(buf_csv);
+
+	/* Release memory */
+
+	free(tbl_name);
+	destroy_buffered_CSV(buf_csv);
+
+	return data_end;
+}
+
+static sqlite3* create_db(const char *database)
+{
+	sqlite3 *db;
+	char * error_msg = NULL;
+	int sql_result = sqlite3_open_v2(database, &db,
+		SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI,
+		NULL);
+	if (SQLITE_OK != sql_result) die (sqlite3_errmsg(db));
+	sql_result = csv_vtab_register(db);
+	if (SQLITE_OK != sql_result) die (sqlite3_errmsg(db));
+	sql_result = sqlite3_exec(
+		db, "PRAGMA synchronous = OFF", NULL, NULL, &error_msg);
+	if (SQLITE_OK != sql_result) die (error_msg);
+	sql_result = sqlite3_exec(
+		db, "PRAGMA journal_mode = MEMORY", NULL, NULL, &error_msg);
+	if (SQLITE_OK != sql_result) die (error_msg);
+	
+	return db;
+}
+
+static void enable_foreign_keys(sqlite3 *db)
+{
+	char *error_msg = NULL;
+
+	char *pragma = "PRAGMA foreign_keys=on;";
+
+	int sql_result = sqlite3_exec(db, pragma, NULL, NULL, &error_msg);
+
+	if (SQLITE_OK != sql_result) die(error_msg);
+}
+
+static void cleanup(sqlite3 *db, struct parameters *params) 
+{
+	sqlite3_close(db);
+	if (-1 == destroy_result_writer(params->output)) output_failure();
+	for (int i = 0; i < params->num_files; i++) {
+		free(params->files[i].filename);
+		free(params->files[i].first_line_re);
+		free(params->files[i].text_fields);
+		free(params->files[i].primary_key_fields);
+		free(params->files[i].foreign_key);
+		free(params->files[i].sidecar_index_fields);
+		free(params->files[i].null_token);
+		free(params->files[i].kept_fields);
+		free(params->files[i].used_fields);
+		csv_filter_free(params->files[i].filter);
+		if (NULL != params->files[i].csv)
+			destroy_buffered_CSV(params->files[i].csv);
+	}
+	free(params->files);
+	free(params->user_sql);
+	free(params->cache_dir);
+	
+	free(params);
+}
+
+/* Files can be loaded concurrently if there is more than one, they go to
+ * an in-memory database, and nothing needs them to be loaded in order or in
+ * the same database: no output (-v, -q, -n) that would get interleaved, no
+ * skipped lines shown (-F), no foreign keys (which don't work across
+ * databases), and no two files with the same table name (which should fail as
+ * it does in a serial load). */
+
+static int num_attached(sqlite3 *db)
+{
+	sqlite3_stmt *stmt;
+	int n = 0;
+	if (SQLITE_OK != sqlite3_prepare_v2(db, "PRAGMA database_list", -1,
+				&stmt, NULL))
+		die(sqlite3_errmsg(db));
+	while (SQLITE_ROW == sqlite3_step(stmt))
+		n++;
+	sqlite3_finalize(stmt);
+	return n - 2;	/* main and temp */
+}
+
+/* 'loaded' tells which files have already been loaded (from the cache). */
+
+static bool can_load_concurrently(sqlite3 *db, struct parameters *params,
+		const bool *loaded)
+{
+	int num_to_load = 0;
+	for (int i = 0; i < params->num_files; i++)
+		if (! loaded[i]) num_to_load++;
+	if (num_to_load < 2)
+		return false;
+	if (num_attached(db) + num_to_load >
+			sqlite3_limit(db, SQLITE_LIMIT_ATTACHED, -1))
+		return false;
+	if (0 != strcmp(MEM_DATABASE, params->database))
+		return false;
+	if (params->switches & (sw_verbose | sw_dry_run | sw_show_sql |
+				sw_enable_foreign_keys))
+		return false;
+	if (0 == sqlite3_threadsafe() || NULL == sqlite3_vfs_find("memdb"))
+		return false;
+
+	char *tbl_names[MAX_FILES];
+	bool ok = true;
+	for (int i = 0; i < params->num_files; i++) {
+		struct file_params fp = params->files[i];
+		if (NULL == fp.alias)
+			tbl_names[i] = filename2tablename(fp.filename);
+		else
+			tbl_names[i] = strdup(fp.alias);
+		if (NULL == tbl_names[i]) die(NULL);
+		if (fp.file_switches & fsw_show_skipped_lines)
+			ok = false;
+		for (int j = 0; j < i; j++)
+			if (0 == strcasecmp(tbl_names[i], tbl_names[j]))
+				ok = false;
+	}
+	for (int i = 0; i < params->num_files; i++)
+		free(tbl_names[i]);
+
+	return ok;
+}
+
+struct load_job {
+	struct parameters *params;
+	int file_index;
+	char *db_uri;
+};
+
+static void *load_file_thread(void *arg)
+{
+	struct load_job *job = arg;
+
+	sqlite3 *db = create_db(job->db_uri);
+	/* memdb databases are capped at 1 GiB by default. */
+	sqlite3_int64 size_limit = (sqlite3_int64) 1 << 62;
+	sqlite3_file_control(db, "main", SQLITE_FCNTL_SIZE_LIMIT, &size_limit);
+
+	read_file_into_table(db, job->file_index, job->params);
+
+	sqlite3_close(db);
+	return NULL;
+}
+
+/* Loads each file in its own thread, through its own connection, into its own
+ * in-memory database. These are ATTACHed to 'db' beforehand, which keeps them
+ * alive after the loaders' connections close, and makes their tables visible
+ * to the user query by their unqualified names. Files read in place (-V) just
+ * need their virtual table declared, which is done on 'db' meanwhile. */
+
+static bool is_loaded_by_thread(struct parameters *params, const bool *loaded,
+		int file_index)
+{
+	return ! loaded[file_index] &&
+		! (params->files[file_index].file_switches & fsw_virtual);
+}
+
+static void load_files_concurrently(sqlite3 *db, struct parameters *params,
+		const bool *loaded)
+{
+	struct load_job jobs[MAX_FILES];
+	pthread_t threads[MAX_FILES];
+
+	for (int i = 0; i < params->num_files; i++) {
+		if (! is_loaded_by_thread(params, loaded, i)) continue;
+		char *schema, *sql;
+		jobs[i].params = params;
+		jobs[i].file_index = i;
+		if (-1 == asprintf(&jobs[i].db_uri, FILE_DB_URI, i))
+			die(NULL);
+		if (-1 == asprintf(&schema, FILE_DB_SCHEMA, i))
+			die(NULL);
+		if (-1 == asprintf(&sql, "ATTACH '%s' AS %s", jobs[i].db_uri,
+					schema))
+			die(NULL);
+		char *error_msg = NULL;
+		if (SQLITE_OK != sqlite3_exec(db, sql, NULL, NULL, &error_msg))
+			die(error_msg);
+		free(sql);
+		free(schema);
+	}
+
+	for (int i = 0; i < params->num_files; i++)
+		if (is_loaded_by_thread(params, loaded, i) && 0 !=
+				pthread_create(&threads[i], NULL,
+					load_file_thread, &jobs[i]))
+			die("can't create loader thread");
+
+	for (int i = 0; i < params->num_files; i++)
+		if (! loaded[i] && ! is_loaded_by_thread(params, loaded, i))
+			read_file_into_table(db, i, params);
+
+	for (int i = 0; i < params->num_files; i++) {
+		if (! is_loaded_by_thread(params, loaded, i)) continue;
+		pthread_join(threads[i], NULL);
+		free(jobs[i].db_uri);
+	}
+}
+
+/* The import cache (-C). A file's cache database is found by hashing the
+ * file's identity (path, device, inode) and everything that determines what
+ * its table looks like (separator, -H, -f, -t, -p, -i, etc.). The database
+ * also records the file's size and mtime when it was imported, and where the
+ * data ended: if the file has not changed since, the table is used as is; if
+ * it has only grown (and the end of the old data is unchanged), only the new
+ * lines are imported; otherwise it is imported afresh. */
+
+struct cache_meta {
+	char *key;
+	sqlite3_int64 size;
+	sqlite3_int64 mtime_sec;
+	sqlite3_int64 mtime_nsec;
+	sqlite3_int64 data_end;
+	sqlite3_int64 tail_hash;
+};
+
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t len)
+{
+	/* FNV-1a */
+	const unsigned char *p = data;
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ p[i]) * 1099511628211ULL;
+	return h;
+}
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+
+/* Returns the cache key of file 'fp', or NULL if it can't be cached. */
+
+static char *cache_key(struct file_params fp, const struct stat *st)
+{
+	if (fp.file_switches & fsw_virtual)
+		return NULL;
+	char *path = realpath(fp.filename, NULL);
+	if (NULL == path) return NULL;
+
+	char *key;
+	int len = asprintf(&key, "%s|%llu|%llu|%d|%d|%s|%s|%s|%s|%s|%s|%s",
+		path,
+		(unsigned long long) st->st_dev,
+		(unsigned long long) st->st_ino, fp.separator,
+		fp.file_switches & (fsw_no_headers | fsw_literal_col_names |
+			fsw_quoted | fsw_sort | fsw_sorted),
+		fp.first_line_re ? fp.first_line_re : "",
+		fp.text_fields ? fp.text_fields : "",
+		fp.primary_key_fields ? fp.primary_key_fields : "",
+		fp.index_fields ? fp.index_fields : "",
+		fp.alias ? fp.alias : "",
+		fp.null_token ? fp.null_token : "",
+		fp.kept_fields ? fp.kept_fields : "");
+	free(path);
+
+	return -1 == len ? NULL : key;
+}
+
+/* Hash of the CACHE_TAIL_LEN bytes before 'end', or -1 if they can't be
+ * read. */
+
+static sqlite3_int64 tail_hash(const char *filename, off_t end)
+{
+	off_t start = end > CACHE_TAIL_LEN ? end - CACHE_TAIL_LEN : 0;
+	char buf[CACHE_TAIL_LEN];
+
+	FILE *f = fopen(filename, "r");
+	if (NULL == f) return -1;
+	size_t len = end - start;
+	bool ok = 0 == fseeko(f, start, SEEK_SET) &&
+		len == fread(buf, 1, len, f);
+	fclose(f);
+	if (! ok) return -1;
+
+	return (sqlite3_int64) (hash_bytes(FNV_OFFSET_BASIS, buf, len) >> 1);
+}
+
+static bool read_cache_meta(sqlite3 *cdb, struct cache_meta *meta)
+{
+	sqlite3_stmt *stmt;
+	if (SQLITE_OK != sqlite3_prepare_v2(cdb, "SELECT key, size, mtime_sec, "
+			"mtime_nsec, data_end, tail_hash FROM "
+			CACHE_META_TABLE, -1, &stmt, NULL))
+		return false;
+	bool found = SQLITE_ROW == sqlite3_step(stmt);
+	if (found) {
+		meta->key = strdup((const char *) sqlite3_column_text(stmt, 0));
+		meta->size = sqlite3_column_int64(stmt, 1);
+		meta->mtime_sec = sqlite3_column_int64(stmt, 2);
+		meta->mtime_nsec = sqlite3_column_int64(stmt, 3);
+		meta->data_end = sqlite3_column_int64(stmt, 4);
+		meta->tail_hash = sqlite3_column_int64(stmt, 5);
+	}
+	sqlite3_finalize(stmt);
+	return found && NULL != meta->key;
+}
+
+static void write_cache_meta(sqlite3 *cdb, const char *filename,
+		const char *key, const struct stat *st, off_t data_end)
+{
+	sqlite3_int64 hash = -1 == data_end ? -1 : tail_hash(filename, data_end);
+	char *sql = sqlite3_mprintf(
+		"DROP TABLE IF EXISTS " CACHE_META_TABLE ";"
+		"CREATE TABLE " CACHE_META_TABLE " (key TEXT, size INTEGER, "
+		"mtime_sec INTEGER, mtime_nsec INTEGER, data_end INTEGER, "
+		"tail_hash INTEGER);"
+		"INSERT INTO " CACHE_META_TABLE " VALUES (%Q, %lld, %lld, %lld, "
+		"%lld, %lld);", key, (long long) st->st_size,
+		(long long) st->st_mtim.tv_sec, (long long) st->st_mtim.tv_nsec,
+		(long long) data_end, (long long) hash);
+	if (NULL == sql) die(NULL);
+
+	char *error_msg = NULL;
+	if (SQLITE_OK != sqlite3_exec(cdb, sql, NULL, NULL, &error_msg))
+		die(error_msg);
+	sqlite3_free(sql);
+}
+
+/* Imports the lines of file 'file_index' from 'data_end' on into its (cached)
+ * table. Returns the new end of the data, or -1 on failure (or if the data
+ * ended early, on a short line). */
+
+static off_t append_to_cached_table(sqlite3 *cdb, int file_index,
+		struct parameters *params, off_t data_end)
+{
+	struct file_params fp = params->files[file_index];
+
+	FILE *csv = fopen(fp.filename, "r");
+	if (NULL == csv) return -1;
+	int flags = buf_csv_flags(fp) & ~BUF_CSV_DUMP_SKIPPED;
+	buffered_CSV_t *buf_csv = create_buffered_CSV(csv, fp.separator,
+			fp.first_line_re, flags);
+	if (NULL == buf_csv) {
+		fclose(csv);
+		return -1;
+	}
+	if (-1 == buf_csv_seek(buf_csv, data_end)) {
+		destroy_buffered_CSV(buf_csv);
+		return -1;
+	}
+
+	char *tbl_name = NULL == fp.alias ?
+		filename2tablename(fp.filename) : strdup(fp.alias);
+	if (NULL == tbl_name) die(NULL);
+	int num_fields;
+	int *field_map = kept_field_map(buf_csv, fp, &num_fields);
+
+	start_transaction(cdb);
+	sqlite3_stmt *stmt = prepare_insert_statement(cdb, tbl_name,
+			num_fields, params->switches & ~sw_show_sql);
+	struct column_conversion *conv = get_column_conversion(cdb, tbl_name,
+			num_fields, buf_csv_field_count(buf_csv), field_map,
+			fp);
+	struct row_batch *batch = create_row_batch(cdb, tbl_name, num_fields,
+			stmt, ! buf_csv_splittable(buf_csv));
+	/* the new lines' statistics are merged into the table's, if it has
+	 * any */
+	column_stats_t *stats = create_column_stats(num_fields);
+	if (NULL == stats) die(NULL);
+	if (! params->column_stats ||
+			! read_column_stats(cdb, tbl_name, stats)) {
+		destroy_column_stats(stats);
+		stats = NULL;
+	}
+	batch->stats = stats;
+	insert_chunk(batch, buf_csv, conv, WHOLE_FILE);
+	destroy_row_batch(batch);
+	sqlite3_finalize(stmt);
+	retype_table(cdb, tbl_name, buf_csv, fp, conv,
+			params->switches & ~sw_show_sql);
+	free_column_conversion(conv);
+	stop_transaction(cdb);
+	if (NULL != stats)
+		store_column_stats(cdb, tbl_name, stats);
+
+	off_t new_end = buf_csv_eof(buf_csv) ? buf_csv_tell(buf_csv) : -1;
+
+	free(tbl_name);
+	destroy_buffered_CSV(buf_csv);
+	return new_end;
+}
+
+/* Makes sure the cache database at 'path' is up to date with file
+ * 'file_index'. Returns false if the file is not cacheable. */
+
+static bool refresh_cache_db(const char *path, int file_index,
+		struct parameters *params, const char *key,
+		const struct stat *st)
+{
+	struct file_params fp = params->files[file_index];
+	bool verbose = params->switches & sw_verbose;
+
+	if (0 == access(path, F_OK)) {
+		sqlite3 *cdb = create_db(path);
+		struct cache_meta meta;
+		bool valid = read_cache_meta(cdb, &meta) &&
+			0 == strcmp(key, meta.key);
+		if (valid && meta.size == st->st_size &&
+				meta.mtime_sec == st->st_mtim.tv_sec &&
+				meta.mtime_nsec == st->st_mtim.tv_nsec) {
+			if (verbose)
+				printf("Using cached %s.\n", fp.filename);
+			free(meta.key);
+			sqlite3_close(cdb);
+			return true;
 		}
+		if (valid && -1 != meta.data_end && meta.size < st->st_size &&
+				meta.tail_hash == tail_hash(fp.filename,
+					meta.data_end)) {
+			if (verbose)
+				printf("Appending to cached %s.\n",
+						fp.filename);
+			off_t data_end = append_to_cached_table(cdb,
+					file_index, params, meta.data_end);
+			write_cache_meta(cdb, fp.filename, key, st, data_end);
+			free(meta.key);
+			sqlite3_close(cdb);
+			return true;
+		}
+		if (valid) free(meta.key);
+		sqlite3_close(cdb);
+		if (0 != unlink(path)) die(NULL);
 	}
 
-	free(fields);
-	regfree(&preg);
+	if (verbose)
+		printf("Caching %s in %s.\n", fp.filename, path);
+	sqlite3 *cdb = create_db(path);
+	off_t data_end = read_file_into_table(cdb, file_index, params);
+	write_cache_meta(cdb, fp.filename, key, st, data_end);
+	sqlite3_close(cdb);
+
+	return true;
 }
 
-static int file2table(sqlite3 *db, buffered_CSV_t *buf_csv, char * tbl_name,
-	struct parameters *params, struct file_params fp)
+/* Loads file 'file_index' through the cache, i.e. ATTACHes its cache
+ * database, after bringing it up to date. Returns false if the file was not
+ * loaded. */
 
+static bool load_file_from_cache(sqlite3 *db, int file_index,
+		struct parameters *params)
 {
-	int run_switches = params->switches;
-	char *text_fields = fp.text_fields;
-	char *primary_key_fields = fp.primary_key_fields;
-	char *foreign_key = fp.foreign_key;
-	char *fk_referent = fp.fk_referent;
+	struct file_params fp = params->files[file_index];
+	struct stat st;
+	if (0 == strcmp("-", fp.filename) || -1 == stat(fp.filename, &st) ||
+			! S_ISREG(st.st_mode))
+		return false;
+	char *key = cache_key(fp, &st);
+	if (NULL == key) return false;
+	if (num_attached(db) >= sqlite3_limit(db, SQLITE_LIMIT_ATTACHED, -1)) {
+		free(key);
+		return false;
+	}
 
-	// TODO: the first_line_re, etc. should be passed to the ctor of
-	// buffered_CSV, which should take care of the skipping and buffering.
-	/*
-	if (NULL != first_line_re)
-		skip_ignored_leading_lines(csv, first_line_re, file_switches); 
-	*/
+	char *path, *schema, *sql;
+	if (-1 == asprintf(&path, CACHE_DB_NAME, params->cache_dir,
+			(unsigned long long) hash_bytes(FNV_OFFSET_BASIS, key,
+				strlen(key))))
+		die(NULL);
+
+	bool loaded = refresh_cache_db(path, file_index, params, key, &st);
+	if (loaded) {
+		if (-1 == asprintf(&schema, CACHE_DB_SCHEMA, file_index))
+			die(NULL);
+		sql = sqlite3_mprintf("ATTACH %Q AS %s", path, schema);
+		if (NULL == sql) die(NULL);
+		char *error_msg = NULL;
+		if (SQLITE_OK != sqlite3_exec(db, sql, NULL, NULL, &error_msg))
+			die(error_msg);
+		sqlite3_free(sql);
+		free(schema);
+	}
 
-	int num_fields = buf_csv_field_count(buf_csv);
-	if (-1 == num_fields) { perror(NULL); exit(EXIT_FAILURE); }
+	free(path);
+	free(key);
+	return loaded;
+}
 
-	char **col_names = get_column_names(buf_csv,
-			fp.file_switches & fsw_literal_col_names);
+/* Whether the database outlives the run (-k), as opposed to being in memory,
+ * or in a temporary file (see place_database()). */
 
-	if (run_switches & sw_verbose)
-		show_char_array(col_names, num_fields, "col_names");
-	if (NULL == col_names) { perror(NULL); exit (EXIT_FAILURE); }
+static bool keeps_database(struct parameters *params)
+{
+	return 0 == strcmp(DISK_DATABASE, params->database);
+}
 
-	char **first_data_line_fields = buf_csv_first_data_line_fields(buf_csv);
-	char **col_types = get_column_types(first_data_line_fields, num_fields);
+/* The cache is not used when the tables must be in the main database (-k, or
+ * -K since foreign keys don't cross databases), or on a dry run. */
 
-	if (NULL != text_fields)
-		coerce_to_text(text_fields, col_types, col_names, num_fields);
+static bool can_use_cache(struct parameters *params)
+{
+	return NULL != params->cache_dir && ! keeps_database(params) &&
+		! (params->switches & (sw_dry_run | sw_enable_foreign_keys));
+}
 
-	create_file_table(db, tbl_name, num_fields, col_names, col_types,
-		primary_key_fields, foreign_key, fk_referent, run_switches);
+/* Finding the columns the query uses: the query is prepared against a scratch
+ * database that has an empty table with all the columns of each file, with an
+ * authorizer that notes the columns it reads. If the query does anything else
+ * (e.g. writes to a table, or runs a PRAGMA such as table_info, which shows
+ * all columns), reads other tables (such as sqlite_schema), or can't be
+ * prepared, all columns are kept. */
+
+struct column_use {
+	int num_files;
+	char *tbl_names[MAX_FILES];
+	int num_cols[MAX_FILES];
+	char **col_names[MAX_FILES];	/* as SQLite has them */
+	bool *used[MAX_FILES];
+	bool read_only;
+};
 
+static int note_column_use(void *arg, int action, const char *table,
+		const char *column, const char *schema, const char *trigger)
+{
+	(void) schema;
+	(void) trigger;
+	struct column_use *use = arg;
+
+	switch (action) {
+	case SQLITE_SELECT:
+	case SQLITE_FUNCTION:
+	case SQLITE_RECURSIVE:
+		return SQLITE_OK;
+	case SQLITE_READ:
+		for (int f = 0; f < use->num_files; f++) {
+			if (0 != sqlite3_stricmp(table, use->tbl_names[f]))
+				continue;
+			for (int c = 0; c < use->num_cols[f]; c++)
+				if (0 == sqlite3_stricmp(column,
+						use->col_names[f][c]))
+					use->used[f][c] = true;
+			return SQLITE_OK;	/* e.g. rowid */
+		}
+		/* FALLTHROUGH */
+	default:
+		use->read_only = false;
+		return SQLITE_OK;
+	}
+}
+
+/* Creates the scratch table of file 'file_index', and notes the names of its
+ * columns. Streams are left open for loading later (see open_input()), as
+ * their header can't be read twice. */
+
+static void create_scratch_table(sqlite3 *scratch, struct parameters *params,
+		int file_index, struct column_use *use)
+{
+	struct file_params *fp = &params->files[file_index];
+	struct stat st;
+	bool regular = 0 != strcmp("-", fp->filename) &&
+		0 == stat(fp->filename, &st) && S_ISREG(st.st_mode);
+	bool literal = fp->file_switches & fsw_literal_col_names;
+
+	int num_fields;
+	char **col_names;
+	if (is_arrow_input(*fp)) {
+		arrow_reader_t *reader = open_arrow_input(*fp);
+		num_fields = arrow_reader_num_columns(reader);
+		col_names = arrow_column_names(reader, literal);
+		close_arrow_reader(reader);
+	} else {
+		buffered_CSV_t *buf_csv;
+		if (regular) {
+			FILE *csv = open_data_file(fp->filename, params);
+			buf_csv = create_buffered_CSV(csv, fp->separator,
+				fp->first_line_re,
+				buf_csv_flags(*fp) & ~BUF_CSV_DUMP_SKIPPED);
+			if (NULL == buf_csv) die(NULL);
+		} else {
+			buf_csv = open_input(params, file_index);
+			fp->csv = buf_csv;
+		}
+		num_fields = buf_csv_field_count(buf_csv);
+		col_names = get_column_names(buf_csv, literal);
+		if (regular)
+			destroy_buffered_CSV(buf_csv);
+	}
+	if (NULL == col_names) die(NULL);
+	sqlite3_str *create = sqlite3_str_new(scratch);
+	sqlite3_str_appendf(create, "CREATE TABLE %s (%s",
+			use->tbl_names[file_index], col_names[0]);
+	for (int i = 1; i < num_fields; i++)
+		sqlite3_str_appendf(create, ", %s", col_names[i]);
+	sqlite3_str_appendchar(create, 1, ')');
+	char *create_SQL = sqlite3_str_finish(create);
+	if (NULL == create_SQL) die(NULL);
 	free_string_array(col_names, num_fields);
-	free_string_array(col_types, num_fields);
 
-	return num_fields;
+	/* e.g. two files with the same name: the real load will complain */
+	if (SQLITE_OK != sqlite3_exec(scratch, create_SQL, NULL, NULL, NULL))
+		use->read_only = false;
+	sqlite3_free(create_SQL);
+
+	sqlite3_stmt *stmt;
+	char *sql = sqlite3_mprintf("PRAGMA table_info(%Q)",
+			use->tbl_names[file_index]);
+	if (NULL == sql) die(NULL);
+	if (SQLITE_OK != sqlite3_prepare_v2(scratch, sql, -1, &stmt, NULL))
+		die(sqlite3_errmsg(scratch));
+	sqlite3_free(sql);
+	use->col_names[file_index] = calloc(num_fields, sizeof(char *));
+	use->used[file_index] = calloc(num_fields, sizeof(bool));
+	if (NULL == use->col_names[file_index] ||
+			NULL == use->used[file_index])
+		die(NULL);
+	while (SQLITE_ROW == sqlite3_step(stmt)) {
+		int col = sqlite3_column_int(stmt, 0);
+		if (col < num_fields)
+			use->col_names[file_index][col] = strdup(
+				(const char *) sqlite3_column_text(stmt, 1));
+	}
+	sqlite3_finalize(stmt);
+	use->num_cols[file_index] = num_fields;
 }
 
-// TODO: for consistency, I should stick to either file_index or file_num, but
-// not both.
+/* Pruning is only done for tables that live for this run only,
+ * have no keys or indexes that might need the pruned columns, and are
+ * neither read in place nor cached. */
 
-static void read_file_into_table(sqlite3 *db, int file_index,
-		struct parameters *params)
+static bool can_prune(struct parameters *params, int file_index)
 {
-	int run_switches = params->switches;
 	struct file_params fp = params->files[file_index];
+	return ! keeps_database(params) && NULL == params->cache_dir &&
+		! (params->switches & (sw_dry_run | sw_enable_foreign_keys)) &&
+		! (fp.file_switches & fsw_virtual) &&
+		NULL == fp.index_fields && NULL == fp.primary_key_fields;
+}
 
-	char *index_fields = fp.index_fields;
+/* Rows can be filtered while loading under the same conditions, except that
+ * indexes and keys don't matter. */
 
-	/* Analyse file and create appropriate table */
+static bool can_filter(struct parameters *params, int file_index)
+{
+	struct file_params fp = params->files[file_index];
+	return ! keeps_database(params) && NULL == params->cache_dir &&
+		! (params->switches & (sw_dry_run | sw_enable_foreign_keys)) &&
+		! (fp.file_switches & fsw_virtual);
+}
 
-	buffered_CSV_t *buf_csv;
-	{
-		/* Doing this in a block keeps 'csv' out of scope as soon as we
-		 * don't need it anymore. ALl I/O should go through the
-		 * buffered_CSV_t struct, not the FILE*. */
-		FILE * csv;
-		if (0 == strcmp("-", fp.filename))
-			csv = stdin;
-		else
-			csv = fopen(fp.filename, "r");
-		if (NULL == csv) die(NULL);
+/* Returns the first occurrence of 'word' (in upper case) in 'sql', in any
+ * case, or NULL. */
+
+static const char *find_word(const char *sql, const char *word)
+{
+	size_t len = strlen(word);
+	for (const char *s = sql; '\0' != *s; s++)
+		if (0 == strncasecmp(s, word, len) &&
+				(s == sql || ! (isalnum(s[-1]) || '_' == s[-1])) &&
+				! (isalnum(s[len]) || '_' == s[len]))
+			return s;
+	return NULL;
+}
 
-		int flags = 0;
-		if (fp.file_switches & fsw_show_skipped_lines) {
-			flags |= BUF_CSV_DUMP_SKIPPED;
+static void use_column_everywhere(struct column_use *use, const char *name,
+		size_t len)
+{
+	for (int f = 0; f < use->num_files; f++)
+		for (int c = 0; c < use->num_cols[f]; c++) {
+			const char *col = use->col_names[f][c];
+			if (NULL != col && strlen(col) == len &&
+					0 == sqlite3_strnicmp(col, name, len))
+				use->used[f][c] = true;
 		}
-		if (fp.file_switches & fsw_no_headers)
-			flags |= BUF_CSV_NO_HEADER;
+}
 
-		buf_csv = create_buffered_CSV(
-				csv, fp.separator, fp.first_line_re, flags);
-		if (NULL == buf_csv) die(NULL);
+/* The authorizer isn't told about the columns of a join's USING clause, so
+ * these are looked for in the SQL, and kept in all tables. A NATURAL join
+ * may use any column, so all are kept. */
+
+static void use_join_columns(struct column_use *use, const char *sql)
+{
+	if (NULL != find_word(sql, "NATURAL")) {
+		use->read_only = false;
+		return;
+	}
+	for (const char *s = find_word(sql, "USING"); NULL != s;
+			s = find_word(s + 1, "USING")) {
+		s += strlen("USING");
+		while (isspace(*s)) s++;
+		if ('(' != *s) continue;
+		while (')' != *s && '\0' != *s) {
+			s++;
+			while (isspace(*s) || NULL != strchr("\"'`[", *s)) s++;
+			size_t len = 0;
+			while ('\0' != s[len] && NULL == strchr(",)\"'`]", s[len])
+					&& ! isspace(s[len]))
+				len++;
+			use_column_everywhere(use, s, len);
+			s += len;
+			while ('\0' != *s && ',' != *s && ')' != *s) s++;
+		}
 	}
+}
 
-	char * tbl_name;
-	if (NULL == fp.alias)
-		tbl_name = filename2tablename(fp.filename);
-	else
-		tbl_name = fp.alias;
+/* Finds the columns each table needs (see above), and the rows (see
+ * csv_filter.h). */
 
-	if (NULL == tbl_name) { perror(NULL); exit (EXIT_FAILURE); }
+static void analyse_query(struct parameters *params)
+{
+	bool any = false;
+	for (int i = 0; i < params->num_files; i++)
+		any = any || can_prune(params, i) || can_filter(params, i);
+	if (! any) return;
 
-	if (run_switches & sw_verbose) {
-		char *istream_name;
-		if (0 == strcmp("-", fp.filename))
-			istream_name = "stdin";
-		else
-			istream_name = fp.filename;
-		printf("Reading %s into table %s.\n", istream_name, tbl_name);
+	sqlite3 *scratch;
+	if (SQLITE_OK != sqlite3_open(MEM_DATABASE, &scratch))
+		die(sqlite3_errmsg(scratch));
+
+	struct column_use use = { .num_files = params->num_files,
+		.read_only = true };
+	for (int i = 0; i < params->num_files; i++) {
+		struct file_params fp = params->files[i];
+		use.tbl_names[i] = NULL == fp.alias ?
+			filename2tablename(fp.filename) : strdup(fp.alias);
+		if (NULL == use.tbl_names[i]) die(NULL);
+		create_scratch_table(scratch, params, i, &use);
 	}
 
-	int num_fields = file2table(db, buf_csv, tbl_name, params, fp);
+	sqlite3_set_authorizer(scratch, note_column_use, &use);
+	/* Only the first statement is prepared, so there must be no other. */
+	sqlite3_stmt *stmt;
+	const char *tail;
+	if (SQLITE_OK != sqlite3_prepare_v2(scratch, params->user_sql, -1,
+				&stmt, &tail))
+		use.read_only = false;
+	for (; NULL != tail && '\0' != *tail; tail++)
+		if (! isspace(*tail) && ';' != *tail)
+			use.read_only = false;
+	sqlite3_finalize(stmt);
+	sqlite3_close(scratch);
+	use_join_columns(&use, params->user_sql);
 
+	for (int i = 0; i < params->num_files; i++) {
+		if (use.read_only && can_prune(params, i)) {
+			params->files[i].used_fields = use.used[i];
+			use.used[i] = NULL;
+		}
+		if (use.read_only && can_filter(params, i))
+			params->files[i].filter = csv_filter_find(
+				params->user_sql, use.tbl_names[i],
+				use.col_names[i], use.num_cols[i]);
+		free(use.used[i]);
+		free_string_array(use.col_names[i], use.num_cols[i]);
+		free(use.tbl_names[i]);
+	}
+}
 
-	/* Populate table in a transaction */
+/* Placement of the database under a memory budget (-m): in memory if its
+ * tables look like they fit in the budget, else in a temporary file (see
+ * tune_database()). A table's size is estimated from the size of its file and
+ * from the size its sampled lines would have as SQLite records. */
 
-	start_transaction(db);
+#define RECORD_OVERHEAD 8	/* bytes per record, with its cell pointer */
+#define COMPRESSION_RATIO 4	/* assumed of compressed files */
+#define SIZE_MARGIN 1.25	/* for the free space in pages, the schema... */
 
-	sqlite3_stmt *stmt = NULL;
-	stmt = prepare_insert_statement(db, tbl_name, num_fields,
-			params->switches);	
+/* Returns the size of a value in a record: its serial type, and its data. */
 
-	if (! (params->switches & sw_dry_run)) {
-		if (NULL == stmt) die (sqlite3_errmsg(db));
-		insert_chunk(db, buf_csv, num_fields, WHOLE_FILE, stmt);
+static size_t record_value_size(const buf_csv_field_t *fld)
+{
+	int64_t integer;
+	double real;
+	switch (csv_number(fld, &integer, &real)) {
+	case CSV_INTEGER: {
+		if (0 == integer || 1 == integer) return 1;
+		uint64_t magnitude = integer < 0 ?
+			~(uint64_t) integer : (uint64_t) integer;
+		if (magnitude < 0x80) return 1 + 1;
+		if (magnitude < 0x8000) return 1 + 2;
+		if (magnitude < 0x800000) return 1 + 3;
+		if (magnitude < 0x80000000) return 1 + 4;
+		if (magnitude < 0x800000000000) return 1 + 6;
+		return 1 + 8;
+	}
+	case CSV_REAL:
+		return 1 + 8;
+	default:
+		return 1 + fld->len;
 	}
+}
 
- 	sqlite3_finalize(stmt);
+/* Adds 1 to the count of each field of 'flds' (names or numbers), if any. */
 
-	stop_transaction(db);
+static void count_key_fields(char *flds, char **col_names, int num_fields,
+		int *counts)
+{
+	if (NULL == flds) return;
+	char *numbers = field_numbers(flds, col_names, num_fields);
+	char *saveptr;
+	for (char *n = strtok_r(numbers, ",", &saveptr); NULL != n;
+			n = strtok_r(NULL, ",", &saveptr))
+		counts[atoi(n)]++;
+	free(numbers);
+}
 
-	/* Create index if requested */
+/* Returns the estimated size of the table of file 'file_index', with its
+ * index and key, or -1 if it can't be told before loading (i.e. for stdin).
+ * The lines are sampled from the start of the file. */
 
-	if (NULL != index_fields) 
-		create_index(db, tbl_name, index_fields, run_switches); 
+static sqlite3_int64 estimated_table_size(struct parameters *params,
+		int file_index)
+{
+	struct file_params fp = params->files[file_index];
+	struct stat st;
+	if (0 == strcmp("-", fp.filename) || 0 != stat(fp.filename, &st) ||
+			! S_ISREG(st.st_mode))
+		return -1;
+	if (fp.file_switches & fsw_virtual) return 0;
+	if (is_arrow_input(fp)) return st.st_size;
+	if (COMPRESSION_NONE != file_compression(fp.filename))
+		return st.st_size * COMPRESSION_RATIO;
+
+	FILE *csv = open_data_file(fp.filename, params);
+	buffered_CSV_t *buf_csv = create_buffered_CSV(csv, fp.separator,
+		fp.first_line_re, buf_csv_flags(fp) & ~BUF_CSV_DUMP_SKIPPED);
+	if (NULL == buf_csv) die(NULL);
+	int num_fields = buf_csv_field_count(buf_csv);
+	int num_kept;
+	int *map = kept_field_map(buf_csv, fp, &num_kept);
+	/* the number of index entries that hold each field */
+	int key_counts[num_fields];
+	memset(key_counts, 0, sizeof(key_counts));
+	int num_indexes = (NULL != fp.index_fields) +
+		(NULL != fp.primary_key_fields);
+	if (num_indexes > 0) {
+		char **col_names = get_column_names(buf_csv,
+				fp.file_switches & fsw_literal_col_names);
+		if (NULL == col_names) die(NULL);
+		count_key_fields(fp.index_fields, col_names, num_fields,
+				key_counts);
+		count_key_fields(fp.primary_key_fields, col_names, num_fields,
+				key_counts);
+		free_string_array(col_names, num_fields);
+	}
+	off_t data_start = buf_csv_tell(buf_csv);
+	buf_csv_field_t *fields = malloc(num_fields * sizeof(buf_csv_field_t));
+	if (NULL == fields) die(NULL);
+
+	int num_lines = 0;
+	double line_bytes = 0, db_bytes = 0;
+	for (; num_lines < params->sample_size; num_lines++) {
+		if (-1 == buf_csv_next_data_line_slices(buf_csv, fields))
+			break;
+		line_bytes += num_fields;	/* separators and newline */
+		for (int i = 0; i < num_fields; i++)
+			line_bytes += fields[i].len;
+		/* index entries also hold the rowid */
+		db_bytes += RECORD_OVERHEAD +
+			num_indexes * (RECORD_OVERHEAD + 4);
+		for (int k = 0; k < num_kept; k++)
+			db_bytes += record_value_size(
+				&fields[NULL == map ? k : map[k]]);
+		for (int i = 0; i < num_fields; i++)
+			if (key_counts[i] > 0)
+				db_bytes += key_counts[i] *
+					record_value_size(&fields[i]);
+	}
+	free(fields);
+	free(map);
+	destroy_buffered_CSV(buf_csv);
+	if (0 == num_lines) return 0;
 
-	/* Release memory */
+	off_t data_len = st.st_size - (data_start > 0 ? data_start : 0);
+	return data_len / line_bytes * db_bytes;
+}
 
-	free(tbl_name);
-	destroy_buffered_CSV(buf_csv);
+/* Returns the estimated size of the database once loaded, or -1 if it can't
+ * be told. */
+
+static sqlite3_int64 estimated_db_size(struct parameters *params)
+{
+	/* with -P, the last table only ever holds a chunk */
+	int num_whole = WHOLE_FILE == params->chunk_size ?
+		params->num_files : params->num_files - 1;
+	double size = 0;
+	for (int i = 0; i < num_whole; i++) {
+		sqlite3_int64 table_size = estimated_table_size(params, i);
+		if (-1 == table_size) return -1;
+		size += table_size;
+	}
+	return size * SIZE_MARGIN;
 }
 
-static sqlite3* create_db(const char *database)
+static void place_database(struct parameters *params)
 {
-	sqlite3 *db;
-	char * error_msg = NULL;
-	int sql_result = sqlite3_open(database, &db);
-	if (SQLITE_OK != sql_result) die (sqlite3_errmsg(db));
-	sql_result = sqlite3_exec(
-		db, "PRAGMA synchronous = OFF", NULL, NULL, &error_msg);
-	if (SQLITE_OK != sql_result) die (error_msg);
-	sql_result = sqlite3_exec(
-		db, "PRAGMA journal_mode = MEMORY", NULL, NULL, &error_msg);
-	if (SQLITE_OK != sql_result) die (error_msg);
-	
-	return db;
+	if (0 == params->memory_budget ||
+			0 != strcmp(MEM_DATABASE, params->database))
+		return;
+	sqlite3_int64 size = estimated_db_size(params);
+	bool fits = -1 != size && size <= params->memory_budget;
+	if (! fits)
+		params->database = TEMP_DATABASE;
+	if (! (params->switches & sw_verbose)) return;
+	if (-1 == size)
+		printf("Database size unknown: in a temporary file.\n");
+	else
+		printf("Estimated database size: %lld bytes, %s.\n",
+			(long long) size,
+			fits ? "in memory" : "in a temporary file");
 }
 
-static void enable_foreign_keys(sqlite3 *db)
+/* A database on disk, be it temporary or kept (-k), gets the memory budget as
+ * its page cache. A temporary database only goes to its file once its pages
+ * overflow the cache, so that e.g. stdin stays in memory unless it turns out
+ * to be too large, whatever the estimate. Sorts (e.g. for -O) and temporary
+ * tables (e.g. for ORDER BY) also spill to temporary files beyond the
+ * budget. */
+
+static void tune_database(sqlite3 *db, struct parameters *params)
 {
-	char *error_msg = NULL;
+	if (0 == params->memory_budget ||
+			0 == strcmp(MEM_DATABASE, params->database))
+		return;
+	char *sql = sqlite3_mprintf("PRAGMA cache_size = -%lld;"
+		"PRAGMA mmap_size = %lld; PRAGMA temp_store = FILE",
+		params->memory_budget / 1024, params->memory_budget);
+	if (NULL == sql) die(NULL);
+	char *error_msg;
+	if (SQLITE_OK != sqlite3_exec(db, sql, NULL, NULL, &error_msg))
+		die(error_msg);
+	sqlite3_free(sql);
+}
 
-	char *pragma = "PRAGMA foreign_keys=on;";
+/* Statistics are gathered as tables are loaded (see column_stats.h) where they
+ * can make a difference: if the query may join tables, or reads the
+ * statistics, or the index advisor (-A) can use them, or if the tables are
+ * kept, in a database file (-k) or the cache (-C), for later queries. For a
+ * single table in memory, they would just slow the load down. */
 
-	int sql_result = sqlite3_exec(db, pragma, NULL, NULL, &error_msg);
+static bool wants_column_stats(struct parameters *params)
+{
+	return params->num_files > 1 ||
+		NULL != find_word(params->user_sql, STATS_TABLE) ||
+		(params->switches & sw_advise_indexes) ||
+		NULL != params->cache_dir || keeps_database(params);
+}
 
-	if (SQLITE_OK != sql_result) die(error_msg);
+/* Creates the indexes that would spare the user's query full scans of large
+ * tables (-A, see index_advisor.h). */
+
+static void create_advised_indexes(sqlite3 *db, struct parameters *params)
+{
+	int run_switches = params->switches;
+	if (! (run_switches & sw_advise_indexes)) return;
+
+	int num_indexes;
+	char **advice = advise_indexes(db, params->user_sql, ADVISE_MIN_ROWS,
+			&num_indexes);
+	if (NULL == advice) {
+		if (run_switches & sw_verbose)
+			printf("No index advice: the query can't be planned "
+					"ahead.\n");
+		return;
+	}
+	if ((run_switches & sw_verbose) && 0 == num_indexes)
+		printf("No index advised.\n");
+	for (int i = 0; i < num_indexes; i++) {
+		if (run_switches & sw_verbose)
+			printf("Creating advised index: %s\n", advice[i]);
+		if (run_switches & sw_show_sql)
+			printf("-- Create advised index:\n%s\n", advice[i]);
+		char *error_msg = NULL;
+		if (SQLITE_OK != sqlite3_exec(db, advice[i], NULL, NULL,
+					&error_msg))
+			die(error_msg);
+	}
+	free_index_advice(advice, num_indexes);
 }
 
-static void cleanup(sqlite3 *db, struct parameters *params) 
+/* The statistics of tables loaded into attached databases (from the cache, or
+ * concurrently) are stored in these: a temporary view shows those of all
+ * tables as STATS_TABLE. */
+
+static void create_stats_view(sqlite3 *db)
 {
-	sqlite3_close(db);
-	for (int i = 0; i < params->num_files; i++) {
-		free(params->files[i].filename);
-		free(params->files[i].first_line_re);
-		free(params->files[i].text_fields);
-		free(params->files[i].primary_key_fields);
-		free(params->files[i].foreign_key);
+	sqlite3_stmt *stmt;
+	if (SQLITE_OK != sqlite3_prepare_v2(db, "SELECT schema FROM "
+			"pragma_table_list WHERE name = '" STATS_TABLE "' AND "
+			"schema <> 'temp'", -1, &stmt, NULL))
+		die(sqlite3_errmsg(db));
+	sqlite3_str *view = sqlite3_str_new(db);
+	sqlite3_str_appendall(view, "CREATE TEMP VIEW " STATS_TABLE " AS ");
+	bool attached = false;
+	for (int n = 0; SQLITE_ROW == sqlite3_step(stmt); n++) {
+		const char *schema = (const char *) sqlite3_column_text(stmt, 0);
+		sqlite3_str_appendf(view, "%sSELECT * FROM \"%w\"." STATS_TABLE,
+				0 == n ? "" : " UNION ALL ", schema);
+		if (0 != strcmp("main", schema)) attached = true;
 	}
-	free(params->files);
-	free(params->user_sql);
-	
-	free(params);
+	sqlite3_finalize(stmt);
+	char *view_SQL = sqlite3_str_finish(view);
+	if (NULL == view_SQL) die(NULL);
+
+	char *error_msg = NULL;
+	if (attached && SQLITE_OK != sqlite3_exec(db, view_SQL, NULL, NULL,
+				&error_msg))
+		die(error_msg);
+	sqlite3_free(view_SQL);
 }
 
 static void regular_run(sqlite3 *db, struct parameters *params)
 {
+	bool loaded[MAX_FILES] = { false };
 
-	for (int file_index = 0; file_index < params->num_files; file_index++) 
-		read_file_into_table(db, file_index, params);
+	if (can_use_cache(params)) {
+		if (-1 == mkdir(params->cache_dir, 0777) && EEXIST != errno)
+			die(NULL);
+		for (int i = 0; i < params->num_files; i++)
+			loaded[i] = load_file_from_cache(db, i, params);
+	}
+
+	if (can_load_concurrently(db, params, loaded))
+		load_files_concurrently(db, params, loaded);
+	else
+		for (int file_index = 0; file_index < params->num_files;
+				file_index++)
+			if (! loaded[file_index])
+				read_file_into_table(db, file_index, params);
+
+	if (! (params->switches & sw_dry_run)) {
+		create_stats_view(db);
+		create_advised_indexes(db, params);
+		execute_user_query(db, params->user_sql, params->output);
+	}
+}
 
-	if (! (params->switches & sw_dry_run))
-		execute_user_query(db, params->user_sql);
+static void exec_merge_sql(sqlite3 *db, const char *sql, int run_switches)
+{
+	if (run_switches & sw_show_sql)
+		printf("-- Merge chunk:\n%s\n", sql);
+	char *error_msg = NULL;
+	if (SQLITE_OK != sqlite3_exec(db, sql, NULL, NULL, &error_msg))
+		die(error_msg);
 }
 
+/* With -M, returns how the query's results are merged across the chunks of
+ * table 'tbl_name' (see chunk_merge.h), or NULL if they need not be. The
+ * state table is created, and the final query checked, so that mistakes
+ * show before the file is read rather than after. */
 
-static void flush_table(sqlite3 *db, char *table_name)
+static struct chunk_merge *merge_plan(sqlite3 *db, const char *tbl_name,
+		struct parameters *params)
 {
-	char *error_msg = NULL;	
-	char *sql = NULL;
-	asprintf(&sql, "DELETE FROM %s;", table_name);
-	int result = sqlite3_exec(db, sql, NULL, NULL, &error_msg);
-	free(sql);
-	if (SQLITE_OK != result) die(error_msg);
+	if (! (params->switches & sw_merge)) return NULL;
+	const char *error;
+	struct chunk_merge *merge = chunk_merge_plan(params->user_sql,
+			tbl_name, &error);
+	if (NULL != error) {
+		fprintf(stderr, "FATAL: -M: can't merge chunks: %s\n", error);
+		exit(EXIT_FAILURE);
+	}
+	if (NULL == merge) return NULL;
+	if (params->switches & sw_verbose)
+		printf("Merging the results of the chunks of %s.\n",
+				tbl_name);
+
+	if (NULL != merge->setup_sql)
+		exec_merge_sql(db, merge->setup_sql, params->switches);
+	if (params->switches & sw_show_sql)
+		printf("-- Final query:\n%s\n", merge->final_sql);
+	sqlite3_stmt *stmt;
+	if (SQLITE_OK != sqlite3_prepare_v2(db, merge->final_sql, -1, &stmt,
+				NULL))
+		die(sqlite3_errmsg(db));
+	sqlite3_finalize(stmt);
+	return merge;
+}
+
+/* Runs the user query ('query') on the chunk in the table, or with -M
+ * ('merge') merges its results, then empties the table if need be. */
+
+static void query_chunk(sqlite3 *db, sqlite3_stmt *query,
+		struct chunk_merge *merge, sqlite3_stmt *flush,
+		struct parameters *params)
+{
+	if (NULL == merge) {
+		if (NULL != query)
+			print_query_result(db, query, params->output);
+	} else {
+		exec_merge_sql(db, merge->chunk_sql, params->switches);
+	}
+	if (NULL == merge || merge->flush) {
+		if (SQLITE_DONE != sqlite3_step(flush))
+			die(sqlite3_errmsg(db));
+		sqlite3_reset(flush);
+	}
+}
+
+/* Like the end of lean_run(), for an Arrow file: chunks are cut out of the
+ * record batches, and need no retyping. */
+
+static void lean_run_arrow(sqlite3 *db, struct parameters *params,
+		struct file_params fp)
+{
+	arrow_reader_t *reader = open_arrow_input(fp);
+	int64_t chunk_size = params->chunk_size > 0 ? params->chunk_size : 1;
+
+	char * tbl_name;
+	if (NULL == fp.alias)
+		tbl_name = filename2tablename(fp.filename);
+	else
+		tbl_name = fp.alias;
+
+	if (NULL == tbl_name) { perror(NULL); exit (EXIT_FAILURE); }
+
+	if (params->switches & sw_verbose)
+		printf("Reading %s into table %s.\n", fp.filename, tbl_name);
+	if (params->switches & sw_dry_run) return;
+
+	int *field_map;
+	int num_fields = arrow2table(db, reader, tbl_name, params, fp,
+			&field_map);
+	sqlite3_stmt *stmt = prepare_insert_statement(db, tbl_name,
+			num_fields, params->switches);
+	if (NULL == stmt) die (sqlite3_errmsg(db));
+	struct column_conversion *conv = get_column_conversion(db, tbl_name,
+			num_fields, arrow_reader_num_columns(reader), field_map,
+			fp);
+	set_arrow_row_filter(conv, reader, fp, tbl_name, params->switches);
+	struct row_batch *batch = create_row_batch(db, tbl_name, num_fields,
+			stmt, false);
+	struct field_value *values = malloc(num_fields *
+			sizeof(struct field_value));
+	if (NULL == values) die(NULL);
+
+	/* the chunked table is empty yet, and so is left alone */
+	create_advised_indexes(db, params);
+	struct chunk_merge *merge = merge_plan(db, tbl_name, params);
+	sqlite3_stmt *query = NULL;
+	if (NULL == merge && SQLITE_OK != sqlite3_prepare_v2(db,
+				params->user_sql, -1, &query, NULL))
+		die(sqlite3_errmsg(db));
+	sqlite3_stmt *flush = flush_statement(db, tbl_name);
+
+	start_transaction(db);
+	int64_t num_rows, chunk_rows = 0;
+	bool queried = false;
+	const char *error;
+	int more;
+	while (1 == (more = arrow_reader_next_batch(reader, &num_rows,
+					&error))) {
+		for (int64_t row = 0; row < num_rows; ) {
+			int64_t n = num_rows - row;
+			if (n > chunk_size - chunk_rows)
+				n = chunk_size - chunk_rows;
+			add_arrow_rows(batch, reader, conv, row, row + n,
+					values);
+			row += n;
+			chunk_rows += n;
+			if (chunk_rows < chunk_size) continue;
+			flush_row_batch(batch);
+			query_chunk(db, query, merge, flush, params);
+			chunk_rows = 0;
+			queried = true;
+		}
+	}
+	if (-1 == more) arrow_failure(fp, error);
+	/* the last chunk, which is queried even if empty, as with CSV */
+	if (chunk_rows > 0 || ! queried) {
+		flush_row_batch(batch);
+		query_chunk(db, query, merge, flush, params);
+	}
+	stop_transaction(db);
+	if (NULL != merge)
+		execute_user_query(db, merge->final_sql, params->output);
+	chunk_merge_free(merge);
+
+	sqlite3_finalize(query);
+	sqlite3_finalize(flush);
+	destroy_row_batch(batch);
+	free(values);
+	free_row_filter(conv->filter);
+	free_column_conversion(conv);
+	sqlite3_finalize(stmt);
+	close_arrow_reader(reader);
 }
 
 static void lean_run(sqlite3 *db, struct parameters *params)
@@ -1064,28 +4332,17 @@ static void lean_run(sqlite3 *db, struct parameters *params)
 		read_file_into_table(db, file_index, params);
 
 	struct file_params fp = params->files[file_index];
+	/* the last file is streamed through its table, never read in place,
+	 * nor sorted */
+	fp.file_switches &= ~(fsw_virtual | fsw_sort | fsw_sorted);
+	if (is_arrow_input(fp)) {
+		lean_run_arrow(db, params, fp);
+		return;
+	}
 	// TODO: need to decide if I think in file chunks or in flush periods
 	int chunk_size = params->chunk_size;
 
-	buffered_CSV_t *buf_csv;
-	{
-		FILE * csv;
-		if (0 == strcmp("-", fp.filename))
-			csv = stdin;
-		else
-			csv = fopen(fp.filename, "r");
-		if (NULL == csv) die(NULL);
-
-		int flags = 0;
-		if (fp.file_switches & fsw_show_skipped_lines)
-			flags |= BUF_CSV_DUMP_SKIPPED;
-		if (fp.file_switches & fsw_no_headers)
-			flags |= BUF_CSV_NO_HEADER;
-
-		buf_csv = create_buffered_CSV(
-				csv, fp.separator, fp.first_line_re, flags);
-		if (NULL == buf_csv) die(NULL);
-	}
+	buffered_CSV_t *buf_csv = open_input(params, file_index);
 
 	char * tbl_name;
 	if (NULL == fp.alias)
@@ -1104,21 +4361,64 @@ static void lean_run(sqlite3 *db, struct parameters *params)
 	sqlite3_stmt *stmt = prepare_insert_statement(db, tbl_name,
 			num_fields, params->switches);	
 	if (NULL == stmt) die (sqlite3_errmsg(db));
-
+	int num_kept;
+	int *field_map = kept_field_map(buf_csv, fp, &num_kept);
+	struct column_conversion *conv = get_column_conversion(db, tbl_name,
+			num_fields, buf_csv_field_count(buf_csv), field_map,
+			fp);
+	/* Chunks that were queried can't be read again: see
+	 * read_file_into_table(). */
+	set_row_filter(conv, fp, tbl_name, true, params->switches);
+	/* the chunk's text stays valid until it is released */
+	struct row_batch *batch = create_row_batch(db, tbl_name, num_fields,
+			stmt, false);
+	/* taken now, as the reader thread owns the buffered_CSV */
+	char **col_names = table_column_names(buf_csv, fp, conv);
+
+	/* the chunked table is empty yet, and so is left alone */
+	create_advised_indexes(db, params);
+	struct chunk_merge *merge = merge_plan(db, tbl_name, params);
+	/* Both are prepared once: SQLite prepares them again by itself if
+	 * the table is retyped. An unconditional DELETE just drops the
+	 * table's pages, rather than deleting the rows one by one. */
+	sqlite3_stmt *query = NULL;
+	if (NULL == merge && SQLITE_OK != sqlite3_prepare_v2(db,
+				params->user_sql, -1, &query, NULL))
+		die(sqlite3_errmsg(db));
+	sqlite3_stmt *flush = flush_statement(db, tbl_name);
+
+	struct chunk_reader *reader = start_chunk_reader(buf_csv, conv,
+			chunk_size);
 	start_transaction(db);
+	bool last;
 	do {
-		insert_chunk(db, buf_csv, num_fields, chunk_size, stmt);
-		execute_user_query(db, params->user_sql);
-		flush_table(db, tbl_name);
-
-	} while (! buf_csv_eof(buf_csv));
+		struct chunk_buffer *chunk = next_chunk(reader);
+		for (size_t row = 0; row < chunk->num_rows; row++)
+			add_row(batch, chunk->values + row * num_fields);
+		flush_row_batch(batch);
+		memcpy(conv->widest, chunk->widest, num_fields *
+				sizeof(enum column_type));
+		last = chunk->last;
+		release_chunk(reader, chunk);
+
+		retype_named_table(db, tbl_name, col_names, fp, conv,
+				params->switches);
+		query_chunk(db, query, merge, flush, params);
+	} while (! last);
 	stop_transaction(db);
-	/* I think it's ok to use buf_csv_eof() here since insert_chunk() will stop
-	 * after 'chunk_size' lines have been read (no EOF) OR on EOF. If EOF
-	 * is just after a chunk, then the next iteration will return
-	 * immediately. */
+	stop_chunk_reader(reader);
+	if (NULL != merge)
+		execute_user_query(db, merge->final_sql, params->output);
+	chunk_merge_free(merge);
 
+	sqlite3_finalize(query);
+	sqlite3_finalize(flush);
+	free_string_array(col_names, num_fields);
+	destroy_row_batch(batch);
+	free_row_filter(conv->filter);
+	free_column_conversion(conv);
 	sqlite3_finalize(stmt);
+	destroy_buffered_CSV(buf_csv);
 }
 
 int main(int argc, char **argv)
@@ -1127,7 +4427,15 @@ int main(int argc, char **argv)
 
 	if (params->switches & sw_verbose) show_params(params);
 
+	params->output = create_result_writer(stdout, params->output_format);
+	if (NULL == params->output) die(NULL);
+
+	analyse_query(params);
+	place_database(params);
+	params->column_stats = wants_column_stats(params);
+
 	sqlite3 *db = create_db(params->database);
+	tune_database(db, params);
 	if (params->switches & sw_enable_foreign_keys)
 		enable_foreign_keys(db);
 
@@ -0,0 +1,135 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <strings.h>
+
+#include "sql_token.h"
+
+static bool is_word_char(char c)
+{
+	return isalnum((unsigned char) c) || '_' == c || '$' == c ||
+		(c & 0x80);
+}
+
+/* Returns the text between 'start' (just after the opening quote) and the
+ * closing quote 'close', in which doubled quotes stand for one, and sets *end
+ * to just after the closing quote; or returns NULL if there is none. */
+
+static char *unquote(const char *start, char close, const char **end)
+{
+	char *text = malloc(strlen(start) + 1);
+	if (NULL == text) return NULL;
+	char *t = text;
+	const char *s;
+	for (s = start; '\0' != *s; s++) {
+		if (close == *s) {
+			if (']' == close || close != s[1]) break;
+			s++;
+		}
+		*t++ = *s;
+	}
+	if ('\0' == *s) {
+		free(text);
+		return NULL;
+	}
+	*t = '\0';
+	*end = s + 1;
+	return text;
+}
+
+void sql_free_tokens(sql_tokens_t *toks)
+{
+	for (int i = 0; i < toks->num; i++)
+		free(toks->tok[i].text);
+	free(toks->tok);
+}
+
+bool sql_tokenize(const char *sql, sql_tokens_t *toks)
+{
+	static const char *const two_char_ops[] = { "==", "!=", "<>", "<=",
+		">=", "||", "<<", ">>", NULL };
+	int max = 0;
+	toks->tok = NULL;
+	toks->num = 0;
+
+	const char *s = sql;
+	while (true) {
+		while (isspace((unsigned char) *s)) s++;
+		if ('-' == s[0] && '-' == s[1]) {
+			while ('\0' != *s && '\n' != *s) s++;
+			continue;
+		}
+		if ('/' == s[0] && '*' == s[1]) {
+			const char *end = strstr(s + 2, "*/");
+			s = NULL == end ? s + strlen(s) : end + 2;
+			continue;
+		}
+		if ('\0' == *s) return true;
+
+		if (toks->num == max) {
+			max = 0 == max ? 64 : 2 * max;
+			struct sql_token *tok = realloc(toks->tok,
+					max * sizeof(struct sql_token));
+			if (NULL == tok) return false;
+			toks->tok = tok;
+		}
+		struct sql_token *tok = &toks->tok[toks->num++];
+		tok->start = s;
+		tok->text = NULL;
+
+		if (('x' == *s || 'X' == *s) && '\'' == s[1]) {
+			/* blob */
+			tok->type = SQL_OTHER;
+			tok->text = unquote(s + 2, '\'', &s);
+			if (NULL == tok->text) return false;
+		} else if ('\'' == *s || '"' == *s || '`' == *s || '[' == *s) {
+			tok->type = '\'' == *s ? SQL_STRING : SQL_QUOTED;
+			tok->text = unquote(s + 1, '[' == *s ? ']' : *s, &s);
+			if (NULL == tok->text) return false;
+		} else if (isdigit((unsigned char) *s) ||
+				('.' == *s && isdigit((unsigned char) s[1]))) {
+			tok->type = SQL_NUMBER;
+			while (is_word_char(*s) || '.' == *s ||
+				(('+' == *s || '-' == *s) &&
+				 ('e' == s[-1] || 'E' == s[-1])))
+				s++;
+		} else if (is_word_char(*s)) {
+			tok->type = SQL_WORD;
+			while (is_word_char(*s)) s++;
+		} else if (NULL != strchr("?:@", *s)) {
+			/* parameter */
+			tok->type = SQL_OTHER;
+			for (s++; is_word_char(*s); s++) ;
+		} else {
+			tok->type = SQL_OP;
+			s++;
+			for (int i = 0; NULL != two_char_ops[i]; i++)
+				if (0 == strncmp(tok->start, two_char_ops[i],
+							2))
+					s++;
+		}
+		tok->len = s - tok->start;
+	}
+}
+
+bool sql_is_keyword(const struct sql_token *tok, const char *keyword)
+{
+	return SQL_WORD == tok->type && strlen(keyword) == tok->len &&
+		0 == strncasecmp(tok->start, keyword, tok->len);
+}
+
+bool sql_is_op(const struct sql_token *tok, const char *op)
+{
+	return SQL_OP == tok->type && strlen(op) == tok->len &&
+		0 == strncmp(tok->start, op, tok->len);
+}
+
+bool sql_name_is(const struct sql_token *tok, const char *name)
+{
+	if (SQL_QUOTED == tok->type)
+		return 0 == strcasecmp(tok->text, name);
+	return SQL_WORD == tok->type && strlen(name) == tok->len &&
+		0 == strncasecmp(tok->start, name, tok->len);
+}
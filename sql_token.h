@@ -0,0 +1,46 @@
+#ifndef SQL_TOKEN_H
+#define SQL_TOKEN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* A rough SQL tokenizer, for finding out things about the user's query
+ * (see csv_filter.h and chunk_merge.h). It knows SQLite's quoting and
+ * comments, but not its keywords: these are just words. */
+
+enum sql_token_type { SQL_WORD, SQL_QUOTED, SQL_STRING, SQL_NUMBER, SQL_OP,
+	SQL_OTHER };
+
+struct sql_token {
+	enum sql_token_type type;
+	const char *start;	/* in the SQL */
+	size_t len;
+	char *text;	/* unquoted, for SQL_QUOTED and SQL_STRING */
+};
+
+typedef struct sql_tokens {
+	struct sql_token *tok;
+	int num;
+} sql_tokens_t;
+
+/* Splits 'sql' into tokens, which point into it. Returns false on error
+ * (e.g. an unterminated string); the tokens must be freed in any case. */
+
+bool sql_tokenize(const char *sql, sql_tokens_t *);
+
+void sql_free_tokens(sql_tokens_t *);
+
+/* Returns true iff the token is the word 'keyword', in any case. */
+
+bool sql_is_keyword(const struct sql_token *, const char *keyword);
+
+/* Returns true iff the token is operator (or punctuation) 'op'. */
+
+bool sql_is_op(const struct sql_token *, const char *op);
+
+/* Returns true iff the token is a word or a quoted identifier that is 'name'
+ * (in any ASCII case). */
+
+bool sql_name_is(const struct sql_token *, const char *name);
+
+#endif
@@ -29,8 +29,8 @@ col_names[1]: class
 col_names[2]: date
 col_names[3]: field
 col_names[4]: label
-col_types[0]: NUMERIC
-col_types[1]: NUMERIC
+col_types[0]: INTEGER
+col_types[1]: INTEGER
 col_types[2]: TEXT
 col_types[3]: TEXT
 col_types[4]: TEXT
@@ -173,8 +173,8 @@ col_names[1]: class
 col_names[2]: date
 col_names[3]: field
 col_names[4]: label
-col_types[0]: NUMERIC
-col_types[1]: NUMERIC
+col_types[0]: INTEGER
+col_types[1]: INTEGER
 col_types[2]: TEXT
 col_types[3]: TEXT
 col_types[4]: TEXT
@@ -187,8 +187,8 @@ col_names[4]: 'ALT'
 col_names[5]: 'QUAL'
 col_names[6]: 'FILTER'
 col_names[7]: 'INFO'
-col_types[0]: NUMERIC
-col_types[1]: NUMERIC
+col_types[0]: INTEGER
+col_types[1]: INTEGER
 col_types[2]: TEXT
 col_types[3]: TEXT
 col_types[4]: TEXT
@@ -423,11 +423,11 @@ END
 
 cat <<END > test14.exp
 -- Create table:
-CREATE TABLE composers (Id NUMERIC, Name TEXT, Born NUMERIC, Died NUMERIC, Period NUMERIC);
+CREATE TABLE composers (Id INTEGER, Name TEXT, Born INTEGER, Died INTEGER, Period INTEGER);
 -- Insert data ('?': SQLite C API placeholders):
 INSERT INTO composers VALUES (?, ?, ?, ?, ?)
 -- Create table:
-CREATE TABLE periods (Id NUMERIC, Name TEXT, Start NUMERIC, End NUMERIC);
+CREATE TABLE periods (Id INTEGER, Name TEXT, Start INTEGER, End INTEGER);
 -- Insert data ('?': SQLite C API placeholders):
 INSERT INTO periods VALUES (?, ?, ?, ?)
 -- Create index:
@@ -569,7 +569,7 @@ else
 fi
 
 # Test 19: numbers in scientific notation -> as numeric, not text
-# TODO: both columns must be NUMERIC (or better, FLOAT)
+# integers are INTEGER, other numbers NUMERIC
 
 cat <<END > test19.csv
 int	float	sci	scip
@@ -591,15 +591,15 @@ col_names[0]: int
 col_names[1]: float
 col_names[2]: sci
 col_names[3]: scip
-col_types[0]: NUMERIC
+col_types[0]: INTEGER
 col_types[1]: NUMERIC
 col_types[2]: NUMERIC
 col_types[3]: NUMERIC
 cid	name	type	notnull	dflt_value	pk
-0	int	NUMERIC	0	(null)	0
-1	float	NUMERIC	0	(null)	0
-2	sci	NUMERIC	0	(null)	0
-3	scip	NUMERIC	0	(null)	0
+0	int	INTEGER	0		0
+1	float	NUMERIC	0		0
+2	sci	NUMERIC	0		0
+3	scip	NUMERIC	0		0
 END
 
 echo -n "Test 19:	"
@@ -642,6 +642,7 @@ col_types[0]: TEXT
 col_types[1]: TEXT
 col_types[2]: NUMERIC
 col_types[3]: NUMERIC
+Keeping rows of test20 where foo = 'Q7'.
 foo	bar	baz	quux
 Q7	Modgorzh	8	0.001
 END
@@ -687,9 +688,9 @@ col_types[0]: TEXT
 col_types[1]: TEXT
 col_types[2]: TEXT
 cid	name	type	notnull	dflt_value	pk
-0	surname	TEXT	0	(null)	2
-1	name	TEXT	0	(null)	1
-2	job	TEXT	0	(null)	0
+0	surname	TEXT	0		2
+1	name	TEXT	0		1
+2	job	TEXT	0		0
 END
 
 echo -n "Test 21:	"
@@ -782,17 +783,17 @@ user SQL:	SELECT * FROM people
 Reading jobs.csv into table jobs.
 col_names[0]: id
 col_names[1]: job
-col_types[0]: NUMERIC
+col_types[0]: INTEGER
 col_types[1]: TEXT
 Reading people.csv into table people.
 col_names[0]: id
 col_names[1]: surname
 col_names[2]: name
 col_names[3]: jobid
-col_types[0]: NUMERIC
+col_types[0]: INTEGER
 col_types[1]: TEXT
 col_types[2]: TEXT
-col_types[3]: NUMERIC
+col_types[3]: INTEGER
 id	surname	name	jobid
 0	BROWN	Jill	4
 1	DOBBE	Isaac	6
@@ -878,8 +879,8 @@ col_names[1]: class
 col_names[2]: date
 col_names[3]: field
 col_names[4]: label
-col_types[0]: NUMERIC
-col_types[1]: NUMERIC
+col_types[0]: INTEGER
+col_types[1]: INTEGER
 col_types[2]: TEXT
 col_types[3]: TEXT
 col_types[4]: TEXT
@@ -921,3 +922,513 @@ if $SQAWK -a tbl ./data/AnAbsurdlyLongFileName.csv 'SELECT count(*) FROM tbl' >
 else
 	echo "ERROR"
 fi
+
+# Test 27: RFC 4180 quoted fields
+
+cat <<END > test27.exp
+id	text
+3	with "quotes"
+4	a long field, with a comma, and
+a newline, that does not fit in one block
+END
+
+echo -n "Test 27:	"
+if $SQAWK -Q -s , data/test_buffered_CSV_quoted.csv 'SELECT id, text FROM test_buffered_CSV_quoted WHERE id IN (3, 4)' > test27.out ; then
+	if diff test27.out test27.exp ; then
+		echo "pass"
+		rm test27.{out,exp}
+	else
+		echo "FAIL"
+	fi
+else
+	echo "ERROR"
+fi
+
+# Test 28: several files (one of them stdin), loaded concurrently
+
+cat <<END > test28.exp
+count(*)	count(DISTINCT tbl.num)
+2372	668
+END
+
+echo -n "Test 28:	"
+if cat $sample | $SQAWK $sample -a tbl ./data/AnAbsurdlyLongFileName.csv - 'SELECT count(*), count(DISTINCT tbl.num) FROM stdin JOIN tbl USING (num, class, date, field, label)' > test28.out ; then
+	if diff test28.out test28.exp ; then
+		echo "pass"
+		rm test28.{out,exp}
+	else
+		echo "FAIL"
+	fi
+else
+	echo "ERROR"
+fi
+
+# Test 29: parallel parsing keeps the rows in file order
+
+$SQAWK $sample 'SELECT rowid, * FROM sample' > test29.exp
+
+echo -n "Test 29:	"
+if $SQAWK -j 3 $sample 'SELECT rowid, * FROM sample' > test29.out ; then
+	if diff test29.out test29.exp ; then
+		echo "pass"
+		rm test29.{out,exp}
+	else
+		echo "FAIL"
+	fi
+else
+	echo "ERROR"
+fi
+
+# Test 30: files read in place (virtual tables) give the same results
+
+$SQAWK $sample 'SELECT * FROM sample WHERE num > 30 ORDER BY field LIMIT 5' > test30.exp
+
+echo -n "Test 30:	"
+if $SQAWK -V $sample 'SELECT * FROM sample WHERE num > 30 ORDER BY field LIMIT 5' > test30.out ; then
+	if diff test30.out test30.exp ; then
+		echo "pass"
+		rm test30.{out,exp}
+	else
+		echo "FAIL"
+	fi
+else
+	echo "ERROR"
+fi
+
+# Test 31: sidecar index
+
+$SQAWK $sample 'SELECT rowid, * FROM sample WHERE num BETWEEN 30 AND 32' > test31.exp
+
+echo -n "Test 31:	"
+rm -f $sample.sqawkidx
+# the second run uses the sidecar written by the first
+if $SQAWK -X num $sample 'SELECT rowid, * FROM sample WHERE num BETWEEN 30 AND 32' > /dev/null &&
+	$SQAWK -X num $sample 'SELECT rowid, * FROM sample WHERE num BETWEEN 30 AND 32' > test31.out &&
+	[ -f $sample.sqawkidx ]; then
+	if diff test31.out test31.exp ; then
+		echo "pass"
+		rm test31.{out,exp}
+	else
+		echo "FAIL"
+	fi
+else
+	echo "ERROR"
+fi
+rm -f $sample.sqawkidx
+
+# Test 32: import cache
+
+$SQAWK -i num $sample 'SELECT * FROM sample WHERE num = 30' > test32.exp
+
+echo -n "Test 32:	"
+rm -rf test32.cache
+# the second run reads the cache written by the first
+if $SQAWK -C test32.cache -i num $sample 'SELECT * FROM sample WHERE num = 30' > /dev/null &&
+	$SQAWK -C test32.cache -i num $sample 'SELECT * FROM sample WHERE num = 30' > test32.out &&
+	[ 1 -eq $(ls test32.cache | wc -l) ]; then
+	if diff test32.out test32.exp ; then
+		echo "pass"
+		rm test32.{out,exp}
+	else
+		echo "FAIL"
+	fi
+else
+	echo "ERROR"
+fi
+rm -rf test32.cache
+
+# Test 33: typed binding; empty numeric fields and -N tokens are NULL, also
+# in a file read in place (-V)
+
+sparse=$DATA_DIR/sparse.tsv
+
+cat <<END > test33.exp
+count(score)	avg(score)	count(note)	group_concat(typeof(score))
+3	5.83333333333333	4	integer,null,null,real,integer
+count(score)	avg(score)	count(note)	group_concat(typeof(score))
+3	5.83333333333333	4	integer,null,null,real,integer
+END
+
+echo -n "Test 33:	"
+if $SQAWK -N NA $sparse 'SELECT count(score), avg(score), count(note), group_concat(typeof(score)) FROM sparse' > test33.out &&
+	$SQAWK -N NA -V $sparse 'SELECT count(score), avg(score), count(note), group_concat(typeof(score)) FROM sparse' >> test33.out ; then
+	if diff test33.out test33.exp ; then
+		echo "pass"
+		rm test33.{out,exp}
+	else
+		echo "FAIL"
+	fi
+else
+	echo "ERROR"
+fi
+
+# Test 34: sampled column types; a later value that doesn't fit retypes
+
+cat <<END > test34.csv
+id	score	label
+1		a
+2	7	b
+3	8.5	c
+4	9	12
+END
+
+cat <<END > test34.exp
+name	type
+id	INTEGER
+score	NUMERIC
+label	TEXT
+typeof(a)	typeof(b)	count(*)
+integer	text	3
+END
+
+echo -n "Test 34:	"
+if $SQAWK test34.csv "SELECT name, type FROM pragma_table_info('test34')" > test34.out &&
+	printf 'a\tb\n1\t2\n2\tx\n3\t4\n' | $SQAWK - 'SELECT typeof(a), typeof(b), count(*) FROM stdin GROUP BY 1, 2' >> test34.out ; then
+	if diff test34.out test34.exp ; then
+		echo "pass"
+		rm test34.{csv,out,exp}
+	else
+		echo "FAIL"
+	fi
+else
+	echo "ERROR"
+fi
+
+# Test 35: rows are inserted in batches, but a row that violates a key
+# constraint is still the only one lost
+
+cat <<END > test35.exp
+count(*)	sum(k)
+300	45150
+END
+
+echo -n "Test 35:	"
+if awk 'BEGIN { print "k\tv"; for (i = 1; i <= 300; i++) print i "\tx"; print "7\ty" }' |
+	$SQAWK -p k - 'SELECT count(*), sum(k) FROM stdin' > test35.out ; then
+	if diff test35.out test35.exp ; then
+		echo "pass"
+		rm test35.{out,exp}
+	else
+		echo "FAIL"
+	fi
+else
+	echo "ERROR"
+fi
+
+# Test 36: columns the query doesn't read are left out of the table, as are
+# those not kept with -c
+
+cat <<END > test36.exp
+CREATE TABLE sample (class INTEGER, label TEXT);
+class	label
+1	"Boldness"
+END
+
+echo -n "Test 36:	"
+if $SQAWK -q $DATA_DIR/sample.csv "SELECT DISTINCT a.class, b.label FROM sample a JOIN sample b USING (class) WHERE b.label = '\"Boldness\"'" | grep '^CREATE' > test36.out &&
+	$SQAWK -c class,4 $DATA_DIR/sample.csv 'SELECT * FROM sample LIMIT 1' >> test36.out ; then
+	if diff test36.out test36.exp ; then
+		echo "pass"
+		rm test36.{out,exp}
+	else
+		echo "FAIL"
+	fi
+else
+	echo "ERROR"
+fi
+
+# Test 37: simple WHERE terms are checked while loading, and rows that fail
+# them are not stored; a numeric term whose column turns out to hold text
+# would have compared the values as numbers, so the file is read again.
+
+cat <<END > test37.exp
+Keeping rows of sample where class >= 5.
+Keeping rows of sample where label IN ('"Toddler"', '"Boldness"').
+count(*)	sum(num)
+61	1407
+count(*)
+3
+END
+
+printf 'k\tv\n1\t5\n2\t20\n3\tn/a\n' > test37.tsv
+echo -n "Test 37:	"
+if $SQAWK -v $DATA_DIR/sample.csv "SELECT count(*), sum(num) FROM sample WHERE class >= 5 AND label IN ('\"Toddler\"', '\"Boldness\"')" | sed -n '/^Keeping/,$p' > test37.out &&
+	$SQAWK -S 1 test37.tsv 'SELECT count(*) FROM test37 WHERE v > 10' >> test37.out ; then
+	if diff test37.out test37.exp ; then
+		echo "pass"
+		rm test37.{tsv,out,exp}
+	else
+		echo "FAIL"
+	fi
+else
+	echo "ERROR"
+fi
+
+# Test 38: with -M, aggregates and ORDER BY ... LIMIT are over the whole last
+# file, not over each chunk; a grouped query with a bare column, or with an
+# aggregate that can't be merged, is refused before the file is read.
+
+cat <<END > test38.exp
+class	count(*)	sum(num)	avg(num)	min(date)	max(date)
+1	68	3077	45.25	2000-08-10	2009-03-26
+2	70	3041	43.4428571428571	2000-07-01	2009-02-27
+3	71	3321	46.7746478873239	2000-11-12	2010-01-18
+4	67	3761	56.134328358209	2001-06-08	2008-09-01
+num	label
+769	"Regression"
+764	"Regression"
+763	"Regression"
+FATAL: -M: can't merge chunks: columns that are neither grouped by nor aggregated can't be merged
+FATAL: -M: can't merge chunks: group_concat() can't be merged
+END
+
+echo -n "Test 38:	"
+if $SQAWK -P 100 -M $DATA_DIR/sample.csv 'SELECT class, count(*), sum(num), avg(num), min(date), max(date) FROM sample GROUP BY class ORDER BY class LIMIT 4' > test38.out &&
+	$SQAWK -P 100 -M $DATA_DIR/sample.csv 'SELECT num, label FROM sample ORDER BY num DESC, date LIMIT 3' >> test38.out &&
+	! $SQAWK -P 500 -M $DATA_DIR/sample.csv 'SELECT label, class, count(*) FROM sample GROUP BY label' 2>> test38.out &&
+	! $SQAWK -P 500 -M $DATA_DIR/sample.csv 'SELECT class, group_concat(label) FROM sample GROUP BY class' 2>> test38.out ; then
+	if diff test38.out test38.exp ; then
+		echo "pass"
+		rm test38.{out,exp}
+	else
+		echo "FAIL"
+	fi
+else
+	echo "ERROR"
+fi
+
+# Test 39: with -P, the next chunk is read while the current one is queried;
+# it must still be converted as per the types of the table after any
+# retyping, e.g. '1e3' stays text once the column is TEXT.
+
+cat <<END > test39.exp
+b	typeof(b)
+2	text
+x	text
+b	typeof(b)
+5	text
+1e3	text
+END
+
+echo -n "Test 39:	"
+if printf 'a\tb\n1\t2\n3\tx\n4\t5\n6\t1e3\n' | $SQAWK -S 1 -P 2 - 'SELECT b, typeof(b) FROM stdin' > test39.out ; then
+	if diff test39.out test39.exp ; then
+		echo "pass"
+		rm test39.{out,exp}
+	else
+		echo "FAIL"
+	fi
+else
+	echo "ERROR"
+fi
+
+# Test 40: output formats (-o); in JSON Lines, blobs and text that isn't UTF-8
+# are hex strings
+
+cat <<END > test40.exp
+num,label,x,n
+1,"""Boldness""","a,b",
+1,"""Toddler""","a,b",
+{"num":1,"label":"\\"Boldness\\"","x":"a,b","n":null}
+{"num":1,"label":"\\"Toddler\\"","x":"a,b","n":null}
+{"b":"00ff","t":"41ff","u":"ok"}
+END
+
+echo -n "Test 40:	"
+if $SQAWK -o csv $DATA_DIR/sample.csv "SELECT num, label, 'a,b' AS x, NULL AS n FROM sample LIMIT 2" > test40.out &&
+	$SQAWK -o jsonl $DATA_DIR/sample.csv "SELECT num, label, 'a,b' AS x, NULL AS n FROM sample LIMIT 2" >> test40.out &&
+	$SQAWK -o jsonl $DATA_DIR/sample.csv "SELECT x'00ff' AS b, CAST(x'41ff' AS TEXT) AS t, 'ok' AS u LIMIT 1" >> test40.out ; then
+	if diff test40.out test40.exp ; then
+		echo "pass"
+		rm test40.{out,exp}
+	else
+		echo "FAIL"
+	fi
+else
+	echo "ERROR"
+fi
+
+# Test 41: Arrow IPC stream output (-o arrow): the stream starts with a
+# message's continuation marker, ends with the end-of-stream marker, and is
+# made of 8-byte aligned messages. A value of a later batch that doesn't fit
+# its column's type is an error, not a null.
+
+cat <<END > test41.exp
+ ff ff ff ff
+ ff ff ff ff 00 00 00 00
+0
+FATAL: -o arrow: a value doesn't fit its column's Arrow type
+END
+
+echo -n "Test 41:	"
+if $SQAWK -o arrow $DATA_DIR/sample.csv "SELECT num, label FROM sample" > test41.arrow ; then
+	head -c 4 test41.arrow | od -An -tx1 > test41.out
+	tail -c 8 test41.arrow | od -An -tx1 >> test41.out
+	echo $(( $(wc -c < test41.arrow) % 8 )) >> test41.out
+	awk 'BEGIN { print "n"; for (i = 1; i <= 70000; i++) print i }' |
+		$SQAWK -o arrow - 'SELECT CASE WHEN n < 70000 THEN n ELSE 0.5 END AS x FROM stdin' 2>> test41.out > /dev/null
+	if diff test41.out test41.exp ; then
+		echo "pass"
+		rm test41.{out,exp,arrow}
+	else
+		echo "FAIL"
+	fi
+else
+	echo "ERROR"
+fi
+
+# Test 42: Arrow input: query results written with -o arrow are read back,
+# with their types, also past the first batch.
+
+cat <<END > test42.exp
+num	label	q	typeof(q)	n
+1	"Boldness"	0.25	real	
+1	"Toddler"	0.25	real	
+2	"Toddler"	0.5	real	
+price	typeof(price)	nulls
+3.5	real	0
+END
+
+echo -n "Test 42:	"
+if $SQAWK -o arrow $DATA_DIR/sample.csv "SELECT num, label, num / 4.0 AS q, NULL AS n FROM sample LIMIT 3" > test42.arrow &&
+	$SQAWK -a t -i num test42.arrow "SELECT num, label, q, typeof(q), n FROM t" > test42.out &&
+	awk 'BEGIN { print "id\tprice"; for (i = 1; i <= 70005; i++) print i "\t" (70001 == i ? "3.5" : i % 7 ".0") }' > test42.tsv &&
+	$SQAWK -o arrow test42.tsv "SELECT id, price FROM test42" > test42.arrow &&
+	$SQAWK -a p test42.arrow "SELECT price, typeof(price), (SELECT count(*) FROM p WHERE price IS NULL) AS nulls FROM p WHERE id = 70001" >> test42.out ; then
+	if diff test42.out test42.exp ; then
+		echo "pass"
+		rm test42.{tsv,out,exp,arrow}
+	else
+		echo "FAIL"
+	fi
+else
+	echo "ERROR"
+fi
+
+# Test 43: compressed input is decompressed, and the table is named without
+# the compression suffix.
+
+cat <<END > test43.exp
+count(*)	sum(num)	max(label)
+2372	352114	"Wigwam"
+END
+
+echo -n "Test 43:	"
+if gzip -c $DATA_DIR/sample.csv > test43.csv.gz &&
+	$SQAWK test43.csv.gz "SELECT count(*), sum(num), max(label) FROM test43" > test43.out ; then
+	if diff test43.out test43.exp ; then
+		echo "pass"
+		rm test43.{out,exp} test43.csv.gz
+	else
+		echo "FAIL"
+	fi
+else
+	echo "ERROR"
+fi
+
+# Test 44: sorted load (-O): the table is WITHOUT ROWID, and its rows are in
+# key order; the first row of a duplicated primary key wins, as without -O.
+# NULL keys keep the table's rowid with -O, and are an error with -R.
+
+printf 'id\tv\n3\ta\n\tb\n1\tc\n\td\n2\te\n' > test44.tsv
+
+cat <<END > test44.exp
+num	label
+1	"Bathe"
+1	"Boldness"
+1	"Chlorophyll"
+1	"Condiment"
+count(*)	group_concat(field, ' ')
+6	"8565" "56" "45556273" "6" "65510" "69770"
+id	v
+1	c
+2	e
+3	a
+4	b
+5	d
+FATAL: test44.tsv: row 2 has a NULL key, which a sorted table (-R) can't hold (use -O)
+END
+
+echo -n "Test 44:	"
+if $SQAWK -p num,label -O $DATA_DIR/sample.csv "SELECT num, label FROM sample WHERE (SELECT sql LIKE '%WITHOUT ROWID' FROM sqlite_master WHERE name = 'sample') LIMIT 4" > test44.out &&
+	$SQAWK -p label -O $DATA_DIR/sample.csv "SELECT count(*), group_concat(field, ' ') FROM (SELECT field FROM sample ORDER BY label LIMIT 6)" >> test44.out &&
+	$SQAWK -p id -O test44.tsv 'SELECT id, v FROM test44 ORDER BY id' >> test44.out &&
+	! $SQAWK -p id -R test44.tsv 'SELECT count(*) FROM test44' 2>> test44.out ; then
+	if diff test44.out test44.exp ; then
+		echo "pass"
+		rm test44.{tsv,out,exp}
+	else
+		echo "FAIL"
+	fi
+else
+	echo "ERROR"
+fi
+
+# Test 45: the index advisor (-A) indexes the column that the correlated
+# subquery looks up, so that the table is not scanned for every row.
+
+cat <<END > test45.exp
+-- Create advised index:
+CREATE INDEX IF NOT EXISTS "main"."a:label" ON "a" ("label")
+count(*)
+591
+END
+
+echo -n "Test 45:	"
+if $SQAWK -q -A -a a $DATA_DIR/sample.csv "SELECT count(*) FROM a WHERE num IN (SELECT class FROM a x WHERE x.label = a.label)" | sed -n '/^-- Create advised/,$p' > test45.out ; then
+	if diff test45.out test45.exp ; then
+		echo "pass"
+		rm test45.{out,exp}
+	else
+		echo "FAIL"
+	fi
+else
+	echo "ERROR"
+fi
+
+# Test 46: column statistics are gathered as the table is loaded (exact row,
+# NULL and small distinct counts, estimated large ones), and the index's rows
+# per key go to sqlite_stat1.
+
+cat <<END > test46.exp
+column_name	row_count	null_count	distinct_count	min_value	max_value	stat
+num	2372	0	669	1	769	
+class	2372	0	235	1	70585742	
+date	2372	0	596	2000-04-10	2010-03-23	
+field	2372	0	2093	"0"	"Z89805"	
+label	2372	0	24	"Bathe"	"Wigwam"	2372 99
+END
+
+echo -n "Test 46:	"
+if $SQAWK -i label $DATA_DIR/sample.csv "SELECT s.column_name, s.row_count, s.null_count, s.distinct_count, s.min_value, s.max_value, i.stat FROM sqawk_stats s LEFT JOIN sqlite_stat1 i ON i.tbl = s.table_name AND i.idx = s.table_name || ':' || s.column_name" > test46.out ; then
+	if diff test46.out test46.exp ; then
+		echo "pass"
+		rm test46.{out,exp}
+	else
+		echo "FAIL"
+	fi
+else
+	echo "ERROR"
+fi
+
+# Test 47: a memory budget (-m) that the table doesn't fit in puts the database
+# in a temporary file.
+
+cat <<END > test47.exp
+memory budget:	1024 bytes
+Estimated database size: 31353 bytes, in a temporary file.
+count(*)	sum(num)
+2372	352114
+END
+
+echo -n "Test 47:	"
+if $SQAWK -v -m 1K $DATA_DIR/sample.csv "SELECT count(*), sum(num) FROM sample" | sed -n '/^memory budget/p;/^Estimated/p;/^count/,$p' > test47.out ; then
+	if diff test47.out test47.exp ; then
+		echo "pass"
+		rm test47.{out,exp}
+	else
+		echo "FAIL"
+	fi
+else
+	echo "ERROR"
+fi